@@ -0,0 +1,185 @@
+/* vim: set ft=objc fenc=utf-8 sw=2 ts=2 et: */
+
+#import <Foundation/Foundation.h>
+#import "VSDataStore.h"
+#include "bench.h"
+
+#define COMPILED_CALLS 10000000
+#define FORWARDED_CALLS 1000000
+
+@interface Item : VSDataObject
+@property (nonatomic, strong) NSString *itemID;
+@property (nonatomic, strong) NSString *name;
+@property (atomic, copy) NSString *title;
+@property (nonatomic) NSInteger rank;
+@end
+
+@implementation Item
+@dynamic itemID;
+@dynamic name;
+@dynamic title;
+@dynamic rank;
+
++ (NSString *)nameForUniqueIdentifier
+{
+  return @"itemID";
+}
+@end
+
+static volatile uintptr_t sink;
+
+/*
+ * What every accessor call went through before they were installed as
+ * methods: a signature lookup, an NSInvocation and -forwardInvocation:.
+ * Only the failed method lookup of the runtime is left out.
+ */
+static NSInvocation *forwardedInvocation(id object, SEL selector)
+{
+  NSInvocation *invocation = [NSInvocation invocationWithMethodSignature:[object methodSignatureForSelector:selector]];
+  [invocation setSelector:selector];
+  [invocation setTarget:object];
+  return invocation;
+}
+
+static id forwardedGetObject(id object, SEL selector)
+{
+  NSInvocation *invocation = forwardedInvocation(object, selector);
+  [object forwardInvocation:invocation];
+
+  __unsafe_unretained id value = nil;
+  [invocation getReturnValue:&value];
+  return value;
+}
+
+static void forwardedSetObject(id object, SEL selector, __unsafe_unretained id value)
+{
+  NSInvocation *invocation = forwardedInvocation(object, selector);
+  [invocation setArgument:&value atIndex:2];
+  [object forwardInvocation:invocation];
+}
+
+static NSInteger forwardedGetInteger(id object, SEL selector)
+{
+  NSInvocation *invocation = forwardedInvocation(object, selector);
+  [object forwardInvocation:invocation];
+
+  NSInteger value = 0;
+  [invocation getReturnValue:&value];
+  return value;
+}
+
+static void forwardedSetInteger(id object, SEL selector, NSInteger value)
+{
+  NSInvocation *invocation = forwardedInvocation(object, selector);
+  [invocation setArgument:&value atIndex:2];
+  [object forwardInvocation:invocation];
+}
+
+static void report(const char *name, double compiled, double forwarded)
+{
+  double compiledNanoseconds = compiled * 1e9 / COMPILED_CALLS;
+  double forwardedNanoseconds = forwarded * 1e9 / FORWARDED_CALLS;
+  printf("%-26s %8.1f ns forwarded  %6.1f ns compiled  %6.1fx\n",
+         name, forwardedNanoseconds, compiledNanoseconds, forwardedNanoseconds / compiledNanoseconds);
+}
+
+int main(int argc, const char * argv[])
+{
+  @autoreleasepool {
+    Item *item = [[Item alloc] init];
+    NSString *name = @"a name long enough not to be a tagged pointer";
+    [item setItemID:@"item"];
+    [item setName:name];
+    [item setTitle:name];
+    [item setRank:42];
+
+    double start, compiled, forwarded;
+    NSUInteger i;
+
+    start = bench_now();
+    for (i = 0; i < COMPILED_CALLS; i++) {
+      sink ^= (uintptr_t)(__bridge void *)[item name];
+    }
+    compiled = bench_now() - start;
+    start = bench_now();
+    for (i = 0; i < FORWARDED_CALLS; i++) {
+      @autoreleasepool {
+        sink ^= (uintptr_t)(__bridge void *)forwardedGetObject(item, @selector(name));
+      }
+    }
+    forwarded = bench_now() - start;
+    report("nonatomic object get", compiled, forwarded);
+
+    start = bench_now();
+    for (i = 0; i < COMPILED_CALLS; i++) {
+      [item setName:name];
+    }
+    compiled = bench_now() - start;
+    start = bench_now();
+    for (i = 0; i < FORWARDED_CALLS; i++) {
+      @autoreleasepool {
+        forwardedSetObject(item, @selector(setName:), name);
+      }
+    }
+    forwarded = bench_now() - start;
+    report("nonatomic object set", compiled, forwarded);
+
+    start = bench_now();
+    for (i = 0; i < COMPILED_CALLS; i++) {
+      sink ^= (uintptr_t)(__bridge void *)[item title];
+    }
+    compiled = bench_now() - start;
+    start = bench_now();
+    for (i = 0; i < FORWARDED_CALLS; i++) {
+      @autoreleasepool {
+        sink ^= (uintptr_t)(__bridge void *)forwardedGetObject(item, @selector(title));
+      }
+    }
+    forwarded = bench_now() - start;
+    report("atomic copy object get", compiled, forwarded);
+
+    start = bench_now();
+    for (i = 0; i < COMPILED_CALLS; i++) {
+      [item setTitle:name];
+    }
+    compiled = bench_now() - start;
+    start = bench_now();
+    for (i = 0; i < FORWARDED_CALLS; i++) {
+      @autoreleasepool {
+        forwardedSetObject(item, @selector(setTitle:), name);
+      }
+    }
+    forwarded = bench_now() - start;
+    report("atomic copy object set", compiled, forwarded);
+
+    start = bench_now();
+    for (i = 0; i < COMPILED_CALLS; i++) {
+      sink ^= (uintptr_t)[item rank];
+    }
+    compiled = bench_now() - start;
+    start = bench_now();
+    for (i = 0; i < FORWARDED_CALLS; i++) {
+      @autoreleasepool {
+        sink ^= (uintptr_t)forwardedGetInteger(item, @selector(rank));
+      }
+    }
+    forwarded = bench_now() - start;
+    report("nonatomic scalar get", compiled, forwarded);
+
+    start = bench_now();
+    for (i = 0; i < COMPILED_CALLS; i++) {
+      [item setRank:(NSInteger)i];
+    }
+    compiled = bench_now() - start;
+    start = bench_now();
+    for (i = 0; i < FORWARDED_CALLS; i++) {
+      @autoreleasepool {
+        forwardedSetInteger(item, @selector(setRank:), (NSInteger)i);
+      }
+    }
+    forwarded = bench_now() - start;
+    report("nonatomic scalar set", compiled, forwarded);
+  }
+
+  return 0;
+}
@@ -0,0 +1,61 @@
+/* vim: set ft=c fenc=utf-8 sw=2 ts=2 et: */
+
+#ifndef __vsdatastore_bench_h__
+#define __vsdatastore_bench_h__
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+static inline double bench_now(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+static inline unsigned int bench_cpu_count(void)
+{
+  long count = sysconf(_SC_NPROCESSORS_ONLN);
+  return (count > 0) ? (unsigned int)count : 1;
+}
+
+static inline uint64_t bench_random(uint64_t *state)
+{
+  uint64_t x = *state;
+  x ^= x << 13;
+  x ^= x >> 7;
+  x ^= x << 17;
+  return (*state = x);
+}
+
+/*
+ * Runs body on count threads, handing each its own element of contexts,
+ * and returns the wall-clock time until the last one is done.
+ */
+static inline double bench_run_threads(unsigned int count, void *(*body)(void *),
+                                       void *contexts, size_t context_size)
+{
+  pthread_t *threads = (pthread_t *)malloc(sizeof(pthread_t) * count);
+  double start = bench_now();
+  unsigned int i;
+
+  for (i = 0; i < count; ++i) {
+    if (pthread_create(&threads[i], NULL, body, (char *)contexts + i * context_size) != 0) {
+      fprintf(stderr, "pthread_create failed\n");
+      exit(1);
+    }
+  }
+  for (i = 0; i < count; ++i) {
+    pthread_join(threads[i], NULL);
+  }
+
+  double elapsed = bench_now() - start;
+  free(threads);
+  return elapsed;
+}
+
+#endif /* __vsdatastore_bench_h__ */
@@ -0,0 +1,83 @@
+/* vim: set ft=c fenc=utf-8 sw=2 ts=2 et: */
+
+#include "vsdb.h"
+#include "bench.h"
+#include <string.h>
+
+#define KEY_COUNT 200000
+#define GET_COUNT 2000000
+#define HIT_PERCENT 10
+
+/*
+ * Looks up keys of which only HIT_PERCENT exist, as optional properties
+ * that are never written and duplicate checks do, with and without the
+ * bloom option.
+ */
+static double run(int bloom, vsdb_stats_t *stats)
+{
+  static const char *filename = "bloom_miss.db";
+  vsdb_options_t options;
+  memset(&options, 0, sizeof(options));
+  options.shards = 4;
+  options.bloom = bloom;
+
+  vsdb_unlink(filename, &options);
+  vsdb_t vsdb = vsdb_open2(filename, &options);
+  if (vsdb == NULL) {
+    fprintf(stderr, "cannot open %s\n", filename);
+    exit(1);
+  }
+
+  char key[32];
+  char value[100];
+  memset(value, 'v', sizeof(value));
+  unsigned int i;
+  for (i = 0; i < KEY_COUNT; ++i) {
+    int length = snprintf(key, sizeof(key), "key%08u", i);
+    vsdb_set(vsdb, key, (size_t)length, value, sizeof(value));
+  }
+  vsdb_sync(vsdb);
+
+  uint64_t seed = 0x9e3779b97f4a7c15ull;
+  size_t hits = 0;
+  double start = bench_now();
+  for (i = 0; i < GET_COUNT; ++i) {
+    uint64_t random = bench_random(&seed);
+    unsigned int index = (unsigned int)(random % KEY_COUNT);
+    int length = ((random >> 32) % 100 < HIT_PERCENT) ?
+      snprintf(key, sizeof(key), "key%08u", index) :
+      snprintf(key, sizeof(key), "missing%08u", index);
+    const void *found;
+    size_t found_size;
+    if (vsdb_get(vsdb, key, (size_t)length, &found, &found_size) == vsdb_okay) {
+      vsdb_free((void *)found);
+      ++hits;
+    }
+  }
+  double rate = GET_COUNT / (bench_now() - start);
+
+  vsdb_get_stats(vsdb, stats);
+  vsdb_close(vsdb);
+  vsdb_unlink(filename, &options);
+
+  if (hits * 100 / GET_COUNT > HIT_PERCENT + 1) {
+    fprintf(stderr, "unexpected hit count %zu\n", hits);
+    exit(1);
+  }
+  return rate;
+}
+
+int main(void)
+{
+  vsdb_stats_t stats;
+  double base = run(0, &stats);
+  double rate = run(1, &stats);
+
+  printf("%d%% hits, without bloom: %10.0f gets/s\n", HIT_PERCENT, base);
+  printf("%d%% hits, with bloom:    %10.0f gets/s  %5.2fx\n", HIT_PERCENT, rate, rate / base);
+  printf("bloom queries %zu, negatives %zu, false positives %zu (%.4f%%)\n",
+         stats.bloom_queries, stats.bloom_negatives, stats.bloom_false_positives,
+         stats.bloom_false_positive_rate * 100.0);
+
+  return 0;
+}
@@ -0,0 +1,194 @@
+/* vim: set ft=c fenc=utf-8 sw=2 ts=2 et: */
+
+#include <CoreFoundation/CoreFoundation.h>
+#include "vsdb.h"
+#include "vsdb_cf.h"
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define RECORD_COUNT 10000
+#define FOLLOWER_COUNT 16
+
+/*
+ * The hook malloc stack logging uses, called for every allocation and
+ * release in every zone, realloc included.
+ */
+#define MALLOC_LOG_TYPE_ALLOCATE 2
+
+typedef void (malloc_logger_t)(uint32_t type, uintptr_t arg1, uintptr_t arg2, uintptr_t arg3,
+                               uintptr_t result, uint32_t num_hot_frames_to_skip);
+extern malloc_logger_t *malloc_logger;
+
+static atomic_size_t malloc_count;
+
+static void count_malloc(uint32_t type, uintptr_t arg1, uintptr_t arg2, uintptr_t arg3,
+                         uintptr_t result, uint32_t num_hot_frames_to_skip)
+{
+  (void)arg1;
+  (void)arg2;
+  (void)arg3;
+  (void)result;
+  (void)num_hot_frames_to_skip;
+
+  if (type & MALLOC_LOG_TYPE_ALLOCATE) {
+    atomic_fetch_add_explicit(&malloc_count, 1, memory_order_relaxed);
+  }
+}
+
+static size_t mallocs(void)
+{
+  return atomic_load_explicit(&malloc_count, memory_order_relaxed);
+}
+
+/*
+ * A record shaped like a stored model object: ASCII and non-ASCII
+ * strings, numbers and an array of identifiers.
+ */
+static CFDictionaryRef create_record(unsigned int index)
+{
+  CFMutableDictionaryRef record = CFDictionaryCreateMutable(NULL, 0, &kCFTypeDictionaryKeyCallBacks,
+                                                            &kCFTypeDictionaryValueCallBacks);
+  CFMutableArrayRef followers = CFArrayCreateMutable(NULL, FOLLOWER_COUNT, &kCFTypeArrayCallBacks);
+  CFStringRef string;
+  CFNumberRef number;
+  int age = (int)(index % 100);
+  unsigned int i;
+
+  string = CFStringCreateWithFormat(NULL, NULL, CFSTR("user-identifier-%08u"), index);
+  CFDictionarySetValue(record, CFSTR("userID"), string);
+  CFRelease(string);
+
+  string = CFStringCreateWithFormat(NULL, NULL, CFSTR("User Number %u of the benchmark"), index);
+  CFDictionarySetValue(record, CFSTR("name"), string);
+  CFRelease(string);
+
+  string = CFStringCreateWithFormat(NULL, NULL, CFSTR("Zöe — für %u Grüße"), index);
+  CFDictionarySetValue(record, CFSTR("bio"), string);
+  CFRelease(string);
+
+  number = CFNumberCreate(NULL, kCFNumberIntType, &age);
+  CFDictionarySetValue(record, CFSTR("age"), number);
+  CFRelease(number);
+
+  for (i = 0; i < FOLLOWER_COUNT; ++i) {
+    string = CFStringCreateWithFormat(NULL, NULL, CFSTR("user-identifier-%08u"), (index + i + 1) % RECORD_COUNT);
+    CFArrayAppendValue(followers, string);
+    CFRelease(string);
+  }
+  CFDictionarySetValue(record, CFSTR("followers"), followers);
+  CFRelease(followers);
+
+  return record;
+}
+
+static CFStringRef create_key(unsigned int index)
+{
+  return CFStringCreateWithFormat(NULL, NULL, CFSTR("User.user-identifier-%08u"), index);
+}
+
+static size_t get_key_bytes(CFStringRef key, char *bytes, size_t size)
+{
+  CFIndex length = 0;
+  CFStringGetBytes(key, CFRangeMake(0, CFStringGetLength(key)), kCFStringEncodingUTF8, 0, false,
+                   (UInt8 *)bytes, (CFIndex)size, &length);
+  return (size_t)length;
+}
+
+static void ignore_value(const void *value, size_t value_size, void *context)
+{
+  (void)value;
+  (void)value_size;
+  (void)context;
+}
+
+/*
+ * Mallocs of the vsdb_cf calls are compared to those of the plain vsdb
+ * calls moving the same bytes, the difference is what encoding and
+ * decoding cost, including the Core Foundation objects decoded.
+ */
+int main(void)
+{
+  static const char *filename = "cf_malloc.db";
+  vsdb_options_t options;
+  memset(&options, 0, sizeof(options));
+
+  vsdb_unlink(filename, &options);
+  vsdb_t vsdb = vsdb_open2(filename, &options);
+  if (vsdb == NULL) {
+    fprintf(stderr, "cannot open %s\n", filename);
+    return 1;
+  }
+
+  CFStringRef *keys = (CFStringRef *)malloc(sizeof(CFStringRef) * RECORD_COUNT);
+  CFDictionaryRef *records = (CFDictionaryRef *)malloc(sizeof(CFDictionaryRef) * RECORD_COUNT);
+  unsigned int i;
+  for (i = 0; i < RECORD_COUNT; ++i) {
+    keys[i] = create_key(i);
+    records[i] = create_record(i);
+  }
+
+  malloc_logger = count_malloc;
+
+  size_t start = mallocs();
+  for (i = 0; i < RECORD_COUNT; ++i) {
+    vsdb_set_cfvalue(vsdb, keys[i], records[i]);
+  }
+  double encode = (double)(mallocs() - start) / RECORD_COUNT;
+
+  size_t decoded = 0;
+  for (i = 0; i < RECORD_COUNT; ++i) {
+    start = mallocs();
+    CFTypeRef value = vsdb_copy_cfvalue(vsdb, keys[i]);
+    decoded += mallocs() - start;
+
+    if (value == NULL || !CFEqual(value, records[i])) {
+      fprintf(stderr, "record %u did not round-trip\n", i);
+      return 1;
+    }
+    CFRelease(value);
+  }
+  double decode = (double)decoded / RECORD_COUNT;
+
+  size_t raw_set = 0;
+  size_t raw_get = 0;
+  char key[128];
+  for (i = 0; i < RECORD_COUNT; ++i) {
+    size_t key_length = get_key_bytes(keys[i], key, sizeof(key));
+    const void *value;
+    size_t value_size;
+    if (vsdb_get(vsdb, key, key_length, &value, &value_size) != vsdb_okay) {
+      fprintf(stderr, "record %u is missing\n", i);
+      return 1;
+    }
+
+    start = mallocs();
+    vsdb_set(vsdb, key, key_length, value, value_size);
+    raw_set += mallocs() - start;
+
+    start = mallocs();
+    vsdb_get_nocopy(vsdb, key, key_length, ignore_value, NULL);
+    raw_get += mallocs() - start;
+
+    vsdb_free((void *)value);
+  }
+
+  malloc_logger = NULL;
+
+  printf("encode: %6.2f mallocs/object (%5.2f in vsdb_set itself)\n",
+         encode, (double)raw_set / RECORD_COUNT);
+  printf("decode: %6.2f mallocs/object (%5.2f in vsdb_get_nocopy itself), creating %d strings with the keys, a number, an array and a dictionary\n",
+         decode, (double)raw_get / RECORD_COUNT, FOLLOWER_COUNT + 8);
+
+  for (i = 0; i < RECORD_COUNT; ++i) {
+    CFRelease(keys[i]);
+    CFRelease(records[i]);
+  }
+  free(keys);
+  free(records);
+
+  vsdb_close(vsdb);
+  vsdb_unlink(filename, &options);
+  return 0;
+}
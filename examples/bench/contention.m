@@ -0,0 +1,167 @@
+/* vim: set ft=objc fenc=utf-8 sw=2 ts=2 et: */
+
+#import <Foundation/Foundation.h>
+#import "VSDataStore.h"
+#include <objc/message.h>
+#include "bench.h"
+
+#define CALLS_PER_THREAD 2000000
+#define PROPERTY_COUNT 8
+
+@interface Record : VSDataObject
+@property (atomic, strong) NSString *recordID;
+@property (atomic, strong) NSString *property0;
+@property (atomic, strong) NSString *property1;
+@property (atomic, strong) NSString *property2;
+@property (atomic, strong) NSString *property3;
+@property (atomic, strong) NSString *property4;
+@property (atomic, strong) NSString *property5;
+@property (atomic, strong) NSString *property6;
+@property (atomic, strong) NSString *property7;
+@end
+
+@implementation Record
+@dynamic recordID;
+@dynamic property0, property1, property2, property3, property4, property5, property6, property7;
+
++ (NSString *)nameForUniqueIdentifier
+{
+  return @"recordID";
+}
+@end
+
+typedef enum {
+  DifferentProperties,
+  SameProperty,
+  SynchronizedDictionary
+} Workload;
+
+typedef struct {
+  __unsafe_unretained Record *record;
+  __unsafe_unretained NSMutableDictionary *dictionary;
+  __unsafe_unretained NSString *value;
+  NSUInteger property;
+  Workload workload;
+} Hammer;
+
+static SEL getters[PROPERTY_COUNT];
+static SEL setters[PROPERTY_COUNT];
+static NSString *keys[PROPERTY_COUNT];
+static uintptr_t sink;
+
+/* three gets for every set */
+static uintptr_t hammerRecord(Hammer *hammer)
+{
+  Record *record = hammer->record;
+  NSString *value = hammer->value;
+  SEL getter = getters[hammer->property];
+  SEL setter = setters[hammer->property];
+  uintptr_t sum = 0;
+
+  for (NSUInteger i = 0; i < CALLS_PER_THREAD; i++) {
+    if ((i & 3) == 3) {
+      ((void (*)(id, SEL, id))objc_msgSend)(record, setter, value);
+    }
+    else {
+      sum ^= (uintptr_t)(__bridge void *)((id (*)(id, SEL))objc_msgSend)(record, getter);
+    }
+  }
+
+  return sum;
+}
+
+/* how atomic properties were guarded before, one lock for the whole object */
+static uintptr_t hammerDictionary(Hammer *hammer)
+{
+  NSMutableDictionary *dictionary = hammer->dictionary;
+  NSString *value = hammer->value;
+  NSString *key = keys[hammer->property];
+  uintptr_t sum = 0;
+
+  for (NSUInteger i = 0; i < CALLS_PER_THREAD; i++) {
+    @synchronized(dictionary) {
+      if ((i & 3) == 3) {
+        [dictionary setObject:value forKey:key];
+      }
+      else {
+        sum ^= (uintptr_t)(__bridge void *)[dictionary objectForKey:key];
+      }
+    }
+  }
+
+  return sum;
+}
+
+static void *hammerMain(void *context)
+{
+  Hammer *hammer = (Hammer *)context;
+  uintptr_t sum;
+
+  @autoreleasepool {
+    sum = (hammer->workload == SynchronizedDictionary) ? hammerDictionary(hammer) : hammerRecord(hammer);
+  }
+
+  __atomic_fetch_xor(&sink, sum, __ATOMIC_RELAXED);
+  return NULL;
+}
+
+static void run(const char *name, Workload workload, Record *record, NSMutableDictionary *dictionary, NSString *value)
+{
+  unsigned int cpus = bench_cpu_count();
+  Hammer *hammers = (Hammer *)calloc(cpus, sizeof(Hammer));
+  double base = 0.0;
+
+  printf("%s\n", name);
+  for (unsigned int threads = 1; ; threads = (threads * 2 < cpus) ? threads * 2 : cpus) {
+    for (unsigned int i = 0; i < threads; i++) {
+      hammers[i].record = record;
+      hammers[i].dictionary = dictionary;
+      hammers[i].value = value;
+      hammers[i].property = (workload == SameProperty) ? 0 : i % PROPERTY_COUNT;
+      hammers[i].workload = workload;
+    }
+
+    double elapsed = bench_run_threads(threads, hammerMain, hammers, sizeof(Hammer));
+    double rate = (double)threads * CALLS_PER_THREAD / elapsed;
+    if (threads == 1) {
+      base = rate;
+    }
+    printf("  %2u threads: %12.0f calls/s  %5.2fx  %6.1f ns/call/thread\n",
+           threads, rate, rate / base, elapsed * 1e9 / CALLS_PER_THREAD);
+    if (threads == cpus) {
+      break;
+    }
+  }
+
+  free(hammers);
+}
+
+/*
+ * Threads hammer different atomic properties of one object, which share
+ * nothing but the object, then all the same property, then a dictionary
+ * behind @synchronized for comparison.
+ */
+int main(int argc, const char * argv[])
+{
+  @autoreleasepool {
+    NSString *value = @"a value long enough not to be a tagged pointer";
+    Record *record = [[Record alloc] init];
+    NSMutableDictionary *dictionary = [NSMutableDictionary dictionary];
+    [record setRecordID:@"record"];
+
+    for (NSUInteger i = 0; i < PROPERTY_COUNT; i++) {
+      NSString *name = [NSString stringWithFormat:@"property%lu", (unsigned long)i];
+      getters[i] = NSSelectorFromString(name);
+      setters[i] = NSSelectorFromString([NSString stringWithFormat:@"setProperty%lu:", (unsigned long)i]);
+      keys[i] = name;
+      ((void (*)(id, SEL, id))objc_msgSend)(record, setters[i], value);
+      [dictionary setObject:value forKey:name];
+    }
+
+    run("different properties of one object", DifferentProperties, record, dictionary, value);
+    run("the same property of one object", SameProperty, record, dictionary, value);
+    run("@synchronized dictionary", SynchronizedDictionary, record, dictionary, value);
+  }
+
+  return 0;
+}
@@ -0,0 +1,71 @@
+/* vim: set ft=objc fenc=utf-8 sw=2 ts=2 et: */
+
+#import <Foundation/Foundation.h>
+#import "VSDataStore.h"
+#import "VSDataModel.h"
+#import "VSLazyCollection.h"
+#import "User.h"
+#include "bench.h"
+
+#define FOLLOWER_COUNT 200000
+
+/*
+ * Stores a user with FOLLOWER_COUNT followers, then loads it again with
+ * lazy collections and checks that the followers stay encoded until they
+ * are first asked for, and are then a set that can be changed.
+ */
+int main(int argc, const char * argv[])
+{
+  @autoreleasepool {
+    NSString *path = @"lazy_load.db";
+    NSDictionary *options = @{VSDataManagerLazyCollectionsOption: @YES};
+    [[NSFileManager defaultManager] removeItemAtPath:path error:NULL];
+
+    @autoreleasepool {
+      VSDataManager *dataManager = [[VSDataManager alloc] initWithDatabasePath:path options:options];
+      NSMutableSet *followers = [NSMutableSet setWithCapacity:FOLLOWER_COUNT];
+      for (NSUInteger i = 0; i < FOLLOWER_COUNT; i++) {
+        [followers addObject:[NSString stringWithFormat:@"follower%06lu", (unsigned long)i]];
+      }
+
+      User *user = [[User alloc] init];
+      [user setUserID:@"celebrity"];
+      [user setFollowers:followers];
+      [dataManager addDataObject:user];
+      [dataManager sync];
+    }
+
+    double start = bench_now();
+    VSDataManager *dataManager = [[VSDataManager alloc] initWithDatabasePath:path options:options];
+    User *user = (User *)[dataManager dataObjectForClass:[User class] uniqueIdentifier:@"celebrity"];
+    double loading = bench_now() - start;
+
+    id loadedFollowers = [[VSDataModel sharedModel] dataObject:user loadedValueForKey:@"followers"];
+    if (![loadedFollowers isKindOfClass:[VSLazySet class]] || [loadedFollowers isDecoded]) {
+      fprintf(stderr, "loading decoded the followers\n");
+      return 1;
+    }
+
+    start = bench_now();
+    NSMutableSet *followers = [user followers];
+    double decoding = bench_now() - start;
+
+    if ([followers count] != FOLLOWER_COUNT || ![followers containsObject:@"follower000042"]) {
+      fprintf(stderr, "followers did not survive loading\n");
+      return 1;
+    }
+    [followers addObject:@"newcomer"];
+    if ([[user followers] count] != FOLLOWER_COUNT + 1) {
+      fprintf(stderr, "followers are not changed in place\n");
+      return 1;
+    }
+
+    printf("loaded %d followers encoded in %.3f ms, decoded on first access in %.3f ms\n",
+           FOLLOWER_COUNT, loading * 1000.0, decoding * 1000.0);
+
+    dataManager = nil;
+    [[NSFileManager defaultManager] removeItemAtPath:path error:NULL];
+  }
+
+  return 0;
+}
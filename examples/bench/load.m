@@ -0,0 +1,71 @@
+/* vim: set ft=objc fenc=utf-8 sw=2 ts=2 et: */
+
+#import <Foundation/Foundation.h>
+#import "VSDataStore.h"
+#import "User.h"
+#include "bench.h"
+
+#define USER_COUNT 200000
+#define FOLLOWER_COUNT 8
+
+/*
+ * Stores USER_COUNT users, then times opening the database, which loads
+ * them all, with 1 up to one loading thread per core.
+ */
+int main(int argc, const char * argv[])
+{
+  @autoreleasepool {
+    NSString *path = @"load.db";
+    [[NSFileManager defaultManager] removeItemAtPath:path error:NULL];
+
+    @autoreleasepool {
+      VSDataManager *dataManager = [[VSDataManager alloc] initWithDatabasePath:path];
+      [dataManager beginBatch];
+      for (NSUInteger i = 0; i < USER_COUNT; i++) {
+        @autoreleasepool {
+          User *user = [[User alloc] init];
+          [user setUserID:[NSString stringWithFormat:@"user%08lu", (unsigned long)i]];
+          [user setName:[NSString stringWithFormat:@"User Number %lu", (unsigned long)i]];
+          NSMutableSet *followers = [NSMutableSet setWithCapacity:FOLLOWER_COUNT];
+          for (NSUInteger j = 1; j <= FOLLOWER_COUNT; j++) {
+            [followers addObject:[NSString stringWithFormat:@"user%08lu", (unsigned long)((i + j * 7919) % USER_COUNT)]];
+          }
+          [user setFollowers:followers];
+          [dataManager addDataObject:user];
+        }
+      }
+      [dataManager commitBatch];
+      [dataManager sync];
+    }
+
+    unsigned int cpus = bench_cpu_count();
+    double base = 0.0;
+    for (unsigned int threads = 1; ; threads = (threads * 2 < cpus) ? threads * 2 : cpus) {
+      double elapsed;
+      NSUInteger count;
+      @autoreleasepool {
+        double start = bench_now();
+        VSDataManager *dataManager = [[VSDataManager alloc] initWithDatabasePath:path
+                                                                         options:@{VSDataManagerLoadConcurrencyOption: @(threads)}];
+        elapsed = bench_now() - start;
+        count = [[dataManager dataObjectsForClass:[User class]] count];
+      }
+
+      if (count != USER_COUNT) {
+        fprintf(stderr, "loaded %lu users out of %d\n", (unsigned long)count, USER_COUNT);
+        return 1;
+      }
+      if (threads == 1) {
+        base = elapsed;
+      }
+      printf("%2u threads: loaded %d users in %8.1f ms  %5.2fx\n", threads, USER_COUNT, elapsed * 1000.0, base / elapsed);
+      if (threads == cpus) {
+        break;
+      }
+    }
+
+    [[NSFileManager defaultManager] removeItemAtPath:path error:NULL];
+  }
+
+  return 0;
+}
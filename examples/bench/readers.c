@@ -0,0 +1,92 @@
+/* vim: set ft=c fenc=utf-8 sw=2 ts=2 et: */
+
+#include "vsdb.h"
+#include "bench.h"
+#include <string.h>
+
+#define KEY_COUNT 100000
+#define GETS_PER_THREAD 500000
+
+typedef struct {
+  vsdb_t vsdb;
+  uint64_t seed;
+} reader_t;
+
+static void *reader_main(void *context)
+{
+  reader_t *reader = (reader_t *)context;
+  char key[32];
+  size_t i;
+
+  for (i = 0; i < GETS_PER_THREAD; ++i) {
+    int length = snprintf(key, sizeof(key), "key%08u", (unsigned int)(bench_random(&reader->seed) % KEY_COUNT));
+    const void *value;
+    size_t value_size;
+    if (vsdb_get(reader->vsdb, key, (size_t)length, &value, &value_size) != vsdb_okay) {
+      fprintf(stderr, "missing %s\n", key);
+      exit(1);
+    }
+    vsdb_free((void *)value);
+  }
+
+  return NULL;
+}
+
+static void run(unsigned int shards)
+{
+  static const char *filename = "readers.db";
+  vsdb_options_t options;
+  memset(&options, 0, sizeof(options));
+  options.shards = shards;
+
+  vsdb_unlink(filename, &options);
+  vsdb_t vsdb = vsdb_open2(filename, &options);
+  if (vsdb == NULL) {
+    fprintf(stderr, "cannot open %s\n", filename);
+    exit(1);
+  }
+
+  char key[32];
+  char value[100];
+  memset(value, 'v', sizeof(value));
+  unsigned int i;
+  for (i = 0; i < KEY_COUNT; ++i) {
+    int length = snprintf(key, sizeof(key), "key%08u", i);
+    vsdb_set(vsdb, key, (size_t)length, value, sizeof(value));
+  }
+  vsdb_sync(vsdb);
+
+  unsigned int cpus = bench_cpu_count();
+  reader_t *readers = (reader_t *)calloc(cpus, sizeof(reader_t));
+  double base = 0.0;
+  unsigned int threads;
+
+  printf("shards=%u\n", shards);
+  for (threads = 1; ; threads = (threads * 2 < cpus) ? threads * 2 : cpus) {
+    for (i = 0; i < threads; ++i) {
+      readers[i].vsdb = vsdb;
+      readers[i].seed = 0x9e3779b97f4a7c15ull * (i + 1);
+    }
+
+    double elapsed = bench_run_threads(threads, reader_main, readers, sizeof(reader_t));
+    double rate = (double)threads * GETS_PER_THREAD / elapsed;
+    if (threads == 1) {
+      base = rate;
+    }
+    printf("  %2u threads: %12.0f gets/s  %5.2fx\n", threads, rate, rate / base);
+    if (threads == cpus) {
+      break;
+    }
+  }
+
+  free(readers);
+  vsdb_close(vsdb);
+  vsdb_unlink(filename, &options);
+}
+
+int main(void)
+{
+  run(1);
+  run(16);
+  return 0;
+}
@@ -0,0 +1,85 @@
+/* vim: set ft=c fenc=utf-8 sw=2 ts=2 et: */
+
+#include "vsdb.h"
+#include "bench.h"
+#include <string.h>
+
+#define COMMITS_PER_THREAD 2000
+
+typedef struct {
+  vsdb_t vsdb;
+  unsigned int thread;
+  int sync;
+} committer_t;
+
+static void *committer_main(void *context)
+{
+  committer_t *committer = (committer_t *)context;
+  char key[32];
+  char value[100];
+  unsigned int i;
+
+  memset(value, 'v', sizeof(value));
+  for (i = 0; i < COMMITS_PER_THREAD; ++i) {
+    int length = snprintf(key, sizeof(key), "key%02u-%08u", committer->thread, i);
+    if (vsdb_set(committer->vsdb, key, (size_t)length, value, sizeof(value)) != vsdb_okay ||
+        (committer->sync && vsdb_sync(committer->vsdb) != vsdb_okay)) {
+      fprintf(stderr, "write failed\n");
+      exit(1);
+    }
+  }
+
+  return NULL;
+}
+
+/*
+ * Every commit is durable when its call returns, either through the log
+ * with wal_sync or through vsdb_sync() after the write.
+ */
+static double run(int wal, unsigned int threads)
+{
+  static const char *filename = "wal_commit.db";
+  vsdb_options_t options;
+  memset(&options, 0, sizeof(options));
+  options.wal = wal;
+  options.wal_sync = wal;
+
+  vsdb_unlink(filename, &options);
+  vsdb_t vsdb = vsdb_open2(filename, &options);
+  if (vsdb == NULL) {
+    fprintf(stderr, "cannot open %s\n", filename);
+    exit(1);
+  }
+
+  committer_t *committers = (committer_t *)calloc(threads, sizeof(committer_t));
+  unsigned int i;
+  for (i = 0; i < threads; ++i) {
+    committers[i].vsdb = vsdb;
+    committers[i].thread = i;
+    committers[i].sync = !wal;
+  }
+
+  double elapsed = bench_run_threads(threads, committer_main, committers, sizeof(committer_t));
+  double rate = (double)threads * COMMITS_PER_THREAD / elapsed;
+
+  free(committers);
+  vsdb_close(vsdb);
+  vsdb_unlink(filename, &options);
+  return rate;
+}
+
+int main(void)
+{
+  unsigned int threads = bench_cpu_count();
+  double base = run(0, 1);
+
+  printf("vsdb_sync per write, 1 thread:  %10.0f commits/s\n", base);
+  printf("vsdb_sync per write, %2u threads: %10.0f commits/s\n", threads, run(0, threads));
+
+  double rate = run(1, 1);
+  printf("wal_sync, 1 thread:             %10.0f commits/s  %6.2fx\n", rate, rate / base);
+  rate = run(1, threads);
+  printf("wal_sync, %2u threads:           %10.0f commits/s  %6.2fx\n", threads, rate, rate / base);
+
+  return 0;
+}
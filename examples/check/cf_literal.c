@@ -0,0 +1,57 @@
+/* vim: set ft=c fenc=utf-8 sw=2 ts=2 et: */
+
+/*
+ * Stores values under keys holding the glob characters '?' and '[' but
+ * no '*', and checks that vsdb_copy_cfvalue() reads each of them back as
+ * it is, rather than as a pattern.
+ */
+
+#include <CoreFoundation/CoreFoundation.h>
+#include "vsdb.h"
+#include "vsdb_cf.h"
+#include <stdio.h>
+#include <string.h>
+
+static const char *filename = "cf_literal.db";
+
+int main(void)
+{
+  CFStringRef keys[] = {CFSTR("a?b"), CFSTR("[x]"), CFSTR("axb"), CFSTR("x")};
+  CFIndex key_count = sizeof(keys) / sizeof(keys[0]);
+  CFIndex i;
+  vsdb_options_t options;
+  int failures = 0;
+
+  memset(&options, 0, sizeof(options));
+  vsdb_unlink(filename, &options);
+  vsdb_t vsdb = vsdb_open2(filename, &options);
+  if (vsdb == NULL) {
+    fprintf(stderr, "cf_literal: cannot open %s\n", filename);
+    return 1;
+  }
+
+  for (i = 0; i < key_count; i++) {
+    vsdb_set_cfvalue(vsdb, keys[i], keys[i]);
+  }
+
+  for (i = 0; i < key_count; i++) {
+    CFTypeRef value = vsdb_copy_cfvalue(vsdb, keys[i]);
+    if (value == NULL || CFGetTypeID(value) != CFStringGetTypeID() || !CFEqual(value, keys[i])) {
+      char key[16];
+      CFStringGetCString(keys[i], key, sizeof(key), kCFStringEncodingUTF8);
+      fprintf(stderr, "cf_literal: \"%s\" was not read back\n", key);
+      failures++;
+    }
+    if (value != NULL) {
+      CFRelease(value);
+    }
+  }
+
+  vsdb_close(vsdb);
+  vsdb_unlink(filename, &options);
+
+  if (failures == 0) {
+    printf("cf_literal: ok\n");
+  }
+  return failures == 0 ? 0 : 1;
+}
@@ -0,0 +1,77 @@
+/* vim: set ft=objc fenc=utf-8 sw=2 ts=2 et: */
+
+#import <Foundation/Foundation.h>
+#import "VSDataStore.h"
+#import "VSDataManager+Query.h"
+#import "User.h"
+
+static int check(BOOL condition, const char *what)
+{
+  if (!condition) {
+    fprintf(stderr, "index_batch: %s\n", what);
+    return 1;
+  }
+  return 0;
+}
+
+/* the user is found by its name, and not by the name it had for a while */
+static int checkLookups(VSDataManager *dataManager, const char *when)
+{
+  int failures = 0;
+  NSArray *equal = [dataManager dataObjectsForClass:[User class] whereProperty:@"name" equals:@"bob"];
+  NSArray *matching = [dataManager dataObjectsForClass:[User class]
+                                     matchingPredicate:[NSPredicate predicateWithFormat:@"name == %@", @"bob"]
+                                       sortDescriptors:nil
+                                                 limit:0];
+  NSArray *stale = [dataManager dataObjectsForClass:[User class] whereProperty:@"name" equals:@"x"];
+
+  if ([equal count] != 1 || [matching count] != 1 || [stale count] != 0) {
+    fprintf(stderr, "index_batch: %s: %lu, %lu and %lu users found\n", when,
+            (unsigned long)[equal count], (unsigned long)[matching count], (unsigned long)[stale count]);
+    failures++;
+  }
+  return failures;
+}
+
+/*
+ * Changes the indexed name of a user away and back within one batch, and
+ * checks that the user is still found by the name it ends up with, by the
+ * index lookup and by a predicate, both before and after reopening.
+ */
+int main(int argc, const char * argv[])
+{
+  int failures = 0;
+
+  @autoreleasepool {
+    NSString *path = @"index_batch.db";
+    [[NSFileManager defaultManager] removeItemAtPath:path error:NULL];
+
+    @autoreleasepool {
+      VSDataManager *dataManager = [[VSDataManager alloc] initWithDatabasePath:path];
+      User *user = [[User alloc] init];
+      [user setUserID:@"user1"];
+      [user setName:@"bob"];
+      [dataManager addDataObject:user];
+      [dataManager sync];
+
+      [dataManager beginBatch];
+      [user setName:@"x"];
+      [user setName:@"bob"];
+      failures += check([dataManager commitBatch], "the batch failed");
+      failures += checkLookups(dataManager, "after the batch");
+      [dataManager sync];
+    }
+
+    @autoreleasepool {
+      VSDataManager *dataManager = [[VSDataManager alloc] initWithDatabasePath:path];
+      failures += checkLookups(dataManager, "after reopening");
+    }
+
+    [[NSFileManager defaultManager] removeItemAtPath:path error:NULL];
+  }
+
+  if (failures == 0) {
+    printf("index_batch: ok\n");
+  }
+  return failures == 0 ? 0 : 1;
+}
@@ -0,0 +1,58 @@
+/* vim: set ft=objc fenc=utf-8 sw=2 ts=2 et: */
+
+#import <Foundation/Foundation.h>
+#import "VSDataStore.h"
+#import "User.h"
+
+#define FOLLOW_COUNT 20000
+
+/*
+ * Has one user follow many others with write-back flushing in the
+ * background every millisecond, while the sets are changed in place, and
+ * checks that all of them are found after reopening.
+ */
+int main(int argc, const char * argv[])
+{
+  int failures = 0;
+
+  @autoreleasepool {
+    NSString *path = @"write_back.db";
+    NSDictionary *options = @{VSDataManagerWriteBackOption: @YES,
+                              VSDataManagerWriteBackDelayOption: @0.001};
+    [[NSFileManager defaultManager] removeItemAtPath:path error:NULL];
+
+    @autoreleasepool {
+      VSDataManager *dataManager = [[VSDataManager alloc] initWithDatabasePath:path options:options];
+      User *user = [[User alloc] init];
+      [user setUserID:@"follower"];
+      [dataManager addDataObject:user];
+
+      for (NSUInteger i = 0; i < FOLLOW_COUNT; i++) {
+        @autoreleasepool {
+          User *followed = [[User alloc] init];
+          [followed setUserID:[NSString stringWithFormat:@"user%06lu", (unsigned long)i]];
+          [dataManager addDataObject:followed];
+          [user follow:followed];
+        }
+      }
+      [dataManager sync];
+    }
+
+    @autoreleasepool {
+      VSDataManager *dataManager = [[VSDataManager alloc] initWithDatabasePath:path options:options];
+      User *user = (User *)[dataManager dataObjectForClass:[User class] uniqueIdentifier:@"follower"];
+      User *followed = (User *)[dataManager dataObjectForClass:[User class] uniqueIdentifier:@"user000042"];
+      if ([[user following] count] != FOLLOW_COUNT || ![followed isFollowedBy:user]) {
+        fprintf(stderr, "write_back: %lu of %d follows found\n", (unsigned long)[[user following] count], FOLLOW_COUNT);
+        failures++;
+      }
+    }
+
+    [[NSFileManager defaultManager] removeItemAtPath:path error:NULL];
+  }
+
+  if (failures == 0) {
+    printf("write_back: ok\n");
+  }
+  return failures == 0 ? 0 : 1;
+}
@@ -0,0 +1,217 @@
+/* vim: set ft=c fenc=utf-8 sw=2 ts=2 et: */
+
+/*
+ * Kills a writer with SIGKILL at random points and checks, after the log
+ * is replayed on reopen, that every write the writer was told is durable
+ * is in the database with its value. Run with "lsm" to use that engine.
+ */
+
+#include "vsdb.h"
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#define ROUNDS 20
+#define BATCH_SIZE 8
+
+static const char *filename = "crash.db";
+static vsdb_options_t options;
+
+static size_t make_key(char *key, size_t size, uint32_t index)
+{
+  return (size_t)snprintf(key, size, "key%010u", index);
+}
+
+static size_t make_value(char *value, size_t size, uint32_t index)
+{
+  size_t length = 0;
+  while (length + 16 < size) {
+    length += (size_t)snprintf(value + length, size - length, "value%010u", index);
+  }
+  return length;
+}
+
+static void acknowledge(int fd, uint32_t index)
+{
+  while (write(fd, &index, sizeof(index)) != (ssize_t)sizeof(index)) {
+    if (errno != EINTR) {
+      _exit(2);
+    }
+  }
+}
+
+/*
+ * Alternates single vsdb_set() calls and batches, and acknowledges each
+ * key over the pipe only once the call that wrote it has returned.
+ */
+static void writer_main(int fd, uint32_t index)
+{
+  vsdb_t vsdb = vsdb_open2(filename, &options);
+  if (vsdb == NULL) {
+    _exit(2);
+  }
+
+  vsdb_batch_t batch = vsdb_batch_create();
+  char key[32];
+  char value[128];
+
+  for (;;) {
+    size_t key_length = make_key(key, sizeof(key), index);
+    size_t value_size = make_value(value, sizeof(value), index);
+    if (vsdb_set(vsdb, key, key_length, value, value_size) != vsdb_okay) {
+      _exit(2);
+    }
+    acknowledge(fd, index++);
+
+    vsdb_batch_clear(batch);
+    uint32_t i;
+    for (i = 0; i < BATCH_SIZE; ++i) {
+      key_length = make_key(key, sizeof(key), index + i);
+      value_size = make_value(value, sizeof(value), index + i);
+      vsdb_batch_put(batch, key, key_length, value, value_size);
+    }
+    if (vsdb_batch_commit(vsdb, batch) != vsdb_okay) {
+      _exit(2);
+    }
+    for (i = 0; i < BATCH_SIZE; ++i) {
+      acknowledge(fd, index++);
+    }
+  }
+}
+
+static void read_acknowledgements(int fd, uint32_t *acknowledged, int timeout)
+{
+  struct pollfd pfd;
+  uint32_t indexes[1024];
+  ssize_t size;
+  ssize_t i;
+
+  pfd.fd = fd;
+  pfd.events = POLLIN;
+  if (timeout >= 0 && poll(&pfd, 1, timeout) <= 0) {
+    return;
+  }
+
+  /* the pipe carries whole indexes, a short read only happens at EOF */
+  size = read(fd, indexes, sizeof(indexes));
+  for (i = 0; i < size / (ssize_t)sizeof(uint32_t); ++i) {
+    if (indexes[i] != *acknowledged) {
+      fprintf(stderr, "acknowledged %u out of order, expected %u\n", indexes[i], *acknowledged);
+      exit(1);
+    }
+    ++*acknowledged;
+  }
+}
+
+static void drain_acknowledgements(int fd, uint32_t *acknowledged)
+{
+  uint32_t before;
+  do {
+    before = *acknowledged;
+    read_acknowledgements(fd, acknowledged, -1);
+  } while (*acknowledged != before);
+}
+
+static double now(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+static void verify(uint32_t acknowledged)
+{
+  vsdb_t vsdb = vsdb_open2(filename, &options);
+  if (vsdb == NULL) {
+    fprintf(stderr, "cannot reopen %s\n", filename);
+    exit(1);
+  }
+
+  char key[32];
+  char expected[128];
+  uint32_t index;
+
+  for (index = 0; index < acknowledged; ++index) {
+    size_t key_length = make_key(key, sizeof(key), index);
+    size_t expected_size = make_value(expected, sizeof(expected), index);
+    const void *value;
+    size_t value_size;
+
+    if (vsdb_get(vsdb, key, key_length, &value, &value_size) != vsdb_okay) {
+      fprintf(stderr, "lost acknowledged write %u\n", index);
+      exit(1);
+    }
+    if (value_size != expected_size || memcmp(value, expected, value_size) != 0) {
+      fprintf(stderr, "corrupted acknowledged write %u\n", index);
+      exit(1);
+    }
+    vsdb_free((void *)value);
+  }
+
+  vsdb_close(vsdb);
+}
+
+int main(int argc, const char *argv[])
+{
+  memset(&options, 0, sizeof(options));
+  options.shards = 4;
+  options.wal = 1;
+  options.wal_sync = 1;
+  options.wal_checkpoint_size = 256 * 1024;
+  options.engine = (argc > 1 && strcmp(argv[1], "lsm") == 0) ? vsdb_engine_lsm : vsdb_engine_btree;
+
+  vsdb_unlink(filename, &options);
+  srand((unsigned int)time(NULL));
+
+  uint32_t acknowledged = 0;
+  int round;
+
+  for (round = 1; round <= ROUNDS; ++round) {
+    int fds[2];
+    if (pipe(fds) != 0) {
+      perror("pipe");
+      return 1;
+    }
+
+    pid_t pid = fork();
+    if (pid < 0) {
+      perror("fork");
+      return 1;
+    }
+    if (pid == 0) {
+      close(fds[0]);
+      writer_main(fds[1], acknowledged);
+    }
+    close(fds[1]);
+
+    /* keep the pipe drained so that the writer is killed mid-write */
+    double deadline = now() + (double)(50 + rand() % 450) / 1000.0;
+    while (now() < deadline) {
+      read_acknowledgements(fds[0], &acknowledged, 10);
+    }
+
+    kill(pid, SIGKILL);
+    int status;
+    waitpid(pid, &status, 0);
+    drain_acknowledgements(fds[0], &acknowledged);
+    close(fds[0]);
+
+    if (!WIFSIGNALED(status)) {
+      fprintf(stderr, "writer failed before it was killed\n");
+      return 1;
+    }
+
+    verify(acknowledged);
+    printf("round %2d: %u acknowledged writes survived\n", round, acknowledged);
+  }
+
+  vsdb_unlink(filename, &options);
+  return 0;
+}
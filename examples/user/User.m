@@ -9,6 +9,11 @@
 @dynamic followers;
 @dynamic following;
 
++ (NSArray *)indexedProperties
+{
+  return @[@"name"];
+}
+
 - (id)init
 {
   self = [super init];
@@ -43,12 +48,14 @@
     return;
   }
 
-  [self willChangeValueForKey:@"following"];
-  [user willChangeValueForKey:@"followers"];
+  NSSet *following = [NSSet setWithObject:[user userID]];
+  NSSet *followers = [NSSet setWithObject:[self userID]];
+  [self willChangeValueForKey:@"following" withSetMutation:NSKeyValueUnionSetMutation usingObjects:following];
+  [user willChangeValueForKey:@"followers" withSetMutation:NSKeyValueUnionSetMutation usingObjects:followers];
   [[self following] addObject:[user userID]];
   [[user followers] addObject:[self userID]];
-  [self didChangeValueForKey:@"following"];
-  [user didChangeValueForKey:@"followers"];
+  [self didChangeValueForKey:@"following" withSetMutation:NSKeyValueUnionSetMutation usingObjects:following];
+  [user didChangeValueForKey:@"followers" withSetMutation:NSKeyValueUnionSetMutation usingObjects:followers];
 }
 
 - (void)unfollow:(User *)user
@@ -57,12 +64,14 @@
     return;
   }
 
-  [self willChangeValueForKey:@"following"];
-  [user willChangeValueForKey:@"followers"];
+  NSSet *following = [NSSet setWithObject:[user userID]];
+  NSSet *followers = [NSSet setWithObject:[self userID]];
+  [self willChangeValueForKey:@"following" withSetMutation:NSKeyValueMinusSetMutation usingObjects:following];
+  [user willChangeValueForKey:@"followers" withSetMutation:NSKeyValueMinusSetMutation usingObjects:followers];
   [[self following] removeObject:[user userID]];
   [[user followers] removeObject:[self userID]];
-  [self didChangeValueForKey:@"following"];
-  [user didChangeValueForKey:@"followers"];
+  [self didChangeValueForKey:@"following" withSetMutation:NSKeyValueMinusSetMutation usingObjects:following];
+  [user didChangeValueForKey:@"followers" withSetMutation:NSKeyValueMinusSetMutation usingObjects:followers];
 }
 
 @end
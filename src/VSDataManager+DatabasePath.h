@@ -32,4 +32,7 @@
 + (NSString *)defaultDatabaseName;
 + (void)setDefaultDatabaseName:(NSString *)name;
 
++ (NSDictionary *)defaultDatabaseOptions;
++ (void)setDefaultDatabaseOptions:(NSDictionary *)options;
+
 @end
@@ -26,6 +26,7 @@
 
 static NSString *gDefaultDatabasePath = nil;
 static NSString *gDefaultDatabaseName = @"VSDataStore.db";
+static NSDictionary *gDefaultDatabaseOptions = nil;
 
 @implementation VSDataManager (DatabasePath)
 
@@ -90,4 +91,14 @@ static NSString *gDefaultDatabaseName = @"VSDataStore.db";
   gDefaultDatabaseName = [name copy];
 }
 
++ (NSDictionary *)defaultDatabaseOptions
+{
+  return gDefaultDatabaseOptions;
+}
+
++ (void)setDefaultDatabaseOptions:(NSDictionary *)options
+{
+  gDefaultDatabaseOptions = [options copy];
+}
+
 @end
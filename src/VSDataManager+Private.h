@@ -28,4 +28,45 @@
 
 - (void)setValue:(id)value forProperty:(NSString *)property uniqueIdentifier:(NSString *)uniqueIdentifier modelIdentifier:(NSString *)modelIdentifier;
 
+/*
+ * Persist a single mutation of the collection value, only writing the
+ * objects involved. value is the collection after the mutation.
+ */
+- (void)setValue:(id)value withSetMutation:(NSKeyValueSetMutationKind)mutationKind usingObjects:(NSSet *)objects forProperty:(NSString *)property uniqueIdentifier:(NSString *)uniqueIdentifier modelIdentifier:(NSString *)modelIdentifier;
+- (void)setValue:(id)value withChange:(NSKeyValueChange)changeKind atIndexes:(NSIndexSet *)indexes forProperty:(NSString *)property uniqueIdentifier:(NSString *)uniqueIdentifier modelIdentifier:(NSString *)modelIdentifier;
+
+/*
+ * Reads every property of a single object, keyed by property name.
+ */
+- (NSDictionary *)valuesForUniqueIdentifier:(NSString *)uniqueIdentifier modelIdentifier:(NSString *)modelIdentifier;
+
+/*
+ * Reads a single property of the given objects only, keyed by unique
+ * identifier, each with a seek.
+ */
+- (NSDictionary *)valuesForProperty:(NSString *)property ofClass:(Class)dataObjectClass uniqueIdentifiers:(id<NSFastEnumeration>)uniqueIdentifiers;
+
+/*
+ * The unique identifiers of the index entries of values in a range, or
+ * of strings with a prefix, in value order, without reading any object.
+ * Entries may be stale, values must be checked. Return nil if the
+ * property is not indexed or the values cannot be.
+ */
+- (BOOL)isIndexedProperty:(NSString *)property ofClass:(Class)dataObjectClass;
+- (NSArray *)uniqueIdentifiersForClass:(Class)dataObjectClass
+                  whereIndexedProperty:(NSString *)property
+                             fromValue:(id)fromValue
+                             inclusive:(BOOL)fromInclusive
+                               toValue:(id)toValue
+                             inclusive:(BOOL)toInclusive;
+- (NSArray *)uniqueIdentifiersForClass:(Class)dataObjectClass whereIndexedProperty:(NSString *)property hasPrefix:(NSString *)prefix;
+
+/*
+ * With write-back, changes are not persisted as they are made. The model
+ * marks the property dirty and tells the manager, which later has the
+ * model write the dirty properties of the object.
+ */
+- (BOOL)writesBack;
+- (void)dataObjectDidBecomeDirty:(VSDataObject *)dataObject;
+
 @end
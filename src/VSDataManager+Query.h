@@ -0,0 +1,47 @@
+/* vim: set ft=objc fenc=utf-8 sw=2 ts=2 et: */
+/*
+ * Copyright (c) 2013-2014 Chongyu Zhu <i@lembacon.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#import "VSDataManager.h"
+
+@interface VSDataManager (Query)
+
+/*
+ * Returns the stored objects of the class matching predicate (nil matches
+ * every object), ordered by sortDescriptors, or by unique identifier
+ * without any, at most limit of them (0 for no limit).
+ *
+ * Comparisons of properties with constants, combined with AND, OR and
+ * NOT, are run against the stored values of the properties they involve,
+ * found through the index of indexed properties for ==, <, <=, >, >=,
+ * BEGINSWITH, IN and BETWEEN, and only the objects returned are created.
+ * Sorting by properties only reads them as well. Anything else, like
+ * key paths across objects or comparisons with nil, is evaluated against
+ * the objects.
+ */
+- (NSArray *)dataObjectsForClass:(Class)dataObjectClass
+               matchingPredicate:(NSPredicate *)predicate
+                 sortDescriptors:(NSArray *)sortDescriptors
+                           limit:(NSUInteger)limit;
+
+@end
@@ -0,0 +1,409 @@
+/* vim: set ft=objc fenc=utf-8 sw=2 ts=2 et: */
+/*
+ * Copyright (c) 2013-2014 Chongyu Zhu <i@lembacon.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#import "VSDataManager+Query.h"
+#import "VSDataManager+Private.h"
+#import "VSDataModel.h"
+#import "VSDataObject.h"
+
+/* an object as far as sorting goes, holding the values of the sort keys only */
+@interface VSDataManagerQueryRow : NSObject
+@property (nonatomic, strong) NSString *uniqueIdentifier;
+@property (nonatomic, strong) NSMutableDictionary *values;
+@end
+@implementation VSDataManagerQueryRow
+- (id)valueForKey:(NSString *)key
+{
+  return [_values objectForKey:key];
+}
+@end
+
+static BOOL getConstantValue(NSExpression *expression, id *value)
+{
+  if ([expression expressionType] == NSConstantValueExpressionType) {
+    *value = [expression constantValue];
+    return YES;
+  }
+
+  /* literal collections, as in IN {1, 2} or BETWEEN {1, 2} */
+  if ([expression expressionType] == NSAggregateExpressionType) {
+    NSMutableArray *values = [NSMutableArray array];
+    for (NSExpression *element in [expression collection]) {
+      id elementValue = nil;
+      if (![element isKindOfClass:[NSExpression class]] || !getConstantValue(element, &elementValue) || elementValue == nil) {
+        return NO;
+      }
+      [values addObject:elementValue];
+    }
+    *value = values;
+    return YES;
+  }
+
+  return NO;
+}
+
+static BOOL getFlippedOperatorType(NSPredicateOperatorType type, NSPredicateOperatorType *flippedType)
+{
+  switch (type) {
+  case NSLessThanPredicateOperatorType:
+    *flippedType = NSGreaterThanPredicateOperatorType;
+    return YES;
+  case NSLessThanOrEqualToPredicateOperatorType:
+    *flippedType = NSGreaterThanOrEqualToPredicateOperatorType;
+    return YES;
+  case NSGreaterThanPredicateOperatorType:
+    *flippedType = NSLessThanPredicateOperatorType;
+    return YES;
+  case NSGreaterThanOrEqualToPredicateOperatorType:
+    *flippedType = NSLessThanOrEqualToPredicateOperatorType;
+    return YES;
+  case NSEqualToPredicateOperatorType:
+    *flippedType = type;
+    return YES;
+  default:
+    return NO;
+  }
+}
+
+/*
+ * Rewrites a comparison as "property op constant", or returns nil if it
+ * cannot be decided from the stored values of a property. Objects without
+ * a value are never read, so comparisons they could match, with != or
+ * with nil, are left to the objects.
+ */
+static NSComparisonPredicate *normalizedComparison(NSComparisonPredicate *comparison, Class dataObjectClass, NSString **property, id *constant)
+{
+  NSPredicateOperatorType type = [comparison predicateOperatorType];
+  if ([comparison comparisonPredicateModifier] != NSDirectPredicateModifier ||
+      type == NSCustomSelectorPredicateOperatorType || type == NSNotEqualToPredicateOperatorType) {
+    return nil;
+  }
+
+  NSExpression *left = [comparison leftExpression];
+  NSExpression *right = [comparison rightExpression];
+  if ([left expressionType] != NSKeyPathExpressionType) {
+    if ([right expressionType] != NSKeyPathExpressionType || !getFlippedOperatorType(type, &type)) {
+      return nil;
+    }
+    NSExpression *expression = left;
+    left = right;
+    right = expression;
+  }
+
+  *constant = nil;
+  if (!getConstantValue(right, constant) || *constant == nil || [*constant isKindOfClass:[NSNull class]]) {
+    return nil;
+  }
+
+  *property = [left keyPath];
+  if (![[VSDataModel sharedModel] dataObjectClass:dataObjectClass hasPropertyForKey:*property]) {
+    return nil;
+  }
+
+  return (NSComparisonPredicate *)[NSComparisonPredicate predicateWithLeftExpression:[NSExpression expressionForKeyPath:*property]
+                                                                     rightExpression:[NSExpression expressionForConstantValue:*constant]
+                                                                            modifier:NSDirectPredicateModifier
+                                                                                type:type
+                                                                             options:[comparison options]];
+}
+
+@implementation VSDataManager (Query)
+
+/*
+ * Returns the unique identifiers of candidates (every object if nil) that
+ * may match predicate, or nil for all of candidates. *exact tells whether
+ * they all do match, otherwise the objects must be checked.
+ */
+- (NSSet *)_uniqueIdentifiersForClass:(Class)dataObjectClass matchingPredicate:(NSPredicate *)predicate within:(NSSet *)candidates exact:(BOOL *)exact
+{
+  if ([predicate isKindOfClass:[NSComparisonPredicate class]]) {
+    return [self _uniqueIdentifiersForClass:dataObjectClass matchingComparison:(NSComparisonPredicate *)predicate within:candidates exact:exact];
+  }
+
+  if (![predicate isKindOfClass:[NSCompoundPredicate class]]) {
+    *exact = NO;
+    return candidates;
+  }
+
+  NSArray *subpredicates = [(NSCompoundPredicate *)predicate subpredicates];
+  NSSet *result;
+  BOOL subpredicateExact;
+
+  switch ([(NSCompoundPredicate *)predicate compoundPredicateType]) {
+  case NSAndPredicateType:
+    /* indexed comparisons first, so that the others only read what is left */
+    result = candidates;
+    *exact = YES;
+    for (NSPredicate *subpredicate in [self _subpredicatesByCost:subpredicates forClass:dataObjectClass]) {
+      NSSet *matches = [self _uniqueIdentifiersForClass:dataObjectClass matchingPredicate:subpredicate within:result exact:&subpredicateExact];
+      *exact = *exact && subpredicateExact;
+      if (matches != nil) {
+        result = matches;
+      }
+    }
+    return result;
+
+  case NSOrPredicateType:
+    result = [NSMutableSet set];
+    *exact = YES;
+    for (NSPredicate *subpredicate in subpredicates) {
+      NSSet *matches = [self _uniqueIdentifiersForClass:dataObjectClass matchingPredicate:subpredicate within:candidates exact:&subpredicateExact];
+      if (matches == nil) {
+        *exact = NO;
+        return candidates;
+      }
+      *exact = *exact && subpredicateExact;
+      [(NSMutableSet *)result unionSet:matches];
+    }
+    return result;
+
+  case NSNotPredicateType:
+    result = [self _uniqueIdentifiersForClass:dataObjectClass matchingPredicate:[subpredicates firstObject] within:candidates exact:&subpredicateExact];
+    if (result == nil || !subpredicateExact) {
+      *exact = NO;
+      return candidates;
+    }
+    else {
+      NSMutableSet *complement = (candidates != nil) ? [candidates mutableCopy] : [NSMutableSet setWithArray:[self uniqueIdentifiersForClass:dataObjectClass]];
+      [complement minusSet:result];
+      *exact = YES;
+      return complement;
+    }
+
+  default:
+    *exact = NO;
+    return candidates;
+  }
+}
+
+- (NSArray *)_subpredicatesByCost:(NSArray *)subpredicates forClass:(Class)dataObjectClass
+{
+  NSUInteger (^cost)(NSPredicate *) = ^NSUInteger (NSPredicate *predicate) {
+    if (![predicate isKindOfClass:[NSComparisonPredicate class]]) {
+      return 2;
+    }
+
+    NSExpression *left = [(NSComparisonPredicate *)predicate leftExpression];
+    NSExpression *right = [(NSComparisonPredicate *)predicate rightExpression];
+    NSExpression *keyPath = ([left expressionType] == NSKeyPathExpressionType) ? left : right;
+    if ([keyPath expressionType] == NSKeyPathExpressionType && [self isIndexedProperty:[keyPath keyPath] ofClass:dataObjectClass]) {
+      return 0;
+    }
+
+    return 1;
+  };
+
+  return [subpredicates sortedArrayWithOptions:NSSortStable usingComparator:^NSComparisonResult (id predicate1, id predicate2) {
+    NSUInteger cost1 = cost(predicate1);
+    NSUInteger cost2 = cost(predicate2);
+    return (cost1 < cost2) ? NSOrderedAscending : ((cost1 > cost2) ? NSOrderedDescending : NSOrderedSame);
+  }];
+}
+
+- (NSSet *)_uniqueIdentifiersForClass:(Class)dataObjectClass matchingComparison:(NSComparisonPredicate *)comparison within:(NSSet *)candidates exact:(BOOL *)exact
+{
+  NSString *property = nil;
+  id constant = nil;
+  NSComparisonPredicate *normalized = normalizedComparison(comparison, dataObjectClass, &property, &constant);
+  if (normalized == nil) {
+    *exact = NO;
+    return candidates;
+  }
+
+  /* with candidates left, reading their values beats walking the index */
+  NSArray *indexed = nil;
+  if (candidates == nil && [normalized options] == 0) {
+    indexed = [self _indexedUniqueIdentifiersForClass:dataObjectClass property:property operatorType:[normalized predicateOperatorType] constant:constant];
+  }
+
+  /* index entries may be stale, so the values are checked all the same */
+  NSDictionary *values;
+  if (indexed != nil) {
+    values = [self valuesForProperty:property ofClass:dataObjectClass uniqueIdentifiers:indexed];
+  }
+  else if (candidates != nil) {
+    values = [self valuesForProperty:property ofClass:dataObjectClass uniqueIdentifiers:candidates];
+  }
+  else {
+    values = [self valuesForProperty:property ofClass:dataObjectClass];
+  }
+
+  NSMutableSet *matches = [NSMutableSet set];
+  for (NSString *uniqueIdentifier in values) {
+    if ([normalized evaluateWithObject:@{property: [values objectForKey:uniqueIdentifier]}]) {
+      [matches addObject:uniqueIdentifier];
+    }
+  }
+
+  *exact = YES;
+  return matches;
+}
+
+/*
+ * Index order is the order of the UTF-8 bytes for strings, which -compare:
+ * does not follow, so only numbers and dates are looked up by range.
+ */
+- (NSArray *)_indexedUniqueIdentifiersForClass:(Class)dataObjectClass property:(NSString *)property operatorType:(NSPredicateOperatorType)operatorType constant:(id)constant
+{
+  BOOL ordered = [constant isKindOfClass:[NSNumber class]] || [constant isKindOfClass:[NSDate class]];
+
+  switch (operatorType) {
+  case NSEqualToPredicateOperatorType:
+    return [self uniqueIdentifiersForClass:dataObjectClass whereIndexedProperty:property fromValue:constant inclusive:YES toValue:constant inclusive:YES];
+  case NSLessThanPredicateOperatorType:
+  case NSLessThanOrEqualToPredicateOperatorType:
+    if (!ordered) {
+      return nil;
+    }
+    return [self uniqueIdentifiersForClass:dataObjectClass whereIndexedProperty:property fromValue:nil inclusive:YES toValue:constant
+                                 inclusive:(operatorType == NSLessThanOrEqualToPredicateOperatorType)];
+  case NSGreaterThanPredicateOperatorType:
+  case NSGreaterThanOrEqualToPredicateOperatorType:
+    if (!ordered) {
+      return nil;
+    }
+    return [self uniqueIdentifiersForClass:dataObjectClass whereIndexedProperty:property fromValue:constant
+                                 inclusive:(operatorType == NSGreaterThanOrEqualToPredicateOperatorType) toValue:nil inclusive:YES];
+  case NSBeginsWithPredicateOperatorType:
+    return [self uniqueIdentifiersForClass:dataObjectClass whereIndexedProperty:property hasPrefix:constant];
+  case NSBetweenPredicateOperatorType:
+    if (![constant isKindOfClass:[NSArray class]] || [constant count] != 2) {
+      return nil;
+    }
+    else {
+      id fromValue = [constant objectAtIndex:0];
+      id toValue = [constant objectAtIndex:1];
+      if (!([fromValue isKindOfClass:[NSNumber class]] || [fromValue isKindOfClass:[NSDate class]]) ||
+          !([toValue isKindOfClass:[NSNumber class]] || [toValue isKindOfClass:[NSDate class]])) {
+        return nil;
+      }
+      return [self uniqueIdentifiersForClass:dataObjectClass whereIndexedProperty:property fromValue:fromValue inclusive:YES toValue:toValue inclusive:YES];
+    }
+  case NSInPredicateOperatorType:
+    if (![constant isKindOfClass:[NSArray class]] && ![constant isKindOfClass:[NSSet class]]) {
+      return nil;
+    }
+    else {
+      NSMutableArray *uniqueIdentifiers = [NSMutableArray array];
+      for (id value in constant) {
+        NSArray *matches = [self uniqueIdentifiersForClass:dataObjectClass whereIndexedProperty:property fromValue:value inclusive:YES toValue:value inclusive:YES];
+        if (matches == nil) {
+          return nil;
+        }
+        [uniqueIdentifiers addObjectsFromArray:matches];
+      }
+      return uniqueIdentifiers;
+    }
+  default:
+    return nil;
+  }
+}
+
+/* candidates is nil for every object, whose values are then read in one walk */
+- (NSArray *)_sortedUniqueIdentifiers:(NSArray *)uniqueIdentifiers within:(NSSet *)candidates forClass:(Class)dataObjectClass sortDescriptors:(NSArray *)sortDescriptors
+{
+  if ([sortDescriptors count] == 0) {
+    return [uniqueIdentifiers sortedArrayUsingSelector:@selector(compare:)];
+  }
+
+  NSMutableDictionary *rows = [NSMutableDictionary dictionaryWithCapacity:[uniqueIdentifiers count]];
+  for (NSString *uniqueIdentifier in uniqueIdentifiers) {
+    VSDataManagerQueryRow *row = [[VSDataManagerQueryRow alloc] init];
+    row.uniqueIdentifier = uniqueIdentifier;
+    row.values = [NSMutableDictionary dictionary];
+    [rows setObject:row forKey:uniqueIdentifier];
+  }
+
+  for (NSSortDescriptor *sortDescriptor in sortDescriptors) {
+    NSString *property = [sortDescriptor key];
+    NSDictionary *values = (candidates != nil) ? [self valuesForProperty:property ofClass:dataObjectClass uniqueIdentifiers:candidates]
+                                               : [self valuesForProperty:property ofClass:dataObjectClass];
+    for (NSString *uniqueIdentifier in values) {
+      [[[rows objectForKey:uniqueIdentifier] values] setObject:[values objectForKey:uniqueIdentifier] forKey:property];
+    }
+  }
+
+  NSArray *sortedRows = [[rows allValues] sortedArrayUsingDescriptors:sortDescriptors];
+  NSMutableArray *sortedUniqueIdentifiers = [NSMutableArray arrayWithCapacity:[sortedRows count]];
+  for (VSDataManagerQueryRow *row in sortedRows) {
+    [sortedUniqueIdentifiers addObject:row.uniqueIdentifier];
+  }
+
+  return sortedUniqueIdentifiers;
+}
+
+- (NSArray *)dataObjectsForClass:(Class)dataObjectClass
+               matchingPredicate:(NSPredicate *)predicate
+                 sortDescriptors:(NSArray *)sortDescriptors
+                           limit:(NSUInteger)limit
+{
+  /* the stored values must have the pending changes */
+  [self flush];
+
+  BOOL exact = YES;
+  NSSet *candidates = (predicate != nil) ? [self _uniqueIdentifiersForClass:dataObjectClass matchingPredicate:predicate within:nil exact:&exact] : nil;
+  NSArray *uniqueIdentifiers = (candidates != nil) ? [candidates allObjects] : [self uniqueIdentifiersForClass:dataObjectClass];
+
+  BOOL sortable = YES;
+  for (NSSortDescriptor *sortDescriptor in sortDescriptors) {
+    if (![[VSDataModel sharedModel] dataObjectClass:dataObjectClass hasPropertyForKey:[sortDescriptor key]]) {
+      sortable = NO;
+    }
+  }
+
+  if (!exact || !sortable) {
+    /* the rest is up to the objects */
+    NSMutableArray *dataObjects = [NSMutableArray arrayWithCapacity:[uniqueIdentifiers count]];
+    for (NSString *uniqueIdentifier in uniqueIdentifiers) {
+      VSDataObject *dataObject = [self dataObjectForClass:dataObjectClass uniqueIdentifier:uniqueIdentifier];
+      if (dataObject != nil && (exact || [predicate evaluateWithObject:dataObject])) {
+        [dataObjects addObject:dataObject];
+      }
+    }
+
+    [dataObjects sortUsingDescriptors:([sortDescriptors count] > 0) ? sortDescriptors : @[[NSSortDescriptor sortDescriptorWithKey:@"uniqueIdentifier" ascending:YES selector:@selector(compare:)]]];
+    if (limit > 0 && [dataObjects count] > limit) {
+      return [dataObjects subarrayWithRange:NSMakeRange(0, limit)];
+    }
+
+    return dataObjects;
+  }
+
+  uniqueIdentifiers = [self _sortedUniqueIdentifiers:uniqueIdentifiers within:candidates forClass:dataObjectClass sortDescriptors:sortDescriptors];
+  if (limit > 0 && [uniqueIdentifiers count] > limit) {
+    uniqueIdentifiers = [uniqueIdentifiers subarrayWithRange:NSMakeRange(0, limit)];
+  }
+
+  NSMutableArray *dataObjects = [NSMutableArray arrayWithCapacity:[uniqueIdentifiers count]];
+  for (NSString *uniqueIdentifier in uniqueIdentifiers) {
+    VSDataObject *dataObject = [self dataObjectForClass:dataObjectClass uniqueIdentifier:uniqueIdentifier];
+    if (dataObject != nil) {
+      [dataObjects addObject:dataObject];
+    }
+  }
+
+  return dataObjects;
+}
+
+@end
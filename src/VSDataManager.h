@@ -26,19 +26,155 @@
 
 @class VSDataObject;
 
+/*
+ * Options for -initWithDatabasePath:options:
+ *
+ * VSDataManagerShardCountOption (NSNumber): number of B-trees the records
+ *   are spread over, so that threads touching different records do not
+ *   wait for each other. A database must always be opened with the same
+ *   shard count. Defaults to 1.
+ *
+ * VSDataManagerWriteAheadLogOption (NSNumber, BOOL): log writes ahead and
+ *   let a background checkpoint flush the B-trees. Defaults to NO.
+ *
+ * VSDataManagerSynchronousWritesOption (NSNumber, BOOL): with the log
+ *   enabled, every write is durable once it returns. Defaults to NO.
+ *
+ * VSDataManagerLogStructuredStorageOption (NSNumber, BOOL): store records
+ *   in append-only sorted segments instead of B-trees, which suits write
+ *   heavy use. A database must always be opened with the same storage.
+ *   Defaults to NO.
+ *
+ * VSDataManagerBloomFilterOption (NSNumber, BOOL): keep Bloom filters of
+ *   the stored keys, so that looking up values that were never set is
+ *   cheap. Defaults to NO.
+ *
+ * VSDataManagerLazyCollectionsOption (NSNumber, BOOL): load large array
+ *   and set properties as proxies that only decode the elements actually
+ *   accessed, so that loading costs what is used rather than what is
+ *   stored. Defaults to NO.
+ *
+ * VSDataManagerFaultingOption (NSNumber, BOOL): load nothing up front.
+ *   Objects are created as faults when first asked for, and read their
+ *   values from the database when one of them is first accessed, so that
+ *   opening a database costs the same whatever its size. Defaults to NO.
+ *
+ * VSDataManagerWriteBackOption (NSNumber, BOOL): do not write changed
+ *   properties as they change, only mark them dirty, and have them written
+ *   in the background, each once however often it changed, all in one
+ *   batch. A mutable collection changed in place is copied each time it
+ *   is reported changed, so the copy is written while the collection can
+ *   go on changing. Defaults to NO.
+ *
+ * VSDataManagerWriteBackDelayOption (NSNumber, seconds): with write-back,
+ *   the longest a change waits before it is written. Defaults to 1.
+ *
+ * VSDataManagerWriteBackLimitOption (NSNumber): with write-back, the number
+ *   of pending changes that has them written right away rather than after
+ *   the delay, which bounds the memory they hold on to. 0 has every change
+ *   written right away. Defaults to 4096.
+ *
+ * VSDataManagerLoadConcurrencyOption (NSNumber): the most threads loading
+ *   the objects at startup work on at once. Defaults to 0, as many as
+ *   there are cores.
+ */
+FOUNDATION_EXPORT NSString *const VSDataManagerShardCountOption;
+FOUNDATION_EXPORT NSString *const VSDataManagerWriteAheadLogOption;
+FOUNDATION_EXPORT NSString *const VSDataManagerSynchronousWritesOption;
+FOUNDATION_EXPORT NSString *const VSDataManagerLogStructuredStorageOption;
+FOUNDATION_EXPORT NSString *const VSDataManagerBloomFilterOption;
+FOUNDATION_EXPORT NSString *const VSDataManagerLazyCollectionsOption;
+FOUNDATION_EXPORT NSString *const VSDataManagerFaultingOption;
+FOUNDATION_EXPORT NSString *const VSDataManagerWriteBackOption;
+FOUNDATION_EXPORT NSString *const VSDataManagerWriteBackDelayOption;
+FOUNDATION_EXPORT NSString *const VSDataManagerWriteBackLimitOption;
+FOUNDATION_EXPORT NSString *const VSDataManagerLoadConcurrencyOption;
+
 @interface VSDataManager : NSObject
 
 + (VSDataManager *)defaultManager;
 
+/*
+ * A database written with the former string keys is migrated the first
+ * time it is opened, before the initializer returns, which takes time
+ * proportional to the size of the database. A migration cut short carries
+ * on at the next open.
+ */
 - (id)initWithDatabasePath:(NSString *)path;
+- (id)initWithDatabasePath:(NSString *)path options:(NSDictionary *)options;
 
 - (void)reset;
 - (void)sync;
 
+/*
+ * Writes the pending changes now, with write-back. Returns once they are
+ * in the database. -sync flushes as well, and so does deallocating the
+ * manager.
+ */
+- (void)flush;
+
 - (NSDictionary *)dictionaryOfDataObjectsForClass:(Class)dataObjectClass;
 - (NSArray *)dataObjectsForClass:(Class)dataObjectClass;
 
+/*
+ * Returns the stored object of the class with the unique identifier, or
+ * nil. Unlike -dictionaryOfDataObjectsForClass:, this never has to find
+ * out about the other objects of the class.
+ */
+- (VSDataObject *)dataObjectForClass:(Class)dataObjectClass uniqueIdentifier:(NSString *)uniqueIdentifier;
+
+/*
+ * Count and list the stored objects of the class, in database key order,
+ * from their keys alone, without reading or decoding any value. Key order
+ * is the order of the UTF-8 bytes of the unique identifiers.
+ */
+- (NSUInteger)countOfDataObjectsForClass:(Class)dataObjectClass;
+- (NSArray *)uniqueIdentifiersForClass:(Class)dataObjectClass;
+
+/*
+ * Reads a single property of every stored object of the class straight
+ * from the database, keyed by unique identifier, without touching the
+ * other properties.
+ */
+- (NSDictionary *)valuesForProperty:(NSString *)property ofClass:(Class)dataObjectClass;
+
+/*
+ * Look the stored objects of the class up by the value of one of its
+ * +indexedProperties, which may be a string, a number or a date. The
+ * range is [fromValue, toValue), nil bounds are unbounded, and objects
+ * come in value order, at most limit of them (0 for no limit). Either
+ * costs a seek plus the objects returned. Both return nil if the
+ * property is not indexed.
+ */
+- (NSArray *)dataObjectsForClass:(Class)dataObjectClass whereProperty:(NSString *)property equals:(id)value;
+- (NSArray *)dataObjectsForClass:(Class)dataObjectClass
+                   whereProperty:(NSString *)property
+                       fromValue:(id)fromValue
+                         toValue:(id)toValue
+                           limit:(NSUInteger)limit;
+
+/*
+ * Pages through the stored objects of the class in database key order,
+ * from startUniqueIdentifier (inclusive, nil for the first object) up to
+ * endUniqueIdentifier (exclusive, nil for no bound), at most limit objects
+ * at a time. *nextUniqueIdentifier is set to where the next page starts,
+ * to be passed back as startUniqueIdentifier, or to nil after the last
+ * page. Each page only costs a seek plus the records it returns.
+ */
+- (NSArray *)dataObjectsForClass:(Class)dataObjectClass
+            fromUniqueIdentifier:(NSString *)startUniqueIdentifier
+              toUniqueIdentifier:(NSString *)endUniqueIdentifier
+                           limit:(NSUInteger)limit
+            nextUniqueIdentifier:(NSString **)nextUniqueIdentifier;
+
 - (void)addDataObject:(VSDataObject *)dataObject;
 - (void)removeDataObject:(VSDataObject *)dataObject;
 
+/*
+ * Writes made by the calling thread between -beginBatch and -commitBatch
+ * are applied at once, all or nothing, by the outermost -commitBatch.
+ */
+- (void)beginBatch;
+- (BOOL)commitBatch;
+
 @end
@@ -27,22 +27,1221 @@
 #import "VSDataManager+DatabasePath.h"
 #import "VSDataModel.h"
 #import "VSDataObject.h"
+#import "VSLazyCollection.h"
 #include "vsdb.h"
 #include "vsdb_cf.h"
+#include <pthread.h>
+
+NSString *const VSDataManagerShardCountOption = @"VSDataManagerShardCountOption";
+NSString *const VSDataManagerWriteAheadLogOption = @"VSDataManagerWriteAheadLogOption";
+NSString *const VSDataManagerSynchronousWritesOption = @"VSDataManagerSynchronousWritesOption";
+NSString *const VSDataManagerLogStructuredStorageOption = @"VSDataManagerLogStructuredStorageOption";
+NSString *const VSDataManagerBloomFilterOption = @"VSDataManagerBloomFilterOption";
+NSString *const VSDataManagerLazyCollectionsOption = @"VSDataManagerLazyCollectionsOption";
+NSString *const VSDataManagerFaultingOption = @"VSDataManagerFaultingOption";
+NSString *const VSDataManagerWriteBackOption = @"VSDataManagerWriteBackOption";
+NSString *const VSDataManagerWriteBackDelayOption = @"VSDataManagerWriteBackDelayOption";
+NSString *const VSDataManagerWriteBackLimitOption = @"VSDataManagerWriteBackLimitOption";
+NSString *const VSDataManagerLoadConcurrencyOption = @"VSDataManagerLoadConcurrencyOption";
+
+typedef struct {
+  vsdb_batch_t batch;
+  NSUInteger depth;
+} VSDataManagerBatchState;
+
+static void freeBatchState(void *state)
+{
+  vsdb_batch_free(((VSDataManagerBatchState *)state)->batch);
+  free(state);
+}
+
+/*
+ * Keys are binary tuples, short and built or taken apart without any
+ * string formatting. Models and their properties are numbered in the
+ * catalog record, and numbers are stored as varints that sort like the
+ * numbers they stand for:
+ *
+ *   0x00 "catalog"                        the catalog
+ *   0x00 "index" model prop               marks the index of prop as built
+ *   0x01 model uid 0x00 ':' prop          a value
+ *   0x01 model uid 0x00 ':' prop seq      a delta of a collection value
+ *   0x02 model prop value 0x00 ':' uid    an index entry
+ *
+ * Unique identifiers are stored as their UTF-8 with NUL escaped as NUL
+ * 0xff, like string index values, so they may contain anything and
+ * objects sort in the order of the UTF-8 bytes of their identifiers.
+ * The keys of an object, of a property and of an index each share a
+ * prefix. Keys of the former "Model:uid:prop" format start with a
+ * printable character, and are moved over when the database is opened.
+ */
+enum {
+  VSDataManagerObjectTag = 0x01,
+  VSDataManagerIndexTag = 0x02
+};
+
+static const char VSDataManagerCatalogKey[] = "\0catalog";
+static const char VSDataManagerIndexMarkerKey[] = "\0index";
+
+/*
+ * Changes to collection properties are appended as delta records, keyed
+ * by the key of the property and a sequence number, rather than rewriting
+ * the whole collection, and are folded into the base record when loading.
+ * Once a property has enough deltas, relative to its size, the whole value
+ * is written again and the deltas are erased.
+ */
+enum {
+  VSDataManagerSetDelta = 0,
+  VSDataManagerArrayDelta = 1
+};
+
+static const NSUInteger VSDataManagerMinimumCompactionCount = 32;
+
+/*
+ * Objects are loaded at startup in slices of consecutive unique
+ * identifiers, of at least this many objects, at most a few per core.
+ */
+static const NSUInteger VSDataManagerMinimumLoadSliceSize = 1024;
+
+/*
+ * Records of the string key format are moved over this many at a time,
+ * each batch at once.
+ */
+static const NSUInteger VSDataManagerMigrationBatchSize = 1024;
+
+static const NSTimeInterval VSDataManagerDefaultWriteBackDelay = 1.0;
+static const NSUInteger VSDataManagerDefaultWriteBackLimit = 4096;
 
 @interface VSDataManager () {
 @private
   vsdb_t _vsdb;
+  vsdb_options_t _vsdbOptions;
+  const vsdb_cflazy_t *_lazy;
+  pthread_key_t _batchKey;
   NSString *_databasePath;
   NSDictionary *_dictionaries;
+  NSMutableDictionary *_deltaCounts;
+  BOOL _faulting;
+  NSUInteger _loadConcurrency;
+  NSMutableSet *_enumeratedClasses;
+  BOOL _writeBack;
+  NSTimeInterval _writeBackDelay;
+  NSUInteger _writeBackLimit;
+  NSHashTable *_dirtyObjects;
+  NSUInteger _dirtyCount;
+  BOOL _flushScheduled;
+  pthread_mutex_t _flushMutex;
+  NSDictionary *_indexedProperties;
+  NSMutableSet *_builtIndexes;
+  NSMutableDictionary *_modelIDs;
+  NSMutableDictionary *_propertyIDs;
+  NSDictionary *_propertyNames;
+  BOOL _catalogChanged;
+}
+@end
+
+static void appendVarint(NSMutableData *key, uint64_t value)
+{
+  uint8_t bytes[9];
+  size_t length, i;
+
+  /* the first byte tells the length, and longer forms start with greater bytes */
+  if (value < 0x80) {
+    bytes[0] = (uint8_t)value;
+    length = 1;
+  }
+  else if (value < 0x4000) {
+    bytes[0] = (uint8_t)(0x80 | (value >> 8));
+    length = 2;
+  }
+  else if (value < 0x200000) {
+    bytes[0] = (uint8_t)(0xc0 | (value >> 16));
+    length = 3;
+  }
+  else if (value < 0x10000000) {
+    bytes[0] = (uint8_t)(0xe0 | (value >> 24));
+    length = 4;
+  }
+  else {
+    bytes[0] = 0xf0;
+    length = 9;
+  }
+
+  for (i = 1; i < length; i++) {
+    bytes[i] = (uint8_t)(value >> ((length - 1 - i) * 8));
+  }
+  [key appendBytes:bytes length:length];
+}
+
+static BOOL readVarint(const uint8_t *bytes, size_t length, size_t *offset, uint64_t *value)
+{
+  size_t start = *offset, size, i;
+  uint64_t result;
+
+  if (start >= length) {
+    return NO;
+  }
+
+  uint8_t first = bytes[start];
+  if (first < 0x80) {
+    size = 1;
+    result = first;
+  }
+  else if (first < 0xc0) {
+    size = 2;
+    result = first & 0x3f;
+  }
+  else if (first < 0xe0) {
+    size = 3;
+    result = first & 0x1f;
+  }
+  else if (first < 0xf0) {
+    size = 4;
+    result = first & 0x0f;
+  }
+  else if (first == 0xf0) {
+    size = 9;
+    result = 0;
+  }
+  else {
+    return NO;
+  }
+
+  if (length - start < size) {
+    return NO;
+  }
+
+  for (i = 1; i < size; i++) {
+    result = (result << 8) | bytes[start + i];
+  }
+  *offset = start + size;
+  *value = result;
+  return YES;
+}
+
+/* The first key after every key starting with prefix, empty if there is none. */
+static NSMutableData *keyPrefixSuccessor(NSData *prefix)
+{
+  NSMutableData *key = [prefix mutableCopy];
+  NSUInteger length = [key length];
+  while (length > 0 && ((const uint8_t *)[key bytes])[length - 1] == 0xff) {
+    length--;
+  }
+
+  [key setLength:length];
+  if (length > 0) {
+    ((uint8_t *)[key mutableBytes])[length - 1]++;
+  }
+
+  return key;
+}
+
+/*
+ * NUL followed by 0xff stands for NUL, so that NUL followed by anything
+ * else, below 0xff, ends the bytes and sorts before any longer bytes.
+ */
+static void appendEscapedBytes(NSMutableData *key, const uint8_t *bytes, size_t length)
+{
+  size_t i, start = 0;
+  for (i = 0; i < length; i++) {
+    if (bytes[i] == 0) {
+      [key appendBytes:bytes + start length:i + 1 - start];
+      [key appendBytes:"\xff" length:1];
+      start = i + 1;
+    }
+  }
+  [key appendBytes:bytes + start length:length - start];
+}
+
+static void appendUniqueIdentifierBytes(NSMutableData *key, const uint8_t *bytes, size_t length)
+{
+  appendEscapedBytes(key, bytes, length);
+  [key appendBytes:"\0:" length:2];
+}
+
+static void appendUniqueIdentifier(NSMutableData *key, NSString *uniqueIdentifier)
+{
+  /* unlike -UTF8String, this keeps whatever follows a NUL */
+  NSUInteger length = [uniqueIdentifier lengthOfBytesUsingEncoding:NSUTF8StringEncoding];
+  uint8_t stackBytes[256];
+  uint8_t *bytes = (length <= sizeof(stackBytes)) ? stackBytes : (uint8_t *)malloc(length);
+
+  [uniqueIdentifier getBytes:bytes maxLength:length usedLength:&length encoding:NSUTF8StringEncoding
+                     options:0 range:NSMakeRange(0, [uniqueIdentifier length]) remainingRange:NULL];
+  appendUniqueIdentifierBytes(key, bytes, length);
+
+  if (bytes != stackBytes) {
+    free(bytes);
+  }
+}
+
+static NSData *deltaKey(NSData *key, NSUInteger sequence)
+{
+  NSMutableData *delta = [key mutableCopy];
+  appendVarint(delta, sequence);
+  return delta;
+}
+
+/* uniqueIdentifier is still escaped, see uniqueIdentifierFromObjectKey() */
+typedef struct {
+  const char *uniqueIdentifier;
+  size_t uniqueIdentifierLength;
+  uint64_t propertyID;
+  size_t propertyKeyLength;
+  BOOL isDelta;
+} VSDataManagerObjectKey;
+
+/*
+ * Takes apart the key of a value or delta of an object, past the prefix of
+ * its model. propertyKeyLength is the length of the key of the value.
+ */
+static BOOL parseObjectKey(const char *key, size_t keyLength, size_t prefixLength, VSDataManagerObjectKey *parsed)
+{
+  const uint8_t *bytes = (const uint8_t *)key;
+  size_t offset = prefixLength;
+  uint64_t sequence;
+
+  /* an escaped NUL is followed by 0xff, so the first NUL ':' ends the identifier */
+  while (offset + 1 < keyLength && !(bytes[offset] == 0 && bytes[offset + 1] == ':')) {
+    offset += (bytes[offset] == 0) ? 2 : 1;
+  }
+  if (offset + 1 >= keyLength) {
+    return NO;
+  }
+
+  parsed->uniqueIdentifier = key + prefixLength;
+  parsed->uniqueIdentifierLength = offset - prefixLength;
+  offset += 2;
+  if (!readVarint(bytes, keyLength, &offset, &parsed->propertyID)) {
+    return NO;
+  }
+
+  parsed->propertyKeyLength = offset;
+  parsed->isDelta = (offset < keyLength);
+  if (parsed->isDelta && (!readVarint(bytes, keyLength, &offset, &sequence) || offset != keyLength)) {
+    return NO;
+  }
+
+  return YES;
+}
+
+static NSString *uniqueIdentifierFromObjectKey(const VSDataManagerObjectKey *parsed)
+{
+  const uint8_t *bytes = (const uint8_t *)parsed->uniqueIdentifier;
+  size_t length = parsed->uniqueIdentifierLength;
+  if (memchr(bytes, 0, length) == NULL) {
+    return [[NSString alloc] initWithBytes:bytes length:length encoding:NSUTF8StringEncoding];
+  }
+
+  NSMutableData *unescaped = [NSMutableData dataWithCapacity:length];
+  size_t i;
+  for (i = 0; i < length; i++) {
+    [unescaped appendBytes:bytes + i length:1];
+    if (bytes[i] == 0) {
+      i++;
+    }
+  }
+
+  return [[NSString alloc] initWithData:unescaped encoding:NSUTF8StringEncoding];
+}
+
+/* the records of an object are adjacent, so its identifier is only made once per object */
+static BOOL isSameUniqueIdentifier(NSData *uniqueIdentifierBytes, const VSDataManagerObjectKey *parsed)
+{
+  return uniqueIdentifierBytes != nil && [uniqueIdentifierBytes length] == parsed->uniqueIdentifierLength &&
+         memcmp([uniqueIdentifierBytes bytes], parsed->uniqueIdentifier, parsed->uniqueIdentifierLength) == 0;
+}
+
+static NSString *propertyNameForID(NSArray *propertyNames, uint64_t propertyID)
+{
+  id propertyName = (propertyID < [propertyNames count]) ? [propertyNames objectAtIndex:(NSUInteger)propertyID] : nil;
+  return [propertyName isKindOfClass:[NSString class]] ? propertyName : nil;
+}
+
+@interface VSDataManagerDeltas : NSObject
+@property (nonatomic, strong) NSString *uniqueIdentifier;
+@property (nonatomic, strong) NSString *property;
+@property (nonatomic, strong) NSMutableArray *values;
+@end
+@implementation VSDataManagerDeltas
+@end
+
+/* deltas sort after their base record, and in the order they were made */
+static void addLoadedDelta(NSMutableDictionary *deltas, const char *key, const VSDataManagerObjectKey *parsed,
+                           NSString *uniqueIdentifier, NSString *propertyName, id value)
+{
+  NSData *propertyKey = [NSData dataWithBytes:key length:parsed->propertyKeyLength];
+  VSDataManagerDeltas *propertyDeltas = [deltas objectForKey:propertyKey];
+  if (propertyDeltas == nil) {
+    propertyDeltas = [[VSDataManagerDeltas alloc] init];
+    propertyDeltas.uniqueIdentifier = uniqueIdentifier;
+    propertyDeltas.property = propertyName;
+    propertyDeltas.values = [NSMutableArray array];
+    [deltas setObject:propertyDeltas forKey:propertyKey];
+  }
+  [propertyDeltas.values addObject:value];
+}
+
+@interface VSDataManagerLoad : NSObject
+@property (nonatomic, assign) size_t prefixLength;
+@property (nonatomic, strong) NSArray *propertyNames;
+@property (nonatomic, strong) NSMutableDictionary *dictionaries;
+@property (nonatomic, strong) NSMutableDictionary *deltas;
+@property (nonatomic, strong) NSData *uniqueIdentifierBytes;
+@property (nonatomic, strong) NSString *uniqueIdentifier;
+@end
+@implementation VSDataManagerLoad
+@end
+
+static void addLoadedValue(VSDataManagerLoad *load, const char *key, const VSDataManagerObjectKey *parsed, id value)
+{
+  if (!isSameUniqueIdentifier(load.uniqueIdentifierBytes, parsed)) {
+    load.uniqueIdentifierBytes = [NSData dataWithBytes:parsed->uniqueIdentifier length:parsed->uniqueIdentifierLength];
+    load.uniqueIdentifier = uniqueIdentifierFromObjectKey(parsed);
+  }
+
+  NSString *propertyName = propertyNameForID(load.propertyNames, parsed->propertyID);
+  if (load.uniqueIdentifier == nil || propertyName == nil) {
+    return;
+  }
+
+  NSMutableDictionary *extraDict = [load.dictionaries objectForKey:load.uniqueIdentifier];
+  if (extraDict == nil) {
+    extraDict = [NSMutableDictionary dictionary];
+    [load.dictionaries setObject:extraDict forKey:load.uniqueIdentifier];
+  }
+
+  if (!parsed->isDelta) {
+    [extraDict setObject:value forKey:propertyName];
+    return;
+  }
+
+  addLoadedDelta(load.deltas, key, parsed, load.uniqueIdentifier, propertyName, value);
+}
+
+static NSIndexSet *indexSetWithRanges(NSArray *ranges)
+{
+  NSMutableIndexSet *indexes = [NSMutableIndexSet indexSet];
+  for (NSUInteger i = 0; i + 1 < [ranges count]; i += 2) {
+    [indexes addIndexesInRange:NSMakeRange([[ranges objectAtIndex:i] unsignedIntegerValue],
+                                           [[ranges objectAtIndex:i + 1] unsignedIntegerValue])];
+  }
+
+  return indexes;
+}
+
+static id applyDeltas(id value, NSArray *deltas)
+{
+  NSArray *first = [deltas objectAtIndex:0];
+  if (![first isKindOfClass:[NSArray class]] || [first count] == 0) {
+    return value;
+  }
+
+  NSInteger type = [[first objectAtIndex:0] integerValue];
+  if (type == VSDataManagerSetDelta) {
+    if (value != nil && ![value isKindOfClass:[NSSet class]]) {
+      return value;
+    }
+
+    NSMutableSet *set = (value != nil) ? [value mutableCopy] : [NSMutableSet set];
+    for (NSArray *delta in deltas) {
+      if (![delta isKindOfClass:[NSArray class]] || [delta count] != 3 || [[delta objectAtIndex:0] integerValue] != VSDataManagerSetDelta) {
+        continue;
+      }
+
+      NSSet *objects = [NSSet setWithArray:[delta objectAtIndex:2]];
+      switch ([[delta objectAtIndex:1] unsignedIntegerValue]) {
+        case NSKeyValueUnionSetMutation:
+          [set unionSet:objects];
+          break;
+        case NSKeyValueMinusSetMutation:
+          [set minusSet:objects];
+          break;
+        case NSKeyValueIntersectSetMutation:
+          [set intersectSet:objects];
+          break;
+        default:
+          break;
+      }
+    }
+
+    return set;
+  }
+  else if (type == VSDataManagerArrayDelta) {
+    if (value != nil && ![value isKindOfClass:[NSArray class]]) {
+      return value;
+    }
+
+    NSMutableArray *array = (value != nil) ? [value mutableCopy] : [NSMutableArray array];
+    for (NSArray *delta in deltas) {
+      if (![delta isKindOfClass:[NSArray class]] || [delta count] != 4 || [[delta objectAtIndex:0] integerValue] != VSDataManagerArrayDelta) {
+        continue;
+      }
+
+      NSIndexSet *indexes = indexSetWithRanges([delta objectAtIndex:2]);
+      NSArray *objects = [delta objectAtIndex:3];
+      if ([indexes count] == 0) {
+        continue;
+      }
+
+      switch ([[delta objectAtIndex:1] unsignedIntegerValue]) {
+        case NSKeyValueChangeInsertion:
+          if ([objects count] == [indexes count] && [indexes lastIndex] < [array count] + [indexes count]) {
+            [array insertObjects:objects atIndexes:indexes];
+          }
+          break;
+        case NSKeyValueChangeRemoval:
+          if ([indexes lastIndex] < [array count]) {
+            [array removeObjectsAtIndexes:indexes];
+          }
+          break;
+        case NSKeyValueChangeReplacement:
+          if ([objects count] == [indexes count] && [indexes lastIndex] < [array count]) {
+            [array replaceObjectsAtIndexes:indexes withObjects:objects];
+          }
+          break;
+        default:
+          break;
+      }
+    }
+
+    return array;
+  }
+
+  return value;
+}
+
+static int loadObjectValue(const char *key, size_t keyLength, CFTypeRef value, void *context)
+{
+  VSDataManagerLoad *load = (__bridge VSDataManagerLoad *)context;
+  VSDataManagerObjectKey parsed;
+  if (parseObjectKey(key, keyLength, load.prefixLength, &parsed)) {
+    addLoadedValue(load, key, &parsed, (__bridge id)value);
+  }
+
+  return 1;
+}
+
+@interface VSDataManagerLoadSlice : NSObject
+@property (nonatomic, assign) Class dataObjectClass;
+@property (nonatomic, strong) NSData *start;
+@property (nonatomic, strong) NSData *end;
+@property (nonatomic, strong) NSMutableDictionary *dataObjects;
+@end
+@implementation VSDataManagerLoadSlice
+@end
+
+/*
+ * Streams the records of a slice straight into objects. The keys of an
+ * object are consecutive, so it is created at its first key, its values
+ * are stored into it as they are decoded, and the deltas of its
+ * collections, kept aside meanwhile, are folded in once the next object
+ * starts.
+ */
+@interface VSDataManagerStream : NSObject
+@property (nonatomic, assign) Class dataObjectClass;
+@property (nonatomic, unsafe_unretained) VSDataManager *dataManager;
+@property (nonatomic, assign) size_t prefixLength;
+@property (nonatomic, strong) NSArray *propertyNames;
+@property (nonatomic, strong) NSMutableDictionary *dataObjects;
+@property (nonatomic, strong) NSMutableDictionary *deltaCounts;
+@property (nonatomic, strong) VSDataObject *dataObject;
+@property (nonatomic, strong) NSData *uniqueIdentifierBytes;
+@property (nonatomic, strong) NSString *uniqueIdentifier;
+@property (nonatomic, strong) NSMutableDictionary *deltas;
+@end
+@implementation VSDataManagerStream
+@end
+
+static void finishStreamedDataObject(VSDataManagerStream *stream)
+{
+  if (stream.dataObject == nil) {
+    return;
+  }
+
+  for (NSData *key in stream.deltas) {
+    VSDataManagerDeltas *propertyDeltas = [stream.deltas objectForKey:key];
+    id value = applyDeltas([[VSDataModel sharedModel] dataObject:stream.dataObject loadedValueForKey:propertyDeltas.property], propertyDeltas.values);
+    if (value != nil) {
+      [[VSDataModel sharedModel] dataObject:stream.dataObject loadValue:value forKey:propertyDeltas.property];
+    }
+
+    [stream.deltaCounts setObject:@([propertyDeltas.values count]) forKey:key];
+  }
+
+  [stream.dataObjects setObject:stream.dataObject forKey:stream.uniqueIdentifier];
+  stream.dataObject = nil;
+  stream.uniqueIdentifier = nil;
+  [stream.deltas removeAllObjects];
+}
+
+static int streamDataObjectValue(const char *key, size_t keyLength, CFTypeRef value, void *context)
+{
+  VSDataManagerStream *stream = (__bridge VSDataManagerStream *)context;
+  VSDataManagerObjectKey parsed;
+  if (!parseObjectKey(key, keyLength, stream.prefixLength, &parsed)) {
+    return 1;
+  }
+
+  if (!isSameUniqueIdentifier(stream.uniqueIdentifierBytes, &parsed)) {
+    finishStreamedDataObject(stream);
+    stream.uniqueIdentifierBytes = [NSData dataWithBytes:parsed.uniqueIdentifier length:parsed.uniqueIdentifierLength];
+    stream.uniqueIdentifier = uniqueIdentifierFromObjectKey(&parsed);
+    if (stream.uniqueIdentifier != nil) {
+      stream.dataObject = [[VSDataModel sharedModel] dataObjectWithClass:stream.dataObjectClass
+                                                        uniqueIdentifier:stream.uniqueIdentifier
+                                                             dataManager:stream.dataManager];
+    }
+  }
+
+  NSString *propertyName = propertyNameForID(stream.propertyNames, parsed.propertyID);
+  if (stream.dataObject == nil || propertyName == nil) {
+    return 1;
+  }
+
+  if (!parsed.isDelta) {
+    [[VSDataModel sharedModel] dataObject:stream.dataObject loadValue:(__bridge id)value forKey:propertyName];
+    return 1;
+  }
+
+  addLoadedDelta(stream.deltas, key, &parsed, stream.uniqueIdentifier, propertyName, (__bridge id)value);
+  return 1;
+}
+
+@interface VSDataManagerPage : VSDataManagerLoad
+@property (nonatomic, assign) NSUInteger limit;
+@property (nonatomic, strong) NSMutableArray *uniqueIdentifiers;
+@property (nonatomic, strong) NSString *nextUniqueIdentifier;
+@end
+@implementation VSDataManagerPage
+@end
+
+static int loadPageValue(const char *key, size_t keyLength, CFTypeRef value, void *context)
+{
+  VSDataManagerPage *page = (__bridge VSDataManagerPage *)context;
+  VSDataManagerObjectKey parsed;
+  if (!parseObjectKey(key, keyLength, page.prefixLength, &parsed)) {
+    return 1;
+  }
+
+  /* the records of an object are adjacent, a new identifier starts a new object */
+  if (!isSameUniqueIdentifier(page.uniqueIdentifierBytes, &parsed)) {
+    NSString *uniqueIdentifier = uniqueIdentifierFromObjectKey(&parsed);
+    if (uniqueIdentifier != nil) {
+      if ([page.uniqueIdentifiers count] == page.limit) {
+        page.nextUniqueIdentifier = uniqueIdentifier;
+        return 0;
+      }
+
+      [page.uniqueIdentifiers addObject:uniqueIdentifier];
+    }
+  }
+
+  addLoadedValue(page, key, &parsed, (__bridge id)value);
+  return 1;
+}
+
+/*
+ * Walks the keys of the model, those starting with prefix, without reading
+ * any value, and counts the objects, adding their identifiers to
+ * uniqueIdentifiers unless it is nil.
+ */
+static NSUInteger walkUniqueIdentifiers(vsdb_t vsdb, NSData *prefix, NSMutableArray *uniqueIdentifiers)
+{
+  if (prefix == nil) {
+    return 0;
+  }
+
+  vsdb_cursor_t cursor = vsdb_cursor_open2(vsdb, [prefix bytes], [prefix length], 1);
+  if (cursor == NULL) {
+    return 0;
+  }
+
+  const char *key;
+  const void *value;
+  size_t keyLength, valueSize;
+  VSDataManagerObjectKey parsed;
+  NSMutableData *last = nil;
+  NSUInteger count = 0;
+
+  while (vsdb_cursor_next(cursor, &key, &keyLength, &value, &valueSize) == vsdb_okay) {
+    /* the records of an object are adjacent, a new identifier starts a new object */
+    if (!parseObjectKey(key, keyLength, [prefix length], &parsed) || isSameUniqueIdentifier(last, &parsed)) {
+      continue;
+    }
+
+    if (last == nil) {
+      last = [NSMutableData data];
+    }
+    [last setLength:0];
+    [last appendBytes:parsed.uniqueIdentifier length:parsed.uniqueIdentifierLength];
+    count++;
+
+    if (uniqueIdentifiers != nil) {
+      NSString *string = uniqueIdentifierFromObjectKey(&parsed);
+      if (string != nil) {
+        [uniqueIdentifiers addObject:string];
+      }
+    }
+  }
+
+  vsdb_cursor_close(cursor);
+  return count;
+}
+
+/* runs body for each of count items, on at most width threads at once, 0 for any */
+static void applyConcurrently(NSUInteger count, NSUInteger width, void (^body)(NSUInteger i))
+{
+  dispatch_queue_t queue = dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_DEFAULT, 0);
+  if (width == 0 || width >= count) {
+    dispatch_apply(count, queue, ^(size_t i) {
+      body(i);
+    });
+    return;
+  }
+
+  __block NSUInteger next = 0;
+  dispatch_apply(width, queue, ^(size_t worker) {
+    NSUInteger i;
+    while ((i = __atomic_fetch_add(&next, 1, __ATOMIC_RELAXED)) < count) {
+      body(i);
+    }
+  });
+}
+
+/*
+ * An indexed property has an empty entry per object with a value, so that
+ * the objects with a value, or with values in a range, are found with a
+ * seek. Values are encoded so that their bytes sort like they do: a tag,
+ * then for numbers and dates the bits of the double as fixed width hex,
+ * and for strings their UTF-8 with NUL escaped as NUL 0xff. The NUL ':'
+ * ending the value sorts below whatever can follow it in a longer one.
+ */
+static char indexValueTag(id value)
+{
+  if ([value isKindOfClass:[NSString class]]) {
+    return 's';
+  }
+  else if ([value isKindOfClass:[NSNumber class]]) {
+    return 'n';
+  }
+  else if ([value isKindOfClass:[NSDate class]]) {
+    return 'd';
+  }
+
+  return 0;
+}
+
+static BOOL appendIndexValue(NSMutableData *key, id value)
+{
+  char tag = indexValueTag(value);
+  if (tag == 0) {
+    return NO;
+  }
+
+  if (tag == 's') {
+    NSData *data = [value dataUsingEncoding:NSUTF8StringEncoding];
+    [key appendBytes:"s" length:1];
+    appendEscapedBytes(key, [data bytes], [data length]);
+    return YES;
+  }
+
+  double number = (tag == 'n') ? [value doubleValue] : [value timeIntervalSinceReferenceDate];
+
+  /* -0 is 0, then flipping the sign bit of positives and every bit of negatives orders them */
+  uint64_t bits;
+  char encoded[18];
+  if (number == 0) {
+    number = 0;
+  }
+  memcpy(&bits, &number, sizeof(bits));
+  bits = (bits >> 63) ? ~bits : (bits | (1ULL << 63));
+  snprintf(encoded, sizeof(encoded), "%c%016llx", tag, (unsigned long long)bits);
+  [key appendBytes:encoded length:17];
+  return YES;
+}
+
+static NSData *indexKey(NSData *prefix, id value, NSString *uniqueIdentifier)
+{
+  NSMutableData *key = [prefix mutableCopy];
+  if (!appendIndexValue(key, value)) {
+    return nil;
+  }
+
+  [key appendBytes:"\0:" length:2];
+  [key appendData:[uniqueIdentifier dataUsingEncoding:NSUTF8StringEncoding]];
+  return key;
+}
+
+/*
+ * Bounds of the entries with values from or up to value, inclusive or not.
+ * Without a value, the bound is the first or last value of the type tag,
+ * or of the whole index without a tag either.
+ */
+static NSMutableData *indexLowerBound(NSData *prefix, id value, BOOL inclusive, char tag)
+{
+  NSMutableData *bound = [prefix mutableCopy];
+  if (value != nil) {
+    if (!appendIndexValue(bound, value)) {
+      return nil;
+    }
+    if (!inclusive) {
+      /* ';' follows ':', so "value\0;" follows every entry of the value */
+      [bound appendBytes:"\0;" length:2];
+    }
+  }
+  else if (tag != 0) {
+    [bound appendBytes:&tag length:1];
+  }
+
+  return bound;
+}
+
+static NSMutableData *indexUpperBound(NSData *prefix, id value, BOOL inclusive, char tag)
+{
+  NSMutableData *bound = [prefix mutableCopy];
+  if (value != nil) {
+    if (!appendIndexValue(bound, value)) {
+      return nil;
+    }
+    if (inclusive) {
+      [bound appendBytes:"\0;" length:2];
+    }
+  }
+  else if (tag != 0) {
+    char nextTag = tag + 1;
+    [bound appendBytes:&nextTag length:1];
+  }
+  else {
+    bound = keyPrefixSuccessor(prefix);
+  }
+
+  return bound;
+}
+
+static NSString *uniqueIdentifierFromIndexKey(const char *key, size_t keyLength, size_t prefixLength)
+{
+  /* an escaped NUL is followed by 0xff, so the first NUL ':' ends the value */
+  size_t i;
+  for (i = prefixLength; i + 1 < keyLength; i++) {
+    if (key[i] == 0 && key[i + 1] == ':') {
+      return [[NSString alloc] initWithBytes:key + i + 2 length:keyLength - i - 2 encoding:NSUTF8StringEncoding];
+    }
+  }
+
+  return nil;
+}
+
+@implementation VSDataManager (Private)
+- (NSMutableData *)_keyPrefixForModelIdentifier:(NSString *)modelIdentifier
+{
+  NSNumber *modelID = (modelIdentifier != nil) ? [_modelIDs objectForKey:modelIdentifier] : nil;
+  if (modelID == nil) {
+    return nil;
+  }
+
+  uint8_t tag = VSDataManagerObjectTag;
+  NSMutableData *key = [NSMutableData dataWithCapacity:32];
+  [key appendBytes:&tag length:1];
+  appendVarint(key, [modelID unsignedLongLongValue]);
+  return key;
+}
+
+- (NSMutableData *)_keyForUniqueIdentifier:(NSString *)uniqueIdentifier modelIdentifier:(NSString *)modelIdentifier
+{
+  NSMutableData *key = [self _keyPrefixForModelIdentifier:modelIdentifier];
+  if (key == nil || uniqueIdentifier == nil) {
+    return nil;
+  }
+
+  appendUniqueIdentifier(key, uniqueIdentifier);
+  return key;
+}
+
+- (NSMutableData *)_keyForProperty:(NSString *)property uniqueIdentifier:(NSString *)uniqueIdentifier modelIdentifier:(NSString *)modelIdentifier
+{
+  NSNumber *propertyID = (property != nil) ? [[_propertyIDs objectForKey:modelIdentifier] objectForKey:property] : nil;
+  NSMutableData *key = (propertyID != nil) ? [self _keyForUniqueIdentifier:uniqueIdentifier modelIdentifier:modelIdentifier] : nil;
+  if (key == nil) {
+    return nil;
+  }
+
+  appendVarint(key, [propertyID unsignedLongLongValue]);
+  return key;
+}
+
+- (NSMutableData *)_keyWithTag:(const char *)tag length:(size_t)tagLength property:(NSString *)property modelIdentifier:(NSString *)modelIdentifier
+{
+  NSNumber *modelID = [_modelIDs objectForKey:modelIdentifier];
+  NSNumber *propertyID = [[_propertyIDs objectForKey:modelIdentifier] objectForKey:property];
+  if (modelID == nil || propertyID == nil) {
+    return nil;
+  }
+
+  NSMutableData *key = [NSMutableData dataWithBytes:tag length:tagLength];
+  appendVarint(key, [modelID unsignedLongLongValue]);
+  appendVarint(key, [propertyID unsignedLongLongValue]);
+  return key;
+}
+
+- (NSMutableData *)_indexKeyPrefixForProperty:(NSString *)property modelIdentifier:(NSString *)modelIdentifier
+{
+  char tag = VSDataManagerIndexTag;
+  return [self _keyWithTag:&tag length:1 property:property modelIdentifier:modelIdentifier];
+}
+
+- (NSMutableData *)_indexMarkerForProperty:(NSString *)property modelIdentifier:(NSString *)modelIdentifier
+{
+  return [self _keyWithTag:VSDataManagerIndexMarkerKey length:sizeof(VSDataManagerIndexMarkerKey) - 1 property:property modelIdentifier:modelIdentifier];
+}
+
+- (VSDataManagerLoad *)_loadForModelIdentifier:(NSString *)modelIdentifier
+{
+  NSData *prefix = [self _keyPrefixForModelIdentifier:modelIdentifier];
+  if (prefix == nil) {
+    return nil;
+  }
+
+  VSDataManagerLoad *load = [[VSDataManagerLoad alloc] init];
+  load.prefixLength = [prefix length];
+  load.propertyNames = [_propertyNames objectForKey:modelIdentifier];
+  load.dictionaries = [NSMutableDictionary dictionary];
+  load.deltas = [NSMutableDictionary dictionary];
+  return load;
+}
+
+- (void)_putValue:(id)value forKey:(NSData *)key
+{
+  VSDataManagerBatchState *state = pthread_getspecific(_batchKey);
+  if (state != NULL && state->depth > 0) {
+    vsdb_batch_set_cfvalue_with_key(state->batch, [key bytes], [key length], (__bridge CFTypeRef)value);
+  }
+  else {
+    vsdb_set_cfvalue_with_key(_vsdb, [key bytes], [key length], (__bridge CFTypeRef)value);
+  }
+}
+
+- (void)_putIndexKey:(NSData *)key present:(BOOL)present
+{
+  const void *value = present ? "" : NULL;
+  VSDataManagerBatchState *state = pthread_getspecific(_batchKey);
+  if (state != NULL && state->depth > 0) {
+    vsdb_batch_put(state->batch, [key bytes], [key length], value, 0);
+  }
+  else {
+    vsdb_set(_vsdb, [key bytes], [key length], value, 0);
+  }
+}
+
+- (void)_indexValue:(id)value forKey:(NSData *)key property:(NSString *)property uniqueIdentifier:(NSString *)uniqueIdentifier modelIdentifier:(NSString *)modelIdentifier
+{
+  /*
+   * The entry of the value being replaced is found from the stored value,
+   * which misses writes still queued in a batch or racing on another
+   * thread. The new entry is put even when the stored value is the same,
+   * after the removal of the old one, since a queued write may remove it.
+   */
+  id previousValue = CFBridgingRelease(vsdb_copy_cfvalue_with_key(_vsdb, [key bytes], [key length], NULL));
+
+  NSData *prefix = [self _indexKeyPrefixForProperty:property modelIdentifier:modelIdentifier];
+  NSData *previousKey = indexKey(prefix, previousValue, uniqueIdentifier);
+  if (previousKey != nil) {
+    [self _putIndexKey:previousKey present:NO];
+  }
+
+  NSData *indexedKey = indexKey(prefix, value, uniqueIdentifier);
+  if (indexedKey != nil) {
+    [self _putIndexKey:indexedKey present:YES];
+  }
+}
+
+- (void)setValue:(id)value forProperty:(NSString *)property uniqueIdentifier:(NSString *)uniqueIdentifier modelIdentifier:(NSString *)modelIdentifier
+{
+  /* properties the model does not have are not stored */
+  NSData *key = [self _keyForProperty:property uniqueIdentifier:uniqueIdentifier modelIdentifier:modelIdentifier];
+  if (key == nil) {
+    return;
+  }
+
+  NSUInteger deltaCount;
+  @synchronized(_deltaCounts) {
+    deltaCount = [[_deltaCounts objectForKey:key] unsignedIntegerValue];
+    [_deltaCounts removeObjectForKey:key];
+  }
+
+  BOOL indexed = [[_indexedProperties objectForKey:modelIdentifier] containsObject:property];
+  if (deltaCount == 0 && !indexed) {
+    [self _putValue:value forKey:key];
+    return;
+  }
+
+  /* index entries, and the deltas the whole value supersedes, change along with it */
+  [self beginBatch];
+  if (indexed) {
+    [self _indexValue:value forKey:key property:property uniqueIdentifier:uniqueIdentifier modelIdentifier:modelIdentifier];
+  }
+  [self _putValue:value forKey:key];
+  for (NSUInteger i = 1; i <= deltaCount; i++) {
+    [self _putValue:nil forKey:deltaKey(key, i)];
+  }
+  [self commitBatch];
+}
+
+- (void)_appendDelta:(NSArray *)delta toValue:(id)value forProperty:(NSString *)property uniqueIdentifier:(NSString *)uniqueIdentifier modelIdentifier:(NSString *)modelIdentifier
+{
+  NSData *key = [self _keyForProperty:property uniqueIdentifier:uniqueIdentifier modelIdentifier:modelIdentifier];
+  if (key == nil) {
+    return;
+  }
+
+  NSUInteger deltaCount = NSNotFound;
+  @synchronized(_deltaCounts) {
+    NSUInteger count = [[_deltaCounts objectForKey:key] unsignedIntegerValue];
+    if (count < MAX(VSDataManagerMinimumCompactionCount, [value count] / 4)) {
+      deltaCount = count + 1;
+      [_deltaCounts setObject:@(deltaCount) forKey:key];
+    }
+  }
+
+  if (deltaCount == NSNotFound) {
+    [self setValue:value forProperty:property uniqueIdentifier:uniqueIdentifier modelIdentifier:modelIdentifier];
+    return;
+  }
+
+  [self _putValue:delta forKey:deltaKey(key, deltaCount)];
+}
+
+- (void)setValue:(id)value withSetMutation:(NSKeyValueSetMutationKind)mutationKind usingObjects:(NSSet *)objects forProperty:(NSString *)property uniqueIdentifier:(NSString *)uniqueIdentifier modelIdentifier:(NSString *)modelIdentifier
+{
+  if (![value isKindOfClass:[NSSet class]] || mutationKind == NSKeyValueSetSetMutation) {
+    [self setValue:value forProperty:property uniqueIdentifier:uniqueIdentifier modelIdentifier:modelIdentifier];
+    return;
+  }
+
+  NSArray *delta = @[@(VSDataManagerSetDelta), @(mutationKind), (objects != nil) ? [objects allObjects] : @[]];
+  [self _appendDelta:delta toValue:value forProperty:property uniqueIdentifier:uniqueIdentifier modelIdentifier:modelIdentifier];
+}
+
+- (void)setValue:(id)value withChange:(NSKeyValueChange)changeKind atIndexes:(NSIndexSet *)indexes forProperty:(NSString *)property uniqueIdentifier:(NSString *)uniqueIdentifier modelIdentifier:(NSString *)modelIdentifier
+{
+  if (![value isKindOfClass:[NSArray class]] || changeKind == NSKeyValueChangeSetting ||
+      (changeKind != NSKeyValueChangeRemoval && [indexes lastIndex] >= [value count])) {
+    [self setValue:value forProperty:property uniqueIdentifier:uniqueIdentifier modelIdentifier:modelIdentifier];
+    return;
+  }
+
+  NSMutableArray *ranges = [NSMutableArray array];
+  [indexes enumerateRangesUsingBlock:^(NSRange range, BOOL *stop) {
+    [ranges addObject:@(range.location)];
+    [ranges addObject:@(range.length)];
+  }];
+
+  NSArray *objects = (changeKind != NSKeyValueChangeRemoval) ? [value objectsAtIndexes:indexes] : @[];
+  NSArray *delta = @[@(VSDataManagerArrayDelta), @(changeKind), ranges, objects];
+  [self _appendDelta:delta toValue:value forProperty:property uniqueIdentifier:uniqueIdentifier modelIdentifier:modelIdentifier];
+}
+
+- (NSDictionary *)valuesForUniqueIdentifier:(NSString *)uniqueIdentifier modelIdentifier:(NSString *)modelIdentifier
+{
+  VSDataManagerLoad *load = [self _loadForModelIdentifier:modelIdentifier];
+  NSData *start = [self _keyForUniqueIdentifier:uniqueIdentifier modelIdentifier:modelIdentifier];
+  if (load == nil || start == nil) {
+    return nil;
+  }
+
+  NSData *end = keyPrefixSuccessor(start);
+  vsdb_enumerate_cfvalues_in_key_range(_vsdb, [start bytes], [start length], [end bytes], [end length], 0, loadObjectValue, (__bridge void *)load, _lazy);
+  [self _finishLoad:load];
+
+  return [load.dictionaries objectForKey:uniqueIdentifier];
+}
+
+- (NSDictionary *)valuesForProperty:(NSString *)property ofClass:(Class)dataObjectClass uniqueIdentifiers:(id<NSFastEnumeration>)uniqueIdentifiers
+{
+  NSString *modelIdentifier = [dataObjectClass modelIdentifier];
+  VSDataManagerLoad *load = [self _loadForModelIdentifier:modelIdentifier];
+  if (load == nil) {
+    return @{};
+  }
+
+  /* the keys of the property and of its deltas share a prefix */
+  for (NSString *uniqueIdentifier in uniqueIdentifiers) {
+    NSData *start = [self _keyForProperty:property uniqueIdentifier:uniqueIdentifier modelIdentifier:modelIdentifier];
+    if (start == nil) {
+      break;
+    }
+
+    NSData *end = keyPrefixSuccessor(start);
+    vsdb_enumerate_cfvalues_in_key_range(_vsdb, [start bytes], [start length], [end bytes], [end length], 0, loadObjectValue, (__bridge void *)load, _lazy);
+  }
+  [self _finishLoad:load];
+
+  NSMutableDictionary *values = [NSMutableDictionary dictionaryWithCapacity:[load.dictionaries count]];
+  for (NSString *uniqueIdentifier in load.dictionaries) {
+    id value = [[load.dictionaries objectForKey:uniqueIdentifier] objectForKey:property];
+    if (value != nil) {
+      [values setObject:value forKey:uniqueIdentifier];
+    }
+  }
+
+  return values;
 }
-@end
 
-@implementation VSDataManager (Private)
-- (void)setValue:(id)value forProperty:(NSString *)property uniqueIdentifier:(NSString *)uniqueIdentifier modelIdentifier:(NSString *)modelIdentifier
+- (BOOL)isIndexedProperty:(NSString *)property ofClass:(Class)dataObjectClass
+{
+  return property != nil && [[_indexedProperties objectForKey:[dataObjectClass modelIdentifier]] containsObject:property];
+}
+
+- (void)_buildIndexForProperty:(NSString *)property ofClass:(Class)dataObjectClass
+{
+  NSString *modelIdentifier = [dataObjectClass modelIdentifier];
+  NSData *marker = [self _indexMarkerForProperty:property modelIdentifier:modelIdentifier];
+  NSData *prefix = [self _indexKeyPrefixForProperty:property modelIdentifier:modelIdentifier];
+  if (marker == nil || prefix == nil) {
+    return;
+  }
+
+  @synchronized(_builtIndexes) {
+    if ([_builtIndexes containsObject:marker]) {
+      return;
+    }
+
+    /* properties declared indexed after their values were stored */
+    const void *value;
+    size_t valueSize;
+    if (vsdb_get(_vsdb, [marker bytes], [marker length], &value, &valueSize) == vsdb_okay) {
+      vsdb_free((void *)value);
+    }
+    else {
+      NSDictionary *values = [self valuesForProperty:property ofClass:dataObjectClass];
+      [self beginBatch];
+      for (NSString *uniqueIdentifier in values) {
+        NSData *key = indexKey(prefix, [values objectForKey:uniqueIdentifier], uniqueIdentifier);
+        if (key != nil) {
+          [self _putIndexKey:key present:YES];
+        }
+      }
+      [self _putIndexKey:marker present:YES];
+      [self commitBatch];
+    }
+
+    [_builtIndexes addObject:marker];
+  }
+}
+
+- (NSArray *)_uniqueIdentifiersForClass:(Class)dataObjectClass property:(NSString *)property fromIndex:(NSData *)start toIndex:(NSData *)end
+{
+  size_t prefixLength = [[self _indexKeyPrefixForProperty:property modelIdentifier:[dataObjectClass modelIdentifier]] length];
+
+  /* the index must have the pending changes */
+  [self flush];
+  [self _buildIndexForProperty:property ofClass:dataObjectClass];
+
+  NSMutableArray *uniqueIdentifiers = [NSMutableArray array];
+  vsdb_cursor_t cursor = vsdb_cursor_open_range(_vsdb, [start bytes], [start length], [end bytes], [end length]);
+  if (cursor == NULL) {
+    return uniqueIdentifiers;
+  }
+
+  const char *key;
+  const void *value;
+  size_t keyLength, valueSize;
+  while (vsdb_cursor_next(cursor, &key, &keyLength, &value, &valueSize) == vsdb_okay) {
+    NSString *uniqueIdentifier = uniqueIdentifierFromIndexKey(key, keyLength, prefixLength);
+    if (uniqueIdentifier != nil) {
+      [uniqueIdentifiers addObject:uniqueIdentifier];
+    }
+  }
+
+  vsdb_cursor_close(cursor);
+  return uniqueIdentifiers;
+}
+
+- (NSArray *)uniqueIdentifiersForClass:(Class)dataObjectClass
+                  whereIndexedProperty:(NSString *)property
+                             fromValue:(id)fromValue
+                             inclusive:(BOOL)fromInclusive
+                               toValue:(id)toValue
+                             inclusive:(BOOL)toInclusive
+{
+  if (![self isIndexedProperty:property ofClass:dataObjectClass]) {
+    return nil;
+  }
+
+  NSData *prefix = [self _indexKeyPrefixForProperty:property modelIdentifier:[dataObjectClass modelIdentifier]];
+  char tag = indexValueTag((fromValue != nil) ? fromValue : toValue);
+  NSData *start = indexLowerBound(prefix, fromValue, fromInclusive, tag);
+  NSData *end = indexUpperBound(prefix, toValue, toInclusive, tag);
+  if (start == nil || end == nil) {
+    return nil;
+  }
+
+  return [self _uniqueIdentifiersForClass:dataObjectClass property:property fromIndex:start toIndex:end];
+}
+
+- (NSArray *)uniqueIdentifiersForClass:(Class)dataObjectClass whereIndexedProperty:(NSString *)property hasPrefix:(NSString *)prefix
+{
+  if (![self isIndexedProperty:property ofClass:dataObjectClass] || ![prefix isKindOfClass:[NSString class]]) {
+    return nil;
+  }
+
+  /* UTF-8 never has 0xff, the escape after a NUL aside, so it follows every string with the prefix */
+  NSData *indexPrefix = [self _indexKeyPrefixForProperty:property modelIdentifier:[dataObjectClass modelIdentifier]];
+  NSMutableData *start = indexLowerBound(indexPrefix, prefix, YES, 0);
+  NSMutableData *end = [start mutableCopy];
+  [end appendBytes:"\xff" length:1];
+
+  return [self _uniqueIdentifiersForClass:dataObjectClass property:property fromIndex:start toIndex:end];
+}
+
+- (BOOL)writesBack
+{
+  return _writeBack;
+}
+
+- (void)dataObjectDidBecomeDirty:(VSDataObject *)dataObject
+{
+  BOOL flushNow = NO;
+  BOOL scheduleFlush = NO;
+  @synchronized(_dirtyObjects) {
+    [_dirtyObjects addObject:dataObject];
+    if (++_dirtyCount >= _writeBackLimit) {
+      flushNow = YES;
+    }
+    else if (!_flushScheduled) {
+      _flushScheduled = YES;
+      scheduleFlush = YES;
+    }
+  }
+
+  if (!flushNow && !scheduleFlush) {
+    return;
+  }
+
+  __weak VSDataManager *weakSelf = self;
+  dispatch_time_t when = flushNow ? DISPATCH_TIME_NOW : dispatch_time(DISPATCH_TIME_NOW, (int64_t)(_writeBackDelay * NSEC_PER_SEC));
+  dispatch_after(when, dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_BACKGROUND, 0), ^{
+    [weakSelf flush];
+  });
+}
+
+- (void)_finishLoad:(VSDataManagerLoad *)load
 {
-  NSString *key = [NSString stringWithFormat:@"%@:%@:%@", modelIdentifier, uniqueIdentifier, property];
-  vsdb_set_cfvalue(_vsdb, (__bridge CFStringRef)key, (__bridge CFTypeRef)value);
+  for (NSData *key in load.deltas) {
+    VSDataManagerDeltas *propertyDeltas = [load.deltas objectForKey:key];
+    NSMutableDictionary *extraDict = [load.dictionaries objectForKey:propertyDeltas.uniqueIdentifier];
+
+    id value = applyDeltas([extraDict objectForKey:propertyDeltas.property], propertyDeltas.values);
+    if (value != nil) {
+      [extraDict setObject:value forKey:propertyDeltas.property];
+    }
+
+    /* a concurrent writer may have appended more since */
+    @synchronized(_deltaCounts) {
+      if ([[_deltaCounts objectForKey:key] unsignedIntegerValue] < [propertyDeltas.values count]) {
+        [_deltaCounts setObject:@([propertyDeltas.values count]) forKey:key];
+      }
+    }
+  }
 }
 @end
 
@@ -54,62 +1253,360 @@
   static dispatch_once_t onceToken;
   dispatch_once(&onceToken, ^{
     [VSDataModel sharedModel];
-    dataManager = [[VSDataManager alloc] initWithDatabasePath:[self defaultDatabasePath]];
+    dataManager = [[VSDataManager alloc] initWithDatabasePath:[self defaultDatabasePath]
+                                                      options:[self defaultDatabaseOptions]];
   });
 
   return dataManager;
 }
 
-- (NSMutableDictionary *)_loadAllDataObjectsForClass:(Class)class
+- (NSArray *)_loadSlicesForClass:(Class)class
 {
-  NSString *glob = [NSString stringWithFormat:@"%@:*", [class modelIdentifier]];
-  NSDictionary *results = CFBridgingRelease(vsdb_copy_cfvalue(_vsdb, (__bridge CFStringRef)glob));
-  if (results == nil) {
-    return [NSMutableDictionary dictionary];
+  NSString *modelIdentifier = [class modelIdentifier];
+  NSData *prefix = [self _keyPrefixForModelIdentifier:modelIdentifier];
+  if (prefix == nil) {
+    return @[];
   }
 
-  NSMutableDictionary *dictionaries = [NSMutableDictionary dictionary];
-  for (NSString *key in results) {
-    NSArray *keyComponents = [key componentsSeparatedByString:@":"];
-    if ([keyComponents count] != 3) {
-      continue;
+  NSMutableArray *uniqueIdentifiers = [NSMutableArray array];
+  walkUniqueIdentifiers(_vsdb, prefix, uniqueIdentifiers);
+  NSUInteger count = [uniqueIdentifiers count];
+
+  NSUInteger sliceCount = MIN(MAX(count / VSDataManagerMinimumLoadSliceSize, 1), [[NSProcessInfo processInfo] activeProcessorCount] * 4);
+
+  /*
+   * Slices end where the next begins, so that the deltas of an object stay
+   * with it. Slice i starts at object i * count / sliceCount, which is
+   * always within the objects and never repeats.
+   */
+  NSMutableArray *slices = [NSMutableArray arrayWithCapacity:sliceCount];
+  NSUInteger i;
+  for (i = 0; i < sliceCount; i++) {
+    VSDataManagerLoadSlice *slice = [[VSDataManagerLoadSlice alloc] init];
+    slice.dataObjectClass = class;
+    slice.start = (i > 0) ? [self _keyForUniqueIdentifier:[uniqueIdentifiers objectAtIndex:i * count / sliceCount] modelIdentifier:modelIdentifier] : prefix;
+    slice.end = (i + 1 < sliceCount) ? [self _keyForUniqueIdentifier:[uniqueIdentifiers objectAtIndex:(i + 1) * count / sliceCount] modelIdentifier:modelIdentifier] : keyPrefixSuccessor(prefix);
+    [slices addObject:slice];
+  }
+
+  return slices;
+}
+
+- (void)_loadSlice:(VSDataManagerLoadSlice *)slice
+{
+  NSString *modelIdentifier = [slice.dataObjectClass modelIdentifier];
+  VSDataManagerStream *stream = [[VSDataManagerStream alloc] init];
+  stream.dataObjectClass = slice.dataObjectClass;
+  stream.dataManager = self;
+  stream.prefixLength = [[self _keyPrefixForModelIdentifier:modelIdentifier] length];
+  stream.propertyNames = [_propertyNames objectForKey:modelIdentifier];
+  stream.dataObjects = [NSMutableDictionary dictionary];
+  stream.deltaCounts = [NSMutableDictionary dictionary];
+  stream.deltas = [NSMutableDictionary dictionary];
+  vsdb_enumerate_cfvalues_in_key_range(_vsdb, [slice.start bytes], [slice.start length], [slice.end bytes], [slice.end length], 0,
+                                       streamDataObjectValue, (__bridge void *)stream, _lazy);
+  finishStreamedDataObject(stream);
+
+  /* a concurrent writer may have appended more since */
+  @synchronized(_deltaCounts) {
+    for (NSData *key in stream.deltaCounts) {
+      NSNumber *deltaCount = [stream.deltaCounts objectForKey:key];
+      if ([[_deltaCounts objectForKey:key] unsignedIntegerValue] < [deltaCount unsignedIntegerValue]) {
+        [_deltaCounts setObject:deltaCount forKey:key];
+      }
+    }
+  }
+
+  slice.dataObjects = stream.dataObjects;
+}
+
+/*
+ * Classes are sliced by walking their keys, then the slices are decoded
+ * and turned into objects concurrently, and merged back per class.
+ */
+- (NSDictionary *)_loadAllDataObjectsForClasses:(NSArray *)classes
+{
+  NSMutableArray *slicesOfClasses = [NSMutableArray arrayWithCapacity:[classes count]];
+  for (NSUInteger i = 0; i < [classes count]; i++) {
+    [slicesOfClasses addObject:[NSMutableArray array]];
+  }
+  applyConcurrently([classes count], _loadConcurrency, ^(NSUInteger i) {
+    [[slicesOfClasses objectAtIndex:i] addObjectsFromArray:[self _loadSlicesForClass:(Class)[classes objectAtIndex:i]]];
+  });
+
+  NSMutableArray *slices = [NSMutableArray array];
+  for (NSArray *slicesOfClass in slicesOfClasses) {
+    [slices addObjectsFromArray:slicesOfClass];
+  }
+  applyConcurrently([slices count], _loadConcurrency, ^(NSUInteger i) {
+    [self _loadSlice:[slices objectAtIndex:i]];
+  });
+
+  NSMutableDictionary *dictionaries = [NSMutableDictionary dictionaryWithCapacity:[classes count]];
+  for (id class in classes) {
+    [dictionaries setObject:[NSMutableDictionary dictionary] forKey:class];
+  }
+  for (VSDataManagerLoadSlice *slice in slices) {
+    [[dictionaries objectForKey:(id)slice.dataObjectClass] addEntriesFromDictionary:slice.dataObjects];
+  }
+
+  return dictionaries;
+}
+
+- (void)_readCatalog
+{
+  NSDictionary *catalog = CFBridgingRelease(vsdb_copy_cfvalue_with_key(_vsdb, VSDataManagerCatalogKey, sizeof(VSDataManagerCatalogKey) - 1, NULL));
+  NSDictionary *modelIDs = [catalog isKindOfClass:[NSDictionary class]] ? [catalog objectForKey:@"models"] : nil;
+  NSDictionary *propertyIDs = [catalog isKindOfClass:[NSDictionary class]] ? [catalog objectForKey:@"properties"] : nil;
+
+  _modelIDs = [NSMutableDictionary dictionaryWithDictionary:modelIDs];
+  _propertyIDs = [NSMutableDictionary dictionaryWithCapacity:[propertyIDs count]];
+  for (NSString *modelIdentifier in propertyIDs) {
+    [_propertyIDs setObject:[[propertyIDs objectForKey:modelIdentifier] mutableCopy] forKey:modelIdentifier];
+  }
+  _catalogChanged = NO;
+}
+
+/*
+ * Numbers are handed out in order and never taken back, those of models
+ * and properties that are gone stay in the catalog.
+ */
+- (void)_addProperty:(NSString *)property modelIdentifier:(NSString *)modelIdentifier
+{
+  if ([_modelIDs objectForKey:modelIdentifier] == nil) {
+    [_modelIDs setObject:@([_modelIDs count] + 1) forKey:modelIdentifier];
+    _catalogChanged = YES;
+  }
+
+  NSMutableDictionary *propertyIDs = [_propertyIDs objectForKey:modelIdentifier];
+  if (propertyIDs == nil) {
+    propertyIDs = [NSMutableDictionary dictionary];
+    [_propertyIDs setObject:propertyIDs forKey:modelIdentifier];
+  }
+
+  if (property != nil && [propertyIDs objectForKey:property] == nil) {
+    [propertyIDs setObject:@([propertyIDs count] + 1) forKey:property];
+    _catalogChanged = YES;
+  }
+}
+
+- (NSDictionary *)_catalog
+{
+  return @{@"models": _modelIDs, @"properties": _propertyIDs};
+}
+
+/*
+ * Takes apart a key of the former "Model:uid:prop" or "Model:uid:prop:seq"
+ * format, from both ends, so that identifiers with ':' come out whole, and
+ * returns the binary key for it, numbering what the catalog does not have
+ * yet.
+ */
+- (NSData *)_keyForStringKey:(const char *)key length:(size_t)keyLength
+{
+  const char *end = key + keyLength;
+  const char *modelEnd = memchr(key, ':', keyLength);
+  if (modelEnd == NULL) {
+    return nil;
+  }
+
+  const char *uniqueIdentifierStart = modelEnd + 1;
+  const char *separator = end - 1, *propertyEnd = end;
+  while (separator >= uniqueIdentifierStart && *separator != ':') {
+    separator--;
+  }
+  if (separator < uniqueIdentifierStart) {
+    return nil;
+  }
+
+  /* a delta ends with a sequence number of at least ten digits */
+  uint64_t sequence = 0;
+  const char *digit;
+  for (digit = separator + 1; digit < end && *digit >= '0' && *digit <= '9'; digit++) {
+    sequence = sequence * 10 + (uint64_t)(*digit - '0');
+  }
+  if (digit == end && end - separator - 1 >= 10) {
+    propertyEnd = separator--;
+    while (separator >= uniqueIdentifierStart && *separator != ':') {
+      separator--;
+    }
+    if (separator < uniqueIdentifierStart) {
+      return nil;
     }
+  }
+  else {
+    sequence = 0;
+  }
+
+  NSString *modelIdentifier = [[NSString alloc] initWithBytes:key length:modelEnd - key encoding:NSUTF8StringEncoding];
+  NSString *property = [[NSString alloc] initWithBytes:separator + 1 length:propertyEnd - separator - 1 encoding:NSUTF8StringEncoding];
+  if ([modelIdentifier length] == 0 || [property length] == 0) {
+    return nil;
+  }
+
+  [self _addProperty:property modelIdentifier:modelIdentifier];
+  NSMutableData *binaryKey = [self _keyPrefixForModelIdentifier:modelIdentifier];
+  appendUniqueIdentifierBytes(binaryKey, (const uint8_t *)uniqueIdentifierStart, separator - uniqueIdentifierStart);
+  appendVarint(binaryKey, [[[_propertyIDs objectForKey:modelIdentifier] objectForKey:property] unsignedLongLongValue]);
+  if (sequence > 0) {
+    appendVarint(binaryKey, sequence);
+  }
+
+  return binaryKey;
+}
+
+/*
+ * Moves the records stored under string keys over to binary keys, values
+ * untouched, a batch at a time. Each batch also has the catalog numbers it
+ * uses, so that a migration cut short carries on where it stopped the
+ * next time. Index entries are dropped, indexes are built again when used.
+ */
+- (void)_migrateStringKeys
+{
+  /* binary keys start with a byte below ' ', string keys with a printable one */
+  vsdb_cursor_t cursor = vsdb_cursor_open_range(_vsdb, " ", 1, NULL, 0);
+  if (cursor == NULL) {
+    return;
+  }
+
+  BOOL indexIsModel = ([_modelIDs objectForKey:@"idx"] != nil);
+  vsdb_batch_t batch = vsdb_batch_create();
+  NSUInteger count = 0;
+  BOOL more = YES;
 
-    NSString *uniqueIdentifier = [keyComponents objectAtIndex:1];
-    NSMutableDictionary *extraDict = [dictionaries objectForKey:uniqueIdentifier];
-    if (extraDict == nil) {
-      extraDict = [NSMutableDictionary dictionary];
-      [dictionaries setObject:extraDict forKey:uniqueIdentifier];
+  while (more) {
+    @autoreleasepool {
+      const char *key;
+      const void *value;
+      size_t keyLength, valueSize;
+      more = (vsdb_cursor_next(cursor, &key, &keyLength, &value, &valueSize) == vsdb_okay);
+      if (more) {
+        if (!indexIsModel && keyLength >= 4 && memcmp(key, "idx:", 4) == 0) {
+          vsdb_batch_delete(batch, key, keyLength);
+          count++;
+        }
+        else {
+          NSData *binaryKey = [self _keyForStringKey:key length:keyLength];
+          if (binaryKey != nil) {
+            vsdb_batch_put(batch, [binaryKey bytes], [binaryKey length], value, valueSize);
+            vsdb_batch_delete(batch, key, keyLength);
+            count++;
+          }
+        }
+      }
+
+      if (count == VSDataManagerMigrationBatchSize || (!more && count > 0)) {
+        if (_catalogChanged) {
+          vsdb_batch_set_cfvalue_with_key(batch, VSDataManagerCatalogKey, sizeof(VSDataManagerCatalogKey) - 1, (__bridge CFTypeRef)[self _catalog]);
+        }
+        if (vsdb_batch_commit(_vsdb, batch) == vsdb_okay) {
+          _catalogChanged = NO;
+        }
+        vsdb_batch_clear(batch);
+        count = 0;
+      }
     }
+  }
 
-    NSString *propertyName = [keyComponents objectAtIndex:2];
-    [extraDict setObject:[results objectForKey:key] forKey:propertyName];
+  vsdb_batch_free(batch);
+  vsdb_cursor_close(cursor);
+}
+
+/*
+ * Numbers every model class and property, moves records of the string key
+ * format over, and keeps the names of the property numbers for loading.
+ */
+- (void)_openCatalogForClasses:(NSArray *)modelClasses
+{
+  [self _readCatalog];
+  for (id class in modelClasses) {
+    [self _addProperty:nil modelIdentifier:[(Class)class modelIdentifier]];
+    for (NSString *property in [[VSDataModel sharedModel] propertyNamesForDataObjectClass:(Class)class]) {
+      [self _addProperty:property modelIdentifier:[(Class)class modelIdentifier]];
+    }
   }
 
-  NSMutableDictionary *allDataObjects = [NSMutableDictionary dictionaryWithCapacity:[dictionaries count]];
-  for (NSString *uniqueIdentifier in dictionaries) {
-    VSDataObject *dataObject = [[VSDataModel sharedModel] dataObjectWithClass:class
-                                                                   dictionary:[dictionaries objectForKey:uniqueIdentifier]
-                                                                  dataManager:self];
-    [allDataObjects setObject:dataObject forKey:uniqueIdentifier];
+  [self _migrateStringKeys];
+  if (_catalogChanged) {
+    vsdb_set_cfvalue_with_key(_vsdb, VSDataManagerCatalogKey, sizeof(VSDataManagerCatalogKey) - 1, (__bridge CFTypeRef)[self _catalog]);
+    _catalogChanged = NO;
   }
 
-  return allDataObjects;
+  NSMutableDictionary *propertyNames = [NSMutableDictionary dictionaryWithCapacity:[_propertyIDs count]];
+  for (NSString *modelIdentifier in _propertyIDs) {
+    NSDictionary *propertyIDs = [_propertyIDs objectForKey:modelIdentifier];
+    NSMutableArray *names = [NSMutableArray arrayWithCapacity:[propertyIDs count] + 1];
+    for (NSUInteger i = 0; i <= [propertyIDs count]; i++) {
+      [names addObject:[NSNull null]];
+    }
+    for (NSString *property in propertyIDs) {
+      NSUInteger propertyID = [[propertyIDs objectForKey:property] unsignedIntegerValue];
+      if (propertyID < [names count]) {
+        [names replaceObjectAtIndex:propertyID withObject:property];
+      }
+    }
+    [propertyNames setObject:[names copy] forKey:modelIdentifier];
+  }
+  _propertyNames = propertyNames;
 }
 
 - (id)initWithDatabasePath:(NSString *)path
+{
+  return [self initWithDatabasePath:path options:nil];
+}
+
+- (id)initWithDatabasePath:(NSString *)path options:(NSDictionary *)options
 {
   self = [super init];
   if (self) {
-    _vsdb = vsdb_open([path UTF8String]);
+    bzero(&_vsdbOptions, sizeof(_vsdbOptions));
+    _vsdbOptions.shards = [[options objectForKey:VSDataManagerShardCountOption] unsignedIntValue];
+    _vsdbOptions.wal = [[options objectForKey:VSDataManagerWriteAheadLogOption] boolValue];
+    _vsdbOptions.wal_sync = [[options objectForKey:VSDataManagerSynchronousWritesOption] boolValue];
+    _vsdbOptions.engine = [[options objectForKey:VSDataManagerLogStructuredStorageOption] boolValue] ? vsdb_engine_lsm : vsdb_engine_btree;
+    _vsdbOptions.bloom = [[options objectForKey:VSDataManagerBloomFilterOption] boolValue];
+    _lazy = [[options objectForKey:VSDataManagerLazyCollectionsOption] boolValue] ? VSLazyCollectionDecoding() : NULL;
+    _faulting = [[options objectForKey:VSDataManagerFaultingOption] boolValue];
+    _loadConcurrency = [[options objectForKey:VSDataManagerLoadConcurrencyOption] unsignedIntegerValue];
+    _writeBack = [[options objectForKey:VSDataManagerWriteBackOption] boolValue];
+    _writeBackDelay = ([options objectForKey:VSDataManagerWriteBackDelayOption] != nil) ? [[options objectForKey:VSDataManagerWriteBackDelayOption] doubleValue] : VSDataManagerDefaultWriteBackDelay;
+    _writeBackLimit = ([options objectForKey:VSDataManagerWriteBackLimitOption] != nil) ? [[options objectForKey:VSDataManagerWriteBackLimitOption] unsignedIntegerValue] : VSDataManagerDefaultWriteBackLimit;
+
+    _vsdb = vsdb_open2([path UTF8String], &_vsdbOptions);
     _databasePath = path;
+    _deltaCounts = [[NSMutableDictionary alloc] init];
+    pthread_key_create(&_batchKey, freeBatchState);
+    _dirtyObjects = [NSHashTable hashTableWithOptions:NSPointerFunctionsStrongMemory | NSPointerFunctionsObjectPointerPersonality];
+    pthread_mutex_init(&_flushMutex, NULL);
+    _builtIndexes = [[NSMutableSet alloc] init];
 
     NSArray *modelClasses = [[VSDataModel sharedModel] modelClasses];
-    NSMutableDictionary *dictionaries = [[NSMutableDictionary alloc] initWithCapacity:[modelClasses count]];
+    [self _openCatalogForClasses:modelClasses];
+
+    NSMutableDictionary *indexedProperties = [[NSMutableDictionary alloc] init];
     for (id class in modelClasses) {
-      [dictionaries setObject:[self _loadAllDataObjectsForClass:(Class)class] forKey:class];
+      NSMutableSet *properties = [NSMutableSet set];
+      for (NSString *property in [(Class)class indexedProperties]) {
+        if ([[VSDataModel sharedModel] dataObjectClass:(Class)class hasPropertyForKey:property]) {
+          [properties addObject:property];
+        }
+      }
+      if ([properties count] > 0) {
+        [indexedProperties setObject:properties forKey:[(Class)class modelIdentifier]];
+      }
+    }
+    _indexedProperties = indexedProperties;
+
+    if (_faulting) {
+      NSMutableDictionary *dictionaries = [[NSMutableDictionary alloc] initWithCapacity:[modelClasses count]];
+      for (id class in modelClasses) {
+        [dictionaries setObject:[NSMutableDictionary dictionary] forKey:class];
+      }
+      _dictionaries = dictionaries;
     }
-    _dictionaries = dictionaries;
+    else {
+      _dictionaries = [self _loadAllDataObjectsForClasses:modelClasses];
+    }
+    _enumeratedClasses = [[NSMutableSet alloc] init];
   }
 
   return self;
@@ -117,30 +1614,153 @@
 
 - (void)dealloc
 {
+  [self flush];
   vsdb_close(_vsdb);
   _vsdb = NULL;
+  pthread_key_delete(_batchKey);
+  pthread_mutex_destroy(&_flushMutex);
 }
 
 - (void)reset
 {
   vsdb_close(_vsdb);
-  [[NSFileManager defaultManager] removeItemAtPath:_databasePath error:NULL];
+  vsdb_unlink([_databasePath UTF8String], &_vsdbOptions);
 
-  _vsdb = vsdb_open([_databasePath UTF8String]);
+  _vsdb = vsdb_open2([_databasePath UTF8String], &_vsdbOptions);
+  /* the numbers in use stay the same, the new database must know them */
+  vsdb_set_cfvalue_with_key(_vsdb, VSDataManagerCatalogKey, sizeof(VSDataManagerCatalogKey) - 1, (__bridge CFTypeRef)[self _catalog]);
+  @synchronized(_deltaCounts) {
+    [_deltaCounts removeAllObjects];
+  }
+  @synchronized(_dirtyObjects) {
+    [_dirtyObjects removeAllObjects];
+    _dirtyCount = 0;
+  }
   for (id key in _dictionaries) {
     NSMutableDictionary *dict = [_dictionaries objectForKey:key];
-    [dict removeAllObjects];
+    @synchronized(dict) {
+      [dict removeAllObjects];
+    }
+  }
+  @synchronized(_enumeratedClasses) {
+    [_enumeratedClasses removeAllObjects];
+  }
+  @synchronized(_builtIndexes) {
+    [_builtIndexes removeAllObjects];
   }
 }
 
 - (void)sync
 {
+  [self flush];
   vsdb_sync(_vsdb);
 }
 
+- (void)flush
+{
+  if (!_writeBack) {
+    return;
+  }
+
+  /* flushes must not interleave, or an older value could be written last */
+  pthread_mutex_lock(&_flushMutex);
+
+  NSArray *dataObjects;
+  @synchronized(_dirtyObjects) {
+    dataObjects = [_dirtyObjects allObjects];
+    [_dirtyObjects removeAllObjects];
+    _dirtyCount = 0;
+    _flushScheduled = NO;
+  }
+
+  if ([dataObjects count] > 0) {
+    [self beginBatch];
+    for (VSDataObject *dataObject in dataObjects) {
+      [[VSDataModel sharedModel] dataManager:self setDirtyValuesForDataObject:dataObject];
+    }
+    [self commitBatch];
+  }
+
+  pthread_mutex_unlock(&_flushMutex);
+}
+
 - (NSDictionary *)dictionaryOfDataObjectsForClass:(Class)dataObjectClass
 {
-  return [_dictionaries objectForKey:(id)dataObjectClass];
+  NSMutableDictionary *dict = [_dictionaries objectForKey:(id)dataObjectClass];
+  if (!_faulting || dict == nil) {
+    return dict;
+  }
+
+  @synchronized(_enumeratedClasses) {
+    if (![_enumeratedClasses containsObject:dataObjectClass]) {
+      /* only the keys are read, the objects stay faults until used */
+      NSMutableArray *uniqueIdentifiers = [NSMutableArray array];
+      walkUniqueIdentifiers(_vsdb, [self _keyPrefixForModelIdentifier:[dataObjectClass modelIdentifier]], uniqueIdentifiers);
+      @synchronized(dict) {
+        for (NSString *uniqueIdentifier in uniqueIdentifiers) {
+          if ([dict objectForKey:uniqueIdentifier] == nil) {
+            VSDataObject *dataObject = [[VSDataModel sharedModel] faultWithClass:dataObjectClass uniqueIdentifier:uniqueIdentifier dataManager:self];
+            if (dataObject != nil) {
+              [dict setObject:dataObject forKey:uniqueIdentifier];
+            }
+          }
+        }
+      }
+      [_enumeratedClasses addObject:dataObjectClass];
+    }
+  }
+
+  @synchronized(dict) {
+    return [dict copy];
+  }
+}
+
+- (VSDataObject *)dataObjectForClass:(Class)dataObjectClass uniqueIdentifier:(NSString *)uniqueIdentifier
+{
+  NSMutableDictionary *dict = [_dictionaries objectForKey:(id)dataObjectClass];
+  if (dict == nil || uniqueIdentifier == nil) {
+    return nil;
+  }
+
+  if (!_faulting) {
+    return [dict objectForKey:uniqueIdentifier];
+  }
+
+  VSDataObject *dataObject;
+  @synchronized(dict) {
+    dataObject = [dict objectForKey:uniqueIdentifier];
+  }
+  if (dataObject != nil) {
+    return dataObject;
+  }
+
+  /* an object exists if any of its keys does */
+  NSData *prefix = [self _keyForUniqueIdentifier:uniqueIdentifier modelIdentifier:[dataObjectClass modelIdentifier]];
+  vsdb_cursor_t cursor = (prefix != nil) ? vsdb_cursor_open2(_vsdb, [prefix bytes], [prefix length], 1) : NULL;
+  if (cursor == NULL) {
+    return nil;
+  }
+
+  const char *key;
+  const void *value;
+  size_t keyLength, valueSize;
+  BOOL exists = (vsdb_cursor_next(cursor, &key, &keyLength, &value, &valueSize) == vsdb_okay);
+  vsdb_cursor_close(cursor);
+  if (!exists) {
+    return nil;
+  }
+
+  @synchronized(dict) {
+    dataObject = [dict objectForKey:uniqueIdentifier];
+    if (dataObject == nil) {
+      dataObject = [[VSDataModel sharedModel] faultWithClass:dataObjectClass uniqueIdentifier:uniqueIdentifier dataManager:self];
+      if (dataObject != nil) {
+        [dict setObject:dataObject forKey:uniqueIdentifier];
+      }
+    }
+  }
+
+  return dataObject;
 }
 
 - (NSArray *)dataObjectsForClass:(Class)dataObjectClass
@@ -148,24 +1768,227 @@
   return [[self dictionaryOfDataObjectsForClass:dataObjectClass] allValues];
 }
 
+- (NSArray *)dataObjectsForClass:(Class)dataObjectClass
+            fromUniqueIdentifier:(NSString *)startUniqueIdentifier
+              toUniqueIdentifier:(NSString *)endUniqueIdentifier
+                           limit:(NSUInteger)limit
+            nextUniqueIdentifier:(NSString **)nextUniqueIdentifier
+{
+  NSString *modelIdentifier = [dataObjectClass modelIdentifier];
+  NSData *prefix = [self _keyPrefixForModelIdentifier:modelIdentifier];
+  if (prefix == nil) {
+    if (nextUniqueIdentifier != NULL) {
+      *nextUniqueIdentifier = nil;
+    }
+    return @[];
+  }
+
+  NSData *start = (startUniqueIdentifier != nil) ? [self _keyForUniqueIdentifier:startUniqueIdentifier modelIdentifier:modelIdentifier] : prefix;
+  NSData *end = (endUniqueIdentifier != nil) ? [self _keyForUniqueIdentifier:endUniqueIdentifier modelIdentifier:modelIdentifier] : keyPrefixSuccessor(prefix);
+
+  VSDataManagerPage *page = [[VSDataManagerPage alloc] init];
+  page.prefixLength = [prefix length];
+  page.propertyNames = [_propertyNames objectForKey:modelIdentifier];
+  page.limit = (limit > 0) ? limit : NSUIntegerMax;
+  page.uniqueIdentifiers = [NSMutableArray array];
+  page.dictionaries = [NSMutableDictionary dictionary];
+  page.deltas = [NSMutableDictionary dictionary];
+  vsdb_enumerate_cfvalues_in_key_range(_vsdb, [start bytes], [start length], [end bytes], [end length], 0, loadPageValue, (__bridge void *)page, _lazy);
+  [self _finishLoad:page];
+
+  NSMutableDictionary *cachedDataObjects = [_dictionaries objectForKey:(id)dataObjectClass];
+  NSMutableArray *dataObjects = [NSMutableArray arrayWithCapacity:[page.uniqueIdentifiers count]];
+  for (NSString *uniqueIdentifier in page.uniqueIdentifiers) {
+    VSDataObject *dataObject;
+    @synchronized(cachedDataObjects) {
+      dataObject = [cachedDataObjects objectForKey:uniqueIdentifier];
+      if (dataObject == nil) {
+        dataObject = [[VSDataModel sharedModel] dataObjectWithClass:dataObjectClass
+                                                         dictionary:[page.dictionaries objectForKey:uniqueIdentifier]
+                                                        dataManager:self];
+        /* with faulting, the cache is filled as objects are asked for */
+        if (_faulting) {
+          [cachedDataObjects setObject:dataObject forKey:uniqueIdentifier];
+        }
+      }
+    }
+    [dataObjects addObject:dataObject];
+  }
+
+  if (nextUniqueIdentifier != NULL) {
+    *nextUniqueIdentifier = page.nextUniqueIdentifier;
+  }
+
+  return dataObjects;
+}
+
+- (NSUInteger)countOfDataObjectsForClass:(Class)dataObjectClass
+{
+  return walkUniqueIdentifiers(_vsdb, [self _keyPrefixForModelIdentifier:[dataObjectClass modelIdentifier]], nil);
+}
+
+- (NSArray *)uniqueIdentifiersForClass:(Class)dataObjectClass
+{
+  NSMutableArray *uniqueIdentifiers = [NSMutableArray array];
+  walkUniqueIdentifiers(_vsdb, [self _keyPrefixForModelIdentifier:[dataObjectClass modelIdentifier]], uniqueIdentifiers);
+
+  return uniqueIdentifiers;
+}
+
+- (NSDictionary *)valuesForProperty:(NSString *)property ofClass:(Class)dataObjectClass
+{
+  /* the values are read from the database, which must have the pending changes */
+  [self flush];
+
+  /* the keys are walked without reading any value, then each object only has the property read */
+  NSMutableArray *uniqueIdentifiers = [NSMutableArray array];
+  walkUniqueIdentifiers(_vsdb, [self _keyPrefixForModelIdentifier:[dataObjectClass modelIdentifier]], uniqueIdentifiers);
+
+  return [self valuesForProperty:property ofClass:dataObjectClass uniqueIdentifiers:uniqueIdentifiers];
+}
+
+- (NSArray *)_dataObjectsForClass:(Class)dataObjectClass
+                         property:(NSString *)property
+                        fromIndex:(NSData *)start
+                          toIndex:(NSData *)end
+                            limit:(NSUInteger)limit
+{
+  NSData *prefix = [self _indexKeyPrefixForProperty:property modelIdentifier:[dataObjectClass modelIdentifier]];
+  size_t prefixLength = [prefix length];
+
+  /* the index must have the pending changes */
+  [self flush];
+  [self _buildIndexForProperty:property ofClass:dataObjectClass];
+
+  NSMutableArray *dataObjects = [NSMutableArray array];
+  vsdb_cursor_t cursor = vsdb_cursor_open_range(_vsdb, [start bytes], [start length], [end bytes], [end length]);
+  if (cursor == NULL) {
+    return dataObjects;
+  }
+
+  const char *key;
+  const void *value;
+  size_t keyLength, valueSize;
+  while ((limit == 0 || [dataObjects count] < limit) &&
+         vsdb_cursor_next(cursor, &key, &keyLength, &value, &valueSize) == vsdb_okay) {
+    NSString *uniqueIdentifier = uniqueIdentifierFromIndexKey(key, keyLength, prefixLength);
+    VSDataObject *dataObject = [self dataObjectForClass:dataObjectClass uniqueIdentifier:uniqueIdentifier];
+    if (dataObject == nil) {
+      continue;
+    }
+
+    /* an entry left behind by concurrent changes no longer matches the value */
+    NSData *currentKey = indexKey(prefix, [dataObject valueForKey:property], uniqueIdentifier);
+    if (currentKey != nil && [currentKey length] == keyLength && memcmp([currentKey bytes], key, keyLength) == 0) {
+      [dataObjects addObject:dataObject];
+    }
+  }
+
+  vsdb_cursor_close(cursor);
+  return dataObjects;
+}
+
+- (NSArray *)dataObjectsForClass:(Class)dataObjectClass whereProperty:(NSString *)property equals:(id)value
+{
+  if (![self isIndexedProperty:property ofClass:dataObjectClass]) {
+    return nil;
+  }
+
+  NSData *prefix = [self _indexKeyPrefixForProperty:property modelIdentifier:[dataObjectClass modelIdentifier]];
+  NSData *start = indexLowerBound(prefix, value, YES, 0);
+  NSData *end = indexUpperBound(prefix, value, YES, 0);
+  if (start == nil || end == nil) {
+    return @[];
+  }
+
+  return [self _dataObjectsForClass:dataObjectClass property:property fromIndex:start toIndex:end limit:0];
+}
+
+- (NSArray *)dataObjectsForClass:(Class)dataObjectClass
+                   whereProperty:(NSString *)property
+                       fromValue:(id)fromValue
+                         toValue:(id)toValue
+                           limit:(NSUInteger)limit
+{
+  if (![self isIndexedProperty:property ofClass:dataObjectClass]) {
+    return nil;
+  }
+
+  NSData *prefix = [self _indexKeyPrefixForProperty:property modelIdentifier:[dataObjectClass modelIdentifier]];
+  char tag = indexValueTag((fromValue != nil) ? fromValue : toValue);
+  NSData *start = indexLowerBound(prefix, fromValue, YES, tag);
+  NSData *end = indexUpperBound(prefix, toValue, NO, tag);
+  if (start == nil || end == nil) {
+    return @[];
+  }
+
+  return [self _dataObjectsForClass:dataObjectClass property:property fromIndex:start toIndex:end limit:limit];
+}
+
 - (void)addDataObject:(VSDataObject *)dataObject
 {
+  [self beginBatch];
   if ([[VSDataModel sharedModel] dataManager:self setAllValuesForDataObject:dataObject]) {
     NSMutableDictionary *dict = [_dictionaries objectForKey:(id)[dataObject class]];
     if (dict != nil) {
-      [dict setObject:dataObject forKey:[dataObject uniqueIdentifier]];
+      @synchronized(dict) {
+        [dict setObject:dataObject forKey:[dataObject uniqueIdentifier]];
+      }
     }
   }
+  [self commitBatch];
 }
 
 - (void)removeDataObject:(VSDataObject *)dataObject
 {
+  /* a flush in progress must not write the object back once erased */
+  pthread_mutex_lock(&_flushMutex);
+  [self beginBatch];
+  if (_writeBack && [dataObject dataManager] == self) {
+    @synchronized(_dirtyObjects) {
+      [_dirtyObjects removeObject:dataObject];
+    }
+    /* only the values the object still has are erased, those it dropped may not be written yet */
+    [[VSDataModel sharedModel] dataManager:self setDirtyValuesForDataObject:dataObject];
+  }
   if ([[VSDataModel sharedModel] dataManager:self eraseAllValuesForDataObject:dataObject]) {
     NSMutableDictionary *dict = [_dictionaries objectForKey:(id)[dataObject class]];
     if (dict != nil) {
-      [dict removeObjectForKey:[dataObject uniqueIdentifier]];
+      @synchronized(dict) {
+        [dict removeObjectForKey:[dataObject uniqueIdentifier]];
+      }
     }
   }
+  [self commitBatch];
+  pthread_mutex_unlock(&_flushMutex);
+}
+
+- (void)beginBatch
+{
+  VSDataManagerBatchState *state = pthread_getspecific(_batchKey);
+  if (state == NULL) {
+    state = (VSDataManagerBatchState *)calloc(1, sizeof(VSDataManagerBatchState));
+    state->batch = vsdb_batch_create();
+    pthread_setspecific(_batchKey, state);
+  }
+
+  state->depth++;
+}
+
+- (BOOL)commitBatch
+{
+  VSDataManagerBatchState *state = pthread_getspecific(_batchKey);
+  if (state == NULL || state->depth == 0) {
+    return NO;
+  }
+
+  if (--state->depth > 0) {
+    return YES;
+  }
+
+  BOOL committed = (vsdb_batch_commit(_vsdb, state->batch) == vsdb_okay);
+  vsdb_batch_clear(state->batch);
+  return committed;
 }
 
 @end
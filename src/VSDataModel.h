@@ -32,6 +32,9 @@
 + (VSDataModel *)sharedModel;
 
 - (NSArray *)modelClasses;
+- (BOOL)dataObjectClass:(Class)class hasPropertyForKey:(NSString *)key;
+- (NSArray *)propertyNamesForDataObjectClass:(Class)class;
+- (void)initializeSlotsForDataObject:(VSDataObject *)dataObject;
 
 - (VSDataObject *)copyDataObject:(VSDataObject *)dataObject withZone:(NSZone *)zone;
 - (void)decodeDataObject:(VSDataObject *)dataObject withCoder:(NSCoder *)aDecoder;
@@ -43,14 +46,26 @@
 
 - (void)dataObject:(VSDataObject *)dataObject willChangeValueForKey:(NSString *)key;
 - (void)dataObject:(VSDataObject *)dataObject didChangeValueForKey:(NSString *)key;
+- (void)dataObject:(VSDataObject *)dataObject didChangeValueForKey:(NSString *)key withSetMutation:(NSKeyValueSetMutationKind)mutationKind usingObjects:(NSSet *)objects;
+- (void)dataObject:(VSDataObject *)dataObject didChange:(NSKeyValueChange)changeKind valuesAtIndexes:(NSIndexSet *)indexes forKey:(NSString *)key;
 
 - (BOOL)dataObject:(VSDataObject *)dataObject getValue:(__strong id *)value forKey:(NSString *)key;
 - (BOOL)dataObject:(VSDataObject *)dataObject setValue:(id)value forKey:(NSString *)key;
 
+/*
+ * Store values read from the database into an object being loaded, and
+ * read them back, without notifying or marking anything dirty.
+ */
+- (void)dataObject:(VSDataObject *)dataObject loadValue:(id)value forKey:(NSString *)key;
+- (id)dataObject:(VSDataObject *)dataObject loadedValueForKey:(NSString *)key;
+
 - (BOOL)dataManager:(VSDataManager *)dataManager eraseAllValuesForDataObject:(VSDataObject *)dataObject;
 - (BOOL)dataManager:(VSDataManager *)dataManager setAllValuesForDataObject:(VSDataObject *)dataObject;
+- (BOOL)dataManager:(VSDataManager *)dataManager setDirtyValuesForDataObject:(VSDataObject *)dataObject;
 
 - (NSString *)uniqueIdentifierForDataObject:(VSDataObject *)dataObject;
 - (VSDataObject *)dataObjectWithClass:(Class)class dictionary:(NSDictionary *)dictionary dataManager:(VSDataManager *)dataManager;
+- (VSDataObject *)dataObjectWithClass:(Class)class uniqueIdentifier:(NSString *)uniqueIdentifier dataManager:(VSDataManager *)dataManager;
+- (VSDataObject *)faultWithClass:(Class)class uniqueIdentifier:(NSString *)uniqueIdentifier dataManager:(VSDataManager *)dataManager;
 
 @end
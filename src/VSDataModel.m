@@ -26,7 +26,11 @@
 #import "VSDataManager.h"
 #import "VSDataManager+Private.h"
 #import "VSDataObject.h"
+#import "VSDataObject+Private.h"
+#import "VSLazyCollection.h"
 #include <objc/runtime.h>
+#include <objc/message.h>
+#include <os/lock.h>
 
 #if defined(__has_include) && __has_include(<VSFoundation/VSLogger.h>)
 #import <VSFoundation/VSLogger.h>
@@ -158,9 +162,23 @@ static inline Class getClassFromPropertyTypeSignature(const char *typeSignature)
   return class;
 }
 
+static inline BOOL isSupportedScalarType(const char *typeSignature)
+{
+  if (typeSignature[0] == '{') {
+    /* plain old data only, no objects, pointers or unions */
+    return strchr(typeSignature, '=') != NULL && strpbrk(typeSignature, "@^*:#(") == NULL;
+  }
+
+  return typeSignature[0] != '\0' && typeSignature[1] == '\0' && strchr("cCsSiIlLqQfdB", typeSignature[0]) != NULL;
+}
+
 @interface VSDataObjectPropertyInfo : NSObject
 @property (nonatomic, assign) VSDataObjectPropertyFlags flags;
 @property (nonatomic, assign) Class typeClass;
+@property (nonatomic, strong) NSString *objCType;
+@property (nonatomic, assign) NSUInteger size;
+@property (nonatomic, assign) NSUInteger index;
+@property (nonatomic, assign) NSUInteger slot;
 @property (nonatomic, strong) NSString *propertyName;
 @property (nonatomic, strong) NSMethodSignature *getterSignature;
 @property (nonatomic, strong) NSMethodSignature *setterSignature;
@@ -172,87 +190,359 @@ static inline Class getClassFromPropertyTypeSignature(const char *typeSignature)
 @implementation VSDataObjectPropertyInfo
 @end
 
-static const void *kDataObjectExtraInfoAssocKey = &kDataObjectExtraInfoAssocKey;
 static NSString *const kDataObjectExtraDictionaryCoderKey = @"ExtraDictionary";
 
-@interface VSDataObjectExtraInfo : NSObject
-@property (nonatomic, strong) NSMutableDictionary *extraDictionary;
-@property (nonatomic, weak) VSDataManager *dataManager;
-@end
-@implementation VSDataObjectExtraInfo
-@end
+static inline BOOL isScalarProperty(VSDataObjectPropertyInfo *propertyInfo)
+{
+  return ([propertyInfo flags] & (VSPrimitiveTypedProperty | VSStructTypedProperty)) != 0;
+}
 
-@interface VSDataObject (DataModel)
-- (id)initWithExtraDictionary:(NSDictionary *)dictionary dataManager:(VSDataManager *)dataManager properties:(NSDictionary *)properties;
-@property (nonatomic, strong, readonly) NSMutableDictionary *extraDictionary;
-@property (nonatomic, weak) VSDataManager *dataManager;
-@end
-@implementation VSDataObject (DataModel)
-- (VSDataObjectExtraInfo *)_extraInfo
+/*
+ * Object values live in the slot the model gave their property, scalar
+ * values unboxed at its offset in the scalar storage, and each property
+ * has a dirty bit at its index, see VSDataObject+Private.h.
+ */
+static inline id getSlotValue(VSDataObject *dataObject, NSUInteger slot)
 {
-  VSDataObjectExtraInfo *extraInfo = objc_getAssociatedObject(self, kDataObjectExtraInfoAssocKey);
-  if (extraInfo == nil) {
-    extraInfo = [[VSDataObjectExtraInfo alloc] init];
-    objc_setAssociatedObject(self, kDataObjectExtraInfoAssocKey, extraInfo, OBJC_ASSOCIATION_RETAIN_NONATOMIC);
+  return (slot < dataObject->_slotCount) ? dataObject->_slots[slot] : nil;
+}
+
+static inline void setSlotValue(VSDataObject *dataObject, NSUInteger slot, id value)
+{
+  if (slot < dataObject->_slotCount) {
+    dataObject->_slots[slot] = value;
   }
+}
 
-  return extraInfo;
+/* the bits of different properties share bytes, so they are updated atomically */
+static inline void setDirty(VSDataObject *dataObject, NSUInteger index)
+{
+  if (dataObject->_dirtyBits != NULL) {
+    __atomic_fetch_or(&dataObject->_dirtyBits[index >> 3], (uint8_t)(1 << (index & 7)), __ATOMIC_RELAXED);
+  }
 }
 
-- (id)initWithExtraDictionary:(NSDictionary *)dictionary dataManager:(VSDataManager *)dataManager properties:(NSDictionary *)properties
+/* returns whether the bit was set */
+static inline BOOL clearDirty(VSDataObject *dataObject, NSUInteger index)
 {
-  self = [self init];
-  if (self) {
-    NSMutableDictionary *mutableDict;
-    if (properties == nil) {
-      mutableDict = [dictionary mutableCopy];
+  if (dataObject->_dirtyBits == NULL) {
+    return NO;
+  }
+
+  uint8_t mask = (uint8_t)(1 << (index & 7));
+  return (__atomic_fetch_and(&dataObject->_dirtyBits[index >> 3], (uint8_t)~mask, __ATOMIC_RELAXED) & mask) != 0;
+}
+
+/*
+ * Atomic properties are guarded by a lock picked from a fixed set by the
+ * object and the property index, so that different properties of an
+ * object, like different objects, seldom share one. The locks are only
+ * held to copy a value in or out, never across KVO notifications, and
+ * each sits on its own cache line.
+ */
+#define PROPERTY_LOCK_COUNT 64
+
+typedef struct {
+  os_unfair_lock lock;
+  uint8_t padding[64 - sizeof(os_unfair_lock)];
+} VSPropertyLock;
+
+static VSPropertyLock propertyLocks[PROPERTY_LOCK_COUNT];
+
+static inline os_unfair_lock *propertyLock(VSDataObject *dataObject, NSUInteger index)
+{
+  uintptr_t hash = ((uintptr_t)(__bridge void *)dataObject >> 4) ^ ((uintptr_t)(__bridge void *)dataObject >> 10);
+  return &propertyLocks[(hash + index * 0x9e3779b9u) % PROPERTY_LOCK_COUNT].lock;
+}
+
+#define BOX_SCALAR(type, selector) \
+  { \
+    type scalar; \
+    memcpy(&scalar, bytes, sizeof(type)); \
+    return [NSNumber selector:scalar]; \
+  }
+
+static id boxScalar(const char *objCType, const void *bytes, size_t size)
+{
+  switch (objCType[0]) {
+  case 'c': BOX_SCALAR(char, numberWithChar)
+  case 'C': BOX_SCALAR(unsigned char, numberWithUnsignedChar)
+  case 's': BOX_SCALAR(short, numberWithShort)
+  case 'S': BOX_SCALAR(unsigned short, numberWithUnsignedShort)
+  case 'i': BOX_SCALAR(int, numberWithInt)
+  case 'I': BOX_SCALAR(unsigned int, numberWithUnsignedInt)
+  case 'l': BOX_SCALAR(int, numberWithInt)
+  case 'L': BOX_SCALAR(unsigned int, numberWithUnsignedInt)
+  case 'q': BOX_SCALAR(long long, numberWithLongLong)
+  case 'Q': BOX_SCALAR(unsigned long long, numberWithUnsignedLongLong)
+  case 'f': BOX_SCALAR(float, numberWithFloat)
+  case 'd': BOX_SCALAR(double, numberWithDouble)
+  case 'B': BOX_SCALAR(bool, numberWithBool)
+  case '{':
+    /* structs are stored as their bytes */
+    return [NSData dataWithBytes:bytes length:size];
+  default:
+    return nil;
+  }
+}
+
+#undef BOX_SCALAR
+
+#define UNBOX_SCALAR(type, selector) \
+  { \
+    type scalar = [value selector]; \
+    memcpy(bytes, &scalar, sizeof(type)); \
+    return YES; \
+  }
+
+static BOOL unboxScalar(id value, const char *objCType, void *bytes, size_t size)
+{
+  if (objCType[0] == '{') {
+    if ([value isKindOfClass:[NSData class]] && [value length] == size) {
+      memcpy(bytes, [value bytes], size);
+      return YES;
     }
-    else {
-      mutableDict = [[NSMutableDictionary alloc] initWithCapacity:[dictionary count]];
-      for (NSString *propertyName in dictionary) {
-        id object = [dictionary objectForKey:propertyName];
-        VSDataObjectPropertyInfo *propInfo = [properties objectForKey:propertyName];
-        if (propInfo != nil) {
-          if ([propInfo flags] & VSMutableVariantProperty) {
-            object = [object mutableCopy];
-          }
-          else {
-            object = [object copy];
-          }
-        }
-
-        [mutableDict setObject:object forKey:propertyName];
-      }
+    else if ([value isKindOfClass:[NSValue class]] && strcmp([value objCType], objCType) == 0) {
+      [value getValue:bytes];
+      return YES;
+    }
+
+    return NO;
+  }
+
+  if (![value isKindOfClass:[NSNumber class]]) {
+    return NO;
+  }
+
+  switch (objCType[0]) {
+  case 'c': UNBOX_SCALAR(char, charValue)
+  case 'C': UNBOX_SCALAR(unsigned char, unsignedCharValue)
+  case 's': UNBOX_SCALAR(short, shortValue)
+  case 'S': UNBOX_SCALAR(unsigned short, unsignedShortValue)
+  case 'i': UNBOX_SCALAR(int, intValue)
+  case 'I': UNBOX_SCALAR(unsigned int, unsignedIntValue)
+  case 'l': UNBOX_SCALAR(int, intValue)
+  case 'L': UNBOX_SCALAR(unsigned int, unsignedIntValue)
+  case 'q': UNBOX_SCALAR(long long, longLongValue)
+  case 'Q': UNBOX_SCALAR(unsigned long long, unsignedLongLongValue)
+  case 'f': UNBOX_SCALAR(float, floatValue)
+  case 'd': UNBOX_SCALAR(double, doubleValue)
+  case 'B': UNBOX_SCALAR(bool, boolValue)
+  default:
+    return NO;
+  }
+}
+
+#undef UNBOX_SCALAR
+
+static void fireFault(VSDataObject *dataObject);
+
+static inline void willAccessValue(VSDataObject *dataObject)
+{
+  if (__builtin_expect(__atomic_load_n(&dataObject->_isFault, __ATOMIC_ACQUIRE), 0)) {
+    fireFault(dataObject);
+  }
+}
+
+/*
+ * Mutable properties keep the lazy collection they were loaded with, so
+ * that loading does not decode its elements, until the value is first
+ * asked for and replaced by a mutable copy.
+ */
+static inline BOOL isLazyCollection(id object)
+{
+  Class class = object_getClass(object);
+  return class == [VSLazySet class] || class == [VSLazyArray class];
+}
+
+static id loadMutableValue(VSDataObject *dataObject, NSUInteger index, NSUInteger slot, id object, BOOL atomic)
+{
+  id mutableObject = [object mutableCopy];
+  if (!atomic) {
+    setSlotValue(dataObject, slot, mutableObject);
+    return mutableObject;
+  }
+
+  /* copied outside the lock, so another thread may have replaced it meanwhile */
+  os_unfair_lock *lock = propertyLock(dataObject, index);
+  os_unfair_lock_lock(lock);
+  id previousValue = getSlotValue(dataObject, slot);
+  if (previousValue == object) {
+    setSlotValue(dataObject, slot, mutableObject);
+  }
+  else {
+    mutableObject = previousValue;
+  }
+  os_unfair_lock_unlock(lock);
+  return mutableObject;
+}
+
+static inline id getObjectValue(VSDataObject *dataObject, NSUInteger index, NSUInteger slot, BOOL atomic, BOOL mutableVariant)
+{
+  id object;
+
+  willAccessValue(dataObject);
+  if (!atomic) {
+    object = getSlotValue(dataObject, slot);
+  }
+  else {
+    os_unfair_lock *lock = propertyLock(dataObject, index);
+    os_unfair_lock_lock(lock);
+    object = getSlotValue(dataObject, slot);
+    os_unfair_lock_unlock(lock);
+  }
+
+  if (__builtin_expect(mutableVariant && isLazyCollection(object), 0)) {
+    object = loadMutableValue(dataObject, index, slot, object, atomic);
+  }
+  return object;
+}
+
+static inline void setObjectValue(VSDataObject *dataObject, NSString *propertyName, NSUInteger index, NSUInteger slot, id value, BOOL atomic)
+{
+  /* the previous value is released after the lock is dropped */
+  id previousValue = nil;
+
+  willAccessValue(dataObject);
+  [dataObject willChangeValueForKey:propertyName];
+  if (!atomic) {
+    setSlotValue(dataObject, slot, value);
+  }
+  else {
+    os_unfair_lock *lock = propertyLock(dataObject, index);
+    os_unfair_lock_lock(lock);
+    previousValue = getSlotValue(dataObject, slot);
+    setSlotValue(dataObject, slot, value);
+    os_unfair_lock_unlock(lock);
+  }
+  setDirty(dataObject, index);
+  [dataObject didChangeValueForKey:propertyName];
+}
+
+static inline void getScalarValue(VSDataObject *dataObject, NSUInteger index, NSUInteger offset, void *bytes, size_t size, BOOL atomic)
+{
+  willAccessValue(dataObject);
+  if (!atomic) {
+    memcpy(bytes, dataObject->_scalars + offset, size);
+    return;
+  }
+
+  os_unfair_lock *lock = propertyLock(dataObject, index);
+  os_unfair_lock_lock(lock);
+  memcpy(bytes, dataObject->_scalars + offset, size);
+  os_unfair_lock_unlock(lock);
+}
+
+static inline void setScalarValue(VSDataObject *dataObject, NSString *propertyName, NSUInteger index, NSUInteger offset, const void *bytes, size_t size, BOOL atomic)
+{
+  willAccessValue(dataObject);
+  [dataObject willChangeValueForKey:propertyName];
+  if (!atomic) {
+    memcpy(dataObject->_scalars + offset, bytes, size);
+  }
+  else {
+    os_unfair_lock *lock = propertyLock(dataObject, index);
+    os_unfair_lock_lock(lock);
+    memcpy(dataObject->_scalars + offset, bytes, size);
+    os_unfair_lock_unlock(lock);
+  }
+  setDirty(dataObject, index);
+  [dataObject didChangeValueForKey:propertyName];
+}
+
+/* boxes scalars on demand */
+static id getPropertyValue(VSDataObject *dataObject, VSDataObjectPropertyInfo *propertyInfo)
+{
+  BOOL atomic = !([propertyInfo flags] & VSNonatomicProperty);
+  if (!isScalarProperty(propertyInfo)) {
+    return getObjectValue(dataObject, [propertyInfo index], [propertyInfo slot], atomic, ([propertyInfo flags] & VSMutableVariantProperty) != 0);
+  }
+
+  if (dataObject->_scalars == NULL) {
+    return nil;
+  }
+
+  NSMutableData *bytes = [NSMutableData dataWithLength:[propertyInfo size]];
+  getScalarValue(dataObject, [propertyInfo index], [propertyInfo slot], [bytes mutableBytes], [propertyInfo size], atomic);
+  return boxScalar([[propertyInfo objCType] UTF8String], [bytes bytes], [propertyInfo size]);
+}
+
+static NSDictionary *dictionaryOfSlots(VSDataObject *dataObject, NSDictionary *properties)
+{
+  NSMutableDictionary *dictionary = [NSMutableDictionary dictionaryWithCapacity:[properties count]];
+  for (NSString *propertyName in properties) {
+    id value = getPropertyValue(dataObject, [properties objectForKey:propertyName]);
+    if (value != nil) {
+      [dictionary setObject:value forKey:propertyName];
+    }
+  }
+
+  return dictionary;
+}
+
+/*
+ * Stores a value read from the database, like a copy property would, but
+ * lazy collections of mutable properties are only copied by getObjectValue().
+ */
+static void loadSlotValue(VSDataObject *dataObject, VSDataObjectPropertyInfo *propertyInfo, id value)
+{
+  if (isScalarProperty(propertyInfo)) {
+    if (dataObject->_scalars != NULL) {
+      unboxScalar(value, [[propertyInfo objCType] UTF8String], dataObject->_scalars + [propertyInfo slot], [propertyInfo size]);
     }
+    return;
+  }
 
-    VSDataObjectExtraInfo *extraInfo = [self _extraInfo];
-    [extraInfo setExtraDictionary:mutableDict];
-    [extraInfo setDataManager:dataManager];
+  if ([propertyInfo flags] & VSMutableVariantProperty) {
+    value = isLazyCollection(value) ? value : [value mutableCopy];
+  }
+  else {
+    value = [value copy];
+  }
+
+  setSlotValue(dataObject, [propertyInfo slot], value);
+}
+
+@interface VSDataObject (DataModel)
+- (id)initWithExtraDictionary:(NSDictionary *)dictionary dataManager:(VSDataManager *)dataManager properties:(NSDictionary *)properties;
+- (void)setSlotsWithDictionary:(NSDictionary *)dictionary properties:(NSDictionary *)properties;
+@property (nonatomic, weak) VSDataManager *dataManager;
+@end
+@implementation VSDataObject (DataModel)
+- (id)initWithExtraDictionary:(NSDictionary *)dictionary dataManager:(VSDataManager *)dataManager properties:(NSDictionary *)properties
+{
+  self = [self init];
+  if (self) {
+    _dataManager = dataManager;
+    [self setSlotsWithDictionary:dictionary properties:properties];
   }
 
   return self;
 }
 
-- (NSMutableDictionary *)extraDictionary
+- (void)setSlotsWithDictionary:(NSDictionary *)dictionary properties:(NSDictionary *)properties
 {
-  VSDataObjectExtraInfo *extraInfo = [self _extraInfo];
-  NSMutableDictionary *extraDict = [extraInfo extraDictionary];
-  if (extraDict == nil) {
-    extraDict = [[NSMutableDictionary alloc] init];
-    [extraInfo setExtraDictionary:extraDict];
+  for (NSString *propertyName in dictionary) {
+    VSDataObjectPropertyInfo *propInfo = [properties objectForKey:propertyName];
+    if (propInfo != nil) {
+      loadSlotValue(self, propInfo, [dictionary objectForKey:propertyName]);
+    }
   }
 
-  return extraDict;
+  /* values read from the database are clean, the others are not */
+  if (_dirtyBits != NULL) {
+    memset(_dirtyBits, (_dataManager != nil) ? 0x00 : 0xff, ([properties count] + 7) / 8);
+  }
 }
 
 - (void)setDataManager:(VSDataManager *)dataManager
 {
-  [[self _extraInfo] setDataManager:dataManager];
+  _dataManager = dataManager;
 }
 
 - (VSDataManager *)dataManager
 {
-  return [[self _extraInfo] dataManager];
+  return _dataManager;
 }
 @end
 
@@ -260,72 +550,275 @@ static NSString *const kDataObjectExtraDictionaryCoderKey = @"ExtraDictionary";
 - (void)invokeProperty:(VSDataObjectPropertyInfo *)propertyInfo withInvocation:(NSInvocation *)invocation;
 @end
 @implementation VSDataObject (PropertyInvocation)
-- (void)_getNonatomicProperty:(VSDataObjectPropertyInfo *)propertyInfo withInvocation:(NSInvocation *)invocation
+- (void)_getProperty:(VSDataObjectPropertyInfo *)propertyInfo withInvocation:(NSInvocation *)invocation
 {
-  id object = [[self extraDictionary] objectForKey:[propertyInfo propertyName]];
+  BOOL atomic = !([propertyInfo flags] & VSNonatomicProperty);
+  if (isScalarProperty(propertyInfo)) {
+    if (_scalars != NULL) {
+      NSMutableData *bytes = [NSMutableData dataWithLength:[propertyInfo size]];
+      getScalarValue(self, [propertyInfo index], [propertyInfo slot], [bytes mutableBytes], [propertyInfo size], atomic);
+      [invocation setReturnValue:[bytes mutableBytes]];
+    }
+    return;
+  }
+
+  id object = getObjectValue(self, [propertyInfo index], [propertyInfo slot], atomic, ([propertyInfo flags] & VSMutableVariantProperty) != 0);
   [invocation setReturnValue:&object];
 }
 
-- (void)_setNonatomicProperty:(VSDataObjectPropertyInfo *)propertyInfo withInvocation:(NSInvocation *)invocation
+- (void)_setProperty:(VSDataObjectPropertyInfo *)propertyInfo withInvocation:(NSInvocation *)invocation
 {
+  BOOL atomic = !([propertyInfo flags] & VSNonatomicProperty);
+  if (isScalarProperty(propertyInfo)) {
+    if (_scalars != NULL) {
+      NSMutableData *bytes = [NSMutableData dataWithLength:[propertyInfo size]];
+      [invocation getArgument:[bytes mutableBytes] atIndex:2];
+      setScalarValue(self, [propertyInfo propertyName], [propertyInfo index], [propertyInfo slot], [bytes bytes], [propertyInfo size], atomic);
+    }
+    return;
+  }
+
   __unsafe_unretained id object = nil;
   [invocation getArgument:&object atIndex:2];
 
-  [self willChangeValueForKey:[propertyInfo propertyName]];
-  if (object == nil) {
-    [[self extraDictionary] removeObjectForKey:[propertyInfo propertyName]];
-  }
-  else {
-    if ([propertyInfo flags] & VSCopyProperty) {
-      if ([propertyInfo flags] & VSMutableVariantProperty) {
-        [[self extraDictionary] setObject:[object mutableCopy] forKey:[propertyInfo propertyName]];
-      }
-      else {
-        [[self extraDictionary] setObject:[object copy] forKey:[propertyInfo propertyName]];
-      }
+  if (object != nil && ([propertyInfo flags] & VSCopyProperty)) {
+    if ([propertyInfo flags] & VSMutableVariantProperty) {
+      setObjectValue(self, [propertyInfo propertyName], [propertyInfo index], [propertyInfo slot], [object mutableCopy], atomic);
     }
     else {
-      [[self extraDictionary] setObject:object forKey:[propertyInfo propertyName]];
+      setObjectValue(self, [propertyInfo propertyName], [propertyInfo index], [propertyInfo slot], [object copy], atomic);
     }
   }
-  [self didChangeValueForKey:[propertyInfo propertyName]];
+  else {
+    setObjectValue(self, [propertyInfo propertyName], [propertyInfo index], [propertyInfo slot], object, atomic);
+  }
 }
 
 - (void)invokeProperty:(VSDataObjectPropertyInfo *)propertyInfo withInvocation:(NSInvocation *)invocation
 {
   if ([invocation selector] == [propertyInfo getter]) {
-    if ([propertyInfo flags] & VSNonatomicProperty) {
-      [self _getNonatomicProperty:propertyInfo withInvocation:invocation];
-    }
-    else {
-      @synchronized([self extraDictionary]) {
-        [self _getNonatomicProperty:propertyInfo withInvocation:invocation];
-      }
-    }
+    [self _getProperty:propertyInfo withInvocation:invocation];
   }
   else {
-    if ([propertyInfo flags] & VSNonatomicProperty) {
-      [self _setNonatomicProperty:propertyInfo withInvocation:invocation];
+    [self _setProperty:propertyInfo withInvocation:invocation];
+  }
+}
+@end
+
+/*
+ * Accessors installed into the model classes, so that properties are
+ * plain message sends rather than going through forwarding. Each one is
+ * specialized for the attributes of its property.
+ */
+static IMP getterImplementation(VSDataObjectPropertyInfo *propertyInfo)
+{
+  NSUInteger index = [propertyInfo index];
+  NSUInteger slot = [propertyInfo slot];
+  BOOL mutableVariant = ([propertyInfo flags] & VSMutableVariantProperty) != 0;
+  if ([propertyInfo flags] & VSNonatomicProperty) {
+    return imp_implementationWithBlock(^id (VSDataObject *dataObject) {
+      return getObjectValue(dataObject, index, slot, NO, mutableVariant);
+    });
+  }
+
+  return imp_implementationWithBlock(^id (VSDataObject *dataObject) {
+    return getObjectValue(dataObject, index, slot, YES, mutableVariant);
+  });
+}
+
+static IMP setterImplementation(VSDataObjectPropertyInfo *propertyInfo)
+{
+  NSString *propertyName = [propertyInfo propertyName];
+  NSUInteger index = [propertyInfo index];
+  NSUInteger slot = [propertyInfo slot];
+  VSDataObjectPropertyFlags flags = [propertyInfo flags];
+
+  if (flags & VSNonatomicProperty) {
+    if ((flags & VSCopyProperty) && (flags & VSMutableVariantProperty)) {
+      return imp_implementationWithBlock(^(VSDataObject *dataObject, id value) {
+        setObjectValue(dataObject, propertyName, index, slot, [value mutableCopy], NO);
+      });
+    }
+    else if (flags & VSCopyProperty) {
+      return imp_implementationWithBlock(^(VSDataObject *dataObject, id value) {
+        setObjectValue(dataObject, propertyName, index, slot, [value copy], NO);
+      });
     }
     else {
-      @synchronized([self extraDictionary]) {
-        [self _setNonatomicProperty:propertyInfo withInvocation:invocation];
-      }
+      return imp_implementationWithBlock(^(VSDataObject *dataObject, id value) {
+        setObjectValue(dataObject, propertyName, index, slot, value, NO);
+      });
     }
   }
+
+  if ((flags & VSCopyProperty) && (flags & VSMutableVariantProperty)) {
+    return imp_implementationWithBlock(^(VSDataObject *dataObject, id value) {
+      setObjectValue(dataObject, propertyName, index, slot, [value mutableCopy], YES);
+    });
+  }
+  else if (flags & VSCopyProperty) {
+    return imp_implementationWithBlock(^(VSDataObject *dataObject, id value) {
+      setObjectValue(dataObject, propertyName, index, slot, [value copy], YES);
+    });
+  }
+  else {
+    return imp_implementationWithBlock(^(VSDataObject *dataObject, id value) {
+      setObjectValue(dataObject, propertyName, index, slot, value, YES);
+    });
+  }
+}
+
+#define DEFINE_SCALAR_ACCESSORS(name, type) \
+  static IMP name##GetterImplementation(NSUInteger index, NSUInteger offset, BOOL atomic) \
+  { \
+    if (!atomic) { \
+      return imp_implementationWithBlock(^type (VSDataObject *dataObject) { \
+        type value; \
+        getScalarValue(dataObject, index, offset, &value, sizeof(type), NO); \
+        return value; \
+      }); \
+    } \
+  \
+    return imp_implementationWithBlock(^type (VSDataObject *dataObject) { \
+      type value; \
+      getScalarValue(dataObject, index, offset, &value, sizeof(type), YES); \
+      return value; \
+    }); \
+  } \
+  \
+  static IMP name##SetterImplementation(NSString *propertyName, NSUInteger index, NSUInteger offset, BOOL atomic) \
+  { \
+    if (!atomic) { \
+      return imp_implementationWithBlock(^(VSDataObject *dataObject, type value) { \
+        setScalarValue(dataObject, propertyName, index, offset, &value, sizeof(type), NO); \
+      }); \
+    } \
+  \
+    return imp_implementationWithBlock(^(VSDataObject *dataObject, type value) { \
+      setScalarValue(dataObject, propertyName, index, offset, &value, sizeof(type), YES); \
+    }); \
+  }
+
+DEFINE_SCALAR_ACCESSORS(char, char)
+DEFINE_SCALAR_ACCESSORS(unsignedChar, unsigned char)
+DEFINE_SCALAR_ACCESSORS(short, short)
+DEFINE_SCALAR_ACCESSORS(unsignedShort, unsigned short)
+DEFINE_SCALAR_ACCESSORS(int, int)
+DEFINE_SCALAR_ACCESSORS(unsignedInt, unsigned int)
+DEFINE_SCALAR_ACCESSORS(longLong, long long)
+DEFINE_SCALAR_ACCESSORS(unsignedLongLong, unsigned long long)
+DEFINE_SCALAR_ACCESSORS(float, float)
+DEFINE_SCALAR_ACCESSORS(double, double)
+DEFINE_SCALAR_ACCESSORS(bool, bool)
+
+#undef DEFINE_SCALAR_ACCESSORS
+
+/*
+ * Structs have no specialized accessors, they keep going through
+ * forwarding, which handles any size.
+ */
+static void addScalarAccessors(Class class, VSDataObjectPropertyInfo *propertyInfo)
+{
+  NSString *propertyName = [propertyInfo propertyName];
+  NSUInteger index = [propertyInfo index];
+  NSUInteger offset = [propertyInfo slot];
+  BOOL atomic = !([propertyInfo flags] & VSNonatomicProperty);
+  IMP getter, setter;
+
+  switch ([[propertyInfo objCType] UTF8String][0]) {
+  case 'c':
+    getter = charGetterImplementation(index, offset, atomic);
+    setter = charSetterImplementation(propertyName, index, offset, atomic);
+    break;
+  case 'C':
+    getter = unsignedCharGetterImplementation(index, offset, atomic);
+    setter = unsignedCharSetterImplementation(propertyName, index, offset, atomic);
+    break;
+  case 's':
+    getter = shortGetterImplementation(index, offset, atomic);
+    setter = shortSetterImplementation(propertyName, index, offset, atomic);
+    break;
+  case 'S':
+    getter = unsignedShortGetterImplementation(index, offset, atomic);
+    setter = unsignedShortSetterImplementation(propertyName, index, offset, atomic);
+    break;
+  case 'i':
+  case 'l':
+    getter = intGetterImplementation(index, offset, atomic);
+    setter = intSetterImplementation(propertyName, index, offset, atomic);
+    break;
+  case 'I':
+  case 'L':
+    getter = unsignedIntGetterImplementation(index, offset, atomic);
+    setter = unsignedIntSetterImplementation(propertyName, index, offset, atomic);
+    break;
+  case 'q':
+    getter = longLongGetterImplementation(index, offset, atomic);
+    setter = longLongSetterImplementation(propertyName, index, offset, atomic);
+    break;
+  case 'Q':
+    getter = unsignedLongLongGetterImplementation(index, offset, atomic);
+    setter = unsignedLongLongSetterImplementation(propertyName, index, offset, atomic);
+    break;
+  case 'f':
+    getter = floatGetterImplementation(index, offset, atomic);
+    setter = floatSetterImplementation(propertyName, index, offset, atomic);
+    break;
+  case 'd':
+    getter = doubleGetterImplementation(index, offset, atomic);
+    setter = doubleSetterImplementation(propertyName, index, offset, atomic);
+    break;
+  case 'B':
+    getter = boolGetterImplementation(index, offset, atomic);
+    setter = boolSetterImplementation(propertyName, index, offset, atomic);
+    break;
+  default:
+    return;
+  }
+
+  NSString *getterTypes = [NSString stringWithFormat:@"%@@:", [propertyInfo objCType]];
+  if (!class_addMethod(class, [propertyInfo getter], getter, [getterTypes UTF8String])) {
+    imp_removeBlock(getter);
+  }
+
+  NSString *setterTypes = [NSString stringWithFormat:@"v@:%@", [propertyInfo objCType]];
+  if (!class_addMethod(class, [propertyInfo setter], setter, [setterTypes UTF8String])) {
+    imp_removeBlock(setter);
+  }
+}
+
+static void addAccessors(Class class, VSDataObjectPropertyInfo *propertyInfo)
+{
+  if (isScalarProperty(propertyInfo)) {
+    addScalarAccessors(class, propertyInfo);
+    return;
+  }
+
+  IMP getter = getterImplementation(propertyInfo);
+  if (!class_addMethod(class, [propertyInfo getter], getter, "@@:")) {
+    imp_removeBlock(getter);
+  }
+
+  IMP setter = setterImplementation(propertyInfo);
+  if (!class_addMethod(class, [propertyInfo setter], setter, "v@:@")) {
+    imp_removeBlock(setter);
+  }
 }
-@end
 
 @interface VSDataObjectModelInfo : NSObject {
 @private
   __weak VSDataObjectPropertyInfo *_uniqueIdentifierProperty;
   NSDictionary *_selectors;
   NSDictionary *_properties;
+  NSUInteger _slotCount;
+  NSUInteger _scalarSize;
 }
 - (id)initWithModelClass:(Class)class;
 
 - (NSDictionary *)properties;
 - (NSString *)nameForUniqueIdentifier;
+- (NSUInteger)slotForUniqueIdentifier;
+- (void)initializeSlotsForDataObject:(VSDataObject *)dataObject;
 
 - (NSMethodSignature *)methodSignatureForSelector:(SEL)aSelector forDataObject:(VSDataObject *)object;
 - (BOOL)forwardInvocation:(NSInvocation *)anInvocation forDataObject:(VSDataObject *)object;
@@ -342,6 +835,7 @@ static NSString *const kDataObjectExtraDictionaryCoderKey = @"ExtraDictionary";
   const char *propertyName, *setterName, *getterName, *typeSignature;
   VSDataObjectPropertyFlags flags;
   Class typeClass;
+  NSUInteger size;
 
   array = [NSMutableArray array];
   getterSignature = [NSMethodSignature signatureWithObjCTypes:"@@:"];
@@ -365,6 +859,17 @@ static NSString *const kDataObjectExtraDictionaryCoderKey = @"ExtraDictionary";
       VSDMLog(@"unsupported 'weak' property '%s' found in '%@'", propertyName, NSStringFromClass(class));
       goto nextAttribute;
     }
+    else if (flags & (VSPrimitiveTypedProperty | VSStructTypedProperty)) {
+      if (!isSupportedScalarType(typeSignature)) {
+        VSDMLog(@"unsupported type of property '%s' found in '%@'", propertyName, NSStringFromClass(class));
+        goto nextAttribute;
+      }
+
+      /* scalars are stored unboxed */
+      typeClass = NULL;
+      NSGetSizeAndAlignment(typeSignature, &size, NULL);
+      goto addProperty;
+    }
     else if (flags & VSAssignProperty) {
       VSDMLog(@"unsupported 'assign/unsafe_unretained' property '%s' found in '%@'", propertyName, NSStringFromClass(class));
       goto nextAttribute;
@@ -408,12 +913,24 @@ static NSString *const kDataObjectExtraDictionaryCoderKey = @"ExtraDictionary";
       goto nextAttribute;
     }
 
+    size = sizeof(id);
+
+addProperty:
     info = [[VSDataObjectPropertyInfo alloc] init];
+    [info setIndex:[array count]];
     [info setFlags:flags];
     [info setTypeClass:typeClass];
+    [info setObjCType:[NSString stringWithUTF8String:typeSignature]];
+    [info setSize:size];
     [info setPropertyName:[NSString stringWithUTF8String:propertyName]];
-    [info setGetterSignature:getterSignature];
-    [info setSetterSignature:setterSignature];
+    if (typeClass == NULL) {
+      [info setGetterSignature:[NSMethodSignature signatureWithObjCTypes:[[NSString stringWithFormat:@"%s@:", typeSignature] UTF8String]]];
+      [info setSetterSignature:[NSMethodSignature signatureWithObjCTypes:[[NSString stringWithFormat:@"v@:%s", typeSignature] UTF8String]]];
+    }
+    else {
+      [info setGetterSignature:getterSignature];
+      [info setSetterSignature:setterSignature];
+    }
 
     if (getterName == NULL) {
       [info setGetterName:[NSString stringWithUTF8String:propertyName]];
@@ -456,9 +973,18 @@ nextAttribute:
     NSMutableDictionary *propDict = [NSMutableDictionary dictionaryWithCapacity:[properties count]];
     NSMutableDictionary *selDict = [NSMutableDictionary dictionaryWithCapacity:([properties count] * 2)];
     for (VSDataObjectPropertyInfo *info in properties) {
+      if (isScalarProperty(info)) {
+        [info setSlot:_scalarSize];
+        _scalarSize += [info size];
+      }
+      else {
+        [info setSlot:_slotCount++];
+      }
+
       [propDict setObject:info forKey:[info propertyName]];
       [selDict setObject:info forKey:[info getterName]];
       [selDict setObject:info forKey:[info setterName]];
+      addAccessors(class, info);
     }
     _properties = propDict;
     _selectors = selDict;
@@ -497,6 +1023,31 @@ nextAttribute:
   return [_uniqueIdentifierProperty propertyName];
 }
 
+- (NSUInteger)slotForUniqueIdentifier
+{
+  if (_uniqueIdentifierProperty == nil || isScalarProperty(_uniqueIdentifierProperty)) {
+    return NSNotFound;
+  }
+
+  return [_uniqueIdentifierProperty slot];
+}
+
+- (void)initializeSlotsForDataObject:(VSDataObject *)dataObject
+{
+  NSUInteger propertyCount = [_properties count];
+  if (propertyCount == 0) {
+    return;
+  }
+
+  /* object slots, then scalars, then dirty bits, in a single allocation */
+  size_t size = _slotCount * sizeof(id) + _scalarSize + (propertyCount + 7) / 8;
+  uint8_t *bytes = (uint8_t *)calloc(1, size);
+  dataObject->_slots = (__strong id *)(void *)bytes;
+  dataObject->_slotCount = _slotCount;
+  dataObject->_scalars = bytes + _slotCount * sizeof(id);
+  dataObject->_dirtyBits = dataObject->_scalars + _scalarSize;
+}
+
 - (NSMethodSignature *)methodSignatureForSelector:(SEL)aSelector forDataObject:(VSDataObject *)object
 {
   NSString *selectorName = NSStringFromSelector(aSelector);
@@ -602,9 +1153,49 @@ nextAttribute:
   return nil;
 }
 
+- (BOOL)dataObjectClass:(Class)class hasPropertyForKey:(NSString *)key
+{
+  return key != nil && [[self _propertiesForDataObjectClass:class] objectForKey:key] != nil;
+}
+
+- (NSArray *)propertyNamesForDataObjectClass:(Class)class
+{
+  return [[[self _propertiesForDataObjectClass:class] allKeys] sortedArrayUsingSelector:@selector(compare:)];
+}
+
+- (void)initializeSlotsForDataObject:(VSDataObject *)dataObject
+{
+  /* subclasses of a model class share its layout */
+  Class class;
+  for (class = [dataObject class]; class != Nil; class = class_getSuperclass(class)) {
+    VSDataObjectModelInfo *modelInfo = [_models objectForKey:(id)class];
+    if (modelInfo != nil) {
+      [modelInfo initializeSlotsForDataObject:dataObject];
+      break;
+    }
+  }
+}
+
+- (id)_valueForKey:(NSString *)key ofDataObject:(VSDataObject *)dataObject
+{
+  VSDataObjectPropertyInfo *propInfo = (key != nil) ? [[self _propertiesForDataObjectClass:[dataObject class]] objectForKey:key] : nil;
+  if (propInfo == nil) {
+    return nil;
+  }
+
+  /* the value is being persisted */
+  clearDirty(dataObject, [propInfo index]);
+  return getPropertyValue(dataObject, propInfo);
+}
+
+- (NSDictionary *)_dictionaryForDataObject:(VSDataObject *)dataObject
+{
+  return dictionaryOfSlots(dataObject, [self _propertiesForDataObjectClass:[dataObject class]]);
+}
+
 - (VSDataObject *)copyDataObject:(VSDataObject *)dataObject withZone:(NSZone *)zone
 {
-  return [[[dataObject class] allocWithZone:zone] initWithExtraDictionary:[dataObject extraDictionary]
+  return [[[dataObject class] allocWithZone:zone] initWithExtraDictionary:[self _dictionaryForDataObject:dataObject]
                                                               dataManager:nil
                                                                properties:[self _propertiesForDataObjectClass:[dataObject class]]];
 }
@@ -613,18 +1204,18 @@ nextAttribute:
 {
   NSDictionary *extraDict = [aDecoder decodeObjectForKey:kDataObjectExtraDictionaryCoderKey];
   if (extraDict != nil) {
-    [[dataObject extraDictionary] setDictionary:extraDict];
+    [dataObject setSlotsWithDictionary:extraDict properties:[self _propertiesForDataObjectClass:[dataObject class]]];
   }
 }
 
 - (void)encodeDataObject:(VSDataObject *)dataObject withCoder:(NSCoder *)aCoder
 {
-  [aCoder encodeObject:[dataObject extraDictionary] forKey:kDataObjectExtraDictionaryCoderKey];
+  [aCoder encodeObject:[self _dictionaryForDataObject:dataObject] forKey:kDataObjectExtraDictionaryCoderKey];
 }
 
 - (NSString *)descriptionForDataObject:(VSDataObject *)dataObject
 {
-  return [[dataObject extraDictionary] description];
+  return [[self _dictionaryForDataObject:dataObject] description];
 }
 
 - (NSMethodSignature *)methodSignatureForSelector:(SEL)aSelector forDataObject:(VSDataObject *)object
@@ -655,10 +1246,95 @@ nextAttribute:
 {
 }
 
+static BOOL isMutableCollection(id value)
+{
+  return [value isKindOfClass:[NSMutableArray class]] || [value isKindOfClass:[NSMutableSet class]] ||
+         [value isKindOfClass:[NSMutableOrderedSet class]] || [value isKindOfClass:[NSMutableDictionary class]];
+}
+
+/*
+ * With write-back, the property is only marked dirty and the manager told.
+ * A mutable collection is copied here, on the thread changing it, since
+ * the flush runs on another thread while it may be changed again in place.
+ */
+- (BOOL)_deferChangeForKey:(NSString *)key ofDataObject:(VSDataObject *)dataObject
+{
+  VSDataManager *dataManager = [dataObject dataManager];
+  if (dataManager == nil || ![dataManager writesBack]) {
+    return NO;
+  }
+
+  VSDataObjectPropertyInfo *propInfo = (key != nil) ? [[self _propertiesForDataObjectClass:[dataObject class]] objectForKey:key] : nil;
+  if (propInfo == nil) {
+    return NO;
+  }
+
+  id snapshot = nil;
+  if (!isScalarProperty(propInfo)) {
+    id value = getPropertyValue(dataObject, propInfo);
+    if (isMutableCollection(value)) {
+      snapshot = [value copy];
+    }
+  }
+
+  /* collections mutated in place never went through a setter */
+  os_unfair_lock_lock(&dataObject->_snapshotLock);
+  if (snapshot != nil) {
+    if (dataObject->_snapshots == nil) {
+      dataObject->_snapshots = [[NSMutableDictionary alloc] init];
+    }
+    [dataObject->_snapshots setObject:snapshot forKey:key];
+  }
+  else {
+    [dataObject->_snapshots removeObjectForKey:key];
+  }
+  setDirty(dataObject, [propInfo index]);
+  os_unfair_lock_unlock(&dataObject->_snapshotLock);
+
+  [dataManager dataObjectDidBecomeDirty:dataObject];
+  return YES;
+}
+
 - (void)dataObject:(VSDataObject *)dataObject didChangeValueForKey:(NSString *)key
 {
+  if ([self _deferChangeForKey:key ofDataObject:dataObject]) {
+    return;
+  }
+
   if ([dataObject dataManager] != nil) {
-    [[dataObject dataManager] setValue:[[dataObject extraDictionary] objectForKey:key]
+    [[dataObject dataManager] setValue:[self _valueForKey:key ofDataObject:dataObject]
+                           forProperty:key
+                      uniqueIdentifier:[self uniqueIdentifierForDataObject:dataObject]
+                       modelIdentifier:[[dataObject class] modelIdentifier]];
+  }
+}
+
+- (void)dataObject:(VSDataObject *)dataObject didChangeValueForKey:(NSString *)key withSetMutation:(NSKeyValueSetMutationKind)mutationKind usingObjects:(NSSet *)objects
+{
+  if ([self _deferChangeForKey:key ofDataObject:dataObject]) {
+    return;
+  }
+
+  if ([dataObject dataManager] != nil) {
+    [[dataObject dataManager] setValue:[self _valueForKey:key ofDataObject:dataObject]
+                       withSetMutation:mutationKind
+                          usingObjects:objects
+                           forProperty:key
+                      uniqueIdentifier:[self uniqueIdentifierForDataObject:dataObject]
+                       modelIdentifier:[[dataObject class] modelIdentifier]];
+  }
+}
+
+- (void)dataObject:(VSDataObject *)dataObject didChange:(NSKeyValueChange)changeKind valuesAtIndexes:(NSIndexSet *)indexes forKey:(NSString *)key
+{
+  if ([self _deferChangeForKey:key ofDataObject:dataObject]) {
+    return;
+  }
+
+  if ([dataObject dataManager] != nil) {
+    [[dataObject dataManager] setValue:[self _valueForKey:key ofDataObject:dataObject]
+                            withChange:changeKind
+                             atIndexes:indexes
                            forProperty:key
                       uniqueIdentifier:[self uniqueIdentifierForDataObject:dataObject]
                        modelIdentifier:[[dataObject class] modelIdentifier]];
@@ -677,14 +1353,18 @@ nextAttribute:
     return NO;
   }
 
-  NSInvocation *invocation = [NSInvocation invocationWithMethodSignature:[propInfo getterSignature]];
-  [invocation setTarget:dataObject];
-  [invocation setSelector:[propInfo getter]];
-  [invocation invoke];
+  if (isScalarProperty(propInfo)) {
+    *value = getPropertyValue(dataObject, propInfo);
+
+    /* structs are stored as their bytes, but come back as NSValue */
+    if ([propInfo flags] & VSStructTypedProperty) {
+      *value = [NSValue valueWithBytes:[*value bytes] objCType:[[propInfo objCType] UTF8String]];
+    }
+
+    return YES;
+  }
 
-  __unsafe_unretained id valueObject = nil;
-  [invocation getReturnValue:&valueObject];
-  *value = valueObject;
+  *value = ((id (*)(id, SEL))objc_msgSend)(dataObject, [propInfo getter]);
 
   return YES;
 }
@@ -701,11 +1381,24 @@ nextAttribute:
     return NO;
   }
 
-  NSInvocation *invocation = [NSInvocation invocationWithMethodSignature:[propInfo setterSignature]];
-  [invocation setTarget:dataObject];
-  [invocation setSelector:[propInfo setter]];
-  [invocation setArgument:&value atIndex:2];
-  [invocation invoke];
+  if (isScalarProperty(propInfo)) {
+    if (value == nil) {
+      [dataObject setNilValueForKey:key];
+      return YES;
+    }
+
+    NSMutableData *bytes = [NSMutableData dataWithLength:[propInfo size]];
+    if (dataObject->_scalars == NULL || !unboxScalar(value, [[propInfo objCType] UTF8String], [bytes mutableBytes], [propInfo size])) {
+      return NO;
+    }
+
+    setScalarValue(dataObject, key, [propInfo index], [propInfo slot], [bytes bytes], [propInfo size],
+                   !([propInfo flags] & VSNonatomicProperty));
+
+    return YES;
+  }
+
+  ((void (*)(id, SEL, id))objc_msgSend)(dataObject, [propInfo setter], value);
 
   return YES;
 }
@@ -724,7 +1417,7 @@ nextAttribute:
     return NO;
   }
 
-  for (NSString *propertyName in [dataObject extraDictionary]) {
+  for (NSString *propertyName in [self _dictionaryForDataObject:dataObject]) {
     [dataManager setValue:nil forProperty:propertyName uniqueIdentifier:uniqueIdentifier modelIdentifier:modelIdentifier];
   }
 
@@ -746,29 +1439,70 @@ nextAttribute:
     return NO;
   }
 
-  if ([[dataManager dictionaryOfDataObjectsForClass:[dataObject class]] objectForKey:uniqueIdentifier] != nil) {
+  if ([dataManager dataObjectForClass:[dataObject class] uniqueIdentifier:uniqueIdentifier] != nil) {
     VSDMLog(@"duplicated unique identifier '%@' in '%@'", uniqueIdentifier, NSStringFromClass([dataObject class]));
     return NO;
   }
 
-  for (NSString *propertyName in [dataObject extraDictionary]) {
-    [dataManager setValue:[[dataObject extraDictionary] objectForKey:propertyName]
-              forProperty:propertyName
-         uniqueIdentifier:uniqueIdentifier
-          modelIdentifier:modelIdentifier];
+  NSDictionary *properties = [self _propertiesForDataObjectClass:[dataObject class]];
+  for (NSString *propertyName in properties) {
+    VSDataObjectPropertyInfo *propInfo = [properties objectForKey:propertyName];
+    id value = getPropertyValue(dataObject, propInfo);
+    if (value != nil) {
+      [dataManager setValue:value forProperty:propertyName uniqueIdentifier:uniqueIdentifier modelIdentifier:modelIdentifier];
+    }
+    clearDirty(dataObject, [propInfo index]);
   }
 
   [dataObject setDataManager:dataManager];
   return YES;
 }
 
+- (BOOL)dataManager:(VSDataManager *)dataManager setDirtyValuesForDataObject:(VSDataObject *)dataObject
+{
+  /* nil while the manager flushes from -dealloc, its weak references are cleared by then */
+  VSDataManager *owner = [dataObject dataManager];
+  if (owner != nil && owner != dataManager) {
+    return NO;
+  }
+
+  NSString *uniqueIdentifier = [self uniqueIdentifierForDataObject:dataObject];
+  NSString *modelIdentifier = [[dataObject class] modelIdentifier];
+
+  if (uniqueIdentifier == nil) {
+    VSDMLog(@"unique identifier is not set in '%@'", NSStringFromClass([dataObject class]));
+    return NO;
+  }
+
+  NSDictionary *properties = [self _propertiesForDataObjectClass:[dataObject class]];
+  for (NSString *propertyName in properties) {
+    VSDataObjectPropertyInfo *propInfo = [properties objectForKey:propertyName];
+    id snapshot = nil;
+
+    /* cleared before reading, so that a change made meanwhile is written again */
+    os_unfair_lock_lock(&dataObject->_snapshotLock);
+    BOOL dirty = clearDirty(dataObject, [propInfo index]);
+    if (dirty && dataObject->_snapshots != nil) {
+      snapshot = [dataObject->_snapshots objectForKey:propertyName];
+      [dataObject->_snapshots removeObjectForKey:propertyName];
+    }
+    os_unfair_lock_unlock(&dataObject->_snapshotLock);
+
+    if (dirty) {
+      [dataManager setValue:(snapshot != nil) ? snapshot : getPropertyValue(dataObject, propInfo) forProperty:propertyName uniqueIdentifier:uniqueIdentifier modelIdentifier:modelIdentifier];
+    }
+  }
+
+  return YES;
+}
+
 - (NSString *)uniqueIdentifierForDataObject:(VSDataObject *)dataObject
 {
   VSDataObjectModelInfo *modelInfo = [_models objectForKey:(id)[dataObject class]];
   if (modelInfo == nil)
     return nil;
 
-  return [[dataObject extraDictionary] objectForKey:[modelInfo nameForUniqueIdentifier]];
+  return getSlotValue(dataObject, [modelInfo slotForUniqueIdentifier]);
 }
 
 - (VSDataObject *)dataObjectWithClass:(Class)class dictionary:(NSDictionary *)dictionary dataManager:(VSDataManager *)dataManager
@@ -778,4 +1512,69 @@ nextAttribute:
                                      properties:[self _propertiesForDataObjectClass:class]];
 }
 
+- (VSDataObject *)dataObjectWithClass:(Class)class uniqueIdentifier:(NSString *)uniqueIdentifier dataManager:(VSDataManager *)dataManager
+{
+  VSDataObjectModelInfo *modelInfo = [_models objectForKey:(id)class];
+  if (modelInfo == nil) {
+    return nil;
+  }
+
+  /* the slots start out empty and clean */
+  VSDataObject *dataObject = [[class alloc] init];
+  dataObject->_dataManager = dataManager;
+  setSlotValue(dataObject, [modelInfo slotForUniqueIdentifier], [uniqueIdentifier copy]);
+  return dataObject;
+}
+
+- (void)dataObject:(VSDataObject *)dataObject loadValue:(id)value forKey:(NSString *)key
+{
+  VSDataObjectPropertyInfo *propInfo = (key != nil) ? [[self _propertiesForDataObjectClass:[dataObject class]] objectForKey:key] : nil;
+  if (propInfo != nil) {
+    loadSlotValue(dataObject, propInfo, value);
+  }
+}
+
+- (id)dataObject:(VSDataObject *)dataObject loadedValueForKey:(NSString *)key
+{
+  VSDataObjectPropertyInfo *propInfo = (key != nil) ? [[self _propertiesForDataObjectClass:[dataObject class]] objectForKey:key] : nil;
+  if (propInfo == nil || isScalarProperty(propInfo)) {
+    return nil;
+  }
+
+  return getSlotValue(dataObject, [propInfo slot]);
+}
+
+- (VSDataObject *)faultWithClass:(Class)class uniqueIdentifier:(NSString *)uniqueIdentifier dataManager:(VSDataManager *)dataManager
+{
+  VSDataObjectModelInfo *modelInfo = [_models objectForKey:(id)class];
+  if (modelInfo == nil || [modelInfo nameForUniqueIdentifier] == nil) {
+    return nil;
+  }
+
+  VSDataObject *dataObject = [self dataObjectWithClass:class uniqueIdentifier:uniqueIdentifier dataManager:dataManager];
+  dataObject->_isFault = YES;
+  return dataObject;
+}
+
+- (void)_fireFaultForDataObject:(VSDataObject *)dataObject
+{
+  /* held across the read, so it is not one of the shared property locks */
+  os_unfair_lock_lock(&dataObject->_faultLock);
+  if (dataObject->_isFault) {
+    VSDataManager *dataManager = [dataObject dataManager];
+    NSString *uniqueIdentifier = [self uniqueIdentifierForDataObject:dataObject];
+    if (dataManager != nil && uniqueIdentifier != nil) {
+      NSDictionary *values = [dataManager valuesForUniqueIdentifier:uniqueIdentifier modelIdentifier:[[dataObject class] modelIdentifier]];
+      [dataObject setSlotsWithDictionary:values properties:[self _propertiesForDataObjectClass:[dataObject class]]];
+    }
+    __atomic_store_n(&dataObject->_isFault, NO, __ATOMIC_RELEASE);
+  }
+  os_unfair_lock_unlock(&dataObject->_faultLock);
+}
+
 @end
+
+static void fireFault(VSDataObject *dataObject)
+{
+  [[VSDataModel sharedModel] _fireFaultForDataObject:dataObject];
+}
@@ -0,0 +1,52 @@
+/* vim: set ft=objc fenc=utf-8 sw=2 ts=2 et: */
+/*
+ * Copyright (c) 2013-2014 Chongyu Zhu <i@lembacon.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#import "VSDataObject.h"
+#include <os/lock.h>
+
+@class VSDataManager;
+
+/*
+ * Property values are kept in an array of slots for objects, then unboxed
+ * scalars, then a bit per property set when its value changed since it
+ * was last persisted, all in a single allocation laid out by the model.
+ * A fault only holds its unique identifier until any other property is
+ * accessed, which reads them all from the data manager under the fault
+ * lock of the object alone. With write-back, the copies of mutable
+ * collections taken when they changed wait in the snapshots, by property
+ * name, to be written instead of the collections themselves.
+ */
+@interface VSDataObject () {
+@package
+  __strong id *_slots;
+  NSUInteger _slotCount;
+  uint8_t *_scalars;
+  uint8_t *_dirtyBits;
+  __weak VSDataManager *_dataManager;
+  BOOL _isFault;
+  os_unfair_lock _faultLock;
+  NSMutableDictionary *_snapshots;
+  os_unfair_lock _snapshotLock;
+}
+@end
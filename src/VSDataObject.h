@@ -28,6 +28,7 @@
 
 + (NSString *)modelIdentifier;
 + (NSString *)nameForUniqueIdentifier;
++ (NSArray *)indexedProperties;
 
 - (NSString *)uniqueIdentifier;
 
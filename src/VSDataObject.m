@@ -23,10 +23,30 @@
  */
 
 #import "VSDataObject.h"
+#import "VSDataObject+Private.h"
 #import "VSDataModel.h"
 
 @implementation VSDataObject
 
+- (id)init
+{
+  self = [super init];
+  if (self) {
+    [[VSDataModel sharedModel] initializeSlotsForDataObject:self];
+  }
+
+  return self;
+}
+
+- (void)dealloc
+{
+  NSUInteger i;
+  for (i = 0; i < _slotCount; i++) {
+    _slots[i] = nil;
+  }
+  free((void *)_slots);
+}
+
 - (id)copyWithZone:(NSZone *)zone
 {
   return [[VSDataModel sharedModel] copyDataObject:self withZone:zone];
@@ -62,6 +82,21 @@
   return nil;
 }
 
++ (NSArray *)indexedProperties
+{
+  return nil;
+}
+
++ (BOOL)automaticallyNotifiesObserversForKey:(NSString *)key
+{
+  /* the installed setters already notify, and persist the change when they do */
+  if ([[VSDataModel sharedModel] dataObjectClass:self hasPropertyForKey:key]) {
+    return NO;
+  }
+
+  return [super automaticallyNotifiesObserversForKey:key];
+}
+
 - (NSString *)description
 {
   return [[VSDataModel sharedModel] descriptionForDataObject:self];
@@ -123,7 +158,7 @@
 
 - (void)didChange:(NSKeyValueChange)changeKind valuesAtIndexes:(NSIndexSet *)indexes forKey:(NSString *)key
 {
-  [[VSDataModel sharedModel] dataObject:self didChangeValueForKey:key];
+  [[VSDataModel sharedModel] dataObject:self didChange:changeKind valuesAtIndexes:indexes forKey:key];
   [super didChange:changeKind valuesAtIndexes:indexes forKey:key];
 }
 
@@ -135,7 +170,7 @@
 
 - (void)didChangeValueForKey:(NSString *)key withSetMutation:(NSKeyValueSetMutationKind)mutationKind usingObjects:(NSSet *)objects
 {
-  [[VSDataModel sharedModel] dataObject:self didChangeValueForKey:key];
+  [[VSDataModel sharedModel] dataObject:self didChangeValueForKey:key withSetMutation:mutationKind usingObjects:objects];
   [super didChangeValueForKey:key withSetMutation:mutationKind usingObjects:objects];
 }
 
@@ -27,6 +27,7 @@
 #import "VSDataObject.h"
 #import "VSDataManager.h"
 #import "VSDataManager+DatabasePath.h"
+#import "VSDataManager+Query.h"
 
 #ifdef __cplusplus
 extern "C" {
@@ -34,6 +35,7 @@ extern "C" {
 
 void VSDataStoreSetDatabasePath(NSString *path);
 void VSDataStoreSetDatabaseName(NSString *name);
+void VSDataStoreSetDatabaseOptions(NSDictionary *options);
 void VSDataStoreInitializationHint(void);
 
 #ifdef __cplusplus
@@ -34,6 +34,11 @@ void VSDataStoreSetDatabaseName(NSString *name)
   [VSDataManager setDefaultDatabaseName:name];
 }
 
+void VSDataStoreSetDatabaseOptions(NSDictionary *options)
+{
+  [VSDataManager setDefaultDatabaseOptions:options];
+}
+
 void VSDataStoreInitializationHint(void)
 {
   dispatch_async(dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_BACKGROUND, 0), ^{
@@ -0,0 +1,49 @@
+/* vim: set ft=objc fenc=utf-8 sw=2 ts=2 et: */
+/*
+ * Copyright (c) 2013-2014 Chongyu Zhu <i@lembacon.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#import <Foundation/Foundation.h>
+#include "vsdb_cf.h"
+
+/*
+ * Decoding with VSLazyCollectionDecoding() turns large arrays and sets
+ * into VSLazyArray and VSLazySet, which keep their elements encoded until
+ * they are accessed. A lazy array decodes each element on its first access
+ * and finds it in O(1) through an offset index built once. A lazy set
+ * decodes all its elements on the first lookup or enumeration, since any
+ * of them may be the one asked for. Both are safe to use from any thread,
+ * like the collections they stand for. Being immutable, they are their
+ * own copies, and only a mutable copy decodes them. isDecoded tells
+ * whether any element has been decoded yet.
+ */
+FOUNDATION_EXPORT const vsdb_cflazy_t *VSLazyCollectionDecoding(void);
+
+@interface VSLazyArray : NSArray
+- (id)initWithElements:(const void *)elements size:(size_t)size count:(NSUInteger)count;
+@property (nonatomic, readonly, getter=isDecoded) BOOL decoded;
+@end
+
+@interface VSLazySet : NSSet
+- (id)initWithElements:(const void *)elements size:(size_t)size count:(NSUInteger)count;
+@property (nonatomic, readonly, getter=isDecoded) BOOL decoded;
+@end
@@ -0,0 +1,238 @@
+/* vim: set ft=objc fenc=utf-8 sw=2 ts=2 et: */
+/*
+ * Copyright (c) 2013-2014 Chongyu Zhu <i@lembacon.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#import "VSLazyCollection.h"
+#include <pthread.h>
+
+/* smaller containers cost less to decode than to keep around encoded */
+#define VSLazyCollectionThreshold 64
+
+static CFTypeRef createLazyCollection(CFTypeID typeID, const void *elements, size_t size, CFIndex count, void *context)
+{
+  if (typeID == CFArrayGetTypeID()) {
+    return CFBridgingRetain([[VSLazyArray alloc] initWithElements:elements size:size count:count]);
+  }
+  else if (typeID == CFSetGetTypeID()) {
+    return CFBridgingRetain([[VSLazySet alloc] initWithElements:elements size:size count:count]);
+  }
+
+  return NULL;
+}
+
+static const vsdb_cflazy_t lazyCollectionDecoding = {
+  VSLazyCollectionThreshold,
+  createLazyCollection,
+  NULL
+};
+
+const vsdb_cflazy_t *VSLazyCollectionDecoding(void)
+{
+  return &lazyCollectionDecoding;
+}
+
+@interface VSLazyArray () {
+@private
+  NSData *_elements;
+  NSUInteger _count;
+  size_t *_offsets;
+  CFTypeRef *_objects;
+  pthread_mutex_t _mutex;
+}
+@end
+
+@implementation VSLazyArray
+
+- (id)initWithElements:(const void *)elements size:(size_t)size count:(NSUInteger)count
+{
+  self = [super init];
+  if (self) {
+    _elements = [NSData dataWithBytes:elements length:size];
+    _count = count;
+    pthread_mutex_init(&_mutex, NULL);
+  }
+
+  return self;
+}
+
+- (void)dealloc
+{
+  if (_objects != NULL) {
+    for (NSUInteger i = 0; i < _count; i++) {
+      if (_objects[i] != NULL) {
+        CFRelease(_objects[i]);
+      }
+    }
+    free(_objects);
+  }
+  free(_offsets);
+  pthread_mutex_destroy(&_mutex);
+}
+
+- (id)copyWithZone:(NSZone *)zone
+{
+  return self;
+}
+
+- (BOOL)isDecoded
+{
+  pthread_mutex_lock(&_mutex);
+  BOOL decoded = (_objects != NULL);
+  pthread_mutex_unlock(&_mutex);
+
+  return decoded;
+}
+
+- (NSUInteger)count
+{
+  return _count;
+}
+
+- (id)objectAtIndex:(NSUInteger)index
+{
+  if (index >= _count) {
+    [NSException raise:NSRangeException format:@"index %lu beyond bounds [0 .. %lu]", (unsigned long)index, (unsigned long)_count - 1];
+  }
+
+  const void *bytes = [_elements bytes];
+  size_t size = [_elements length];
+
+  pthread_mutex_lock(&_mutex);
+
+  /* one walk over the encoded elements finds where each of them starts */
+  if (_offsets == NULL) {
+    _offsets = (size_t *)malloc(sizeof(size_t) * _count);
+    _objects = (CFTypeRef *)calloc(_count, sizeof(CFTypeRef));
+
+    size_t offset = 0;
+    for (NSUInteger i = 0; i < _count; i++) {
+      _offsets[i] = offset;
+      offset = vsdb_skip_cfelement(bytes, size, offset);
+    }
+  }
+
+  if (_objects[index] == NULL) {
+    _objects[index] = vsdb_decode_cfelement(bytes, size, _offsets[index], NULL, &lazyCollectionDecoding);
+  }
+
+  id object = (__bridge id)_objects[index];
+  pthread_mutex_unlock(&_mutex);
+
+  return object;
+}
+
+@end
+
+@interface VSLazySet () {
+@private
+  NSData *_elements;
+  NSUInteger _count;
+  NSSet *_set;
+  pthread_mutex_t _mutex;
+}
+@end
+
+@implementation VSLazySet
+
+- (id)initWithElements:(const void *)elements size:(size_t)size count:(NSUInteger)count
+{
+  self = [super init];
+  if (self) {
+    _elements = [NSData dataWithBytes:elements length:size];
+    _count = count;
+    pthread_mutex_init(&_mutex, NULL);
+  }
+
+  return self;
+}
+
+- (void)dealloc
+{
+  pthread_mutex_destroy(&_mutex);
+}
+
+- (NSSet *)_set
+{
+  pthread_mutex_lock(&_mutex);
+
+  if (_set == nil) {
+    const void *bytes = [_elements bytes];
+    size_t size = [_elements length];
+    NSMutableSet *set = [NSMutableSet setWithCapacity:_count];
+
+    size_t offset = 0;
+    for (NSUInteger i = 0; i < _count; i++) {
+      id object = CFBridgingRelease(vsdb_decode_cfelement(bytes, size, offset, &offset, &lazyCollectionDecoding));
+      [set addObject:object];
+    }
+
+    _set = [set copy];
+    _elements = nil;
+  }
+
+  NSSet *set = _set;
+  pthread_mutex_unlock(&_mutex);
+
+  return set;
+}
+
+- (id)copyWithZone:(NSZone *)zone
+{
+  return self;
+}
+
+- (id)mutableCopyWithZone:(NSZone *)zone
+{
+  return [[self _set] mutableCopyWithZone:zone];
+}
+
+- (BOOL)isDecoded
+{
+  pthread_mutex_lock(&_mutex);
+  BOOL decoded = (_set != nil);
+  pthread_mutex_unlock(&_mutex);
+
+  return decoded;
+}
+
+- (NSUInteger)count
+{
+  return _count;
+}
+
+- (id)member:(id)object
+{
+  return [[self _set] member:object];
+}
+
+- (NSEnumerator *)objectEnumerator
+{
+  return [[self _set] objectEnumerator];
+}
+
+- (NSUInteger)countByEnumeratingWithState:(NSFastEnumerationState *)state objects:(id __unsafe_unretained [])buffer count:(NSUInteger)len
+{
+  return [[self _set] countByEnumeratingWithState:state objects:buffer count:len];
+}
+
+@end
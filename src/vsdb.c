@@ -23,217 +23,1645 @@
  */
 
 #include "vsdb.h"
-#include <db.h>
-#include <fcntl.h>
+#include "vsdb_engine.h"
+#include "vsdb_wal.h"
 #include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <memory.h>
 #include <string.h>
-#include <libkern/OSAtomic.h>
+#include <strings.h>
+#include <unistd.h>
+#include <pthread.h>
 
-struct _vsdb {
+#ifndef SIZE_T_MAX
+#define SIZE_T_MAX SIZE_MAX
+#endif /* SIZE_T_MAX */
+
+#define VSDB_MAX_SHARDS 64
+#define VSDB_WAL_CHECKPOINT_SIZE (4 * 1024 * 1024)
+
+#define VSDB_BLOOM_MAGIC 0x4d4f4c42U /* "BLOM" */
+#define VSDB_BLOOM_BITS_PER_KEY 10
+#define VSDB_BLOOM_HASHES 7
+#define VSDB_BLOOM_MIN_CAPACITY 1024
+
+/*
+ * A Bloom filter over the keys of one shard, so that lookups of missing
+ * keys are answered without touching the engine. Deletes leave their
+ * bits set, which only costs a few more false positives. The filter is
+ * saved to "<shard filename>.bloom" on close, and that file is unlinked
+ * on the first put after it was loaded, so that a stale filter is never
+ * trusted after a crash: a missing file is rebuilt by scanning the shard.
+ */
+typedef struct {
+  uint8_t *bits;
+  uint64_t bit_count;
+  uint64_t count;
+  uint64_t capacity;
+  char *filename;
+  int persisted;
+  size_t queries;
+  size_t negatives;
+  size_t false_positives;
+} vsdb_bloom_t;
+
+/*
+ * Engines are not thread-safe, the BSD B-tree touches its page cache on
+ * every access, reads included, so each shard is locked exclusively.
+ * Readers and writers only run in parallel when their keys hash to
+ * different shards.
+ */
+typedef struct {
   DB *db;
-  OSSpinLock spinlock;
+  vsdb_bloom_t *bloom;
+  pthread_mutex_t mutex;
+} vsdb_shard_t;
+
+struct _vsdb {
+  const vsdb_engine_ops_t *engine;
+  vsdb_shard_t *shards;
+  unsigned int shard_count;
+  vsdb_wal_t wal;
+  char *wal_filename;
+  int wal_sync;
 };
 
-static inline vsdb_t newvsdb(DB *db)
+static inline vsdb_t newvsdb(const vsdb_engine_ops_t *engine, unsigned int shard_count)
+{
+  vsdb_t vsdb;
+  unsigned int i;
+
+  vsdb = (vsdb_t)malloc(sizeof(struct _vsdb) + sizeof(vsdb_shard_t) * shard_count);
+  vsdb->engine = engine;
+  vsdb->shards = (vsdb_shard_t *)(vsdb + 1);
+  vsdb->shard_count = shard_count;
+  vsdb->wal = NULL;
+  vsdb->wal_filename = NULL;
+  vsdb->wal_sync = 0;
+
+  for (i = 0; i < shard_count; i++) {
+    vsdb->shards[i].db = NULL;
+    vsdb->shards[i].bloom = NULL;
+    pthread_mutex_init(&vsdb->shards[i].mutex, NULL);
+  }
+
+  return vsdb;
+}
+
+static void bloom_free(vsdb_bloom_t *bloom);
+
+static inline void freevsdb(vsdb_t vsdb)
+{
+  unsigned int i;
+
+  if (vsdb != NULL) {
+    for (i = 0; i < vsdb->shard_count; i++) {
+      bloom_free(vsdb->shards[i].bloom);
+      pthread_mutex_destroy(&vsdb->shards[i].mutex);
+    }
+    free(vsdb->wal_filename);
+    free(vsdb);
+  }
+}
+
+static inline void lockshard(vsdb_shard_t *shard)
+{
+  pthread_mutex_lock(&shard->mutex);
+}
+
+static inline void unlockshard(vsdb_shard_t *shard)
+{
+  pthread_mutex_unlock(&shard->mutex);
+}
+
+static inline uint32_t hash_key(const char *key, size_t key_length)
+{
+  uint32_t hash;
+  size_t i;
+
+  /* FNV-1a */
+  hash = 2166136261U;
+  for (i = 0; i < key_length; i++) {
+    hash ^= (uint8_t)key[i];
+    hash *= 16777619U;
+  }
+
+  return hash;
+}
+
+static inline vsdb_shard_t *getshard(vsdb_t vsdb, const char *key, size_t key_length)
+{
+  if (vsdb == NULL)
+    return NULL;
+  if (vsdb->shard_count == 1)
+    return &vsdb->shards[0];
+
+  return &vsdb->shards[hash_key(key, key_length) % vsdb->shard_count];
+}
+
+static char *copy_shard_filename(const char *filename, unsigned int index)
+{
+  char *shard_filename;
+  size_t length;
+
+  length = strlen(filename) + 1 + 10 + 1;
+  shard_filename = (char *)malloc(length);
+  if (index == 0) {
+    snprintf(shard_filename, length, "%s", filename);
+  }
+  else {
+    snprintf(shard_filename, length, "%s.%u", filename, index);
+  }
+
+  return shard_filename;
+}
+
+static char *copy_bloom_filename(const char *shard_filename)
+{
+  char *bloom_filename;
+  size_t length;
+
+  length = strlen(shard_filename) + 6 + 1;
+  bloom_filename = (char *)malloc(length);
+  snprintf(bloom_filename, length, "%s.bloom", shard_filename);
+
+  return bloom_filename;
+}
+
+static inline uint64_t bloom_bit_count(uint64_t capacity)
+{
+  return (capacity * VSDB_BLOOM_BITS_PER_KEY + 63) & ~(uint64_t)63;
+}
+
+static vsdb_bloom_t *bloom_create(uint64_t capacity)
+{
+  vsdb_bloom_t *bloom;
+
+  bloom = (vsdb_bloom_t *)malloc(sizeof(vsdb_bloom_t));
+  bzero(bloom, sizeof(vsdb_bloom_t));
+  bloom->capacity = capacity;
+  bloom->bit_count = bloom_bit_count(capacity);
+  bloom->bits = (uint8_t *)calloc((size_t)(bloom->bit_count / 8), 1);
+
+  return bloom;
+}
+
+static void bloom_free(vsdb_bloom_t *bloom)
+{
+  if (bloom != NULL) {
+    free(bloom->bits);
+    free(bloom->filename);
+    free(bloom);
+  }
+}
+
+static inline void bloom_hash(const DBT *kt, uint32_t *h1, uint32_t *h2)
+{
+  uint64_t hash;
+  size_t i;
+
+  /* 64-bit FNV-1a, split for double hashing */
+  hash = 14695981039346656037ULL;
+  for (i = 0; i < kt->size; i++) {
+    hash ^= ((const uint8_t *)kt->data)[i];
+    hash *= 1099511628211ULL;
+  }
+
+  *h1 = (uint32_t)hash;
+  *h2 = (uint32_t)(hash >> 32) | 1;
+}
+
+static void bloom_add(vsdb_bloom_t *bloom, const DBT *kt)
+{
+  uint32_t h1, h2;
+  uint64_t bit;
+  int i;
+
+  bloom_hash(kt, &h1, &h2);
+  for (i = 0; i < VSDB_BLOOM_HASHES; i++) {
+    bit = ((uint64_t)h1 + (uint64_t)h2 * i) % bloom->bit_count;
+    bloom->bits[bit >> 3] |= (uint8_t)(1 << (bit & 7));
+  }
+
+  bloom->count++;
+}
+
+static int bloom_may_contain(vsdb_bloom_t *bloom, const DBT *kt)
+{
+  uint32_t h1, h2;
+  uint64_t bit;
+  int i;
+
+  bloom_hash(kt, &h1, &h2);
+  for (i = 0; i < VSDB_BLOOM_HASHES; i++) {
+    bit = ((uint64_t)h1 + (uint64_t)h2 * i) % bloom->bit_count;
+    if ((bloom->bits[bit >> 3] & (1 << (bit & 7))) == 0)
+      return 0;
+  }
+
+  return 1;
+}
+
+static vsdb_bloom_t *bloom_load(const char *bloom_filename)
+{
+  vsdb_bloom_t *bloom;
+  uint32_t header[2];
+  uint64_t sizes[3];
+  FILE *fp;
+
+  if ((fp = fopen(bloom_filename, "rb")) == NULL)
+    return NULL;
+
+  bloom = NULL;
+  if (fread(header, sizeof(header), 1, fp) != 1 || fread(sizes, sizeof(sizes), 1, fp) != 1)
+    goto cleanup;
+  if (header[0] != VSDB_BLOOM_MAGIC || header[1] != VSDB_BLOOM_HASHES)
+    goto cleanup;
+  if (sizes[2] < VSDB_BLOOM_MIN_CAPACITY || sizes[0] != bloom_bit_count(sizes[2]))
+    goto cleanup;
+
+  bloom = bloom_create(sizes[2]);
+  bloom->count = sizes[1];
+  if (fread(bloom->bits, 1, (size_t)(bloom->bit_count / 8), fp) != bloom->bit_count / 8) {
+    bloom_free(bloom);
+    bloom = NULL;
+  }
+
+cleanup:
+  fclose(fp);
+  return bloom;
+}
+
+static int bloom_save(vsdb_bloom_t *bloom)
+{
+  uint32_t header[2];
+  uint64_t sizes[3];
+  FILE *fp;
+  int ret;
+
+  if ((fp = fopen(bloom->filename, "wb")) == NULL)
+    return -1;
+
+  header[0] = VSDB_BLOOM_MAGIC;
+  header[1] = VSDB_BLOOM_HASHES;
+  sizes[0] = bloom->bit_count;
+  sizes[1] = bloom->count;
+  sizes[2] = bloom->capacity;
+
+  ret = (fwrite(header, sizeof(header), 1, fp) == 1 &&
+         fwrite(sizes, sizeof(sizes), 1, fp) == 1 &&
+         fwrite(bloom->bits, 1, (size_t)(bloom->bit_count / 8), fp) == bloom->bit_count / 8) ? 0 : -1;
+  if (fclose(fp) != 0)
+    ret = -1;
+
+  if (ret != 0) {
+    unlink(bloom->filename);
+  }
+  else {
+    bloom->persisted = 1;
+  }
+
+  return ret;
+}
+
+/* scans the whole shard twice, sizing the filter for twice its keys */
+static vsdb_bloom_t *bloom_rebuild(DB *db)
+{
+  vsdb_bloom_t *bloom;
+  uint64_t count;
+  DBT kt, dt;
+  int ret;
+
+  count = 0;
+  for (ret = db->seq(db, &kt, &dt, R_FIRST); ret == 0; ret = db->seq(db, &kt, &dt, R_NEXT))
+    count++;
+  if (ret < 0)
+    return NULL;
+
+  bloom = bloom_create((count * 2 < VSDB_BLOOM_MIN_CAPACITY) ? VSDB_BLOOM_MIN_CAPACITY : count * 2);
+  for (ret = db->seq(db, &kt, &dt, R_FIRST); ret == 0; ret = db->seq(db, &kt, &dt, R_NEXT))
+    bloom_add(bloom, &kt);
+
+  if (ret < 0) {
+    bloom_free(bloom);
+    return NULL;
+  }
+
+  return bloom;
+}
+
+static int unlink_bloom(const char *shard_filename)
+{
+  char *bloom_filename;
+  int ret;
+
+  bloom_filename = copy_bloom_filename(shard_filename);
+  ret = (unlink(bloom_filename) != 0 && access(bloom_filename, F_OK) == 0) ? -1 : 0;
+  free(bloom_filename);
+
+  return ret;
+}
+
+static int open_bloom(vsdb_shard_t *shard, const char *shard_filename)
+{
+  char *bloom_filename;
+
+  bloom_filename = copy_bloom_filename(shard_filename);
+  if ((shard->bloom = bloom_load(bloom_filename)) != NULL) {
+    shard->bloom->persisted = 1;
+  }
+  else if ((shard->bloom = bloom_rebuild(shard->db)) == NULL) {
+    free(bloom_filename);
+    return -1;
+  }
+
+  shard->bloom->filename = bloom_filename;
+  return 0;
+}
+
+/* must hold the shard lock */
+static void bloom_note_put(vsdb_shard_t *shard, const DBT *kt)
+{
+  vsdb_bloom_t *bloom, *grown;
+
+  if ((bloom = shard->bloom) == NULL)
+    return;
+
+  if (bloom->persisted) {
+    unlink(bloom->filename);
+    bloom->persisted = 0;
+  }
+
+  bloom_add(bloom, kt);
+
+  /* overwrites count too, so this overestimates, and the rebuild corrects it */
+  if (bloom->count > bloom->capacity) {
+    if ((grown = bloom_rebuild(shard->db)) == NULL)
+      return;
+
+    grown->filename = bloom->filename;
+    grown->queries = bloom->queries;
+    grown->negatives = bloom->negatives;
+    grown->false_positives = bloom->false_positives;
+    bloom->filename = NULL;
+    bloom_free(bloom);
+    shard->bloom = grown;
+  }
+}
+
+static inline int shard_put(vsdb_shard_t *shard, DBT *kt, const DBT *dt)
+{
+  int ret;
+
+  if ((ret = shard->db->put(shard->db, kt, dt, 0)) == 0)
+    bloom_note_put(shard, kt);
+
+  return ret;
+}
+
+static char *copy_wal_filename(const char *filename)
+{
+  char *wal_filename;
+  size_t length;
+
+  length = strlen(filename) + 4 + 1;
+  wal_filename = (char *)malloc(length);
+  snprintf(wal_filename, length, "%s.wal", filename);
+
+  return wal_filename;
+}
+
+static int shard_exists(const char *filename, unsigned int index)
+{
+  char *shard_filename;
+  int ret;
+
+  shard_filename = copy_shard_filename(filename, index);
+  ret = (access(shard_filename, F_OK) == 0);
+  free(shard_filename);
+
+  return ret;
+}
+
+static inline const vsdb_engine_ops_t *get_engine(const vsdb_options_t *options)
+{
+  if (options == NULL)
+    return &vsdb_btree_engine;
+
+  switch (options->engine) {
+  case vsdb_engine_btree:
+    return &vsdb_btree_engine;
+  case vsdb_engine_lsm:
+    return &vsdb_lsm_engine;
+  default:
+    return NULL;
+  }
+}
+
+static inline unsigned int get_shard_count(const vsdb_options_t *options)
+{
+  if (options == NULL || options->shards <= 1)
+    return 1;
+  return options->shards;
+}
+
+static int sync_shards(vsdb_t vsdb)
+{
+  vsdb_shard_t *shard;
+  unsigned int i;
+  int ret;
+
+  ret = 0;
+  for (i = 0; i < vsdb->shard_count; i++) {
+    shard = &vsdb->shards[i];
+
+    lockshard(shard);
+    if (shard->db->sync(shard->db, 0) != 0) {
+      ret = -1;
+    }
+    unlockshard(shard);
+  }
+
+  return ret;
+}
+
+static int replay_wal_record(const void *payload, size_t payload_size, void *context);
+static int checkpoint_wal(vsdb_t vsdb);
+static int checkpoint_wal_in_background(void *context);
+
+vsdb_t vsdb_open(const char *filename)
+{
+  return vsdb_open2(filename, NULL);
+}
+
+vsdb_t vsdb_open2(const char *filename, const vsdb_options_t *options)
+{
+  vsdb_t vsdb;
+  const vsdb_engine_ops_t *engine;
+  unsigned int shard_count, i;
+  char *shard_filename, *wal_filename;
+  int ret;
+
+  if (filename == NULL)
+    return NULL;
+  if ((engine = get_engine(options)) == NULL)
+    return NULL;
+  if ((shard_count = get_shard_count(options)) > VSDB_MAX_SHARDS)
+    return NULL;
+
+  /* keys are placed by hash, reopening with another shard count would lose them */
+  if (shard_exists(filename, shard_count))
+    return NULL;
+  if (shard_count > 1 && shard_exists(filename, 0) && !shard_exists(filename, shard_count - 1))
+    return NULL;
+
+  vsdb = newvsdb(engine, shard_count);
+  for (i = 0; i < shard_count; i++) {
+    shard_filename = copy_shard_filename(filename, i);
+    vsdb->shards[i].db = engine->open(shard_filename);
+
+    if (vsdb->shards[i].db == NULL) {
+      free(shard_filename);
+      vsdb_close(vsdb);
+      return NULL;
+    }
+
+    if (options != NULL && options->bloom) {
+      ret = open_bloom(&vsdb->shards[i], shard_filename);
+    }
+    else {
+      /* writes made without the filter would leave it stale */
+      ret = unlink_bloom(shard_filename);
+    }
+    free(shard_filename);
+
+    if (ret != 0) {
+      vsdb_close(vsdb);
+      return NULL;
+    }
+  }
+
+  /* writes logged before a crash, only dropped once the B-trees hold them */
+  wal_filename = copy_wal_filename(filename);
+  ret = vsdb_wal_replay(wal_filename, replay_wal_record, vsdb);
+  if (ret == 0)
+    ret = sync_shards(vsdb);
+  if (ret == 0)
+    ret = vsdb_wal_unlink(wal_filename);
+
+  if (ret == 0 && options != NULL && options->wal) {
+    if ((vsdb->wal = vsdb_wal_open(wal_filename)) == NULL) {
+      ret = -1;
+    }
+    else {
+      vsdb->wal_filename = strdup(wal_filename);
+      vsdb->wal_sync = options->wal_sync;
+      vsdb_wal_start_checkpointer(vsdb->wal,
+                                  (options->wal_checkpoint_size > 0) ? options->wal_checkpoint_size : VSDB_WAL_CHECKPOINT_SIZE,
+                                  checkpoint_wal_in_background, vsdb);
+    }
+  }
+  free(wal_filename);
+
+  if (ret != 0) {
+    vsdb_close(vsdb);
+    return NULL;
+  }
+
+  return vsdb;
+}
+
+void vsdb_close(vsdb_t vsdb)
+{
+  DB *db;
+  unsigned int i;
+  int ret;
+
+  if (vsdb == NULL)
+    return;
+
+  if (vsdb->wal != NULL) {
+    vsdb_wal_stop_checkpointer(vsdb->wal);
+
+    /* whatever a failed checkpoint leaves behind is replayed on next open */
+    ret = checkpoint_wal(vsdb);
+    vsdb_wal_close(vsdb->wal);
+    if (ret == 0)
+      vsdb_wal_unlink(vsdb->wal_filename);
+  }
+
+  for (i = 0; i < vsdb->shard_count; i++) {
+    if ((db = vsdb->shards[i].db) != NULL &&
+        db->close(db) == 0 &&
+        vsdb->shards[i].bloom != NULL &&
+        !vsdb->shards[i].bloom->persisted) {
+      bloom_save(vsdb->shards[i].bloom);
+    }
+  }
+
+  freevsdb(vsdb);
+}
+
+vsdb_ret_t vsdb_unlink(const char *filename, const vsdb_options_t *options)
+{
+  const vsdb_engine_ops_t *engine;
+  unsigned int shard_count, i;
+  char *shard_filename, *wal_filename;
+  vsdb_ret_t vsdb_ret;
+
+  if (filename == NULL)
+    return vsdb_failed;
+  if ((engine = get_engine(options)) == NULL)
+    return vsdb_failed;
+
+  vsdb_ret = vsdb_okay;
+  shard_count = get_shard_count(options);
+
+  for (i = 0; i < shard_count; i++) {
+    shard_filename = copy_shard_filename(filename, i);
+    if (engine->unlink(shard_filename) != 0 || unlink_bloom(shard_filename) != 0) {
+      vsdb_ret = vsdb_failed;
+    }
+    free(shard_filename);
+  }
+
+  wal_filename = copy_wal_filename(filename);
+  if (vsdb_wal_unlink(wal_filename) != 0)
+    vsdb_ret = vsdb_failed;
+  free(wal_filename);
+
+  return vsdb_ret;
+}
+
+vsdb_ret_t vsdb_sync(vsdb_t vsdb)
+{
+  int ret;
+
+  if (vsdb == NULL)
+    return vsdb_failed;
+
+  /* with a log, the B-trees are left to the checkpoint */
+  if (vsdb->wal != NULL) {
+    ret = vsdb_wal_commit(vsdb->wal, 0);
+  }
+  else {
+    ret = sync_shards(vsdb);
+  }
+
+  return (ret == 0) ? vsdb_okay : vsdb_failed;
+}
+
+vsdb_ret_t vsdb_get_stats(vsdb_t vsdb, vsdb_stats_t *stats)
+{
+  vsdb_shard_t *shard;
+  unsigned int i;
+
+  if (vsdb == NULL || stats == NULL)
+    return vsdb_failed;
+
+  bzero(stats, sizeof(vsdb_stats_t));
+  for (i = 0; i < vsdb->shard_count; i++) {
+    shard = &vsdb->shards[i];
+
+    lockshard(shard);
+    if (shard->bloom != NULL) {
+      stats->bloom_queries += shard->bloom->queries;
+      stats->bloom_negatives += shard->bloom->negatives;
+      stats->bloom_false_positives += shard->bloom->false_positives;
+    }
+    unlockshard(shard);
+  }
+
+  if (stats->bloom_negatives + stats->bloom_false_positives > 0) {
+    stats->bloom_false_positive_rate = (double)stats->bloom_false_positives /
+                                       (double)(stats->bloom_negatives + stats->bloom_false_positives);
+  }
+
+  return vsdb_okay;
+}
+
+void vsdb_free(void *ptr)
+{
+  if (ptr != NULL) {
+    free(ptr);
+  }
+}
+
+void vsdb_free2(void **ptrs, size_t count)
+{
+  size_t i;
+
+  if (ptrs == NULL)
+    return;
+
+  for (i = 0; i < count; i++) {
+    if (ptrs[i] != NULL)
+      free(ptrs[i]);
+  }
+
+  free(ptrs);
+}
+
+static inline void dup_dbt(DBT *dst, const DBT *src)
+{
+  dst->size = src->size;
+  dst->data = malloc(dst->size);
+  memcpy(dst->data, src->data, dst->size);
+}
+
+vsdb_ret_t vsdb_get_nocopy(vsdb_t vsdb, const char *key, size_t key_length,
+                                        vsdb_reader_t reader, void *context)
+{
+  vsdb_shard_t *shard;
+  DBT kt, dt;
+  int ret;
+
+  if (vsdb == NULL)
+    goto failed;
+  if (key == NULL || reader == NULL)
+    goto failed;
+  if (key_length == SIZE_T_MAX)
+    key_length = strlen(key);
+  if (key_length == 0)
+    goto failed;
+
+  kt.data = (void *)key;
+  kt.size = key_length;
+  shard = getshard(vsdb, key, key_length);
+
+  lockshard(shard);
+  if (shard->bloom != NULL && !bloom_may_contain(shard->bloom, &kt)) {
+    ret = 1;
+    shard->bloom->negatives++;
+  }
+  else if ((ret = shard->db->get(shard->db, &kt, &dt, 0)) == 0) {
+    reader(dt.data, dt.size, context);
+  }
+  else if (ret > 0 && shard->bloom != NULL) {
+    shard->bloom->false_positives++;
+  }
+  if (shard->bloom != NULL)
+    shard->bloom->queries++;
+  unlockshard(shard);
+
+  if (ret == 0) {
+    return vsdb_okay;
+  }
+
+failed:
+  return vsdb_failed;
+}
+
+static void dup_value(const void *value, size_t value_size, void *context)
+{
+  DBT dt;
+
+  dt.data = (void *)value;
+  dt.size = value_size;
+  dup_dbt((DBT *)context, &dt);
+}
+
+vsdb_ret_t vsdb_get(vsdb_t vsdb, const char *key, size_t key_length,
+                                 const void **value, size_t *value_size)
+{
+  DBT newdt;
+
+  if (value == NULL || value_size == NULL)
+    goto failed;
+
+  if (vsdb_get_nocopy(vsdb, key, key_length, dup_value, &newdt) == vsdb_okay) {
+    *value = newdt.data;
+    *value_size = newdt.size;
+    return vsdb_okay;
+  }
+
+failed:
+  if (value != NULL)
+    *value = NULL;
+  if (value_size != NULL)
+    *value_size = 0;
+  return vsdb_failed;
+}
+
+vsdb_ret_t vsdb_set(vsdb_t vsdb, const char *key, size_t key_length,
+                                 const void *value, size_t value_size)
+{
+  vsdb_shard_t *shard;
+  vsdb_batch_t batch;
+  vsdb_ret_t vsdb_ret;
+  DBT kt, dt;
+  int ret;
+
+  if (vsdb == NULL)
+    goto failed;
+  if (key == NULL)
+    goto failed;
+  if (key_length == SIZE_T_MAX)
+    key_length = strlen(key);
+  if (key_length == 0)
+    goto failed;
+
+  /* logged writes take the batch path, which knows how to undo them */
+  if (vsdb->wal != NULL) {
+    batch = vsdb_batch_create();
+    if (vsdb_batch_put(batch, key, key_length, value, value_size) == vsdb_okay) {
+      vsdb_ret = vsdb_batch_commit(vsdb, batch);
+    }
+    else {
+      vsdb_ret = vsdb_failed;
+    }
+    vsdb_batch_free(batch);
+
+    return vsdb_ret;
+  }
+
+  kt.data = (void *)key;
+  kt.size = key_length;
+  shard = getshard(vsdb, key, key_length);
+
+  if (value != NULL) {
+    dt.data = (void *)value;
+    dt.size = value_size;
+
+    lockshard(shard);
+    ret = shard_put(shard, &kt, &dt);
+    unlockshard(shard);
+
+    if (ret != 0) {
+      goto failed;
+    }
+  }
+  else {
+    lockshard(shard);
+    ret = shard->db->del(shard->db, &kt, 0);
+    unlockshard(shard);
+
+    if (ret != 0) {
+      goto failed;
+    }
+  }
+
+  return vsdb_okay;
+
+failed:
+  return vsdb_failed;
+}
+
+#define VSDB_CURSOR_CHUNK_RECORDS 256
+#define VSDB_CURSOR_CHUNK_BYTES (64 * 1024)
+
+/*
+ * A cursor never holds a shard lock between calls. Every shard is read
+ * in chunks of up to VSDB_CURSOR_CHUNK_RECORDS records, copied into a
+ * buffer owned by the cursor, and the next chunk is located again from
+ * the last key seen. Shards are merged back into key order on the fly.
+ */
+typedef struct {
+  uint8_t *bytes;
+  size_t size;
+  size_t capacity;
+  size_t offset;
+  DBT key;
+  DBT value;
+  uint8_t *last_key;
+  size_t last_key_size;
+  size_t last_key_capacity;
+  int resumed;
+  int exhausted;
+  int loaded;
+} vsdb_cursor_head_t;
+
+struct _vsdb_cursor {
+  vsdb_t vsdb;
+  DBT start;
+  DBT end;
+  DBT pattern;
+  int prefixed;
+  int globbed;
+  int reversed;
+  int keys_only;
+  int started;
+  int error;
+  unsigned int current;
+  vsdb_cursor_head_t *heads;
+};
+
+static inline int compare_dbt(const DBT *a, const DBT *b)
+{
+  int ret;
+
+  if ((ret = memcmp(a->data, b->data, (a->size < b->size) ? a->size : b->size)) != 0)
+    return ret;
+  if (a->size == b->size)
+    return 0;
+  return (a->size < b->size) ? -1 : 1;
+}
+
+static inline int cursor_accepts(vsdb_cursor_t cursor, const DBT *kt)
+{
+  /* walking backwards, the end bound is where the walk starts */
+  if (cursor->reversed) {
+    return cursor->start.size == 0 || compare_dbt(kt, &cursor->start) >= 0;
+  }
+
+  if (cursor->prefixed) {
+    return kt->size >= cursor->start.size &&
+           memcmp(kt->data, cursor->start.data, cursor->start.size) == 0;
+  }
+
+  if (cursor->end.size == 0)
+    return 1;
+  return compare_dbt(kt, &cursor->end) < 0;
+}
+
+/* the bracket expression at pattern[*p], moving *p past it, -1 if it is not closed */
+static int glob_match_class(const char *pattern, size_t pattern_length, size_t *p, uint8_t c)
+{
+  size_t i, first;
+  uint8_t lo, hi;
+  int negated, matched;
+
+  i = *p + 1;
+  negated = 0;
+  if (i < pattern_length && (pattern[i] == '!' || pattern[i] == '^')) {
+    negated = 1;
+    i++;
+  }
+
+  /* a leading ']' is literal */
+  matched = 0;
+  first = i;
+  while (i < pattern_length && (pattern[i] != ']' || i == first)) {
+    lo = (uint8_t)pattern[i];
+    if (i + 2 < pattern_length && pattern[i + 1] == '-' && pattern[i + 2] != ']') {
+      hi = (uint8_t)pattern[i + 2];
+      i += 3;
+    }
+    else {
+      hi = lo;
+      i++;
+    }
+
+    if (c >= lo && c <= hi)
+      matched = 1;
+  }
+
+  if (i >= pattern_length)
+    return -1;
+
+  *p = i + 1;
+  return matched != negated;
+}
+
+/*
+ * '*' matches any run of bytes, '?' any single byte and [...] any byte
+ * of the class, with ranges and '!' or '^' negation. There are no
+ * escapes, and an unclosed '[' is literal. Backtracks to the last '*'
+ * only, so it runs in O(pattern * string) at worst.
+ */
+static int glob_match(const char *pattern, size_t pattern_length, const char *string, size_t string_length)
+{
+  size_t p, s, star_p, star_s, next;
+  int ret;
+
+  p = 0;
+  s = 0;
+  star_p = SIZE_T_MAX;
+  star_s = 0;
+
+  while (s < string_length) {
+    if (p < pattern_length) {
+      switch (pattern[p]) {
+      case '*':
+        star_p = ++p;
+        star_s = s;
+        continue;
+      case '?':
+        p++;
+        s++;
+        continue;
+      case '[':
+        next = p;
+        if ((ret = glob_match_class(pattern, pattern_length, &next, (uint8_t)string[s])) > 0) {
+          p = next;
+          s++;
+          continue;
+        }
+        if (ret < 0 && string[s] == '[') {
+          p++;
+          s++;
+          continue;
+        }
+        break;
+      default:
+        if (pattern[p] == string[s]) {
+          p++;
+          s++;
+          continue;
+        }
+        break;
+      }
+    }
+
+    if (star_p == SIZE_T_MAX)
+      return 0;
+
+    p = star_p;
+    s = ++star_s;
+  }
+
+  while (p < pattern_length && pattern[p] == '*')
+    p++;
+
+  return p == pattern_length;
+}
+
+static inline int cursor_matches(vsdb_cursor_t cursor, const DBT *kt)
+{
+  /* cursor_accepts() already checked the literal prefix */
+  return glob_match((const char *)cursor->pattern.data, cursor->pattern.size,
+                    (const char *)kt->data + cursor->start.size, kt->size - cursor->start.size);
+}
+
+static inline void reserve_bytes(uint8_t **bytes, size_t *capacity, size_t size)
+{
+  if (size <= *capacity)
+    return;
+
+  if (*capacity == 0)
+    *capacity = 256;
+  while (size > *capacity)
+    *capacity <<= 1;
+
+  *bytes = (uint8_t *)realloc(*bytes, *capacity);
+}
+
+/* the last key before bound, or the very last key if bound is NULL */
+static int seek_before(DB *db, const DBT *bound, DBT *kt, DBT *dt)
+{
+  int ret;
+
+  if (bound != NULL) {
+    *kt = *bound;
+    if ((ret = db->seq(db, kt, dt, R_CURSOR)) != 1)
+      return (ret == 0) ? db->seq(db, kt, dt, R_PREV) : ret;
+  }
+
+  /* nothing at or after bound */
+  return db->seq(db, kt, dt, R_LAST);
+}
+
+static void cursor_fill(vsdb_cursor_t cursor, vsdb_cursor_head_t *head, vsdb_shard_t *shard)
+{
+  DB *db;
+  DBT kt, dt, last;
+  size_t count, offset, value_size;
+  u_int step;
+  int ret;
+
+  head->size = 0;
+  head->offset = 0;
+  if (head->exhausted)
+    return;
+
+  db = shard->db;
+  step = cursor->reversed ? R_PREV : R_NEXT;
+  lockshard(shard);
+
+  if (cursor->reversed) {
+    last.data = head->last_key;
+    last.size = head->last_key_size;
+    if (head->resumed) {
+      ret = seek_before(db, &last, &kt, &dt);
+    }
+    else {
+      ret = seek_before(db, (cursor->end.size > 0) ? &cursor->end : NULL, &kt, &dt);
+    }
+  }
+  else if (head->resumed) {
+    last.data = head->last_key;
+    last.size = head->last_key_size;
+    kt = last;
+    if ((ret = db->seq(db, &kt, &dt, R_CURSOR)) == 0 && compare_dbt(&kt, &last) == 0) {
+      ret = db->seq(db, &kt, &dt, R_NEXT);
+    }
+  }
+  else if (cursor->start.size > 0) {
+    kt = cursor->start;
+    ret = db->seq(db, &kt, &dt, R_CURSOR);
+  }
+  else {
+    ret = db->seq(db, &kt, &dt, R_FIRST);
+  }
+
+  offset = 0;
+  count = 0;
+  while (ret == 0) {
+    if (!cursor_accepts(cursor, &kt)) {
+      ret = 1;
+      break;
+    }
+
+    /* rejected records are never copied */
+    if (cursor->globbed && !cursor_matches(cursor, &kt)) {
+      ret = db->seq(db, &kt, &dt, step);
+      continue;
+    }
+
+    if (count == VSDB_CURSOR_CHUNK_RECORDS || head->size >= VSDB_CURSOR_CHUNK_BYTES)
+      break;
+
+    /* key-only cursors hand out every value as empty */
+    value_size = cursor->keys_only ? 0 : dt.size;
+
+    offset = head->size;
+    reserve_bytes(&head->bytes, &head->capacity, head->size + sizeof(size_t) * 2 + kt.size + value_size);
+    memcpy(head->bytes + head->size, &kt.size, sizeof(size_t));
+    memcpy(head->bytes + head->size + sizeof(size_t), &value_size, sizeof(size_t));
+    memcpy(head->bytes + head->size + sizeof(size_t) * 2, kt.data, kt.size);
+    if (value_size > 0)
+      memcpy(head->bytes + head->size + sizeof(size_t) * 2 + kt.size, dt.data, value_size);
+    head->size += sizeof(size_t) * 2 + kt.size + value_size;
+    count++;
+
+    ret = db->seq(db, &kt, &dt, step);
+  }
+
+  unlockshard(shard);
+
+  if (ret != 0) {
+    head->exhausted = 1;
+    if (ret < 0)
+      cursor->error = 1;
+  }
+
+  if (head->size > 0) {
+    memcpy(&kt.size, head->bytes + offset, sizeof(size_t));
+    reserve_bytes(&head->last_key, &head->last_key_capacity, kt.size);
+    memcpy(head->last_key, head->bytes + offset + sizeof(size_t) * 2, kt.size);
+    head->last_key_size = kt.size;
+    head->resumed = 1;
+  }
+}
+
+static void cursor_advance(vsdb_cursor_t cursor, unsigned int index)
+{
+  vsdb_cursor_head_t *head;
+
+  head = &cursor->heads[index];
+  if (head->offset >= head->size) {
+    cursor_fill(cursor, head, &cursor->vsdb->shards[index]);
+  }
+
+  if (head->offset >= head->size) {
+    head->loaded = 0;
+    return;
+  }
+
+  memcpy(&head->key.size, head->bytes + head->offset, sizeof(size_t));
+  memcpy(&head->value.size, head->bytes + head->offset + sizeof(size_t), sizeof(size_t));
+  head->key.data = head->bytes + head->offset + sizeof(size_t) * 2;
+  head->value.data = (uint8_t *)head->key.data + head->key.size;
+  head->offset += sizeof(size_t) * 2 + head->key.size + head->value.size;
+  head->loaded = 1;
+}
+
+static vsdb_cursor_t newcursor(vsdb_t vsdb, const char *start, size_t start_length,
+                                            const char *end, size_t end_length,
+                                            const char *pattern, size_t pattern_length,
+                                            int prefixed)
+{
+  vsdb_cursor_t cursor;
+  size_t heads_size;
+
+  if (vsdb == NULL)
+    return NULL;
+  if (start == NULL)
+    start_length = 0;
+  else if (start_length == SIZE_T_MAX)
+    start_length = strlen(start);
+  if (end == NULL)
+    end_length = 0;
+  else if (end_length == SIZE_T_MAX)
+    end_length = strlen(end);
+  if (pattern == NULL)
+    pattern_length = 0;
+
+  heads_size = sizeof(vsdb_cursor_head_t) * vsdb->shard_count;
+  cursor = (vsdb_cursor_t)malloc(sizeof(struct _vsdb_cursor) + heads_size + start_length + end_length + pattern_length);
+  bzero(cursor, sizeof(struct _vsdb_cursor) + heads_size);
+  cursor->vsdb = vsdb;
+  cursor->prefixed = prefixed;
+  cursor->globbed = (pattern != NULL);
+  cursor->heads = (vsdb_cursor_head_t *)(cursor + 1);
+
+  cursor->start.data = (char *)cursor->heads + heads_size;
+  cursor->start.size = start_length;
+  if (start_length > 0)
+    memcpy(cursor->start.data, start, start_length);
+
+  cursor->end.data = (char *)cursor->start.data + start_length;
+  cursor->end.size = end_length;
+  if (end_length > 0)
+    memcpy(cursor->end.data, end, end_length);
+
+  cursor->pattern.data = (char *)cursor->end.data + end_length;
+  cursor->pattern.size = pattern_length;
+  if (pattern_length > 0)
+    memcpy(cursor->pattern.data, pattern, pattern_length);
+
+  return cursor;
+}
+
+vsdb_cursor_t vsdb_cursor_open(vsdb_t vsdb, const char *prefix, size_t prefix_length)
+{
+  return vsdb_cursor_open2(vsdb, prefix, prefix_length, 0);
+}
+
+vsdb_cursor_t vsdb_cursor_open2(vsdb_t vsdb, const char *prefix, size_t prefix_length, int keys_only)
+{
+  vsdb_cursor_t cursor;
+
+  if ((cursor = newcursor(vsdb, prefix, prefix_length, NULL, 0, NULL, 0, 1)) != NULL)
+    cursor->keys_only = keys_only;
+
+  return cursor;
+}
+
+vsdb_cursor_t vsdb_cursor_open_range(vsdb_t vsdb, const char *start, size_t start_length,
+                                                  const char *end, size_t end_length)
+{
+  return newcursor(vsdb, start, start_length, end, end_length, NULL, 0, 0);
+}
+
+vsdb_cursor_t vsdb_cursor_open_range2(vsdb_t vsdb, const char *start, size_t start_length,
+                                                   const char *end, size_t end_length,
+                                                   int reverse)
+{
+  vsdb_cursor_t cursor;
+
+  if ((cursor = newcursor(vsdb, start, start_length, end, end_length, NULL, 0, 0)) != NULL)
+    cursor->reversed = reverse;
+
+  return cursor;
+}
+
+vsdb_cursor_t vsdb_cursor_open_glob(vsdb_t vsdb, const char *glob, size_t glob_length)
+{
+  return vsdb_cursor_open_glob2(vsdb, glob, glob_length, 0);
+}
+
+vsdb_cursor_t vsdb_cursor_open_glob2(vsdb_t vsdb, const char *glob, size_t glob_length, int keys_only)
+{
+  vsdb_cursor_t cursor;
+  size_t prefix_length;
+
+  if (glob == NULL)
+    return NULL;
+  if (glob_length == SIZE_T_MAX)
+    glob_length = strlen(glob);
+  if (glob_length == 0)
+    return NULL;
+
+  /* only keys starting with the literal prefix are visited */
+  for (prefix_length = 0; prefix_length < glob_length; prefix_length++) {
+    if (glob[prefix_length] == '*' || glob[prefix_length] == '?' || glob[prefix_length] == '[')
+      break;
+  }
+
+  /* a trailing '*' alone is a plain prefix scan */
+  if (prefix_length == glob_length - 1 && glob[prefix_length] == '*') {
+    cursor = newcursor(vsdb, glob, prefix_length, NULL, 0, NULL, 0, 1);
+  }
+  else {
+    cursor = newcursor(vsdb, glob, prefix_length, NULL, 0,
+                       glob + prefix_length, glob_length - prefix_length, 1);
+  }
+
+  if (cursor != NULL)
+    cursor->keys_only = keys_only;
+
+  return cursor;
+}
+
+void vsdb_cursor_close(vsdb_cursor_t cursor)
 {
-  vsdb_t vsdb;
-  vsdb = (vsdb_t)malloc(sizeof(struct _vsdb));
-  vsdb->db = db;
-  vsdb->spinlock = OS_SPINLOCK_INIT;
-  return vsdb;
+  unsigned int i;
+
+  if (cursor != NULL) {
+    for (i = 0; i < cursor->vsdb->shard_count; i++) {
+      free(cursor->heads[i].bytes);
+      free(cursor->heads[i].last_key);
+    }
+    free(cursor);
+  }
 }
 
-static inline void freevsdb(vsdb_t vsdb)
+vsdb_ret_t vsdb_cursor_next(vsdb_cursor_t cursor, const char **key, size_t *key_length,
+                                                  const void **value, size_t *value_size)
 {
-  if (vsdb != NULL) {
-    free(vsdb);
+  vsdb_cursor_head_t *head;
+  unsigned int i, current;
+
+  if (cursor == NULL)
+    goto failed;
+  if (key == NULL || key_length == NULL || value == NULL || value_size == NULL)
+    goto failed;
+
+  if (cursor->started) {
+    cursor_advance(cursor, cursor->current);
+  }
+  else {
+    cursor->started = 1;
+    for (i = 0; i < cursor->vsdb->shard_count; i++) {
+      cursor_advance(cursor, i);
+    }
   }
+
+  head = NULL;
+  current = 0;
+  for (i = 0; i < cursor->vsdb->shard_count; i++) {
+    if (cursor->heads[i].loaded &&
+        (head == NULL || (cursor->reversed ? compare_dbt(&cursor->heads[i].key, &head->key) > 0
+                                           : compare_dbt(&cursor->heads[i].key, &head->key) < 0))) {
+      head = &cursor->heads[i];
+      current = i;
+    }
+  }
+
+  if (head == NULL)
+    goto failed;
+
+  cursor->current = current;
+  *key = (const char *)head->key.data;
+  *key_length = head->key.size;
+  *value = head->value.data;
+  *value_size = head->value.size;
+  return vsdb_okay;
+
+failed:
+  if (key != NULL)
+    *key = NULL;
+  if (key_length != NULL)
+    *key_length = 0;
+  if (value != NULL)
+    *value = NULL;
+  if (value_size != NULL)
+    *value_size = 0;
+  return vsdb_failed;
 }
 
-static inline void lockdb(vsdb_t vsdb)
+/*
+ * Batches are packed as [key_length][value_size][key][value] records,
+ * a value_size of SIZE_T_MAX marks a delete.
+ */
+struct _vsdb_batch {
+  uint8_t *bytes;
+  size_t size;
+  size_t capacity;
+  size_t count;
+};
+
+static inline size_t batch_record_at(vsdb_batch_t batch, size_t offset, DBT *kt, DBT *dt)
 {
-  OSSpinLockLock(&vsdb->spinlock);
+  memcpy(&kt->size, batch->bytes + offset, sizeof(size_t));
+  memcpy(&dt->size, batch->bytes + offset + sizeof(size_t), sizeof(size_t));
+  kt->data = batch->bytes + offset + sizeof(size_t) * 2;
+  dt->data = (uint8_t *)kt->data + kt->size;
+
+  return offset + sizeof(size_t) * 2 + kt->size + ((dt->size == SIZE_T_MAX) ? 0 : dt->size);
 }
 
-static inline void unlockdb(vsdb_t vsdb)
+static void batch_append(vsdb_batch_t batch, const void *key, size_t key_length,
+                                             const void *value, size_t value_size)
 {
-  OSSpinLockUnlock(&vsdb->spinlock);
+  size_t record_size;
+
+  record_size = sizeof(size_t) * 2 + key_length + ((value == NULL) ? 0 : value_size);
+  if (value == NULL)
+    value_size = SIZE_T_MAX;
+
+  reserve_bytes(&batch->bytes, &batch->capacity, batch->size + record_size);
+  memcpy(batch->bytes + batch->size, &key_length, sizeof(size_t));
+  memcpy(batch->bytes + batch->size + sizeof(size_t), &value_size, sizeof(size_t));
+  memcpy(batch->bytes + batch->size + sizeof(size_t) * 2, key, key_length);
+  if (value != NULL)
+    memcpy(batch->bytes + batch->size + sizeof(size_t) * 2 + key_length, value, value_size);
+
+  batch->size += record_size;
+  batch->count++;
 }
 
-static inline DB *getdb(vsdb_t vsdb)
+vsdb_batch_t vsdb_batch_create(void)
 {
-  if (vsdb == NULL)
-    return NULL;
-  return vsdb->db;
+  vsdb_batch_t batch;
+  batch = (vsdb_batch_t)malloc(sizeof(struct _vsdb_batch));
+  bzero(batch, sizeof(struct _vsdb_batch));
+  return batch;
 }
 
-vsdb_t vsdb_open(const char *filename)
+void vsdb_batch_free(vsdb_batch_t batch)
 {
-  DB *db;
+  if (batch != NULL) {
+    free(batch->bytes);
+    free(batch);
+  }
+}
 
-  if (filename == NULL)
-    return NULL;
-  if ((db = dbopen(filename, O_RDWR | O_CREAT, 0644, DB_BTREE, NULL)) == NULL)
-    return NULL;
+void vsdb_batch_clear(vsdb_batch_t batch)
+{
+  if (batch != NULL) {
+    batch->size = 0;
+    batch->count = 0;
+  }
+}
 
-  return newvsdb(db);
+size_t vsdb_batch_count(vsdb_batch_t batch)
+{
+  if (batch == NULL)
+    return 0;
+  return batch->count;
 }
 
-void vsdb_close(vsdb_t vsdb)
+vsdb_ret_t vsdb_batch_put(vsdb_batch_t batch, const char *key, size_t key_length,
+                                              const void *value, size_t value_size)
 {
-  DB *db;
-  if ((db = getdb(vsdb)) != NULL) {
-    db->close(db);
-  }
+  if (batch == NULL || key == NULL)
+    return vsdb_failed;
+  if (key_length == SIZE_T_MAX)
+    key_length = strlen(key);
+  if (key_length == 0)
+    return vsdb_failed;
+  if (value != NULL && value_size == SIZE_T_MAX)
+    return vsdb_failed;
 
-  freevsdb(vsdb);
+  batch_append(batch, key, key_length, value, value_size);
+  return vsdb_okay;
 }
 
-vsdb_ret_t vsdb_sync(vsdb_t vsdb)
+vsdb_ret_t vsdb_batch_delete(vsdb_batch_t batch, const char *key, size_t key_length)
 {
-  DB *db;
+  return vsdb_batch_put(batch, key, key_length, NULL, 0);
+}
+
+static int batch_apply(vsdb_t vsdb, vsdb_batch_t batch, vsdb_batch_t undo, size_t *undo_offsets)
+{
+  vsdb_shard_t *shard;
+  DBT kt, dt, old;
+  size_t offset;
   int ret;
 
-  if ((db = getdb(vsdb)) != NULL) {
-    lockdb(vsdb);
-    ret = db->sync(db, 0);
-    unlockdb(vsdb);
+  offset = 0;
+  while (offset < batch->size) {
+    offset = batch_record_at(batch, offset, &kt, &dt);
+    shard = getshard(vsdb, (const char *)kt.data, kt.size);
+
+    if (undo != NULL) {
+      if ((ret = shard->db->get(shard->db, &kt, &old, 0)) < 0)
+        return -1;
 
-    if (ret == 0) {
-      return vsdb_okay;
+      undo_offsets[undo->count] = undo->size;
+      batch_append(undo, kt.data, kt.size, (ret == 0) ? old.data : NULL, (ret == 0) ? old.size : 0);
     }
-  }
 
-  return vsdb_failed;
-}
+    if (dt.size == SIZE_T_MAX) {
+      ret = shard->db->del(shard->db, &kt, 0);
+    }
+    else {
+      ret = shard_put(shard, &kt, &dt);
+    }
 
-void vsdb_free(void *ptr)
-{
-  if (ptr != NULL) {
-    free(ptr);
+    if (ret < 0 || (ret > 0 && dt.size != SIZE_T_MAX))
+      return -1;
   }
+
+  return 0;
 }
 
-void vsdb_free2(void **ptrs, size_t count)
+static void batch_rollback(vsdb_t vsdb, vsdb_batch_t undo, size_t *undo_offsets)
 {
+  vsdb_shard_t *shard;
+  DBT kt, dt;
   size_t i;
 
-  if (ptrs == NULL)
-    return;
+  for (i = undo->count; i > 0; i--) {
+    batch_record_at(undo, undo_offsets[i - 1], &kt, &dt);
+    shard = getshard(vsdb, (const char *)kt.data, kt.size);
 
-  for (i = 0; i < count; i++) {
-    if (ptrs[i] != NULL)
-      free(ptrs[i]);
+    if (dt.size == SIZE_T_MAX) {
+      shard->db->del(shard->db, &kt, 0);
+    }
+    else {
+      shard_put(shard, &kt, &dt);
+    }
   }
+}
 
-  free(ptrs);
+static uint64_t batch_log(vsdb_t vsdb, vsdb_batch_t batch)
+{
+  struct iovec iov;
+
+  iov.iov_base = batch->bytes;
+  iov.iov_len = batch->size;
+
+  return vsdb_wal_append(vsdb->wal, &iov, 1);
 }
 
-static inline void dup_dbt(DBT *dst, const DBT *src)
+/*
+ * The log entry of a batch precedes its changes, so when a batch fails
+ * halfway its rollback is logged too, as a batch of its own.
+ */
+static uint64_t batch_log_rollback(vsdb_t vsdb, vsdb_batch_t undo, size_t *undo_offsets)
 {
-  dst->size = src->size;
-  dst->data = malloc(dst->size);
-  memcpy(dst->data, src->data, dst->size);
+  vsdb_batch_t reversed;
+  DBT kt, dt;
+  uint64_t lsn;
+  size_t i;
+
+  reversed = vsdb_batch_create();
+  for (i = undo->count; i > 0; i--) {
+    batch_record_at(undo, undo_offsets[i - 1], &kt, &dt);
+    batch_append(reversed, kt.data, kt.size, (dt.size == SIZE_T_MAX) ? NULL : dt.data, dt.size);
+  }
+
+  lsn = batch_log(vsdb, reversed);
+  vsdb_batch_free(reversed);
+
+  return lsn;
 }
 
-vsdb_ret_t vsdb_get(vsdb_t vsdb, const char *key, size_t key_length,
-                                 const void **value, size_t *value_size)
+/*
+ * A logged batch that failed is replayed the same way: it is rolled back
+ * and skipped, its logged rollback then finds nothing left to undo.
+ */
+static int replay_wal_record(const void *payload, size_t payload_size, void *context)
 {
-  DB *db;
+  struct _vsdb_batch batch;
+  vsdb_batch_t undo;
+  size_t *undo_offsets;
   DBT kt, dt;
-  DBT newdt;
-  int ret;
+  size_t offset;
 
-  if ((db = getdb(vsdb)) == NULL)
-    goto failed;
-  if (key == NULL || value == NULL || value_size == NULL)
-    goto failed;
-  if (key_length == SIZE_T_MAX)
-    key_length = strlen(key);
-  if (key_length == 0)
-    goto failed;
+  batch.bytes = (uint8_t *)payload;
+  batch.size = payload_size;
+  batch.capacity = payload_size;
+  batch.count = 0;
 
-  kt.data = (void *)key;
-  kt.size = key_length;
+  for (offset = 0; offset < batch.size; batch.count++)
+    offset = batch_record_at(&batch, offset, &kt, &dt);
 
-  lockdb(vsdb);
-  ret = db->get(db, &kt, &dt, 0);
-  unlockdb(vsdb);
+  undo = vsdb_batch_create();
+  undo_offsets = (size_t *)malloc(sizeof(size_t) * (batch.count + 1));
 
-  if (ret == 0) {
-    dup_dbt(&newdt, &dt);
-    *value = newdt.data;
-    *value_size = newdt.size;
-    return vsdb_okay;
-  }
+  if (batch_apply((vsdb_t)context, &batch, undo, undo_offsets) != 0)
+    batch_rollback((vsdb_t)context, undo, undo_offsets);
 
-failed:
-  if (value != NULL)
-    *value = NULL;
-  if (value_size != NULL)
-    *value_size = 0;
-  return vsdb_failed;
+  vsdb_batch_free(undo);
+  free(undo_offsets);
+
+  return 0;
 }
 
-vsdb_ret_t vsdb_set(vsdb_t vsdb, const char *key, size_t key_length,
-                                 const void *value, size_t value_size)
+/*
+ * Rotating first means the B-trees are flushed while writers keep
+ * appending to a fresh log. The rotated log is only dropped once every
+ * shard made it to disk, until then no further rotation takes place.
+ */
+static int checkpoint_wal(vsdb_t vsdb)
 {
-  DB *db;
+  if (vsdb_wal_rotate(vsdb->wal) != 0)
+    return -1;
+  if (sync_shards(vsdb) != 0)
+    return -1;
+
+  return vsdb_wal_drop_rotated(vsdb->wal);
+}
+
+static int checkpoint_wal_in_background(void *context)
+{
+  return checkpoint_wal((vsdb_t)context);
+}
+
+vsdb_ret_t vsdb_batch_commit(vsdb_t vsdb, vsdb_batch_t batch)
+{
+  vsdb_batch_t undo;
+  size_t *undo_offsets;
+  uint64_t shard_mask, lsn;
   DBT kt, dt;
+  size_t offset;
+  unsigned int i;
   int ret;
 
-  if ((db = getdb(vsdb)) == NULL)
-    goto failed;
-  if (key == NULL)
-    goto failed;
-  if (key_length == SIZE_T_MAX)
-    key_length = strlen(key);
-  if (key_length == 0)
-    goto failed;
+  if (vsdb == NULL || batch == NULL)
+    return vsdb_failed;
+  if (batch->count == 0)
+    return vsdb_okay;
 
-  kt.data = (void *)key;
-  kt.size = key_length;
+  shard_mask = 0;
+  offset = 0;
+  while (offset < batch->size) {
+    offset = batch_record_at(batch, offset, &kt, &dt);
+    shard_mask |= (uint64_t)1 << (getshard(vsdb, (const char *)kt.data, kt.size) - vsdb->shards);
+  }
 
-  if (value != NULL) {
-    dt.data = (void *)value;
-    dt.size = value_size;
+  /*
+   * a single operation fails as a whole, there is nothing to roll back,
+   * unless it has already been logged
+   */
+  undo = NULL;
+  undo_offsets = NULL;
+  if (batch->count > 1 || vsdb->wal != NULL) {
+    undo = vsdb_batch_create();
+    undo_offsets = (size_t *)malloc(sizeof(size_t) * batch->count);
+  }
 
-    lockdb(vsdb);
-    ret = db->put(db, &kt, &dt, 0);
-    unlockdb(vsdb);
+  /* always in index order, so that concurrent batches cannot deadlock */
+  for (i = 0; i < vsdb->shard_count; i++) {
+    if (shard_mask & ((uint64_t)1 << i))
+      lockshard(&vsdb->shards[i]);
+  }
 
-    if (ret != 0) {
-      goto failed;
-    }
+  lsn = 0;
+  if (vsdb->wal != NULL && (lsn = batch_log(vsdb, batch)) == 0) {
+    ret = -1;
+  }
+  else if ((ret = batch_apply(vsdb, batch, undo, undo_offsets)) != 0 && undo != NULL) {
+    batch_rollback(vsdb, undo, undo_offsets);
+    if (vsdb->wal != NULL)
+      lsn = batch_log_rollback(vsdb, undo, undo_offsets);
   }
-  else {
-    lockdb(vsdb);
-    ret = db->del(db, &kt, 0);
-    unlockdb(vsdb);
 
-    if (ret != 0) {
-      goto failed;
-    }
+  for (i = vsdb->shard_count; i > 0; i--) {
+    if (shard_mask & ((uint64_t)1 << (i - 1)))
+      unlockshard(&vsdb->shards[i - 1]);
   }
 
-  return vsdb_okay;
+  vsdb_batch_free(undo);
+  free(undo_offsets);
 
-failed:
-  return vsdb_failed;
+  if (vsdb->wal_sync && lsn != 0 && vsdb_wal_commit(vsdb->wal, lsn) != 0)
+    ret = -1;
+
+  return (ret == 0) ? vsdb_okay : vsdb_failed;
 }
 
 #ifndef __clang_analyzer__
-vsdb_ret_t vsdb_glob(vsdb_t vsdb, const char *glob, size_t glob_length,
+/*
+ * Copies up to limit records out of cursor (0 is unlimited), leaving
+ * out a first record equal to skip. *more tells whether the cursor had
+ * records left. Only the keys are copied if values and value_sizes are
+ * both NULL.
+ */
+static vsdb_ret_t collect_records(vsdb_cursor_t cursor, size_t limit, const DBT *skip,
                                   const char ***keys, size_t **key_lengths,
                                   const void ***values, size_t **value_sizes,
-                                  size_t *count)
+                                  size_t *count, int *more)
 {
-  DB *db;
   DBT kt, dt;
+  const char *key;
   vsdb_ret_t vsdb_ret;
-  int ret;
   size_t i;
   struct {
     DBT *kts, *dts;
@@ -243,102 +1671,70 @@ vsdb_ret_t vsdb_glob(vsdb_t vsdb, const char *glob, size_t glob_length,
 
   vsdb_ret = vsdb_okay;
   bzero(&buf, sizeof(buf));
-  lockdb(vsdb);
+  *more = 0;
 
-  if ((db = getdb(vsdb)) == NULL)
-    goto failed;
-  if (glob == NULL)
-    goto failed;
-  if (glob_length == SIZE_T_MAX)
-    glob_length = strlen(glob);
-  if (glob_length == 0)
-    goto failed;
-  if (keys == NULL || key_lengths == NULL || values == NULL || value_sizes == NULL)
+  if (keys == NULL || key_lengths == NULL || (values == NULL) != (value_sizes == NULL))
     goto failed;
-  if (count == NULL)
+  if (count == NULL || cursor == NULL)
     goto failed;
 
-  if (glob_length == 1 && glob[0] == '*') {
-    if ((ret = db->seq(db, &kt, &dt, R_FIRST)) < 0) {
-      goto failed;
+  while (vsdb_cursor_next(cursor, &key, &kt.size, (const void **)&dt.data, &dt.size) == vsdb_okay) {
+    kt.data = (void *)key;
+    if (skip != NULL) {
+      if (compare_dbt(&kt, skip) == 0)
+        continue;
+      skip = NULL;
     }
-    else if (ret == 0) {
-      do {
-        if (buf.count == buf.capacity) {
-          if (buf.capacity == 0) {
-            buf.capacity = 16;
-            buf.kts = (DBT *)malloc(sizeof(DBT) * buf.capacity);
-            buf.dts = (DBT *)malloc(sizeof(DBT) * buf.capacity);
-          }
-          else {
-            buf.capacity <<= 1;
-            buf.kts = (DBT *)realloc(buf.kts, sizeof(DBT) * buf.capacity);
-            buf.dts = (DBT *)realloc(buf.dts, sizeof(DBT) * buf.capacity);
-          }
-        }
-
-        dup_dbt(&buf.kts[buf.count], &kt);
-        dup_dbt(&buf.dts[buf.count], &dt);
-        buf.count++;
-      } while ((ret = db->seq(db, &kt, &dt, R_NEXT)) == 0);
 
-      if (ret < 0) {
-        goto failed;
-      }
+    if (limit > 0 && buf.count == limit) {
+      *more = 1;
+      break;
     }
-  }
-  else if (glob_length > 0 && glob[glob_length - 1] == '*') {
-    kt.data = (void *)glob;
-    kt.size = glob_length - 1;
 
-    if ((ret = db->seq(db, &kt, &dt, R_CURSOR)) < 0) {
-      goto failed;
+    if (buf.count == buf.capacity) {
+      if (buf.capacity == 0) {
+        buf.capacity = 16;
+        buf.kts = (DBT *)malloc(sizeof(DBT) * buf.capacity);
+        buf.dts = (DBT *)malloc(sizeof(DBT) * buf.capacity);
+      }
+      else {
+        buf.capacity <<= 1;
+        buf.kts = (DBT *)realloc(buf.kts, sizeof(DBT) * buf.capacity);
+        buf.dts = (DBT *)realloc(buf.dts, sizeof(DBT) * buf.capacity);
+      }
     }
-    else if (ret == 0) {
-      do {
-        if (buf.count == buf.capacity) {
-          if (buf.capacity == 0) {
-            buf.capacity = 16;
-            buf.kts = (DBT *)malloc(sizeof(DBT) * buf.capacity);
-            buf.dts = (DBT *)malloc(sizeof(DBT) * buf.capacity);
-          }
-          else {
-            buf.capacity <<= 1;
-            buf.kts = (DBT *)realloc(buf.kts, sizeof(DBT) * buf.capacity);
-            buf.dts = (DBT *)realloc(buf.dts, sizeof(DBT) * buf.capacity);
-          }
-        }
 
-        if (strncmp((const char *)kt.data, glob, ((glob_length - 1) < kt.size) ? (glob_length - 1) : kt.size) != 0) {
-          break;
-        }
-
-        dup_dbt(&buf.kts[buf.count], &kt);
-        dup_dbt(&buf.dts[buf.count], &dt);
-        buf.count++;
-      } while ((ret = db->seq(db, &kt, &dt, R_NEXT)) == 0);
+    dup_dbt(&buf.kts[buf.count], &kt);
+    if (values != NULL)
+      dup_dbt(&buf.dts[buf.count], &dt);
+    buf.count++;
+  }
 
-      if (ret < 0) {
-        goto failed;
-      }
+  if (cursor->error) {
+    for (i = 0; i < buf.count; i++) {
+      free(buf.kts[i].data);
+      if (values != NULL)
+        free(buf.dts[i].data);
     }
-  }
-  else {
     goto failed;
   }
 
   if (buf.count > 0) {
     *keys = (const char **)malloc(sizeof(const char *) * buf.count);
     *key_lengths = (size_t *)malloc(sizeof(size_t) * buf.count);
-    *values = (const void **)malloc(sizeof(const void *) * buf.count);
-    *value_sizes = (size_t *)malloc(sizeof(size_t) * buf.count);
+    if (values != NULL) {
+      *values = (const void **)malloc(sizeof(const void *) * buf.count);
+      *value_sizes = (size_t *)malloc(sizeof(size_t) * buf.count);
+    }
     *count = buf.count;
     
     for (i = 0; i < buf.count; i++) {
       (*keys)[i] = (const char *)buf.kts[i].data;
       (*key_lengths)[i] = buf.kts[i].size;
-      (*values)[i] = buf.dts[i].data;
-      (*value_sizes)[i] = buf.dts[i].size;
+      if (values != NULL) {
+        (*values)[i] = buf.dts[i].data;
+        (*value_sizes)[i] = buf.dts[i].size;
+      }
     }
 
     goto cleanup;
@@ -349,6 +1745,7 @@ vsdb_ret_t vsdb_glob(vsdb_t vsdb, const char *glob, size_t glob_length,
 
 failed:
   vsdb_ret = vsdb_failed;
+  *more = 0;
 reset:
   if (keys != NULL)
     *keys = NULL;
@@ -361,11 +1758,144 @@ reset:
   if (count != NULL)
     *count = 0;
 cleanup:
-  unlockdb(vsdb);
   if (buf.capacity > 0) {
     free(buf.kts);
     free(buf.dts);
   }
   return vsdb_ret;
 }
+
+vsdb_ret_t vsdb_glob(vsdb_t vsdb, const char *glob, size_t glob_length,
+                                  const char ***keys, size_t **key_lengths,
+                                  const void ***values, size_t **value_sizes,
+                                  size_t *count)
+{
+  vsdb_cursor_t cursor;
+  vsdb_ret_t vsdb_ret;
+  int more;
+
+  cursor = vsdb_cursor_open_glob(vsdb, glob, glob_length);
+  vsdb_ret = collect_records(cursor, 0, NULL, keys, key_lengths, values, value_sizes, count, &more);
+  vsdb_cursor_close(cursor);
+
+  return vsdb_ret;
+}
+
+vsdb_ret_t vsdb_glob_keys(vsdb_t vsdb, const char *glob, size_t glob_length,
+                                       const char ***keys, size_t **key_lengths,
+                                       size_t *count)
+{
+  vsdb_cursor_t cursor;
+  vsdb_ret_t vsdb_ret;
+  int more;
+
+  cursor = vsdb_cursor_open_glob2(vsdb, glob, glob_length, 1);
+  vsdb_ret = collect_records(cursor, 0, NULL, keys, key_lengths, NULL, NULL, count, &more);
+  vsdb_cursor_close(cursor);
+
+  return vsdb_ret;
+}
+
+/*
+ * A resume token is the direction followed by the last key returned, the
+ * next page starts right after that key, so records written in between
+ * are neither skipped nor repeated.
+ */
+#define VSDB_SCAN_FORWARD 'F'
+#define VSDB_SCAN_REVERSE 'R'
+
+vsdb_ret_t vsdb_scan(vsdb_t vsdb, const char *start, size_t start_length,
+                                  const char *end, size_t end_length,
+                                  size_t limit, int reverse,
+                                  const void *resume, size_t resume_length,
+                                  const char ***keys, size_t **key_lengths,
+                                  const void ***values, size_t **value_sizes,
+                                  size_t *count,
+                                  void **next_resume, size_t *next_resume_length)
+{
+  vsdb_cursor_t cursor;
+  vsdb_ret_t vsdb_ret;
+  DBT bound, skip;
+  char direction;
+  int more;
+
+  if (next_resume == NULL || next_resume_length == NULL)
+    return vsdb_failed;
+
+  *next_resume = NULL;
+  *next_resume_length = 0;
+  direction = reverse ? VSDB_SCAN_REVERSE : VSDB_SCAN_FORWARD;
+
+  if (start == NULL)
+    start_length = 0;
+  else if (start_length == SIZE_T_MAX)
+    start_length = strlen(start);
+  if (end == NULL)
+    end_length = 0;
+  else if (end_length == SIZE_T_MAX)
+    end_length = strlen(end);
+
+  skip.data = NULL;
+  skip.size = 0;
+  if (resume != NULL) {
+    if (resume_length < 1 || *(const char *)resume != direction)
+      return vsdb_failed;
+
+    bound.data = (char *)resume + 1;
+    bound.size = resume_length - 1;
+
+    /* the exclusive end bound already leaves the resume key out */
+    if (reverse) {
+      end = (const char *)bound.data;
+      end_length = bound.size;
+    }
+    else {
+      start = (const char *)bound.data;
+      start_length = bound.size;
+      skip = bound;
+    }
+  }
+
+  cursor = vsdb_cursor_open_range2(vsdb, start, start_length, end, end_length, reverse);
+  vsdb_ret = collect_records(cursor, limit, (skip.data != NULL) ? &skip : NULL,
+                             keys, key_lengths, values, value_sizes, count, &more);
+  vsdb_cursor_close(cursor);
+
+  if (vsdb_ret == vsdb_okay && more) {
+    *next_resume_length = 1 + (*key_lengths)[*count - 1];
+    *next_resume = malloc(*next_resume_length);
+    *(char *)*next_resume = direction;
+    memcpy((char *)*next_resume + 1, (*keys)[*count - 1], (*key_lengths)[*count - 1]);
+  }
+
+  return vsdb_ret;
+}
 #endif /* __clang_analyzer__ */
+
+vsdb_ret_t vsdb_count(vsdb_t vsdb, const char *glob, size_t glob_length, size_t *count)
+{
+  vsdb_cursor_t cursor;
+  const char *key;
+  const void *value;
+  size_t key_length, value_size, n;
+  int error;
+
+  if (count == NULL)
+    return vsdb_failed;
+
+  *count = 0;
+  if ((cursor = vsdb_cursor_open_glob2(vsdb, glob, glob_length, 1)) == NULL)
+    return vsdb_failed;
+
+  n = 0;
+  while (vsdb_cursor_next(cursor, &key, &key_length, &value, &value_size) == vsdb_okay)
+    n++;
+
+  error = cursor->error;
+  vsdb_cursor_close(cursor);
+  if (error)
+    return vsdb_failed;
+
+  *count = n;
+  return vsdb_okay;
+}
@@ -34,17 +34,77 @@
 #endif /* __cplusplus */
 
 typedef struct _vsdb *vsdb_t;
+typedef struct _vsdb_cursor *vsdb_cursor_t;
+typedef struct _vsdb_batch *vsdb_batch_t;
 
 typedef enum {
   vsdb_okay = 0,
   vsdb_failed = -1
 } vsdb_ret_t;
 
+typedef enum {
+  vsdb_engine_btree = 0,
+  vsdb_engine_lsm = 1
+} vsdb_engine_t;
+
+/*
+ * shards: number of B-trees the keys are spread over by hash, each with
+ *         its own lock so that threads working on different shards run
+ *         in parallel. 0 or 1 keeps the single file layout. A database
+ *         must always be reopened with the shard count it was created
+ *         with, vsdb_open2() fails otherwise.
+ *
+ * wal:    log every write to "<filename>.wal" before applying it, and let
+ *         a background checkpoint flush the B-trees every few seconds or
+ *         once the log has grown past wal_checkpoint_size bytes
+ *         (0 means 4MB). Whatever is left in the log, with or without
+ *         this option, is replayed by vsdb_open2().
+ * wal_sync: make each vsdb_set() and vsdb_batch_commit() durable before
+ *         it returns. Concurrent writers share one fsync. Without it,
+ *         vsdb_sync() is the durability point, and it only has to flush
+ *         the log.
+ * engine: how every shard is stored. vsdb_engine_btree is the BSD B-tree,
+ *         updated in place. vsdb_engine_lsm buffers writes in memory and
+ *         turns them into sequential appends of sorted segment files,
+ *         which are merged in the background, and suits write-heavy use.
+ *         A database must always be reopened with the engine it was
+ *         created with.
+ * bloom:  keep a Bloom filter of the keys of every shard, so that most
+ *         lookups of missing keys never reach the engine. Filters are
+ *         saved next to the shards on close and rebuilt on open when
+ *         missing, which costs a scan of the database.
+ */
+typedef struct {
+  unsigned int shards;
+  int wal;
+  int wal_sync;
+  size_t wal_checkpoint_size;
+  vsdb_engine_t engine;
+  int bloom;
+} vsdb_options_t;
+
 VSDB_EXTERN vsdb_t vsdb_open(const char *filename);
+VSDB_EXTERN vsdb_t vsdb_open2(const char *filename, const vsdb_options_t *options);
 VSDB_EXTERN void vsdb_close(vsdb_t vsdb);
 
+VSDB_EXTERN vsdb_ret_t vsdb_unlink(const char *filename, const vsdb_options_t *options);
+
 VSDB_EXTERN vsdb_ret_t vsdb_sync(vsdb_t vsdb);
 
+/*
+ * Counters since vsdb_open2(), summed over all shards, all zero without
+ * the bloom option. bloom_false_positive_rate is the share of lookups of
+ * missing keys that the filters failed to reject.
+ */
+typedef struct {
+  size_t bloom_queries;
+  size_t bloom_negatives;
+  size_t bloom_false_positives;
+  double bloom_false_positive_rate;
+} vsdb_stats_t;
+
+VSDB_EXTERN vsdb_ret_t vsdb_get_stats(vsdb_t vsdb, vsdb_stats_t *stats);
+
 VSDB_EXTERN void vsdb_free(void *ptr);
 VSDB_EXTERN void vsdb_free2(void **ptrs, size_t count);
 
@@ -53,9 +113,118 @@ VSDB_EXTERN vsdb_ret_t vsdb_get(vsdb_t vsdb, const char *key, size_t key_length,
 VSDB_EXTERN vsdb_ret_t vsdb_set(vsdb_t vsdb, const char *key, size_t key_length,
                                              const void *value, size_t value_size);
 
+/*
+ * vsdb_get_nocopy() hands the value to reader straight from the storage
+ * engine instead of duplicating it. The value is only valid during the
+ * call, and the database is locked meanwhile, so reader must be quick and
+ * must not call back into the same vsdb_t. reader is not called if the
+ * key is not found.
+ */
+
+typedef void (*vsdb_reader_t)(const void *value, size_t value_size, void *context);
+
+VSDB_EXTERN vsdb_ret_t vsdb_get_nocopy(vsdb_t vsdb, const char *key, size_t key_length,
+                                                    vsdb_reader_t reader, void *context);
+
+/*
+ * A batch collects puts and deletes, and vsdb_batch_commit() applies them
+ * while holding every shard they touch, acquired once. Either all
+ * operations take effect or, if one of them fails, those already applied
+ * are rolled back and vsdb_failed is returned. Operations are applied in
+ * the order they were added, and deleting a missing key is not an error.
+ * A committed batch is left untouched, so it can be cleared and reused.
+ */
+
+VSDB_EXTERN vsdb_batch_t vsdb_batch_create(void);
+VSDB_EXTERN void vsdb_batch_free(vsdb_batch_t batch);
+VSDB_EXTERN void vsdb_batch_clear(vsdb_batch_t batch);
+VSDB_EXTERN size_t vsdb_batch_count(vsdb_batch_t batch);
+
+VSDB_EXTERN vsdb_ret_t vsdb_batch_put(vsdb_batch_t batch, const char *key, size_t key_length,
+                                                          const void *value, size_t value_size);
+VSDB_EXTERN vsdb_ret_t vsdb_batch_delete(vsdb_batch_t batch, const char *key, size_t key_length);
+
+VSDB_EXTERN vsdb_ret_t vsdb_batch_commit(vsdb_t vsdb, vsdb_batch_t batch);
+
+/*
+ * Globs may use '*' (any run of bytes), '?' (any single byte) and [...]
+ * (any byte of the class, with ranges like [a-z] and negation with '!'
+ * or '^') anywhere. There are no escapes. Only the keys starting with
+ * the literal part before the first wildcard are visited.
+ */
+
 VSDB_EXTERN vsdb_ret_t vsdb_glob(vsdb_t vsdb, const char *glob, size_t glob_length,
                                               const char ***keys, size_t **key_lengths,
                                               const void ***values, size_t **value_sizes,
                                               size_t *count);
 
+/*
+ * vsdb_glob_keys() returns the matching keys only, freed like those of
+ * vsdb_glob(), and vsdb_count() only counts them. Neither copies any
+ * value, so their cost depends on the keys alone.
+ */
+
+VSDB_EXTERN vsdb_ret_t vsdb_glob_keys(vsdb_t vsdb, const char *glob, size_t glob_length,
+                                                   const char ***keys, size_t **key_lengths,
+                                                   size_t *count);
+VSDB_EXTERN vsdb_ret_t vsdb_count(vsdb_t vsdb, const char *glob, size_t glob_length, size_t *count);
+
+/*
+ * vsdb_scan() returns up to limit records (0 is unlimited) of [start, end)
+ * in key order, or in reverse order if reverse is non-zero. Results are
+ * freed like those of vsdb_glob(). If records are left, *next_resume is
+ * set to an opaque token, to be freed with vsdb_free(), which passed back
+ * as resume with the same bounds and direction returns the next page.
+ * *next_resume is NULL once the scan is complete.
+ */
+
+VSDB_EXTERN vsdb_ret_t vsdb_scan(vsdb_t vsdb, const char *start, size_t start_length,
+                                              const char *end, size_t end_length,
+                                              size_t limit, int reverse,
+                                              const void *resume, size_t resume_length,
+                                              const char ***keys, size_t **key_lengths,
+                                              const void ***values, size_t **value_sizes,
+                                              size_t *count,
+                                              void **next_resume, size_t *next_resume_length);
+
+/*
+ * Cursors walk the records in key order, one at a time.
+ *
+ * - vsdb_cursor_open() visits every key starting with prefix
+ *   (an empty prefix visits the whole database).
+ * - vsdb_cursor_open2() does the same, and if keys_only is non-zero,
+ *   never copies the values and returns each of them as empty.
+ * - vsdb_cursor_open_range() visits every key in [start, end),
+ *   an empty bound is unbounded.
+ * - vsdb_cursor_open_range2() does the same, from end down to start
+ *   if reverse is non-zero.
+ * - vsdb_cursor_open_glob() accepts the same globs as vsdb_glob().
+ * - vsdb_cursor_open_glob2() does the same, and if keys_only is non-zero,
+ *   never copies the values and returns each of them as empty.
+ *
+ * The key and value returned by vsdb_cursor_next() are borrowed, they
+ * must not be freed and stay valid until the next call on the same cursor.
+ * vsdb_cursor_next() returns vsdb_failed once the cursor is exhausted.
+ *
+ * Cursors read ahead in small chunks and do not keep the database locked
+ * between calls, so other vsdb_* calls may be interleaved freely. Records
+ * written while a cursor is open may or may not be visited.
+ */
+
+VSDB_EXTERN vsdb_cursor_t vsdb_cursor_open(vsdb_t vsdb, const char *prefix, size_t prefix_length);
+VSDB_EXTERN vsdb_cursor_t vsdb_cursor_open2(vsdb_t vsdb, const char *prefix, size_t prefix_length,
+                                                         int keys_only);
+VSDB_EXTERN vsdb_cursor_t vsdb_cursor_open_range(vsdb_t vsdb, const char *start, size_t start_length,
+                                                              const char *end, size_t end_length);
+VSDB_EXTERN vsdb_cursor_t vsdb_cursor_open_range2(vsdb_t vsdb, const char *start, size_t start_length,
+                                                               const char *end, size_t end_length,
+                                                               int reverse);
+VSDB_EXTERN vsdb_cursor_t vsdb_cursor_open_glob(vsdb_t vsdb, const char *glob, size_t glob_length);
+VSDB_EXTERN vsdb_cursor_t vsdb_cursor_open_glob2(vsdb_t vsdb, const char *glob, size_t glob_length,
+                                                              int keys_only);
+VSDB_EXTERN void vsdb_cursor_close(vsdb_cursor_t cursor);
+
+VSDB_EXTERN vsdb_ret_t vsdb_cursor_next(vsdb_cursor_t cursor, const char **key, size_t *key_length,
+                                                              const void **value, size_t *value_size);
+
 #endif /* __vsdatastore_vsdb_h__ */
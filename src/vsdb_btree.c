@@ -0,0 +1,49 @@
+/* vim: set ft=c fenc=utf-8 sw=2 ts=2 et: */
+/*
+ * Copyright (c) 2013-2014 Chongyu Zhu <i@lembacon.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include "vsdb_engine.h"
+#include <fcntl.h>
+#include <unistd.h>
+
+/*
+ * The BSD B-tree, updated in place. dbopen(3) already hands out the
+ * handle vsdb.c expects.
+ */
+
+static DB *btree_open(const char *filename)
+{
+  return dbopen(filename, O_RDWR | O_CREAT, 0644, DB_BTREE, NULL);
+}
+
+static int btree_unlink(const char *filename)
+{
+  if (unlink(filename) != 0 && access(filename, F_OK) == 0)
+    return -1;
+  return 0;
+}
+
+const vsdb_engine_ops_t vsdb_btree_engine = {
+  btree_open,
+  btree_unlink
+};
@@ -24,36 +24,90 @@
 
 #include "vsdb_cf.h"
 
-static void get_utf8_bytes(CFStringRef string, char **utf8, size_t *utf8_length)
+/*
+ * The contents of string if it is stored as pure ASCII, which is then its
+ * UTF-8 form too, or NULL. A string shorter in bytes than in characters
+ * has an embedded NUL, one longer is not ASCII.
+ */
+static inline const char *get_ascii_ptr(CFStringRef string, CFIndex string_length)
+{
+  const char *ascii;
+
+  ascii = CFStringGetCStringPtr(string, kCFStringEncodingUTF8);
+  if (ascii == NULL || strlen(ascii) != (size_t)string_length) {
+    return NULL;
+  }
+
+  return ascii;
+}
+
+/* checks 8 bytes at a time, which compilers turn into vector code */
+static inline int is_ascii(const uint8_t *bytes, size_t length)
+{
+  uint64_t word, bits;
+  size_t i;
+
+  bits = 0;
+  for (i = 0; i + sizeof(word) <= length; i += sizeof(word)) {
+    memcpy(&word, bytes + i, sizeof(word));
+    bits |= word;
+  }
+  for (; i < length; i++) {
+    bits |= bytes[i];
+  }
+
+  return (bits & 0x8080808080808080ULL) == 0;
+}
+
+typedef struct {
+  const char *utf8;
+  size_t utf8_length;
+  char *heap_utf8;
+  char inline_utf8[256];
+} utf8_buffer_t;
+
+static void utf8_buffer_open(utf8_buffer_t *buf, CFStringRef string)
 {
   CFIndex string_length;
   CFIndex utf8_max_length;
   CFIndex used_buf_length;
+  char *utf8;
 
   string_length = CFStringGetLength(string);
-  utf8_max_length = CFStringGetMaximumSizeForEncoding(string_length, kCFStringEncodingUTF8);
+  buf->heap_utf8 = NULL;
 
-  *utf8 = (char *)malloc(sizeof(char) * (utf8_max_length + 1));
-  CFStringGetBytes(string, CFRangeMake(0, string_length), kCFStringEncodingUTF8, 0, FALSE, (UInt8 *)*utf8, utf8_max_length, &used_buf_length);
+  if ((buf->utf8 = get_ascii_ptr(string, string_length)) != NULL) {
+    buf->utf8_length = string_length;
+    return;
+  }
 
-  if (used_buf_length < utf8_max_length) {
-    *utf8 = (char *)realloc(*utf8, (used_buf_length + 1) * sizeof(char));
+  utf8_max_length = CFStringGetMaximumSizeForEncoding(string_length, kCFStringEncodingUTF8);
+
+  if (utf8_max_length < (CFIndex)sizeof(buf->inline_utf8)) {
+    utf8 = buf->inline_utf8;
+  }
+  else {
+    utf8 = buf->heap_utf8 = (char *)malloc(sizeof(char) * (utf8_max_length + 1));
   }
 
-  (*utf8)[used_buf_length] = '\0';
-  *utf8_length = used_buf_length;
+  CFStringGetBytes(string, CFRangeMake(0, string_length), kCFStringEncodingUTF8, 0, FALSE, (UInt8 *)utf8, utf8_max_length, &used_buf_length);
+  utf8[used_buf_length] = '\0';
+  buf->utf8 = utf8;
+  buf->utf8_length = used_buf_length;
 }
 
-static inline CF_RETURNS_RETAINED CFStringRef create_cfstring(const char *utf8, size_t utf8_length);
-static inline CFStringRef create_cfstring(const char *utf8, size_t utf8_length)
+static void utf8_buffer_close(utf8_buffer_t *buf)
 {
-  return CFStringCreateWithBytes(kCFAllocatorDefault, (const UInt8 *)utf8, utf8_length, kCFStringEncodingUTF8, FALSE);
+  free(buf->heap_utf8);
 }
 
-static inline CF_RETURNS_RETAINED CFStringRef create_cfstring_nocopy(const char *utf8, size_t utf8_length);
-static inline CFStringRef create_cfstring_nocopy(const char *utf8, size_t utf8_length)
+static inline CF_RETURNS_RETAINED CFStringRef create_cfstring(const char *utf8, size_t utf8_length);
+static inline CFStringRef create_cfstring(const char *utf8, size_t utf8_length)
 {
-  return CFStringCreateWithBytesNoCopy(kCFAllocatorDefault, (const UInt8 *)utf8, utf8_length, kCFStringEncodingUTF8, FALSE, kCFAllocatorMalloc);
+  /* ASCII strings are stored as they are, without decoding UTF-8 */
+  return CFStringCreateWithBytes(kCFAllocatorDefault, (const UInt8 *)utf8, utf8_length,
+                                 is_ascii((const uint8_t *)utf8, utf8_length) ? kCFStringEncodingASCII : kCFStringEncodingUTF8,
+                                 FALSE);
 }
 
 typedef struct {
@@ -64,13 +118,14 @@ typedef struct {
   int owns;
 } stream_buffer_t;
 
-static void stream_buffer_open(stream_buffer_t *sb)
+/* writes go to buf until they outgrow it */
+static void stream_buffer_open(stream_buffer_t *sb, void *buf, size_t bufsize)
 {
-  sb->capacity = 512;
-  sb->bytes = (uint8_t *)malloc(sb->capacity);
+  sb->bytes = (uint8_t *)buf;
   sb->size = 0;
+  sb->capacity = bufsize;
   sb->cursor = 0;
-  sb->owns = 1;
+  sb->owns = 0;
 }
 
 static void stream_buffer_open2(stream_buffer_t *sb, const void *buf, size_t bufsize)
@@ -99,26 +154,6 @@ static inline void stream_buffer_move_cursor(stream_buffer_t *sb, size_t offset)
   sb->cursor += offset;
 }
 
-static inline void stream_buffer_copy(stream_buffer_t *sb, uint8_t **outbuf, size_t *outbuf_size)
-{
-  if (sb->owns) {
-    sb->owns = 0;
-
-    if (sb->size < sb->capacity) {
-      sb->bytes = (uint8_t *)realloc(sb->bytes, sb->size);
-      sb->capacity = sb->size;
-    }
-
-    *outbuf = sb->bytes;
-    *outbuf_size = sb->size;
-  }
-  else {
-    *outbuf = (uint8_t *)malloc(sb->size);
-    memcpy(*outbuf, sb->bytes, sb->size);
-    *outbuf_size = sb->size;
-  }
-}
-
 static inline void stream_buffer_read(stream_buffer_t *sb, void *data, size_t size)
 {
   if (sb->cursor + size > sb->size) {
@@ -145,9 +180,13 @@ static inline CFDataRef stream_buffer_read_cfdata(stream_buffer_t *sb, size_t si
   return cfdata;
 }
 
-static inline void stream_buffer_write(stream_buffer_t *sb, const void *data, size_t size)
+/* room for size more bytes at the cursor, see stream_buffer_commit() */
+static inline uint8_t *stream_buffer_reserve(stream_buffer_t *sb, size_t size)
 {
   if (sb->size + size > sb->capacity) {
+    if (sb->capacity == 0) {
+      sb->capacity = 512;
+    }
     while (sb->size + size > sb->capacity) {
       sb->capacity <<= 1;
     }
@@ -155,7 +194,9 @@ static inline void stream_buffer_write(stream_buffer_t *sb, const void *data, si
     if (!sb->owns) {
       const uint8_t *tmp = sb->bytes;
       sb->bytes = (uint8_t *)malloc(sb->capacity);
-      memcpy(sb->bytes, tmp, sb->size);
+      if (sb->size > 0) {
+        memcpy(sb->bytes, tmp, sb->size);
+      }
       sb->owns = 1;
     }
     else {
@@ -163,11 +204,36 @@ static inline void stream_buffer_write(stream_buffer_t *sb, const void *data, si
     }
   }
 
-  memmove(sb->bytes + sb->cursor, data, size);
+  return sb->bytes + sb->cursor;
+}
+
+static inline void stream_buffer_commit(stream_buffer_t *sb, size_t size)
+{
   sb->size += size;
   sb->cursor += size;
 }
 
+static inline void stream_buffer_write(stream_buffer_t *sb, const void *data, size_t size)
+{
+  memmove(stream_buffer_reserve(sb, size), data, size);
+  stream_buffer_commit(sb, size);
+}
+
+static inline void stream_buffer_write_byte(stream_buffer_t *sb, uint8_t byte)
+{
+  stream_buffer_write(sb, &byte, 1);
+}
+
+static inline int stream_buffer_read_byte(stream_buffer_t *sb, uint8_t *byte)
+{
+  if (sb->cursor >= sb->size) {
+    return 0;
+  }
+
+  *byte = sb->bytes[sb->cursor++];
+  return 1;
+}
+
 enum {
   trait_string,
   trait_data,
@@ -183,17 +249,124 @@ enum {
 };
 typedef uint32_t trait_t;
 
+/*
+ * Values are written in the v2 format, which starts with VSDB_CF_VERSION_2.
+ * v1 values, written before it existed, start with the low byte of a
+ * 32-bit trait instead, which is never VSDB_CF_VERSION_2, so both are read
+ * and v1 records turn into v2 ones whenever they are written again.
+ *
+ * In v2 every value starts with a 1-byte tag. Lengths and counts are
+ * LEB128 varints and integers are zigzag varints. Small non-negative
+ * integers and short strings are folded into their tag, and dictionary
+ * keys are bare strings without a tag.
+ */
+#define VSDB_CF_VERSION_2 0xF2
+
+enum {
+  tag_null,
+  tag_boolean_true,
+  tag_boolean_false,
+  tag_integer,
+  tag_double,
+  tag_date,
+  tag_string,
+  tag_data,
+  tag_dictionary,
+  tag_array,
+  tag_set,
+  tag_small_integer = 0x40, /* | value, below VSDB_CF_SMALL_INTEGER_LIMIT */
+  tag_short_string = 0x80   /* | length, below VSDB_CF_SHORT_STRING_LIMIT */
+};
+
+#define VSDB_CF_SMALL_INTEGER_LIMIT 0x40
+#define VSDB_CF_SHORT_STRING_LIMIT 0x80
+
+static inline void encode_varint(uint64_t value, stream_buffer_t *sb)
+{
+  uint8_t bytes[10];
+  size_t size;
+
+  size = 0;
+  while (value >= 0x80) {
+    bytes[size++] = (uint8_t)(value | 0x80);
+    value >>= 7;
+  }
+  bytes[size++] = (uint8_t)value;
+
+  stream_buffer_write(sb, bytes, size);
+}
+
+static inline uint64_t decode_varint(stream_buffer_t *sb)
+{
+  uint64_t value;
+  unsigned int shift;
+  uint8_t byte;
+
+  value = 0;
+  for (shift = 0; shift < 64; shift += 7) {
+    if (!stream_buffer_read_byte(sb, &byte)) {
+      return 0;
+    }
+
+    value |= (uint64_t)(byte & 0x7f) << shift;
+    if ((byte & 0x80) == 0) {
+      return value;
+    }
+  }
+
+  /* overlong, give up on the rest of the value */
+  sb->cursor = sb->size;
+  return 0;
+}
+
+static inline uint64_t zigzag_encode(long long value)
+{
+  return ((uint64_t)value << 1) ^ (uint64_t)(value >> 63);
+}
+
+static inline long long zigzag_decode(uint64_t value)
+{
+  return (long long)((value >> 1) ^ (~(value & 1) + 1));
+}
+
 static inline CF_RETURNS_RETAINED CFStringRef decode_simple_cfstring(stream_buffer_t *sb);
 static inline CFStringRef decode_simple_cfstring(stream_buffer_t *sb)
 {
-  char *utf8;
   size_t utf8_length;
+  CFStringRef string;
 
   stream_buffer_read(sb, &utf8_length, sizeof(utf8_length));
-  utf8 = (char *)malloc(utf8_length);
-  stream_buffer_read(sb, utf8, utf8_length);
+  if (utf8_length > sb->size - sb->cursor) {
+    sb->cursor = sb->size;
+    return CFRetain(CFSTR(""));
+  }
 
-  return create_cfstring_nocopy(utf8, utf8_length);
+  string = create_cfstring((const char *)sb->bytes + sb->cursor, utf8_length);
+  sb->cursor += utf8_length;
+
+  if (string == NULL) {
+    return CFRetain(CFSTR(""));
+  }
+
+  return string;
+}
+
+/*
+ * Containers up to this size are encoded and decoded with their elements
+ * on the stack, so that small values need no temporary heap buffer.
+ */
+#define STACK_ELEMENT_COUNT 16
+
+static inline CFIndex decode_count(stream_buffer_t *sb)
+{
+  CFIndex count;
+
+  stream_buffer_read(sb, &count, sizeof(count));
+  if (count < 0 || (size_t)count > sb->size - sb->cursor) {
+    return 0;
+  }
+
+  return count;
 }
 
 static CF_RETURNS_RETAINED CFTypeRef decode_cfvalue_sb(stream_buffer_t *sb);
@@ -204,6 +377,7 @@ static CFTypeRef decode_cfvalue_sb(stream_buffer_t *sb)
   double number_double;
   CFAbsoluteTime absolute_time;
   CFTypeRef *keys, *values;
+  CFTypeRef stack_keys[STACK_ELEMENT_COUNT], stack_values[STACK_ELEMENT_COUNT];
   CFIndex count, i;
   CFTypeRef cfvalue;
 
@@ -238,9 +412,15 @@ static CFTypeRef decode_cfvalue_sb(stream_buffer_t *sb)
     return CFDateCreate(kCFAllocatorDefault, absolute_time);
   }
   else if (trait == trait_dictionary) {
-    stream_buffer_read(sb, &count, sizeof(count));
-    keys = (CFTypeRef *)malloc(sizeof(CFTypeRef) * count);
-    values = (CFTypeRef *)malloc(sizeof(CFTypeRef) * count);
+    count = decode_count(sb);
+    if (count <= STACK_ELEMENT_COUNT) {
+      keys = stack_keys;
+      values = stack_values;
+    }
+    else {
+      keys = (CFTypeRef *)malloc(sizeof(CFTypeRef) * count);
+      values = (CFTypeRef *)malloc(sizeof(CFTypeRef) * count);
+    }
 
     for (i = 0; i < count; i++) {
       stream_buffer_move_cursor(sb, sizeof(trait));
@@ -249,14 +429,21 @@ static CFTypeRef decode_cfvalue_sb(stream_buffer_t *sb)
     }
 
     cfvalue = CFDictionaryCreate(kCFAllocatorDefault, keys, values, count, &kCFTypeDictionaryKeyCallBacks, &kCFTypeDictionaryValueCallBacks);
-    free(keys);
-    free(values);
+    for (i = 0; i < count; i++) {
+      CFRelease(keys[i]);
+      CFRelease(values[i]);
+    }
+
+    if (keys != stack_keys) {
+      free(keys);
+      free(values);
+    }
 
     return cfvalue;
   }
   else if (trait == trait_array || trait == trait_set) {
-    stream_buffer_read(sb, &count, sizeof(count));
-    values = (CFTypeRef *)malloc(sizeof(CFTypeRef) * count);
+    count = decode_count(sb);
+    values = (count <= STACK_ELEMENT_COUNT) ? stack_values : (CFTypeRef *)malloc(sizeof(CFTypeRef) * count);
 
     for (i = 0; i < count; i++) {
       values[i] = decode_cfvalue_sb(sb);
@@ -269,7 +456,14 @@ static CFTypeRef decode_cfvalue_sb(stream_buffer_t *sb)
       cfvalue = CFSetCreate(kCFAllocatorDefault, values, count, &kCFTypeSetCallBacks);
     }
 
-    free(values);
+    for (i = 0; i < count; i++) {
+      CFRelease(values[i]);
+    }
+
+    if (values != stack_values) {
+      free(values);
+    }
+
     return cfvalue;
   }
   else {
@@ -277,208 +471,599 @@ static CFTypeRef decode_cfvalue_sb(stream_buffer_t *sb)
   }
 }
 
-static CF_RETURNS_RETAINED CFTypeRef decode_cfvalue(const void *value, size_t value_size);
-static CFTypeRef decode_cfvalue(const void *value, size_t value_size)
+/* a length of bytes that follow, 0 with the cursor at the end if they are not there */
+static inline size_t decode_length2(stream_buffer_t *sb)
+{
+  uint64_t length;
+
+  length = decode_varint(sb);
+  if (length > sb->size - sb->cursor) {
+    sb->cursor = sb->size;
+    return 0;
+  }
+
+  return (size_t)length;
+}
+
+static inline CF_RETURNS_RETAINED CFStringRef decode_simple_cfstring2(stream_buffer_t *sb, size_t utf8_length);
+static inline CFStringRef decode_simple_cfstring2(stream_buffer_t *sb, size_t utf8_length)
+{
+  CFStringRef string;
+
+  if (utf8_length > sb->size - sb->cursor) {
+    sb->cursor = sb->size;
+    return CFRetain(CFSTR(""));
+  }
+
+  string = create_cfstring((const char *)sb->bytes + sb->cursor, utf8_length);
+  sb->cursor += utf8_length;
+
+  if (string == NULL) {
+    return CFRetain(CFSTR(""));
+  }
+
+  return string;
+}
+
+/* moves past the value at the cursor without decoding it */
+static void skip_cfvalue2_sb(stream_buffer_t *sb)
+{
+  uint8_t tag;
+  size_t count, i;
+
+  if (!stream_buffer_read_byte(sb, &tag)) {
+    return;
+  }
+
+  if (tag >= tag_short_string) {
+    count = tag & ~tag_short_string;
+    sb->cursor = (count > sb->size - sb->cursor) ? sb->size : sb->cursor + count;
+    return;
+  }
+  else if (tag >= tag_small_integer) {
+    return;
+  }
+
+  switch (tag) {
+  case tag_string:
+  case tag_data:
+    count = decode_length2(sb);
+    sb->cursor += count;
+    break;
+  case tag_integer:
+    decode_varint(sb);
+    break;
+  case tag_double:
+  case tag_date:
+    sb->cursor = (sizeof(double) > sb->size - sb->cursor) ? sb->size : sb->cursor + sizeof(double);
+    break;
+  case tag_dictionary:
+    count = decode_length2(sb);
+    for (i = 0; i < count && sb->cursor < sb->size; i++) {
+      sb->cursor += decode_length2(sb);
+      skip_cfvalue2_sb(sb);
+    }
+    break;
+  case tag_array:
+  case tag_set:
+    count = decode_length2(sb);
+    for (i = 0; i < count && sb->cursor < sb->size; i++) {
+      skip_cfvalue2_sb(sb);
+    }
+    break;
+  default:
+    break;
+  }
+}
+
+static CF_RETURNS_RETAINED CFTypeRef decode_cfvalue2_sb(stream_buffer_t *sb, const vsdb_cflazy_t *lazy);
+
+/* the elements are left encoded for lazy->create(), NULL if it declines */
+static CF_RETURNS_RETAINED CFTypeRef decode_lazy_cfcontainer2(stream_buffer_t *sb, uint8_t tag, CFIndex count, const vsdb_cflazy_t *lazy);
+static CFTypeRef decode_lazy_cfcontainer2(stream_buffer_t *sb, uint8_t tag, CFIndex count, const vsdb_cflazy_t *lazy)
+{
+  size_t start;
+  CFIndex i;
+  CFTypeRef cfvalue;
+
+  start = sb->cursor;
+  for (i = 0; i < count; i++) {
+    skip_cfvalue2_sb(sb);
+  }
+
+  cfvalue = lazy->create((tag == tag_array) ? CFArrayGetTypeID() : CFSetGetTypeID(),
+                         sb->bytes + start, sb->cursor - start, count, lazy->context);
+  if (cfvalue == NULL) {
+    sb->cursor = start;
+  }
+
+  return cfvalue;
+}
+
+static CFTypeRef decode_cfvalue2_sb(stream_buffer_t *sb, const vsdb_cflazy_t *lazy)
+{
+  uint8_t tag;
+  long long number_long_long;
+  double number_double;
+  CFAbsoluteTime absolute_time;
+  CFTypeRef *keys, *values;
+  CFTypeRef stack_keys[STACK_ELEMENT_COUNT], stack_values[STACK_ELEMENT_COUNT];
+  CFIndex count, i;
+  CFTypeRef cfvalue;
+
+  if (!stream_buffer_read_byte(sb, &tag)) {
+    return CFRetain(kCFNull);
+  }
+
+  if (tag >= tag_short_string) {
+    return decode_simple_cfstring2(sb, tag & ~tag_short_string);
+  }
+  else if (tag >= tag_small_integer) {
+    number_long_long = tag & ~tag_small_integer;
+    return CFNumberCreate(kCFAllocatorDefault, kCFNumberLongLongType, &number_long_long);
+  }
+
+  switch (tag) {
+  case tag_string:
+    return decode_simple_cfstring2(sb, decode_length2(sb));
+  case tag_data:
+    count = (CFIndex)decode_length2(sb);
+    cfvalue = stream_buffer_read_cfdata(sb, count);
+    if (cfvalue == NULL) {
+      return CFRetain(kCFNull);
+    }
+    return cfvalue;
+  case tag_integer:
+    number_long_long = zigzag_decode(decode_varint(sb));
+    return CFNumberCreate(kCFAllocatorDefault, kCFNumberLongLongType, &number_long_long);
+  case tag_double:
+    stream_buffer_read(sb, &number_double, sizeof(number_double));
+    return CFNumberCreate(kCFAllocatorDefault, kCFNumberDoubleType, &number_double);
+  case tag_boolean_true:
+  case tag_boolean_false:
+    return CFRetain((tag == tag_boolean_true) ? kCFBooleanTrue : kCFBooleanFalse);
+  case tag_date:
+    stream_buffer_read(sb, &absolute_time, sizeof(absolute_time));
+    return CFDateCreate(kCFAllocatorDefault, absolute_time);
+  case tag_dictionary:
+    /* every element takes a byte at least */
+    count = (CFIndex)decode_length2(sb);
+    if (count <= STACK_ELEMENT_COUNT) {
+      keys = stack_keys;
+      values = stack_values;
+    }
+    else {
+      keys = (CFTypeRef *)malloc(sizeof(CFTypeRef) * count);
+      values = (CFTypeRef *)malloc(sizeof(CFTypeRef) * count);
+    }
+
+    for (i = 0; i < count; i++) {
+      keys[i] = decode_simple_cfstring2(sb, decode_length2(sb));
+      values[i] = decode_cfvalue2_sb(sb, lazy);
+    }
+
+    cfvalue = CFDictionaryCreate(kCFAllocatorDefault, keys, values, count, &kCFTypeDictionaryKeyCallBacks, &kCFTypeDictionaryValueCallBacks);
+    for (i = 0; i < count; i++) {
+      CFRelease(keys[i]);
+      CFRelease(values[i]);
+    }
+
+    if (keys != stack_keys) {
+      free(keys);
+      free(values);
+    }
+
+    return cfvalue;
+  case tag_array:
+  case tag_set:
+    count = (CFIndex)decode_length2(sb);
+    if (lazy != NULL && count >= lazy->threshold &&
+        (cfvalue = decode_lazy_cfcontainer2(sb, tag, count, lazy)) != NULL) {
+      return cfvalue;
+    }
+
+    values = (count <= STACK_ELEMENT_COUNT) ? stack_values : (CFTypeRef *)malloc(sizeof(CFTypeRef) * count);
+
+    for (i = 0; i < count; i++) {
+      values[i] = decode_cfvalue2_sb(sb, lazy);
+    }
+
+    if (tag == tag_array) {
+      cfvalue = CFArrayCreate(kCFAllocatorDefault, values, count, &kCFTypeArrayCallBacks);
+    }
+    else {
+      cfvalue = CFSetCreate(kCFAllocatorDefault, values, count, &kCFTypeSetCallBacks);
+    }
+
+    for (i = 0; i < count; i++) {
+      CFRelease(values[i]);
+    }
+
+    if (values != stack_values) {
+      free(values);
+    }
+
+    return cfvalue;
+  default:
+    return CFRetain(kCFNull);
+  }
+}
+
+static CF_RETURNS_RETAINED CFTypeRef decode_cfvalue(const void *value, size_t value_size, const vsdb_cflazy_t *lazy);
+static CFTypeRef decode_cfvalue(const void *value, size_t value_size, const vsdb_cflazy_t *lazy)
 {
   stream_buffer_t sb;
   CFTypeRef cfvalue;
 
   stream_buffer_open2(&sb, value, value_size);
   stream_buffer_reset_cusor(&sb);
-  cfvalue = decode_cfvalue_sb(&sb);
+  if (value_size > 0 && *(const uint8_t *)value == VSDB_CF_VERSION_2) {
+    stream_buffer_move_cursor(&sb, 1);
+    cfvalue = decode_cfvalue2_sb(&sb, lazy);
+  }
+  else {
+    cfvalue = decode_cfvalue_sb(&sb);
+  }
   stream_buffer_close(&sb);
 
   return cfvalue;
 }
 
-static inline void encode_simple_cfstring(CFStringRef string, stream_buffer_t *sb)
+CFTypeRef vsdb_decode_cfelement(const void *elements, size_t elements_size, size_t offset,
+                                size_t *next_offset, const vsdb_cflazy_t *lazy)
 {
-  char *utf8;
-  size_t utf8_length;
-  trait_t trait;
+  stream_buffer_t sb;
+  CFTypeRef cfvalue;
 
-  trait = trait_string;
-  get_utf8_bytes(string, &utf8, &utf8_length);
-  
-  stream_buffer_write(sb, &trait, sizeof(trait));
-  stream_buffer_write(sb, &utf8_length, sizeof(utf8_length));
-  stream_buffer_write(sb, utf8, utf8_length);
-  free(utf8);
+  stream_buffer_open2(&sb, elements, elements_size);
+  sb.cursor = (offset < elements_size) ? offset : elements_size;
+  cfvalue = decode_cfvalue2_sb(&sb, lazy);
+  if (next_offset != NULL) {
+    *next_offset = sb.cursor;
+  }
+  stream_buffer_close(&sb);
+
+  return cfvalue;
 }
 
-static void encode_cfvalue_sb(CFTypeRef cfvalue, stream_buffer_t *sb)
+size_t vsdb_skip_cfelement(const void *elements, size_t elements_size, size_t offset)
+{
+  stream_buffer_t sb;
+
+  stream_buffer_open2(&sb, elements, elements_size);
+  sb.cursor = (offset < elements_size) ? offset : elements_size;
+  skip_cfvalue2_sb(&sb);
+  stream_buffer_close(&sb);
+
+  return (sb.cursor < elements_size) ? sb.cursor : elements_size;
+}
+
+/* tagged strings are values, untagged ones are dictionary keys */
+static inline void encode_string_header2(size_t utf8_length, int tagged, stream_buffer_t *sb)
+{
+  if (tagged && utf8_length < VSDB_CF_SHORT_STRING_LIMIT) {
+    stream_buffer_write_byte(sb, (uint8_t)(tag_short_string | utf8_length));
+  }
+  else {
+    if (tagged) {
+      stream_buffer_write_byte(sb, tag_string);
+    }
+    encode_varint(utf8_length, sb);
+  }
+}
+
+/* the UTF-8 bytes are written straight into sb, never through a temporary buffer */
+static inline void encode_simple_cfstring2(CFStringRef string, int tagged, stream_buffer_t *sb)
+{
+  CFIndex string_length, converted, used_buf_length;
+  const char *ascii;
+  size_t mark;
+
+  string_length = CFStringGetLength(string);
+
+  if ((ascii = get_ascii_ptr(string, string_length)) != NULL) {
+    encode_string_header2(string_length, tagged, sb);
+    stream_buffer_write(sb, ascii, string_length);
+    return;
+  }
+
+  /* an ASCII string is as long in bytes as in characters */
+  mark = sb->size;
+  encode_string_header2(string_length, tagged, sb);
+  converted = CFStringGetBytes(string, CFRangeMake(0, string_length), kCFStringEncodingASCII, 0, FALSE,
+                               stream_buffer_reserve(sb, string_length), string_length, &used_buf_length);
+  if (converted == string_length) {
+    stream_buffer_commit(sb, used_buf_length);
+    return;
+  }
+
+  /* otherwise measure the UTF-8 form, then convert again in place */
+  sb->size = mark;
+  sb->cursor = mark;
+  CFStringGetBytes(string, CFRangeMake(0, string_length), kCFStringEncodingUTF8, 0, FALSE,
+                   NULL, 0, &used_buf_length);
+  encode_string_header2(used_buf_length, tagged, sb);
+  CFStringGetBytes(string, CFRangeMake(0, string_length), kCFStringEncodingUTF8, 0, FALSE,
+                   stream_buffer_reserve(sb, used_buf_length), used_buf_length, &used_buf_length);
+  stream_buffer_commit(sb, used_buf_length);
+}
+
+static void encode_cfvalue2_sb(CFTypeRef cfvalue, stream_buffer_t *sb)
 {
   CFTypeID typeid;
-  trait_t trait;
   double number_double;
   long long number_long_long;
   CFAbsoluteTime absolute_time;
   CFTypeRef *keys, *values;
+  CFTypeRef stack_keys[STACK_ELEMENT_COUNT], stack_values[STACK_ELEMENT_COUNT];
   CFIndex count, i;
 
   typeid = CFGetTypeID(cfvalue);
 
   if (typeid == CFStringGetTypeID()) {
-    encode_simple_cfstring((CFStringRef)cfvalue, sb);
+    encode_simple_cfstring2((CFStringRef)cfvalue, 1, sb);
   }
   else if (typeid == CFDataGetTypeID()) {
-    trait = trait_data;
     count = CFDataGetLength((CFDataRef)cfvalue);
-    stream_buffer_write(sb, &trait, sizeof(trait));
-    stream_buffer_write(sb, &count, sizeof(count));
+    stream_buffer_write_byte(sb, tag_data);
+    encode_varint(count, sb);
     stream_buffer_write(sb, CFDataGetBytePtr((CFDataRef)cfvalue), count);
   }
   else if (typeid == CFNumberGetTypeID()) {
     if (CFNumberIsFloatType((CFNumberRef)cfvalue)) {
-      trait = trait_number_double;
       CFNumberGetValue((CFNumberRef)cfvalue, kCFNumberDoubleType, &number_double);
 
-      stream_buffer_write(sb, &trait, sizeof(trait));
+      stream_buffer_write_byte(sb, tag_double);
       stream_buffer_write(sb, &number_double, sizeof(number_double));
     }
     else {
-      trait = trait_number_long_long;
       CFNumberGetValue((CFNumberRef)cfvalue, kCFNumberLongLongType, &number_long_long);
 
-      stream_buffer_write(sb, &trait, sizeof(trait));
-      stream_buffer_write(sb, &number_long_long, sizeof(number_long_long));
+      if (number_long_long >= 0 && number_long_long < VSDB_CF_SMALL_INTEGER_LIMIT) {
+        stream_buffer_write_byte(sb, (uint8_t)(tag_small_integer | number_long_long));
+      }
+      else {
+        stream_buffer_write_byte(sb, tag_integer);
+        encode_varint(zigzag_encode(number_long_long), sb);
+      }
     }
   }
   else if (typeid == CFBooleanGetTypeID()) {
-    if (CFBooleanGetValue((CFBooleanRef)cfvalue))
-      trait = trait_boolean_true;
-    else
-      trait = trait_boolean_false;
-
-    stream_buffer_write(sb, &trait, sizeof(trait));
+    stream_buffer_write_byte(sb, CFBooleanGetValue((CFBooleanRef)cfvalue) ? tag_boolean_true : tag_boolean_false);
   }
   else if (typeid == CFDateGetTypeID()) {
-    trait = trait_date;
     absolute_time = CFDateGetAbsoluteTime((CFDateRef)cfvalue);
-    stream_buffer_write(sb, &trait, sizeof(trait));
+    stream_buffer_write_byte(sb, tag_date);
     stream_buffer_write(sb, &absolute_time, sizeof(absolute_time));
   }
   else if (typeid == CFDictionaryGetTypeID()) {
-    trait = trait_dictionary;
     count = CFDictionaryGetCount((CFDictionaryRef)cfvalue);
-    keys = (CFTypeRef *)malloc(sizeof(CFTypeRef) * count);
-    values = (CFTypeRef *)malloc(sizeof(CFTypeRef) * count);
+    if (count <= STACK_ELEMENT_COUNT) {
+      keys = stack_keys;
+      values = stack_values;
+    }
+    else {
+      keys = (CFTypeRef *)malloc(sizeof(CFTypeRef) * count);
+      values = (CFTypeRef *)malloc(sizeof(CFTypeRef) * count);
+    }
     CFDictionaryGetKeysAndValues((CFDictionaryRef)cfvalue, keys, values);
 
-    stream_buffer_write(sb, &trait, sizeof(trait));
-    stream_buffer_write(sb, &count, sizeof(count));
+    stream_buffer_write_byte(sb, tag_dictionary);
+    encode_varint(count, sb);
 
     for (i = 0; i < count; i++) {
-      encode_simple_cfstring((CFStringRef)keys[i], sb);
-      encode_cfvalue_sb(values[i], sb);
+      encode_simple_cfstring2((CFStringRef)keys[i], 0, sb);
+      encode_cfvalue2_sb(values[i], sb);
     }
 
-    free(keys);
-    free(values);
+    if (keys != stack_keys) {
+      free(keys);
+      free(values);
+    }
   }
   else if (typeid == CFArrayGetTypeID()) {
-    trait = trait_array;
     count = CFArrayGetCount((CFArrayRef)cfvalue);
 
-    stream_buffer_write(sb, &trait, sizeof(trait));
-    stream_buffer_write(sb, &count, sizeof(count));
+    stream_buffer_write_byte(sb, tag_array);
+    encode_varint(count, sb);
 
     for (i = 0; i < count; i++) {
-      encode_cfvalue_sb(CFArrayGetValueAtIndex((CFArrayRef)cfvalue, i), sb);
+      encode_cfvalue2_sb(CFArrayGetValueAtIndex((CFArrayRef)cfvalue, i), sb);
     }
   }
   else if (typeid == CFSetGetTypeID()) {
-    trait = trait_set;
     count = CFSetGetCount((CFSetRef)cfvalue);
-    values = (CFTypeRef *)malloc(sizeof(CFTypeRef) * count);
+    values = (count <= STACK_ELEMENT_COUNT) ? stack_values : (CFTypeRef *)malloc(sizeof(CFTypeRef) * count);
     CFSetGetValues((CFSetRef)cfvalue, values);
 
-    stream_buffer_write(sb, &trait, sizeof(trait));
-    stream_buffer_write(sb, &count, sizeof(count));
+    stream_buffer_write_byte(sb, tag_set);
+    encode_varint(count, sb);
 
     for (i = 0; i < count; i++) {
-      encode_cfvalue_sb(values[i], sb);
+      encode_cfvalue2_sb(values[i], sb);
     }
 
-    free(values);
+    if (values != stack_values) {
+      free(values);
+    }
   }
   else {
-    trait = trait_null;
-    stream_buffer_write(sb, &trait, sizeof(trait));
+    stream_buffer_write_byte(sb, tag_null);
   }
 }
 
-static void encode_cfvalue(CFTypeRef cfvalue, uint8_t **value, size_t *value_size)
+/*
+ * Values are encoded into a buffer on the stack of the caller, which only
+ * spills to the heap for large values.
+ */
+#define ENCODE_STACK_SIZE 512
+
+static void encode_cfvalue(CFTypeRef cfvalue, stream_buffer_t *sb)
 {
-  stream_buffer_t sb;
+  stream_buffer_write_byte(sb, VSDB_CF_VERSION_2);
+  encode_cfvalue2_sb(cfvalue, sb);
+}
 
-  stream_buffer_open(&sb);
-  encode_cfvalue_sb(cfvalue, &sb);
-  stream_buffer_copy(&sb, value, value_size);
-  stream_buffer_close(&sb);
+typedef struct {
+  CFTypeRef cfvalue;
+  const vsdb_cflazy_t *lazy;
+} borrowed_cfvalue_t;
+
+static void decode_borrowed_cfvalue(const void *value, size_t value_size, void *context)
+{
+  borrowed_cfvalue_t *borrowed = (borrowed_cfvalue_t *)context;
+  borrowed->cfvalue = decode_cfvalue(value, value_size, borrowed->lazy);
 }
 
-static CF_RETURNS_RETAINED CFTypeRef copy_simple_cfvalue(vsdb_t vsdb, CFStringRef key);
-static CFTypeRef copy_simple_cfvalue(vsdb_t vsdb, CFStringRef key)
+static CF_RETURNS_RETAINED CFTypeRef copy_simple_cfvalue(vsdb_t vsdb, CFStringRef key, const vsdb_cflazy_t *lazy);
+static CFTypeRef copy_simple_cfvalue(vsdb_t vsdb, CFStringRef key, const vsdb_cflazy_t *lazy)
 {
-  char *utf8_key;
-  size_t utf8_key_length;
-  const void *value;
-  size_t value_size;
-  vsdb_ret_t ret;
+  utf8_buffer_t utf8_key;
   CFTypeRef cfvalue;
 
-  get_utf8_bytes(key, &utf8_key, &utf8_key_length);
-  ret = vsdb_get(vsdb, utf8_key, utf8_key_length, &value, &value_size);
-  free(utf8_key);
+  utf8_buffer_open(&utf8_key, key);
+  cfvalue = vsdb_copy_cfvalue_with_key(vsdb, utf8_key.utf8, utf8_key.utf8_length, lazy);
+  utf8_buffer_close(&utf8_key);
 
-  if (ret == vsdb_failed) {
-    return NULL;
-  }
-
-  cfvalue = decode_cfvalue(value, value_size);
-  vsdb_free((void *)value);
   return cfvalue;
 }
 
-static CF_RETURNS_RETAINED CFTypeRef copy_glob_cfvalue(vsdb_t vsdb, CFStringRef glob);
-static CFTypeRef copy_glob_cfvalue(vsdb_t vsdb, CFStringRef glob)
+/* applier is used when visitor is NULL, and key_visitor when both are */
+static void enumerate_cursor(vsdb_cursor_t cursor, vsdb_cfvalue_applier_t applier,
+                                                   vsdb_cfvalue_visitor_t visitor,
+                                                   vsdb_cfvalue_key_visitor_t key_visitor, void *context,
+                                                   const vsdb_cflazy_t *lazy)
 {
-  char *utf8_glob;
-  size_t utf8_glob_length;
-  const char **keys;
-  const void **values;
-  size_t *key_lengths, *value_sizes;
-  size_t count;
-  vsdb_ret_t ret;
-  size_t i;
-  CFMutableDictionaryRef mutable_dictionary;
-  CFDictionaryRef dictionary;
+  const char *key;
+  const void *value;
+  size_t key_length, value_size;
   CFStringRef cfkey;
   CFTypeRef cfvalue;
+  int proceed;
 
-  get_utf8_bytes(glob, &utf8_glob, &utf8_glob_length);
-  ret = vsdb_glob(vsdb, utf8_glob, utf8_glob_length, &keys, &key_lengths, &values, &value_sizes, &count);
-  free(utf8_glob);
+  proceed = 1;
+  while (proceed && vsdb_cursor_next(cursor, &key, &key_length, &value, &value_size) == vsdb_okay) {
+    cfvalue = decode_cfvalue(value, value_size, lazy);
 
-  if (ret == vsdb_failed) {
-    return NULL;
+    /* binary keys are handed out as they are */
+    if (visitor == NULL && applier == NULL) {
+      proceed = key_visitor(key, key_length, cfvalue, context);
+      CFRelease(cfvalue);
+      continue;
+    }
+
+    cfkey = create_cfstring(key, key_length);
+    if (visitor != NULL) {
+      proceed = visitor(cfkey, cfvalue, context);
+    }
+    else {
+      applier(cfkey, cfvalue, context);
+    }
+    CFRelease(cfkey);
+    CFRelease(cfvalue);
   }
+}
 
-  mutable_dictionary = CFDictionaryCreateMutable(kCFAllocatorDefault, count, &kCFTypeDictionaryKeyCallBacks, &kCFTypeDictionaryValueCallBacks);
-  for (i = 0; i < count; i++) {
-    cfkey = create_cfstring(keys[i], key_lengths[i]);
-    cfvalue = decode_cfvalue(values[i], value_sizes[i]);
+vsdb_ret_t vsdb_enumerate_cfvalues(vsdb_t vsdb, CFStringRef glob,
+                                   vsdb_cfvalue_applier_t applier, void *context)
+{
+  return vsdb_enumerate_cfvalues2(vsdb, glob, applier, context, NULL);
+}
 
-    CFDictionaryAddValue(mutable_dictionary, cfkey, cfvalue);
-    CFRelease(cfkey); 
-    CFRelease(cfvalue);
+vsdb_ret_t vsdb_enumerate_cfvalues2(vsdb_t vsdb, CFStringRef glob,
+                                    vsdb_cfvalue_applier_t applier, void *context,
+                                    const vsdb_cflazy_t *lazy)
+{
+  utf8_buffer_t utf8_glob;
+  vsdb_cursor_t cursor;
+
+  if (vsdb == NULL || glob == NULL || applier == NULL) {
+    return vsdb_failed;
+  }
+
+  utf8_buffer_open(&utf8_glob, glob);
+  cursor = vsdb_cursor_open_glob(vsdb, utf8_glob.utf8, utf8_glob.utf8_length);
+  utf8_buffer_close(&utf8_glob);
+
+  if (cursor == NULL) {
+    return vsdb_failed;
   }
 
-  vsdb_free2((void **)keys, count);
-  vsdb_free2((void **)values, count);
-  vsdb_free(key_lengths);
-  vsdb_free(value_sizes);
+  enumerate_cursor(cursor, applier, NULL, NULL, context, lazy);
+  vsdb_cursor_close(cursor);
+  return vsdb_okay;
+}
+
+vsdb_ret_t vsdb_enumerate_cfvalues_in_range(vsdb_t vsdb, CFStringRef start, CFStringRef end, int reverse,
+                                            vsdb_cfvalue_visitor_t visitor, void *context)
+{
+  return vsdb_enumerate_cfvalues_in_range2(vsdb, start, end, reverse, visitor, context, NULL);
+}
+
+vsdb_ret_t vsdb_enumerate_cfvalues_in_range2(vsdb_t vsdb, CFStringRef start, CFStringRef end, int reverse,
+                                             vsdb_cfvalue_visitor_t visitor, void *context,
+                                             const vsdb_cflazy_t *lazy)
+{
+  utf8_buffer_t utf8_start, utf8_end;
+  vsdb_cursor_t cursor;
+
+  if (vsdb == NULL || visitor == NULL) {
+    return vsdb_failed;
+  }
+
+  utf8_buffer_open(&utf8_start, (start != NULL) ? start : CFSTR(""));
+  utf8_buffer_open(&utf8_end, (end != NULL) ? end : CFSTR(""));
+  cursor = vsdb_cursor_open_range2(vsdb, utf8_start.utf8, utf8_start.utf8_length,
+                                   utf8_end.utf8, utf8_end.utf8_length, reverse);
+  utf8_buffer_close(&utf8_end);
+  utf8_buffer_close(&utf8_start);
+
+  if (cursor == NULL) {
+    return vsdb_failed;
+  }
+
+  enumerate_cursor(cursor, NULL, visitor, NULL, context, lazy);
+  vsdb_cursor_close(cursor);
+  return vsdb_okay;
+}
+
+vsdb_ret_t vsdb_enumerate_cfvalues_in_key_range(vsdb_t vsdb, const char *start, size_t start_length,
+                                                const char *end, size_t end_length, int reverse,
+                                                vsdb_cfvalue_key_visitor_t visitor, void *context,
+                                                const vsdb_cflazy_t *lazy)
+{
+  vsdb_cursor_t cursor;
+
+  if (vsdb == NULL || visitor == NULL) {
+    return vsdb_failed;
+  }
+
+  cursor = vsdb_cursor_open_range2(vsdb, start, start_length, end, end_length, reverse);
+  if (cursor == NULL) {
+    return vsdb_failed;
+  }
+
+  enumerate_cursor(cursor, NULL, NULL, visitor, context, lazy);
+  vsdb_cursor_close(cursor);
+  return vsdb_okay;
+}
+
+static void add_glob_cfvalue(CFStringRef key, CFTypeRef value, void *context)
+{
+  CFDictionaryAddValue((CFMutableDictionaryRef)context, key, value);
+}
+
+static CF_RETURNS_RETAINED CFTypeRef copy_glob_cfvalue(vsdb_t vsdb, CFStringRef glob, const vsdb_cflazy_t *lazy);
+static CFTypeRef copy_glob_cfvalue(vsdb_t vsdb, CFStringRef glob, const vsdb_cflazy_t *lazy)
+{
+  CFMutableDictionaryRef mutable_dictionary;
+  CFDictionaryRef dictionary;
+
+  mutable_dictionary = CFDictionaryCreateMutable(kCFAllocatorDefault, 0, &kCFTypeDictionaryKeyCallBacks, &kCFTypeDictionaryValueCallBacks);
+  if (vsdb_enumerate_cfvalues2(vsdb, glob, add_glob_cfvalue, mutable_dictionary, lazy) == vsdb_failed) {
+    CFRelease(mutable_dictionary);
+    return NULL;
+  }
 
   dictionary = CFDictionaryCreateCopy(kCFAllocatorDefault, mutable_dictionary);
   CFRelease(mutable_dictionary);
@@ -487,45 +1072,101 @@ static CFTypeRef copy_glob_cfvalue(vsdb_t vsdb, CFStringRef glob)
 }
 
 CFTypeRef vsdb_copy_cfvalue(vsdb_t vsdb, CFStringRef key)
+{
+  return vsdb_copy_cfvalue2(vsdb, key, NULL);
+}
+
+CFTypeRef vsdb_copy_cfvalue2(vsdb_t vsdb, CFStringRef key, const vsdb_cflazy_t *lazy)
 {
   if (vsdb == NULL || key == NULL) {
     return NULL;
   }
 
   if (CFStringFind(key, CFSTR("*"), kCFCompareBackwards).location != kCFNotFound) {
-    return copy_glob_cfvalue(vsdb, key);
+    return copy_glob_cfvalue(vsdb, key, lazy);
   }
   else {
-    return copy_simple_cfvalue(vsdb, key);
+    return copy_simple_cfvalue(vsdb, key, lazy);
   }
 }
 
-#ifndef __clang_analyzer__
+CFTypeRef vsdb_copy_cfvalue_with_key(vsdb_t vsdb, const char *key, size_t key_length, const vsdb_cflazy_t *lazy)
+{
+  borrowed_cfvalue_t borrowed;
+
+  if (vsdb == NULL || key == NULL) {
+    return NULL;
+  }
+
+  borrowed.cfvalue = NULL;
+  borrowed.lazy = lazy;
+  vsdb_get_nocopy(vsdb, key, key_length, decode_borrowed_cfvalue, &borrowed);
+
+  return borrowed.cfvalue;
+}
+
 void vsdb_set_cfvalue(vsdb_t vsdb, CFStringRef key, CFTypeRef value)
 {
-  char *utf8_key;
-  size_t utf8_key_length;
-  uint8_t *raw_value;
-  size_t raw_value_size;
-  
+  utf8_buffer_t utf8_key;
+
   if (vsdb == NULL || key == NULL) {
     return;
   }
 
-  get_utf8_bytes(key, &utf8_key, &utf8_key_length);
+  utf8_buffer_open(&utf8_key, key);
+  vsdb_set_cfvalue_with_key(vsdb, utf8_key.utf8, utf8_key.utf8_length, value);
+  utf8_buffer_close(&utf8_key);
+}
 
-  if (value == NULL) {
-    raw_value = NULL;
-    raw_value_size = 0;
+void vsdb_set_cfvalue_with_key(vsdb_t vsdb, const char *key, size_t key_length, CFTypeRef value)
+{
+  uint8_t stack_bytes[ENCODE_STACK_SIZE];
+  stream_buffer_t sb;
+
+  if (vsdb == NULL || key == NULL) {
+    return;
   }
-  else {
-    encode_cfvalue(value, &raw_value, &raw_value_size);
+
+  stream_buffer_open(&sb, stack_bytes, sizeof(stack_bytes));
+
+  if (value != NULL) {
+    encode_cfvalue(value, &sb);
   }
 
-  vsdb_set(vsdb, utf8_key, utf8_key_length, raw_value, raw_value_size);
+  vsdb_set(vsdb, key, key_length, (value != NULL) ? sb.bytes : NULL, sb.size);
+
+  stream_buffer_close(&sb);
+}
+
+void vsdb_batch_set_cfvalue(vsdb_batch_t batch, CFStringRef key, CFTypeRef value)
+{
+  utf8_buffer_t utf8_key;
+
+  if (batch == NULL || key == NULL) {
+    return;
+  }
 
-  free(utf8_key);
-  if (raw_value != NULL)
-    free(raw_value);
+  utf8_buffer_open(&utf8_key, key);
+  vsdb_batch_set_cfvalue_with_key(batch, utf8_key.utf8, utf8_key.utf8_length, value);
+  utf8_buffer_close(&utf8_key);
+}
+
+void vsdb_batch_set_cfvalue_with_key(vsdb_batch_t batch, const char *key, size_t key_length, CFTypeRef value)
+{
+  uint8_t stack_bytes[ENCODE_STACK_SIZE];
+  stream_buffer_t sb;
+
+  if (batch == NULL || key == NULL) {
+    return;
+  }
+
+  if (value == NULL) {
+    vsdb_batch_delete(batch, key, key_length);
+  }
+  else {
+    stream_buffer_open(&sb, stack_bytes, sizeof(stack_bytes));
+    encode_cfvalue(value, &sb);
+    vsdb_batch_put(batch, key, key_length, sb.bytes, sb.size);
+    stream_buffer_close(&sb);
+  }
 }
-#endif /* __clang_analyzer__ */
@@ -43,11 +43,96 @@
  *
  * Unrecognized values will be considered as CFNull.
  *
- * If key contains '*', then that key will be regarded
- * as a glob, the returned value type will be CFDictionary.
+ * Values are stored in a compact versioned encoding. Records written in
+ * the older encoding are still read, and are upgraded whenever they are
+ * written again.
+ *
+ * If key contains '*', then that key will be regarded as a glob
+ * (see vsdb_glob()), the returned value type will be CFDictionary.
+ * Keys with '?' or '[' but no '*' are read as they are, use
+ * vsdb_enumerate_cfvalues() to match them as globs.
  */
 
 VSDB_EXTERN CF_RETURNS_RETAINED CFTypeRef vsdb_copy_cfvalue(vsdb_t vsdb, CFStringRef key);
 VSDB_EXTERN void vsdb_set_cfvalue(vsdb_t vsdb, CFStringRef key, CFTypeRef value);
+VSDB_EXTERN void vsdb_batch_set_cfvalue(vsdb_batch_t batch, CFStringRef key, CFTypeRef value);
+
+/*
+ * Decodes the records matching glob one at a time and hands them to
+ * applier, without materializing the whole result first. The key and
+ * value are only guaranteed to live during the call, retain them to
+ * keep them. applier must not call back into the same vsdb_t.
+ */
+
+typedef void (*vsdb_cfvalue_applier_t)(CFStringRef key, CFTypeRef value, void *context);
+
+VSDB_EXTERN vsdb_ret_t vsdb_enumerate_cfvalues(vsdb_t vsdb, CFStringRef glob,
+                                               vsdb_cfvalue_applier_t applier, void *context);
+
+/*
+ * Same for the records in [start, end), in key order or in reverse order.
+ * NULL bounds are unbounded. The walk stops once visitor returns 0.
+ */
+
+typedef int (*vsdb_cfvalue_visitor_t)(CFStringRef key, CFTypeRef value, void *context);
+
+VSDB_EXTERN vsdb_ret_t vsdb_enumerate_cfvalues_in_range(vsdb_t vsdb, CFStringRef start, CFStringRef end, int reverse,
+                                                        vsdb_cfvalue_visitor_t visitor, void *context);
+
+/*
+ * Lazy decoding. Arrays and sets of at least threshold elements are not
+ * decoded, create is handed their encoded elements instead and returns
+ * the value standing for them, typically a proxy collection decoding its
+ * elements on first access. elements is only valid during the call. If
+ * create returns NULL, the container is decoded as usual. Values stored
+ * in the older encoding are always decoded in full.
+ */
+
+typedef CF_RETURNS_RETAINED CFTypeRef (*vsdb_cfcontainer_creator_t)(CFTypeID type_id,
+                                                                     const void *elements, size_t elements_size,
+                                                                     CFIndex count, void *context);
+
+typedef struct {
+  CFIndex threshold;
+  vsdb_cfcontainer_creator_t create;
+  void *context;
+} vsdb_cflazy_t;
+
+VSDB_EXTERN CF_RETURNS_RETAINED CFTypeRef vsdb_copy_cfvalue2(vsdb_t vsdb, CFStringRef key, const vsdb_cflazy_t *lazy);
+VSDB_EXTERN vsdb_ret_t vsdb_enumerate_cfvalues2(vsdb_t vsdb, CFStringRef glob,
+                                                vsdb_cfvalue_applier_t applier, void *context,
+                                                const vsdb_cflazy_t *lazy);
+VSDB_EXTERN vsdb_ret_t vsdb_enumerate_cfvalues_in_range2(vsdb_t vsdb, CFStringRef start, CFStringRef end, int reverse,
+                                                         vsdb_cfvalue_visitor_t visitor, void *context,
+                                                         const vsdb_cflazy_t *lazy);
+
+/*
+ * vsdb_decode_cfelement() decodes the element at offset of the elements
+ * handed to create, and sets *next_offset to where the next one starts,
+ * elements_size after the last one. Nested containers are decoded lazily
+ * as well if lazy is not NULL. vsdb_skip_cfelement() only returns where
+ * the next element starts, without decoding anything.
+ */
+
+VSDB_EXTERN CF_RETURNS_RETAINED CFTypeRef vsdb_decode_cfelement(const void *elements, size_t elements_size, size_t offset,
+                                                                size_t *next_offset, const vsdb_cflazy_t *lazy);
+VSDB_EXTERN size_t vsdb_skip_cfelement(const void *elements, size_t elements_size, size_t offset);
+
+/*
+ * Same with binary keys, taken and handed out as bytes, which are never
+ * regarded as globs. The key handed to visitor is only valid during the
+ * call.
+ */
+
+typedef int (*vsdb_cfvalue_key_visitor_t)(const char *key, size_t key_length, CFTypeRef value, void *context);
+
+VSDB_EXTERN CF_RETURNS_RETAINED CFTypeRef vsdb_copy_cfvalue_with_key(vsdb_t vsdb, const char *key, size_t key_length,
+                                                                     const vsdb_cflazy_t *lazy);
+VSDB_EXTERN void vsdb_set_cfvalue_with_key(vsdb_t vsdb, const char *key, size_t key_length, CFTypeRef value);
+VSDB_EXTERN void vsdb_batch_set_cfvalue_with_key(vsdb_batch_t batch, const char *key, size_t key_length, CFTypeRef value);
+VSDB_EXTERN vsdb_ret_t vsdb_enumerate_cfvalues_in_key_range(vsdb_t vsdb, const char *start, size_t start_length,
+                                                            const char *end, size_t end_length, int reverse,
+                                                            vsdb_cfvalue_key_visitor_t visitor, void *context,
+                                                            const vsdb_cflazy_t *lazy);
 
 #endif /* __vsdatastore_vsdb_cf_h__ */
@@ -0,0 +1,53 @@
+/* vim: set ft=c fenc=utf-8 sw=2 ts=2 et: */
+/*
+ * Copyright (c) 2013-2014 Chongyu Zhu <i@lembacon.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#ifndef __vsdatastore_vsdb_engine_h__
+#define __vsdatastore_vsdb_engine_h__
+
+#if defined(__has_include) && __has_include(<db_185.h>)
+#include <db_185.h>
+#else /* defined(__has_include) && __has_include(<db_185.h>) */
+#include <db.h>
+#endif /* defined(__has_include) && __has_include(<db_185.h>) */
+#include "vsdb.h"
+
+/*
+ * Private to vsdb.c and the engines.
+ *
+ * A shard is a DB handle whatever the engine, its get/put/del/seq/sync
+ * and close are the per-shard vtable. Engines other than the BSD B-tree
+ * hand out a DB of their own that keeps the dbopen(3) contract: 0 on
+ * success, 1 if the key is not found, -1 on error, and returned data
+ * stays valid until the next call on the same handle. vsdb.c serializes
+ * the calls on a handle, an engine only guards against its own threads.
+ */
+typedef struct {
+  DB *(*open)(const char *filename);
+  int (*unlink)(const char *filename);
+} vsdb_engine_ops_t;
+
+VSDB_EXTERN const vsdb_engine_ops_t vsdb_btree_engine;
+VSDB_EXTERN const vsdb_engine_ops_t vsdb_lsm_engine;
+
+#endif /* __vsdatastore_vsdb_engine_h__ */
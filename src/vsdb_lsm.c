@@ -0,0 +1,1213 @@
+/* vim: set ft=c fenc=utf-8 sw=2 ts=2 et: */
+/*
+ * Copyright (c) 2013-2014 Chongyu Zhu <i@lembacon.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include "vsdb_engine.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <libgen.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+/*
+ * A log-structured engine. Writes go to an in-memory skiplist, the
+ * memtable, which is written out as an immutable sorted segment on sync
+ * or once it holds LSM_MEMTABLE_LIMIT bytes. Reads consult the memtable,
+ * then the segments from newest to oldest. Deletes are tombstones that
+ * shadow older segments until a merge drops them.
+ *
+ * The file given to the engine is its manifest, the list of live
+ * segments, always replaced atomically. Segments live next to it in
+ * "<filename>.<id>.seg":
+ *
+ *   records  [uint32 key_size][uint32 value_size][key][value] ...
+ *   index    [uint64 offset] of every LSM_INDEX_INTERVAL-th record
+ *   footer   lsm_footer_t
+ *
+ * Once LSM_MERGE_THRESHOLD segments pile up, a background thread merges
+ * all of them into one. Replaced segments are unlinked right away but
+ * stay mapped until the next call, since the data returned by the
+ * previous call may still point into them.
+ */
+
+#define LSM_MANIFEST_MAGIC 0x4d53564cU /* "LVSM" */
+#define LSM_SEGMENT_MAGIC 0x5353564cU /* "LVSS" */
+#define LSM_MEMTABLE_LIMIT (4 * 1024 * 1024)
+#define LSM_MERGE_THRESHOLD 4
+#define LSM_INDEX_INTERVAL 64
+#define LSM_MAX_LEVEL 16
+#define LSM_TOMBSTONE UINT32_MAX
+
+typedef struct _lsm_node {
+  uint8_t *value;
+  uint32_t key_size;
+  uint32_t value_size;
+  int level;
+  struct _lsm_node *next[1];
+} lsm_node_t;
+
+typedef struct {
+  lsm_node_t *head;
+  int level;
+  size_t size;
+  size_t count;
+  uint32_t seed;
+} lsm_memtable_t;
+
+typedef struct {
+  uint64_t data_size;
+  uint32_t record_count;
+  uint32_t index_count;
+  uint32_t magic;
+  uint32_t reserved;
+} lsm_footer_t;
+
+typedef struct _lsm_segment {
+  uint64_t id;
+  char *filename;
+  uint8_t *bytes;
+  size_t size;
+  size_t data_size;
+  uint32_t index_count;
+  struct _lsm_segment *next_retired;
+} lsm_segment_t;
+
+typedef struct {
+  DB db;
+  char *filename;
+  lsm_memtable_t memtable;
+  lsm_segment_t **segments;
+  size_t segment_count;
+  uint64_t next_id;
+  lsm_segment_t *retired;
+
+  uint8_t *cursor_key;
+  size_t cursor_key_size;
+  size_t cursor_key_capacity;
+  int cursor_valid;
+
+  pthread_mutex_t mutex;
+  pthread_cond_t merge_cond;
+  pthread_t merge_thread;
+  int merge_running;
+  int stopping;
+} lsm_t;
+
+/* one candidate record, from the memtable or a segment */
+typedef struct {
+  DBT key;
+  DBT value;
+  int tombstone;
+} lsm_entry_t;
+
+static inline int compare_keys(const void *a, size_t a_size, const void *b, size_t b_size)
+{
+  int ret;
+
+  if ((ret = memcmp(a, b, (a_size < b_size) ? a_size : b_size)) != 0)
+    return ret;
+  if (a_size == b_size)
+    return 0;
+  return (a_size < b_size) ? -1 : 1;
+}
+
+static inline uint8_t *node_key(lsm_node_t *node)
+{
+  return (uint8_t *)&node->next[node->level];
+}
+
+static lsm_node_t *newnode(int level, const void *key, size_t key_size)
+{
+  lsm_node_t *node;
+
+  node = (lsm_node_t *)malloc(sizeof(lsm_node_t) + sizeof(lsm_node_t *) * level + key_size);
+  bzero(node, sizeof(lsm_node_t) + sizeof(lsm_node_t *) * level);
+  node->level = level;
+  node->key_size = (uint32_t)key_size;
+  node->value_size = LSM_TOMBSTONE;
+  if (key_size > 0)
+    memcpy(node_key(node), key, key_size);
+
+  return node;
+}
+
+static void memtable_init(lsm_memtable_t *memtable)
+{
+  bzero(memtable, sizeof(lsm_memtable_t));
+  memtable->head = newnode(LSM_MAX_LEVEL, NULL, 0);
+  memtable->level = 1;
+  memtable->seed = 2463534242U;
+}
+
+static void memtable_clear(lsm_memtable_t *memtable)
+{
+  lsm_node_t *node, *next;
+  int i;
+
+  for (node = memtable->head->next[0]; node != NULL; node = next) {
+    next = node->next[0];
+    free(node->value);
+    free(node);
+  }
+
+  for (i = 0; i < LSM_MAX_LEVEL; i++)
+    memtable->head->next[i] = NULL;
+  memtable->level = 1;
+  memtable->size = 0;
+  memtable->count = 0;
+}
+
+static void memtable_free(lsm_memtable_t *memtable)
+{
+  memtable_clear(memtable);
+  free(memtable->head);
+}
+
+static inline int random_level(lsm_memtable_t *memtable)
+{
+  int level;
+
+  /* xorshift32, a new level every fourth node */
+  level = 1;
+  for (;;) {
+    memtable->seed ^= memtable->seed << 13;
+    memtable->seed ^= memtable->seed >> 17;
+    memtable->seed ^= memtable->seed << 5;
+    if (level == LSM_MAX_LEVEL || (memtable->seed & 3) != 0)
+      break;
+    level++;
+  }
+
+  return level;
+}
+
+/*
+ * Returns the first node after key (at key too, unless strict), and
+ * fills update with the last node before it on every level.
+ */
+static lsm_node_t *memtable_seek(lsm_memtable_t *memtable, const DBT *key, int strict,
+                                                     lsm_node_t **update)
+{
+  lsm_node_t *node, *next;
+  int i, ret;
+
+  node = memtable->head;
+  for (i = LSM_MAX_LEVEL - 1; i >= 0; i--) {
+    while ((next = node->next[i]) != NULL) {
+      ret = compare_keys(node_key(next), next->key_size, key->data, key->size);
+      if (ret > 0 || (ret == 0 && !strict))
+        break;
+      node = next;
+    }
+    if (update != NULL)
+      update[i] = node;
+  }
+
+  return node->next[0];
+}
+
+static lsm_node_t *memtable_last(lsm_memtable_t *memtable)
+{
+  lsm_node_t *node;
+  int i;
+
+  node = memtable->head;
+  for (i = LSM_MAX_LEVEL - 1; i >= 0; i--) {
+    while (node->next[i] != NULL)
+      node = node->next[i];
+  }
+
+  return (node == memtable->head) ? NULL : node;
+}
+
+static void memtable_put(lsm_memtable_t *memtable, const DBT *key, const DBT *value)
+{
+  lsm_node_t *update[LSM_MAX_LEVEL];
+  lsm_node_t *node;
+  int level, i;
+
+  node = memtable_seek(memtable, key, 0, update);
+  if (node == NULL || compare_keys(node_key(node), node->key_size, key->data, key->size) != 0) {
+    level = random_level(memtable);
+    node = newnode(level, key->data, key->size);
+    for (i = 0; i < level; i++) {
+      node->next[i] = update[i]->next[i];
+      update[i]->next[i] = node;
+    }
+    if (level > memtable->level)
+      memtable->level = level;
+
+    memtable->size += sizeof(lsm_node_t) + key->size;
+    memtable->count++;
+  }
+  else if (node->value != NULL) {
+    memtable->size -= node->value_size;
+    free(node->value);
+  }
+
+  node->value = NULL;
+  node->value_size = LSM_TOMBSTONE;
+  if (value != NULL) {
+    node->value = (uint8_t *)malloc((value->size > 0) ? value->size : 1);
+    memcpy(node->value, value->data, value->size);
+    node->value_size = (uint32_t)value->size;
+    memtable->size += value->size;
+  }
+}
+
+static inline void node_entry(lsm_node_t *node, lsm_entry_t *entry)
+{
+  entry->key.data = node_key(node);
+  entry->key.size = node->key_size;
+  entry->value.data = node->value;
+  entry->value.size = (node->value_size == LSM_TOMBSTONE) ? 0 : node->value_size;
+  entry->tombstone = (node->value_size == LSM_TOMBSTONE);
+}
+
+static inline size_t segment_record_at(lsm_segment_t *segment, size_t offset, lsm_entry_t *entry)
+{
+  uint32_t key_size, value_size;
+
+  memcpy(&key_size, segment->bytes + offset, sizeof(uint32_t));
+  memcpy(&value_size, segment->bytes + offset + sizeof(uint32_t), sizeof(uint32_t));
+
+  entry->key.data = segment->bytes + offset + sizeof(uint32_t) * 2;
+  entry->key.size = key_size;
+  entry->value.data = segment->bytes + offset + sizeof(uint32_t) * 2 + key_size;
+  entry->value.size = (value_size == LSM_TOMBSTONE) ? 0 : value_size;
+  entry->tombstone = (value_size == LSM_TOMBSTONE);
+
+  return offset + sizeof(uint32_t) * 2 + key_size + entry->value.size;
+}
+
+static inline size_t segment_index_at(lsm_segment_t *segment, uint32_t i)
+{
+  uint64_t offset;
+  memcpy(&offset, segment->bytes + segment->data_size + sizeof(uint64_t) * i, sizeof(uint64_t));
+  return (size_t)offset;
+}
+
+/* number of index entries whose key is before key (or at it, if inclusive) */
+static uint32_t segment_count_blocks(lsm_segment_t *segment, const DBT *key, int inclusive)
+{
+  lsm_entry_t entry;
+  uint32_t lo, hi, mid;
+  int ret;
+
+  lo = 0;
+  hi = segment->index_count;
+  while (lo < hi) {
+    mid = lo + (hi - lo) / 2;
+    segment_record_at(segment, segment_index_at(segment, mid), &entry);
+    ret = compare_keys(entry.key.data, entry.key.size, key->data, key->size);
+    if (ret < 0 || (ret == 0 && inclusive)) {
+      lo = mid + 1;
+    }
+    else {
+      hi = mid;
+    }
+  }
+
+  return lo;
+}
+
+/* the first record after key (at key too, unless strict), key NULL is the first record */
+static int segment_seek_forward(lsm_segment_t *segment, const DBT *key, int strict, lsm_entry_t *entry)
+{
+  uint32_t block;
+  size_t offset;
+  int ret;
+
+  if (segment->data_size == 0)
+    return 1;
+  if (key == NULL) {
+    segment_record_at(segment, 0, entry);
+    return 0;
+  }
+
+  block = segment_count_blocks(segment, key, strict);
+  offset = (block > 0) ? segment_index_at(segment, block - 1) : 0;
+
+  while (offset < segment->data_size) {
+    offset = segment_record_at(segment, offset, entry);
+    ret = compare_keys(entry->key.data, entry->key.size, key->data, key->size);
+    if (ret > 0 || (ret == 0 && !strict))
+      return 0;
+  }
+
+  return 1;
+}
+
+/* the last record before key (at key too, if inclusive), key NULL is the last record */
+static int segment_seek_backward(lsm_segment_t *segment, const DBT *key, int inclusive, lsm_entry_t *entry)
+{
+  lsm_entry_t candidate;
+  uint32_t block;
+  size_t offset;
+  int ret, found;
+
+  if (segment->data_size == 0)
+    return 1;
+
+  block = (key == NULL) ? segment->index_count : segment_count_blocks(segment, key, inclusive);
+  if (block == 0)
+    return 1;
+
+  found = 0;
+  offset = segment_index_at(segment, block - 1);
+  while (offset < segment->data_size) {
+    offset = segment_record_at(segment, offset, &candidate);
+    if (key != NULL) {
+      ret = compare_keys(candidate.key.data, candidate.key.size, key->data, key->size);
+      if (ret > 0 || (ret == 0 && !inclusive))
+        break;
+    }
+    *entry = candidate;
+    found = 1;
+  }
+
+  return found ? 0 : 1;
+}
+
+static char *copy_segment_filename(const char *filename, uint64_t id)
+{
+  char *segment_filename;
+  size_t length;
+
+  length = strlen(filename) + 1 + 20 + 4 + 1;
+  segment_filename = (char *)malloc(length);
+  snprintf(segment_filename, length, "%s.%llu.seg", filename, (unsigned long long)id);
+
+  return segment_filename;
+}
+
+static int sync_directory(const char *filename)
+{
+  char *path;
+  int fd, ret;
+
+  path = strdup(filename);
+  fd = open(dirname(path), O_RDONLY);
+  free(path);
+
+  if (fd < 0)
+    return -1;
+
+  ret = fsync(fd);
+  close(fd);
+  return ret;
+}
+
+static lsm_segment_t *segment_open(const char *filename, uint64_t id)
+{
+  lsm_segment_t *segment;
+  lsm_footer_t footer;
+  struct stat st;
+  void *bytes;
+  int fd;
+
+  segment = NULL;
+  bytes = MAP_FAILED;
+
+  if ((fd = open(filename, O_RDONLY)) < 0)
+    return NULL;
+  if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(lsm_footer_t))
+    goto failed;
+  if ((bytes = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_SHARED, fd, 0)) == MAP_FAILED)
+    goto failed;
+
+  memcpy(&footer, (uint8_t *)bytes + st.st_size - sizeof(lsm_footer_t), sizeof(lsm_footer_t));
+  if (footer.magic != LSM_SEGMENT_MAGIC)
+    goto failed;
+  if (footer.data_size + sizeof(uint64_t) * footer.index_count + sizeof(lsm_footer_t) != (uint64_t)st.st_size)
+    goto failed;
+
+  segment = (lsm_segment_t *)malloc(sizeof(lsm_segment_t));
+  bzero(segment, sizeof(lsm_segment_t));
+  segment->id = id;
+  segment->filename = strdup(filename);
+  segment->bytes = (uint8_t *)bytes;
+  segment->size = (size_t)st.st_size;
+  segment->data_size = (size_t)footer.data_size;
+  segment->index_count = footer.index_count;
+
+  close(fd);
+  return segment;
+
+failed:
+  if (bytes != MAP_FAILED)
+    munmap(bytes, (size_t)st.st_size);
+  close(fd);
+  return NULL;
+}
+
+static void segment_close(lsm_segment_t *segment)
+{
+  munmap(segment->bytes, segment->size);
+  free(segment->filename);
+  free(segment);
+}
+
+typedef struct {
+  FILE *fp;
+  uint64_t offset;
+  uint32_t count;
+  uint64_t *index;
+  uint32_t index_count;
+  uint32_t index_capacity;
+} segment_writer_t;
+
+static int writer_open(segment_writer_t *writer, const char *filename)
+{
+  bzero(writer, sizeof(segment_writer_t));
+  if ((writer->fp = fopen(filename, "wb")) == NULL)
+    return -1;
+  return 0;
+}
+
+static int writer_add(segment_writer_t *writer, const lsm_entry_t *entry)
+{
+  uint32_t key_size, value_size;
+
+  if (writer->count % LSM_INDEX_INTERVAL == 0) {
+    if (writer->index_count == writer->index_capacity) {
+      writer->index_capacity = (writer->index_capacity == 0) ? 64 : (writer->index_capacity << 1);
+      writer->index = (uint64_t *)realloc(writer->index, sizeof(uint64_t) * writer->index_capacity);
+    }
+    writer->index[writer->index_count++] = writer->offset;
+  }
+
+  key_size = (uint32_t)entry->key.size;
+  value_size = entry->tombstone ? LSM_TOMBSTONE : (uint32_t)entry->value.size;
+
+  if (fwrite(&key_size, sizeof(uint32_t), 1, writer->fp) != 1 ||
+      fwrite(&value_size, sizeof(uint32_t), 1, writer->fp) != 1 ||
+      fwrite(entry->key.data, 1, entry->key.size, writer->fp) != entry->key.size)
+    return -1;
+
+  /* tombstones and empty values carry no data */
+  if (entry->value.size > 0 &&
+      fwrite(entry->value.data, 1, entry->value.size, writer->fp) != entry->value.size)
+    return -1;
+
+  writer->offset += sizeof(uint32_t) * 2 + entry->key.size + entry->value.size;
+  writer->count++;
+  return 0;
+}
+
+static int writer_finish(segment_writer_t *writer, int failed)
+{
+  lsm_footer_t footer;
+
+  if (!failed) {
+    bzero(&footer, sizeof(footer));
+    footer.data_size = writer->offset;
+    footer.record_count = writer->count;
+    footer.index_count = writer->index_count;
+    footer.magic = LSM_SEGMENT_MAGIC;
+
+    if ((writer->index_count > 0 &&
+         fwrite(writer->index, sizeof(uint64_t), writer->index_count, writer->fp) != writer->index_count) ||
+        fwrite(&footer, sizeof(footer), 1, writer->fp) != 1 ||
+        fflush(writer->fp) != 0 ||
+        fsync(fileno(writer->fp)) != 0)
+      failed = 1;
+  }
+
+  if (fclose(writer->fp) != 0)
+    failed = 1;
+  free(writer->index);
+
+  return failed ? -1 : 0;
+}
+
+static int write_manifest(lsm_t *lsm, lsm_segment_t **segments, size_t segment_count)
+{
+  char *temp_filename;
+  uint32_t header[2];
+  uint64_t id;
+  size_t length, i;
+  FILE *fp;
+  int ret;
+
+  length = strlen(lsm->filename) + 4 + 1;
+  temp_filename = (char *)malloc(length);
+  snprintf(temp_filename, length, "%s.tmp", lsm->filename);
+
+  ret = -1;
+  if ((fp = fopen(temp_filename, "wb")) == NULL)
+    goto cleanup;
+
+  header[0] = LSM_MANIFEST_MAGIC;
+  header[1] = (uint32_t)segment_count;
+  ret = (fwrite(header, sizeof(header), 1, fp) == 1 &&
+         fwrite(&lsm->next_id, sizeof(uint64_t), 1, fp) == 1) ? 0 : -1;
+  for (i = 0; ret == 0 && i < segment_count; i++) {
+    id = segments[i]->id;
+    if (fwrite(&id, sizeof(uint64_t), 1, fp) != 1)
+      ret = -1;
+  }
+
+  if (ret == 0 && (fflush(fp) != 0 || fsync(fileno(fp)) != 0))
+    ret = -1;
+  if (fclose(fp) != 0)
+    ret = -1;
+
+  if (ret == 0 && rename(temp_filename, lsm->filename) != 0)
+    ret = -1;
+  if (ret == 0)
+    ret = sync_directory(lsm->filename);
+  if (ret != 0)
+    unlink(temp_filename);
+
+cleanup:
+  free(temp_filename);
+  return ret;
+}
+
+static uint64_t *read_manifest(const char *filename, uint32_t *count, uint64_t *next_id)
+{
+  uint32_t header[2];
+  uint64_t *ids;
+  FILE *fp;
+
+  if ((fp = fopen(filename, "rb")) == NULL)
+    return NULL;
+
+  ids = NULL;
+  if (fread(header, sizeof(header), 1, fp) != 1 || header[0] != LSM_MANIFEST_MAGIC)
+    goto failed;
+  if (fread(next_id, sizeof(uint64_t), 1, fp) != 1)
+    goto failed;
+
+  ids = (uint64_t *)malloc(sizeof(uint64_t) * (header[1] + 1));
+  if (fread(ids, sizeof(uint64_t), header[1], fp) != header[1])
+    goto failed;
+
+  *count = header[1];
+  fclose(fp);
+  return ids;
+
+failed:
+  free(ids);
+  fclose(fp);
+  return NULL;
+}
+
+/* must hold lsm->mutex, and only once the previous call's data is no longer needed */
+static void drain_retired(lsm_t *lsm)
+{
+  lsm_segment_t *segment;
+
+  while ((segment = lsm->retired) != NULL) {
+    lsm->retired = segment->next_retired;
+    segment_close(segment);
+  }
+}
+
+static int flush_memtable(lsm_t *lsm)
+{
+  segment_writer_t writer;
+  lsm_segment_t *segment;
+  lsm_node_t *node;
+  lsm_entry_t entry;
+  char *segment_filename;
+  uint64_t id;
+  int failed;
+
+  if (lsm->memtable.count == 0)
+    return 0;
+
+  id = lsm->next_id++;
+  segment_filename = copy_segment_filename(lsm->filename, id);
+  if (writer_open(&writer, segment_filename) != 0) {
+    free(segment_filename);
+    return -1;
+  }
+
+  failed = 0;
+  for (node = lsm->memtable.head->next[0]; node != NULL && !failed; node = node->next[0]) {
+    node_entry(node, &entry);
+
+    /* nothing older to shadow */
+    if (entry.tombstone && lsm->segment_count == 0)
+      continue;
+
+    if (writer_add(&writer, &entry) != 0)
+      failed = 1;
+  }
+
+  segment = NULL;
+  if (writer_finish(&writer, failed) != 0 || (segment = segment_open(segment_filename, id)) == NULL)
+    goto failed;
+
+  lsm->segments = (lsm_segment_t **)realloc(lsm->segments, sizeof(lsm_segment_t *) * (lsm->segment_count + 1));
+  memmove(lsm->segments + 1, lsm->segments, sizeof(lsm_segment_t *) * lsm->segment_count);
+  lsm->segments[0] = segment;
+  lsm->segment_count++;
+
+  if (write_manifest(lsm, lsm->segments, lsm->segment_count) != 0) {
+    lsm->segment_count--;
+    memmove(lsm->segments, lsm->segments + 1, sizeof(lsm_segment_t *) * lsm->segment_count);
+    segment_close(segment);
+    goto failed;
+  }
+
+  free(segment_filename);
+  memtable_clear(&lsm->memtable);
+
+  if (lsm->segment_count >= LSM_MERGE_THRESHOLD)
+    pthread_cond_signal(&lsm->merge_cond);
+
+  return 0;
+
+failed:
+  unlink(segment_filename);
+  free(segment_filename);
+  return -1;
+}
+
+/*
+ * Writes the merge of segments, newest first, into a new segment. Only
+ * called on the oldest segments, so tombstones can be dropped.
+ */
+static lsm_segment_t *merge_segments(const char *segment_filename, uint64_t id,
+                                                             lsm_segment_t **segments, size_t segment_count,
+                                                             int *empty)
+{
+  segment_writer_t writer;
+  lsm_entry_t *entries, *best;
+  size_t *offsets, i;
+  int failed, ret;
+
+  if (writer_open(&writer, segment_filename) != 0)
+    return NULL;
+
+  entries = (lsm_entry_t *)malloc(sizeof(lsm_entry_t) * segment_count);
+  offsets = (size_t *)malloc(sizeof(size_t) * segment_count);
+  for (i = 0; i < segment_count; i++) {
+    offsets[i] = 0;
+    if (segments[i]->data_size > 0)
+      offsets[i] = segment_record_at(segments[i], 0, &entries[i]);
+    else
+      entries[i].key.data = NULL;
+  }
+
+  failed = 0;
+  while (!failed) {
+    best = NULL;
+    for (i = 0; i < segment_count; i++) {
+      if (entries[i].key.data == NULL)
+        continue;
+      /* ties go to the newest segment, which comes first */
+      if (best == NULL || compare_keys(entries[i].key.data, entries[i].key.size,
+                                       best->key.data, best->key.size) < 0)
+        best = &entries[i];
+    }
+
+    if (best == NULL)
+      break;
+
+    if (!best->tombstone && writer_add(&writer, best) != 0)
+      failed = 1;
+
+    for (i = 0; i < segment_count; i++) {
+      if (&entries[i] == best || entries[i].key.data == NULL)
+        continue;
+      ret = compare_keys(entries[i].key.data, entries[i].key.size, best->key.data, best->key.size);
+      if (ret == 0) {
+        if (offsets[i] < segments[i]->data_size)
+          offsets[i] = segment_record_at(segments[i], offsets[i], &entries[i]);
+        else
+          entries[i].key.data = NULL;
+      }
+    }
+
+    i = (size_t)(best - entries);
+    if (offsets[i] < segments[i]->data_size)
+      offsets[i] = segment_record_at(segments[i], offsets[i], &entries[i]);
+    else
+      entries[i].key.data = NULL;
+  }
+
+  *empty = (writer.count == 0);
+
+  free(entries);
+  free(offsets);
+
+  if (writer_finish(&writer, failed) != 0)
+    goto failed;
+  if (*empty) {
+    unlink(segment_filename);
+    return NULL;
+  }
+
+  return segment_open(segment_filename, id);
+
+failed:
+  unlink(segment_filename);
+  return NULL;
+}
+
+static void *merge_main(void *arg)
+{
+  lsm_t *lsm;
+  lsm_segment_t **inputs, **segments, *merged;
+  char *segment_filename;
+  size_t input_count, keep, count, i;
+  uint64_t id;
+  int empty;
+
+  lsm = (lsm_t *)arg;
+  pthread_mutex_lock(&lsm->mutex);
+
+  while (!lsm->stopping) {
+    if (lsm->segment_count < LSM_MERGE_THRESHOLD) {
+      pthread_cond_wait(&lsm->merge_cond, &lsm->mutex);
+      continue;
+    }
+
+    /* segments never go away behind the merge thread's back, only it retires them */
+    input_count = lsm->segment_count;
+    inputs = (lsm_segment_t **)malloc(sizeof(lsm_segment_t *) * input_count);
+    memcpy(inputs, lsm->segments, sizeof(lsm_segment_t *) * input_count);
+    id = lsm->next_id++;
+    segment_filename = copy_segment_filename(lsm->filename, id);
+    pthread_mutex_unlock(&lsm->mutex);
+
+    empty = 0;
+    merged = merge_segments(segment_filename, id, inputs, input_count, &empty);
+
+    pthread_mutex_lock(&lsm->mutex);
+
+    if (merged == NULL && !empty) {
+      /* try again with the next flush */
+      free(segment_filename);
+      free(inputs);
+      pthread_cond_wait(&lsm->merge_cond, &lsm->mutex);
+      continue;
+    }
+
+    /* segments flushed meanwhile are newer, and stay in front */
+    keep = lsm->segment_count - input_count;
+    count = keep + ((merged != NULL) ? 1 : 0);
+    segments = (lsm_segment_t **)malloc(sizeof(lsm_segment_t *) * (count + 1));
+    memcpy(segments, lsm->segments, sizeof(lsm_segment_t *) * keep);
+    if (merged != NULL)
+      segments[keep] = merged;
+
+    if (write_manifest(lsm, segments, count) != 0) {
+      if (merged != NULL) {
+        unlink(segment_filename);
+        segment_close(merged);
+      }
+      free(segments);
+      free(segment_filename);
+      free(inputs);
+      pthread_cond_wait(&lsm->merge_cond, &lsm->mutex);
+      continue;
+    }
+
+    free(lsm->segments);
+    lsm->segments = segments;
+    lsm->segment_count = count;
+
+    for (i = 0; i < input_count; i++) {
+      unlink(inputs[i]->filename);
+      inputs[i]->next_retired = lsm->retired;
+      lsm->retired = inputs[i];
+    }
+
+    free(segment_filename);
+    free(inputs);
+  }
+
+  pthread_mutex_unlock(&lsm->mutex);
+  return NULL;
+}
+
+/*
+ * Finds the next live record from key, forward or backward, and at key
+ * too if inclusive. key NULL starts from either end. The newest source
+ * wins among equal keys, and a winning tombstone hides the key.
+ */
+static int lsm_step(lsm_t *lsm, const DBT *key, int forward, int inclusive, lsm_entry_t *found)
+{
+  lsm_node_t *update[LSM_MAX_LEVEL];
+  lsm_node_t *node;
+  lsm_entry_t entry, best;
+  DBT from;
+  size_t i;
+  int has_best, ret;
+
+  for (;;) {
+    has_best = 0;
+
+    if (forward) {
+      node = (key == NULL) ? lsm->memtable.head->next[0] : memtable_seek(&lsm->memtable, key, !inclusive, NULL);
+    }
+    else if (key == NULL) {
+      node = memtable_last(&lsm->memtable);
+    }
+    else {
+      memtable_seek(&lsm->memtable, key, inclusive, update);
+      node = (update[0] == lsm->memtable.head) ? NULL : update[0];
+    }
+
+    if (node != NULL) {
+      node_entry(node, &best);
+      has_best = 1;
+    }
+
+    for (i = 0; i < lsm->segment_count; i++) {
+      if (forward) {
+        ret = segment_seek_forward(lsm->segments[i], key, !inclusive, &entry);
+      }
+      else {
+        ret = segment_seek_backward(lsm->segments[i], key, inclusive, &entry);
+      }
+      if (ret != 0)
+        continue;
+
+      if (has_best) {
+        ret = compare_keys(entry.key.data, entry.key.size, best.key.data, best.key.size);
+        if (ret == 0 || (forward ? ret > 0 : ret < 0))
+          continue;
+      }
+
+      best = entry;
+      has_best = 1;
+    }
+
+    if (!has_best)
+      return 1;
+
+    if (!best.tombstone) {
+      *found = best;
+      return 0;
+    }
+
+    from = best.key;
+    key = &from;
+    inclusive = 0;
+  }
+}
+
+static void remember_cursor(lsm_t *lsm, const DBT *key)
+{
+  if (key->size > lsm->cursor_key_capacity) {
+    lsm->cursor_key_capacity = key->size;
+    lsm->cursor_key = (uint8_t *)realloc(lsm->cursor_key, lsm->cursor_key_capacity);
+  }
+
+  memcpy(lsm->cursor_key, key->data, key->size);
+  lsm->cursor_key_size = key->size;
+  lsm->cursor_valid = 1;
+}
+
+static int lsm_lookup(lsm_t *lsm, const DBT *key, lsm_entry_t *found)
+{
+  lsm_node_t *node;
+  size_t i;
+
+  node = memtable_seek(&lsm->memtable, key, 0, NULL);
+  if (node != NULL && compare_keys(node_key(node), node->key_size, key->data, key->size) == 0) {
+    node_entry(node, found);
+    return found->tombstone ? 1 : 0;
+  }
+
+  for (i = 0; i < lsm->segment_count; i++) {
+    if (segment_seek_forward(lsm->segments[i], key, 0, found) == 0 &&
+        compare_keys(found->key.data, found->key.size, key->data, key->size) == 0)
+      return found->tombstone ? 1 : 0;
+  }
+
+  return 1;
+}
+
+static int lsm_get(const DB *db, const DBT *key, DBT *data, u_int flags)
+{
+  lsm_t *lsm;
+  lsm_entry_t found;
+  int ret;
+
+  (void)flags;
+
+  lsm = (lsm_t *)db->internal;
+  pthread_mutex_lock(&lsm->mutex);
+  drain_retired(lsm);
+
+  if ((ret = lsm_lookup(lsm, key, &found)) == 0)
+    *data = found.value;
+
+  pthread_mutex_unlock(&lsm->mutex);
+  return ret;
+}
+
+static int lsm_put(const DB *db, DBT *key, const DBT *data, u_int flags)
+{
+  lsm_t *lsm;
+
+  (void)flags;
+
+  if (key->size >= LSM_TOMBSTONE || data->size >= LSM_TOMBSTONE)
+    return -1;
+
+  lsm = (lsm_t *)db->internal;
+  pthread_mutex_lock(&lsm->mutex);
+  drain_retired(lsm);
+
+  memtable_put(&lsm->memtable, key, data);
+
+  /* a failed flush keeps the memtable, sync reports it */
+  if (lsm->memtable.size >= LSM_MEMTABLE_LIMIT)
+    flush_memtable(lsm);
+
+  pthread_mutex_unlock(&lsm->mutex);
+  return 0;
+}
+
+static int lsm_del(const DB *db, const DBT *key, u_int flags)
+{
+  lsm_t *lsm;
+  lsm_entry_t found;
+  int ret;
+
+  (void)flags;
+
+  lsm = (lsm_t *)db->internal;
+  pthread_mutex_lock(&lsm->mutex);
+  drain_retired(lsm);
+
+  if ((ret = lsm_lookup(lsm, key, &found)) == 0)
+    memtable_put(&lsm->memtable, key, NULL);
+
+  pthread_mutex_unlock(&lsm->mutex);
+  return ret;
+}
+
+static int lsm_seq(const DB *db, DBT *key, DBT *data, u_int flags)
+{
+  lsm_t *lsm;
+  lsm_entry_t found;
+  DBT from;
+  int ret;
+
+  lsm = (lsm_t *)db->internal;
+  pthread_mutex_lock(&lsm->mutex);
+  drain_retired(lsm);
+
+  from.data = lsm->cursor_key;
+  from.size = lsm->cursor_key_size;
+
+  switch (flags) {
+  case R_CURSOR:
+    ret = lsm_step(lsm, key, 1, 1, &found);
+    break;
+  case R_FIRST:
+    ret = lsm_step(lsm, NULL, 1, 1, &found);
+    break;
+  case R_LAST:
+    ret = lsm_step(lsm, NULL, 0, 1, &found);
+    break;
+  case R_NEXT:
+    ret = lsm_step(lsm, lsm->cursor_valid ? &from : NULL, 1, 0, &found);
+    break;
+  case R_PREV:
+    ret = lsm_step(lsm, lsm->cursor_valid ? &from : NULL, 0, 0, &found);
+    break;
+  default:
+    ret = -1;
+    break;
+  }
+
+  if (ret == 0) {
+    remember_cursor(lsm, &found.key);
+    *key = found.key;
+    *data = found.value;
+  }
+
+  pthread_mutex_unlock(&lsm->mutex);
+  return ret;
+}
+
+static int lsm_sync(const DB *db, u_int flags)
+{
+  lsm_t *lsm;
+  int ret;
+
+  (void)flags;
+
+  lsm = (lsm_t *)db->internal;
+  pthread_mutex_lock(&lsm->mutex);
+  drain_retired(lsm);
+  ret = flush_memtable(lsm);
+  pthread_mutex_unlock(&lsm->mutex);
+
+  return ret;
+}
+
+static int lsm_fd(const DB *db)
+{
+  (void)db;
+  return -1;
+}
+
+static void freelsm(lsm_t *lsm)
+{
+  size_t i;
+
+  drain_retired(lsm);
+  for (i = 0; i < lsm->segment_count; i++)
+    segment_close(lsm->segments[i]);
+
+  memtable_free(&lsm->memtable);
+  pthread_cond_destroy(&lsm->merge_cond);
+  pthread_mutex_destroy(&lsm->mutex);
+  free(lsm->segments);
+  free(lsm->cursor_key);
+  free(lsm->filename);
+  free(lsm);
+}
+
+static int lsm_close(DB *db)
+{
+  lsm_t *lsm;
+  int ret;
+
+  lsm = (lsm_t *)db->internal;
+
+  if (lsm->merge_running) {
+    pthread_mutex_lock(&lsm->mutex);
+    lsm->stopping = 1;
+    pthread_cond_signal(&lsm->merge_cond);
+    pthread_mutex_unlock(&lsm->mutex);
+    pthread_join(lsm->merge_thread, NULL);
+  }
+
+  ret = flush_memtable(lsm);
+  freelsm(lsm);
+
+  return ret;
+}
+
+static DB *lsm_open(const char *filename)
+{
+  lsm_t *lsm;
+  lsm_segment_t *segment;
+  uint64_t *ids;
+  uint32_t count, i;
+  char *segment_filename;
+
+  lsm = (lsm_t *)malloc(sizeof(lsm_t));
+  bzero(lsm, sizeof(lsm_t));
+  lsm->filename = strdup(filename);
+  memtable_init(&lsm->memtable);
+  pthread_mutex_init(&lsm->mutex, NULL);
+  pthread_cond_init(&lsm->merge_cond, NULL);
+
+  if (access(filename, F_OK) != 0) {
+    if (write_manifest(lsm, NULL, 0) != 0)
+      goto failed;
+  }
+  else {
+    if ((ids = read_manifest(filename, &count, &lsm->next_id)) == NULL)
+      goto failed;
+
+    lsm->segments = (lsm_segment_t **)malloc(sizeof(lsm_segment_t *) * (count + 1));
+    for (i = 0; i < count; i++) {
+      segment_filename = copy_segment_filename(filename, ids[i]);
+      segment = segment_open(segment_filename, ids[i]);
+      free(segment_filename);
+
+      if (segment == NULL) {
+        free(ids);
+        goto failed;
+      }
+      lsm->segments[lsm->segment_count++] = segment;
+    }
+    free(ids);
+  }
+
+  lsm->db.type = DB_BTREE;
+  lsm->db.close = lsm_close;
+  lsm->db.del = lsm_del;
+  lsm->db.get = lsm_get;
+  lsm->db.put = lsm_put;
+  lsm->db.seq = lsm_seq;
+  lsm->db.sync = lsm_sync;
+  lsm->db.fd = lsm_fd;
+  lsm->db.internal = lsm;
+
+  if (pthread_create(&lsm->merge_thread, NULL, merge_main, lsm) == 0)
+    lsm->merge_running = 1;
+
+  if (lsm->segment_count >= LSM_MERGE_THRESHOLD) {
+    pthread_mutex_lock(&lsm->mutex);
+    pthread_cond_signal(&lsm->merge_cond);
+    pthread_mutex_unlock(&lsm->mutex);
+  }
+
+  return &lsm->db;
+
+failed:
+  freelsm(lsm);
+  return NULL;
+}
+
+static int lsm_unlink(const char *filename)
+{
+  uint64_t *ids, next_id;
+  uint32_t count, i;
+  char *segment_filename;
+  int ret;
+
+  ret = 0;
+  if ((ids = read_manifest(filename, &count, &next_id)) != NULL) {
+    for (i = 0; i < count; i++) {
+      segment_filename = copy_segment_filename(filename, ids[i]);
+      if (unlink(segment_filename) != 0 && errno != ENOENT)
+        ret = -1;
+      free(segment_filename);
+    }
+    free(ids);
+  }
+
+  if (unlink(filename) != 0 && errno != ENOENT)
+    ret = -1;
+
+  return ret;
+}
+
+const vsdb_engine_ops_t vsdb_lsm_engine = {
+  lsm_open,
+  lsm_unlink
+};
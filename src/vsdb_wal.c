@@ -0,0 +1,508 @@
+/* vim: set ft=c fenc=utf-8 sw=2 ts=2 et: */
+/*
+ * Copyright (c) 2013-2014 Chongyu Zhu <i@lembacon.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include "vsdb_wal.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <libgen.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+#define VSDB_WAL_CHECKPOINT_INTERVAL 10
+#define VSDB_WAL_MAX_IOV 8
+
+typedef struct {
+  uint32_t size;
+  uint32_t checksum;
+} wal_header_t;
+
+struct _vsdb_wal {
+  int fd;
+  char *filename;
+  char *rotated_filename;
+  int rotated;
+  size_t size;
+  uint64_t appended;
+  uint64_t synced;
+  int syncing;
+  pthread_mutex_t mutex;
+  pthread_cond_t synced_cond;
+
+  pthread_t checkpointer_thread;
+  pthread_cond_t checkpoint_cond;
+  size_t checkpoint_size;
+  vsdb_wal_checkpointer_t checkpointer;
+  void *checkpointer_context;
+  int checkpointer_running;
+  int stopping;
+};
+
+static inline uint32_t checksum_bytes(uint32_t checksum, const void *bytes, size_t size)
+{
+  size_t i;
+
+  /* FNV-1a */
+  for (i = 0; i < size; i++) {
+    checksum ^= ((const uint8_t *)bytes)[i];
+    checksum *= 16777619U;
+  }
+
+  return checksum;
+}
+
+static char *copy_rotated_filename(const char *filename)
+{
+  char *rotated_filename;
+  size_t length;
+
+  length = strlen(filename) + 4 + 1;
+  rotated_filename = (char *)malloc(length);
+  snprintf(rotated_filename, length, "%s.old", filename);
+
+  return rotated_filename;
+}
+
+static int sync_fd(int fd)
+{
+#ifdef F_FULLFSYNC
+  if (fcntl(fd, F_FULLFSYNC) == 0)
+    return 0;
+#endif /* F_FULLFSYNC */
+  return fsync(fd);
+}
+
+static int sync_directory(const char *filename)
+{
+  char *path;
+  int fd, ret;
+
+  path = strdup(filename);
+  fd = open(dirname(path), O_RDONLY);
+  free(path);
+
+  if (fd < 0)
+    return -1;
+
+  ret = fsync(fd);
+  close(fd);
+  return ret;
+}
+
+static int write_fully(int fd, struct iovec *iov, int iovcnt)
+{
+  ssize_t written;
+
+  while (iovcnt > 0) {
+    if ((written = writev(fd, iov, iovcnt)) < 0) {
+      if (errno == EINTR)
+        continue;
+      return -1;
+    }
+
+    while (iovcnt > 0 && (size_t)written >= iov->iov_len) {
+      written -= iov->iov_len;
+      iov++;
+      iovcnt--;
+    }
+
+    if (iovcnt > 0) {
+      iov->iov_base = (uint8_t *)iov->iov_base + written;
+      iov->iov_len -= written;
+    }
+  }
+
+  return 0;
+}
+
+static int create_log(const char *filename)
+{
+  int fd;
+
+  if ((fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0644)) < 0)
+    return -1;
+
+  if (sync_directory(filename) != 0) {
+    close(fd);
+    return -1;
+  }
+
+  return fd;
+}
+
+vsdb_wal_t vsdb_wal_open(const char *filename)
+{
+  vsdb_wal_t wal;
+  int fd;
+
+  if ((fd = create_log(filename)) < 0)
+    return NULL;
+
+  wal = (vsdb_wal_t)malloc(sizeof(struct _vsdb_wal));
+  bzero(wal, sizeof(struct _vsdb_wal));
+  wal->fd = fd;
+  wal->filename = strdup(filename);
+  wal->rotated_filename = copy_rotated_filename(filename);
+  pthread_mutex_init(&wal->mutex, NULL);
+  pthread_cond_init(&wal->synced_cond, NULL);
+  pthread_cond_init(&wal->checkpoint_cond, NULL);
+
+  return wal;
+}
+
+void vsdb_wal_close(vsdb_wal_t wal)
+{
+  if (wal == NULL)
+    return;
+
+  vsdb_wal_stop_checkpointer(wal);
+  close(wal->fd);
+
+  pthread_cond_destroy(&wal->checkpoint_cond);
+  pthread_cond_destroy(&wal->synced_cond);
+  pthread_mutex_destroy(&wal->mutex);
+  free(wal->rotated_filename);
+  free(wal->filename);
+  free(wal);
+}
+
+static int replay_log(const char *filename, vsdb_wal_replayer_t replayer, void *context)
+{
+  struct stat st;
+  wal_header_t header;
+  uint8_t *bytes;
+  size_t offset, size;
+  ssize_t nread;
+  int fd, ret;
+
+  if ((fd = open(filename, O_RDONLY)) < 0)
+    return (errno == ENOENT) ? 0 : -1;
+
+  if (fstat(fd, &st) != 0) {
+    close(fd);
+    return -1;
+  }
+
+  size = (size_t)st.st_size;
+  bytes = (uint8_t *)malloc(size + 1);
+  for (offset = 0; offset < size; offset += nread) {
+    if ((nread = read(fd, bytes + offset, size - offset)) <= 0) {
+      if (nread < 0 && errno == EINTR) {
+        nread = 0;
+        continue;
+      }
+      break;
+    }
+  }
+  close(fd);
+
+  /* a short read is treated like a torn tail */
+  size = offset;
+  ret = 0;
+  offset = 0;
+
+  while (size - offset >= sizeof(header)) {
+    memcpy(&header, bytes + offset, sizeof(header));
+    if (header.size > size - offset - sizeof(header))
+      break;
+    if (checksum_bytes(2166136261U, bytes + offset + sizeof(header), header.size) != header.checksum)
+      break;
+
+    if (replayer(bytes + offset + sizeof(header), header.size, context) != 0) {
+      ret = -1;
+      break;
+    }
+
+    offset += sizeof(header) + header.size;
+  }
+
+  free(bytes);
+  return ret;
+}
+
+int vsdb_wal_replay(const char *filename, vsdb_wal_replayer_t replayer, void *context)
+{
+  char *rotated_filename;
+  int ret;
+
+  rotated_filename = copy_rotated_filename(filename);
+  ret = replay_log(rotated_filename, replayer, context);
+  free(rotated_filename);
+
+  if (ret != 0)
+    return ret;
+
+  return replay_log(filename, replayer, context);
+}
+
+int vsdb_wal_unlink(const char *filename)
+{
+  char *rotated_filename;
+  int ret;
+
+  ret = 0;
+  rotated_filename = copy_rotated_filename(filename);
+  if (unlink(rotated_filename) != 0 && errno != ENOENT)
+    ret = -1;
+  free(rotated_filename);
+
+  if (unlink(filename) != 0 && errno != ENOENT)
+    ret = -1;
+
+  return ret;
+}
+
+uint64_t vsdb_wal_append(vsdb_wal_t wal, const struct iovec *iov, int iovcnt)
+{
+  struct iovec record[VSDB_WAL_MAX_IOV + 1];
+  wal_header_t header;
+  size_t size;
+  uint64_t lsn;
+  int i;
+
+  if (wal == NULL || iovcnt > VSDB_WAL_MAX_IOV)
+    return 0;
+
+  size = 0;
+  header.checksum = 2166136261U;
+  for (i = 0; i < iovcnt; i++) {
+    size += iov[i].iov_len;
+    header.checksum = checksum_bytes(header.checksum, iov[i].iov_base, iov[i].iov_len);
+    record[i + 1] = iov[i];
+  }
+
+  if (size > UINT32_MAX)
+    return 0;
+
+  header.size = (uint32_t)size;
+  record[0].iov_base = &header;
+  record[0].iov_len = sizeof(header);
+
+  pthread_mutex_lock(&wal->mutex);
+
+  if (write_fully(wal->fd, record, iovcnt + 1) != 0) {
+    /* never leave a torn record in front of later ones */
+    if (ftruncate(wal->fd, wal->size) == 0)
+      lseek(wal->fd, wal->size, SEEK_SET);
+    pthread_mutex_unlock(&wal->mutex);
+    return 0;
+  }
+
+  wal->size += sizeof(header) + size;
+  wal->appended += sizeof(header) + size;
+  lsn = wal->appended;
+
+  if (wal->checkpoint_size > 0 && wal->size >= wal->checkpoint_size)
+    pthread_cond_signal(&wal->checkpoint_cond);
+
+  pthread_mutex_unlock(&wal->mutex);
+  return lsn;
+}
+
+int vsdb_wal_commit(vsdb_wal_t wal, uint64_t lsn)
+{
+  uint64_t target;
+  int fd, ret;
+
+  if (wal == NULL)
+    return -1;
+
+  pthread_mutex_lock(&wal->mutex);
+
+  if (lsn == 0)
+    lsn = wal->appended;
+
+  ret = 0;
+  while (wal->synced < lsn) {
+    if (wal->syncing) {
+      pthread_cond_wait(&wal->synced_cond, &wal->mutex);
+      continue;
+    }
+
+    /* become the leader, everyone arriving meanwhile rides on this fsync */
+    wal->syncing = 1;
+    target = wal->appended;
+    fd = wal->fd;
+    pthread_mutex_unlock(&wal->mutex);
+
+    ret = sync_fd(fd);
+
+    pthread_mutex_lock(&wal->mutex);
+    wal->syncing = 0;
+    if (ret == 0 && target > wal->synced)
+      wal->synced = target;
+    pthread_cond_broadcast(&wal->synced_cond);
+
+    if (ret != 0)
+      break;
+  }
+
+  pthread_mutex_unlock(&wal->mutex);
+  return ret;
+}
+
+int vsdb_wal_rotate(vsdb_wal_t wal)
+{
+  int fd;
+
+  if (wal == NULL)
+    return -1;
+
+  pthread_mutex_lock(&wal->mutex);
+
+  while (wal->syncing)
+    pthread_cond_wait(&wal->synced_cond, &wal->mutex);
+
+  /* the previously rotated log has not been dropped yet, keep appending */
+  if (wal->rotated || wal->size == 0) {
+    pthread_mutex_unlock(&wal->mutex);
+    return 0;
+  }
+
+  if (sync_fd(wal->fd) != 0)
+    goto failed;
+
+  wal->synced = wal->appended;
+  pthread_cond_broadcast(&wal->synced_cond);
+
+  if (rename(wal->filename, wal->rotated_filename) != 0)
+    goto failed;
+
+  if ((fd = create_log(wal->filename)) < 0) {
+    rename(wal->rotated_filename, wal->filename);
+    goto failed;
+  }
+
+  close(wal->fd);
+  wal->fd = fd;
+  wal->size = 0;
+  wal->rotated = 1;
+
+  pthread_mutex_unlock(&wal->mutex);
+  return 0;
+
+failed:
+  pthread_mutex_unlock(&wal->mutex);
+  return -1;
+}
+
+int vsdb_wal_drop_rotated(vsdb_wal_t wal)
+{
+  int ret;
+
+  if (wal == NULL)
+    return -1;
+
+  ret = 0;
+  pthread_mutex_lock(&wal->mutex);
+  if (wal->rotated) {
+    if (unlink(wal->rotated_filename) != 0 && errno != ENOENT) {
+      ret = -1;
+    }
+    else {
+      wal->rotated = 0;
+    }
+  }
+  pthread_mutex_unlock(&wal->mutex);
+
+  return ret;
+}
+
+static void *checkpointer_main(void *arg)
+{
+  vsdb_wal_t wal;
+  struct timespec deadline;
+  int ret;
+
+  wal = (vsdb_wal_t)arg;
+  pthread_mutex_lock(&wal->mutex);
+
+  while (!wal->stopping) {
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += VSDB_WAL_CHECKPOINT_INTERVAL;
+
+    while (!wal->stopping && wal->size < wal->checkpoint_size) {
+      if (pthread_cond_timedwait(&wal->checkpoint_cond, &wal->mutex, &deadline) == ETIMEDOUT)
+        break;
+    }
+
+    if (wal->stopping)
+      break;
+    if (wal->size == 0 && !wal->rotated)
+      continue;
+
+    pthread_mutex_unlock(&wal->mutex);
+    ret = wal->checkpointer(wal->checkpointer_context);
+    pthread_mutex_lock(&wal->mutex);
+
+    /* the log is still too large after a failure, do not retry at once */
+    if (ret != 0) {
+      clock_gettime(CLOCK_REALTIME, &deadline);
+      deadline.tv_sec += VSDB_WAL_CHECKPOINT_INTERVAL;
+
+      while (!wal->stopping) {
+        if (pthread_cond_timedwait(&wal->checkpoint_cond, &wal->mutex, &deadline) == ETIMEDOUT)
+          break;
+      }
+    }
+  }
+
+  pthread_mutex_unlock(&wal->mutex);
+  return NULL;
+}
+
+void vsdb_wal_start_checkpointer(vsdb_wal_t wal, size_t checkpoint_size,
+                                                 vsdb_wal_checkpointer_t checkpointer,
+                                                 void *context)
+{
+  if (wal == NULL || wal->checkpointer_running)
+    return;
+
+  wal->checkpoint_size = checkpoint_size;
+  wal->checkpointer = checkpointer;
+  wal->checkpointer_context = context;
+  wal->stopping = 0;
+
+  if (pthread_create(&wal->checkpointer_thread, NULL, checkpointer_main, wal) == 0)
+    wal->checkpointer_running = 1;
+}
+
+void vsdb_wal_stop_checkpointer(vsdb_wal_t wal)
+{
+  if (wal == NULL || !wal->checkpointer_running)
+    return;
+
+  pthread_mutex_lock(&wal->mutex);
+  wal->stopping = 1;
+  pthread_cond_signal(&wal->checkpoint_cond);
+  pthread_mutex_unlock(&wal->mutex);
+
+  pthread_join(wal->checkpointer_thread, NULL);
+  wal->checkpointer_running = 0;
+}
@@ -0,0 +1,71 @@
+/* vim: set ft=c fenc=utf-8 sw=2 ts=2 et: */
+/*
+ * Copyright (c) 2013-2014 Chongyu Zhu <i@lembacon.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#ifndef __vsdatastore_vsdb_wal_h__
+#define __vsdatastore_vsdb_wal_h__
+
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <stdint.h>
+#include "vsdb.h"
+
+/*
+ * Private to vsdb.c.
+ *
+ * An append-only log of opaque payloads. Every record carries its size
+ * and a checksum, replay stops at the first torn or corrupted record.
+ * LSNs are byte positions in the log stream and keep growing across
+ * rotations. vsdb_wal_commit() makes everything up to an LSN durable,
+ * concurrent committers share a single fsync.
+ *
+ * A checkpoint rotates the log aside to "<filename>.old", flushes the
+ * database and then drops the rotated log. Replay therefore visits the
+ * rotated log first, then the current one. The checkpointer returns 0
+ * on success, after a failure it is only retried once the checkpoint
+ * interval has passed, however large the log has grown.
+ */
+
+typedef struct _vsdb_wal *vsdb_wal_t;
+
+typedef int (*vsdb_wal_replayer_t)(const void *payload, size_t payload_size, void *context);
+typedef int (*vsdb_wal_checkpointer_t)(void *context);
+
+VSDB_EXTERN vsdb_wal_t vsdb_wal_open(const char *filename);
+VSDB_EXTERN void vsdb_wal_close(vsdb_wal_t wal);
+
+VSDB_EXTERN int vsdb_wal_replay(const char *filename, vsdb_wal_replayer_t replayer, void *context);
+VSDB_EXTERN int vsdb_wal_unlink(const char *filename);
+
+VSDB_EXTERN uint64_t vsdb_wal_append(vsdb_wal_t wal, const struct iovec *iov, int iovcnt);
+VSDB_EXTERN int vsdb_wal_commit(vsdb_wal_t wal, uint64_t lsn);
+
+VSDB_EXTERN int vsdb_wal_rotate(vsdb_wal_t wal);
+VSDB_EXTERN int vsdb_wal_drop_rotated(vsdb_wal_t wal);
+
+VSDB_EXTERN void vsdb_wal_start_checkpointer(vsdb_wal_t wal, size_t checkpoint_size,
+                                                               vsdb_wal_checkpointer_t checkpointer,
+                                                               void *context);
+VSDB_EXTERN void vsdb_wal_stop_checkpointer(vsdb_wal_t wal);
+
+#endif /* __vsdatastore_vsdb_wal_h__ */